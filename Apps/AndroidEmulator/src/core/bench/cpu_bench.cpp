@@ -0,0 +1,515 @@
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "cpu/cpu_emulator.h"
+
+// Guest instruction throughput benchmarks for CPUEmulator.
+//
+// Every workload is a small A64 program that loops forever; each vCPU
+// runs it until it has retired the instruction budget. Results go to
+// stdout and, as JSON, to the output file so CI can compare runs.
+
+// Guest memory layout shared by all workloads
+static constexpr size_t GUEST_MEMORY = 32 * 1024 * 1024;
+static constexpr uint64_t DATA_BASE = 0x100000;        // 1MB of data per vCPU from here
+static constexpr uint64_t STACK_BASE = 0x1010000;      // 64KB of stack per vCPU from here
+static constexpr int MAX_VCPUS = 16;
+
+// A64 encodings used by the workloads. Registers are X registers unless
+// the name says otherwise.
+enum Condition : uint32_t {
+    COND_EQ = 0,
+    COND_NE = 1
+};
+
+class Assembler {
+public:
+    std::vector<uint32_t> code;
+    
+    size_t here() const {
+        return code.size() * 4;
+    }
+    
+    void emit(uint32_t insn) {
+        code.push_back(insn);
+    }
+    
+    void movz(unsigned rd, uint32_t imm16, unsigned hw = 0) { emit(0xD2800000 | hw << 21 | imm16 << 5 | rd); }
+    void movk(unsigned rd, uint32_t imm16, unsigned hw) { emit(0xF2800000 | hw << 21 | imm16 << 5 | rd); }
+    void addImm(unsigned rd, unsigned rn, uint32_t imm12, bool shift12 = false) {
+        emit(0x91000000 | (shift12 ? 1u << 22 : 0) | imm12 << 10 | rn << 5 | rd);
+    }
+    void subsImm(unsigned rd, unsigned rn, uint32_t imm12) { emit(0xF1000000 | imm12 << 10 | rn << 5 | rd); }
+    void addReg(unsigned rd, unsigned rn, unsigned rm) { emit(0x8B000000 | rm << 16 | rn << 5 | rd); }
+    void eorReg(unsigned rd, unsigned rn, unsigned rm) { emit(0xCA000000 | rm << 16 | rn << 5 | rd); }
+    void lsl(unsigned rd, unsigned rn, unsigned shift) {
+        emit(0xD3400000 | ((64 - shift) & 63) << 16 | (63 - shift) << 10 | rn << 5 | rd);
+    }
+    void lsr(unsigned rd, unsigned rn, unsigned shift) { emit(0xD340FC00 | shift << 16 | rn << 5 | rd); }
+    void madd(unsigned rd, unsigned rn, unsigned rm, unsigned ra) {
+        emit(0x9B000000 | rm << 16 | ra << 10 | rn << 5 | rd);
+    }
+    void ldr(unsigned rt, unsigned rn, uint32_t offset) { emit(0xF9400000 | (offset / 8) << 10 | rn << 5 | rt); }
+    void ldrPost(unsigned rt, unsigned rn, int32_t imm9) { emit(0xF8400400 | (imm9 & 0x1FF) << 12 | rn << 5 | rt); }
+    void strPost(unsigned rt, unsigned rn, int32_t imm9) { emit(0xF8000400 | (imm9 & 0x1FF) << 12 | rn << 5 | rt); }
+    void ldrQPost(unsigned qt, unsigned rn, int32_t imm9) { emit(0x3CC00400 | (imm9 & 0x1FF) << 12 | rn << 5 | qt); }
+    void addV4S(unsigned vd, unsigned vn, unsigned vm) { emit(0x4EA08400 | vm << 16 | vn << 5 | vd); }
+    void mulV4S(unsigned vd, unsigned vn, unsigned vm) { emit(0x4EA09C00 | vm << 16 | vn << 5 | vd); }
+    void pushFrame() { emit(0xA9BF7BFD); }              // stp x29, x30, [sp, #-16]!
+    void popFrame() { emit(0xA8C17BFD); }               // ldp x29, x30, [sp], #16
+    void movFromSp(unsigned rd) { addImm(rd, 31, 0); }
+    void movToSp(unsigned rn) { emit(0x9100001F | rn << 5); }
+    void ret() { emit(0xD65F03C0); }
+    
+    void b(size_t target) { emit(0x14000000 | (offset(target) >> 2 & 0x03FFFFFF)); }
+    void bl(size_t target) { emit(0x94000000 | (offset(target) >> 2 & 0x03FFFFFF)); }
+    void bcond(Condition cond, size_t target) { emit(0x54000000 | (offset(target) >> 2 & 0x7FFFF) << 5 | cond); }
+    void cbz(unsigned rt, size_t target) { emit(0xB4000000 | (offset(target) >> 2 & 0x7FFFF) << 5 | rt); }
+    void tbz(unsigned rt, unsigned bit, size_t target) { testBranch(0x36000000, rt, bit, target); }
+    void tbnz(unsigned rt, unsigned bit, size_t target) { testBranch(0x37000000, rt, bit, target); }
+    
+    // Loads a 64-bit constant with MOVZ/MOVK
+    void movImm64(unsigned rd, uint64_t value) {
+        movz(rd, value & 0xFFFF);
+        for (unsigned hw = 1; hw < 4; hw++) {
+            movk(rd, (value >> (16 * hw)) & 0xFFFF, hw);
+        }
+    }
+    
+    // x20 = this vCPU's data area, sp = top of its stack; x0 holds the
+    // vCPU index on entry
+    void prologue() {
+        lsl(20, 0, 20);
+        addImm(20, 20, DATA_BASE >> 12, true);
+        lsl(21, 0, 16);
+        movImm64(22, STACK_BASE + 0x10000);
+        addReg(21, 21, 22);
+        movToSp(21);
+    }
+    
+private:
+    uint32_t offset(size_t target) const {
+        return static_cast<uint32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(here()));
+    }
+    
+    void testBranch(uint32_t opcode, unsigned rt, unsigned bit, size_t target) {
+        emit(opcode | (bit >> 5) << 31 | (bit & 31) << 19 | (offset(target) >> 2 & 0x3FFF) << 5 | rt);
+    }
+};
+
+// Dependent integer arithmetic; the loop branch is almost always taken
+static void buildAlu(Assembler& a) {
+    a.prologue();
+    a.movz(1, 1);
+    a.movz(2, 3);
+    size_t outer = a.here();
+    a.movz(6, 1000);
+    size_t loop = a.here();
+    a.addReg(1, 1, 2);
+    a.eorReg(2, 2, 1);
+    a.lsl(3, 1, 3);
+    a.addReg(2, 2, 3);
+    a.madd(4, 1, 2, 31);
+    a.lsr(5, 4, 7);
+    a.eorReg(1, 1, 5);
+    a.subsImm(6, 6, 1);
+    a.bcond(COND_NE, loop);
+    a.b(outer);
+}
+
+// Read-modify-write pass over 256KB, then a read of the next word
+static void buildMemory(Assembler& a) {
+    a.prologue();
+    size_t outer = a.here();
+    a.addImm(1, 20, 0);
+    a.movz(6, 256 * 1024 / 16);
+    size_t loop = a.here();
+    a.ldr(2, 1, 0);
+    a.addImm(2, 2, 1);
+    a.strPost(2, 1, 8);
+    a.ldrPost(3, 1, 8);
+    a.addReg(4, 4, 3);
+    a.subsImm(6, 6, 1);
+    a.bcond(COND_NE, loop);
+    a.b(outer);
+}
+
+// Branches on bits of a linear congruential generator, so the exits
+// taken are unpredictable
+static void buildBranch(Assembler& a) {
+    a.prologue();
+    a.movImm64(7, 6364136223846793005ull);
+    a.movImm64(8, 1442695040888963407ull);
+    a.movz(1, 1);
+    size_t outer = a.here();
+    a.movz(6, 1000);
+    size_t loop = a.here();
+    a.madd(1, 1, 7, 8);
+    a.tbnz(1, 33, a.here() + 8);
+    a.addImm(2, 2, 1);
+    a.tbz(1, 40, a.here() + 8);
+    a.eorReg(3, 3, 1);
+    a.lsr(4, 1, 61);
+    a.cbz(4, a.here() + 8);
+    a.addImm(5, 5, 1);
+    a.subsImm(6, 6, 1);
+    a.bcond(COND_NE, loop);
+    a.b(outer);
+}
+
+// Calls through a framed function into a leaf
+static void buildCalls(Assembler& a) {
+    a.prologue();
+    size_t outerJump = a.here();
+    a.b(0);                                 // patched below to skip the functions
+    
+    size_t leaf = a.here();
+    a.addReg(10, 10, 9);
+    a.ret();
+    
+    size_t func = a.here();
+    a.pushFrame();
+    a.movFromSp(29);
+    a.addImm(9, 9, 1);
+    a.bl(leaf);
+    a.popFrame();
+    a.ret();
+    
+    size_t outer = a.here();
+    a.code[outerJump / 4] = 0x14000000 | static_cast<uint32_t>((outer - outerJump) >> 2);
+    a.movz(6, 1000);
+    size_t loop = a.here();
+    a.bl(func);
+    a.subsImm(6, 6, 1);
+    a.bcond(COND_NE, loop);
+    a.b(outer);
+}
+
+// 4 x 32-bit vector adds and multiplies over a 64KB buffer
+static void buildSimd(Assembler& a) {
+    a.prologue();
+    size_t outer = a.here();
+    a.addImm(1, 20, 0);
+    a.movz(6, 64 * 1024 / 16);
+    size_t loop = a.here();
+    a.ldrQPost(0, 1, 16);
+    a.addV4S(1, 1, 0);
+    a.mulV4S(2, 2, 0);
+    a.addV4S(3, 3, 2);
+    a.subsImm(6, 6, 1);
+    a.bcond(COND_NE, loop);
+    a.b(outer);
+}
+
+struct Workload {
+    const char* name;
+    void (*build)(Assembler&);
+};
+
+static const Workload WORKLOADS[] = {
+    { "alu", buildAlu },
+    { "memory", buildMemory },
+    { "branch", buildBranch },
+    { "calls", buildCalls },
+    { "simd", buildSimd }
+};
+
+// Host CPU cycles of this process and every thread it starts, where the
+// kernel lets us count them
+class CycleCounter {
+public:
+    CycleCounter() {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    
+    ~CycleCounter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    bool available() const {
+        return fd >= 0;
+    }
+    
+    void start() {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    
+    // Counts of exited threads are only folded in once they are joined
+    uint64_t stop() {
+        uint64_t cycles = 0;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+                cycles = 0;
+            }
+        }
+        return cycles;
+    }
+    
+private:
+    int fd = -1;
+};
+
+struct Result {
+    std::string workload;
+    std::string mode;
+    std::string memory;
+    int vcpus;
+    bool completed;         // every vCPU retired its budget without trapping
+    uint64_t instructions;
+    double seconds;
+    uint64_t cycles;        // 0 when not counted
+    double scaling;
+    
+    double mips() const {
+        return seconds > 0 ? instructions / seconds / 1e6 : 0;
+    }
+};
+
+struct Options {
+    uint64_t budget = 20000000;
+    int maxVcpus = 0;
+    std::vector<std::string> workloads;
+    std::vector<std::string> modes = { "interpreter", "jit" };
+    std::vector<std::string> backends = { "softmmu", "hostmapped" };
+    std::string output = "cpu_bench.json";
+};
+
+static std::vector<std::string> splitList(const char* list) {
+    std::vector<std::string> items;
+    std::string current;
+    for (const char* p = list; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (!current.empty()) {
+                items.push_back(current);
+            }
+            current.clear();
+            if (*p == '\0') {
+                break;
+            }
+        } else {
+            current += *p;
+        }
+    }
+    return items;
+}
+
+static bool contains(const std::vector<std::string>& list, const std::string& item) {
+    return std::find(list.begin(), list.end(), item) != list.end();
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [--budget N] [--max-vcpus N] [--workloads a,b] [--modes interpreter,jit]\n"
+            "       [--memory softmmu,hostmapped] [--output FILE]\n"
+            "workloads: alu, memory, branch, calls, simd (default: all)\n",
+            argv0);
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--budget") {
+            options.budget = strtoull(value, nullptr, 10);
+        } else if (arg == "--max-vcpus") {
+            options.maxVcpus = atoi(value);
+        } else if (arg == "--workloads") {
+            options.workloads = splitList(value);
+        } else if (arg == "--modes") {
+            options.modes = splitList(value);
+        } else if (arg == "--memory") {
+            options.backends = splitList(value);
+        } else if (arg == "--output") {
+            options.output = value;
+        } else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    
+    for (const std::string& mode : options.modes) {
+        if (mode != "interpreter" && mode != "jit") {
+            fprintf(stderr, "unknown mode %s\n", mode.c_str());
+            return false;
+        }
+    }
+    for (const std::string& backend : options.backends) {
+        if (backend != "softmmu" && backend != "hostmapped") {
+            fprintf(stderr, "unknown memory backend %s\n", backend.c_str());
+            return false;
+        }
+    }
+    if (options.budget == 0) {
+        fprintf(stderr, "budget must be positive\n");
+        return false;
+    }
+    if (options.maxVcpus <= 0) {
+        options.maxVcpus = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    options.maxVcpus = std::min(options.maxVcpus, MAX_VCPUS);
+    return true;
+}
+
+// 1, 2, 4, ... up to max, plus max itself
+static std::vector<int> vcpuCounts(int max) {
+    std::vector<int> counts;
+    for (int n = 1; n < max; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(max);
+    return counts;
+}
+
+static Result run(const Workload& workload, ExecutionMode mode, MemoryBackend backend, int vcpus, uint64_t budget,
+                  CycleCounter& counter) {
+    Assembler a;
+    workload.build(a);
+    
+    Result result = {};
+    result.workload = workload.name;
+    result.vcpus = vcpus;
+    
+    CPUEmulator emulator(GUEST_MEMORY, vcpus, mode, backend);
+    result.mode = emulator.getExecutionMode() == ExecutionMode::Jit ? "jit" : "interpreter";
+    result.memory = emulator.getMemoryBackend() == MemoryBackend::HostMapped ? "hostmapped" : "softmmu";
+    emulator.setInstructionBudget(budget);
+    emulator.loadProgram(reinterpret_cast<const uint8_t*>(a.code.data()), a.code.size() * 4);
+    
+    counter.start();
+    auto begin = std::chrono::steady_clock::now();
+    emulator.start();
+    emulator.waitUntilHalted();
+    auto end = std::chrono::steady_clock::now();
+    result.cycles = counter.stop();
+    
+    result.seconds = std::chrono::duration<double>(end - begin).count();
+    result.instructions = emulator.getRetiredInstructions();
+    result.completed = true;
+    for (int i = 0; i < vcpus; i++) {
+        if (emulator.getRetiredInstructions(i) < budget) {
+            result.completed = false;
+        }
+    }
+    return result;
+}
+
+static bool writeJson(const Options& options, const std::vector<Result>& results, bool cyclesCounted) {
+    FILE* f = fopen(options.output.c_str(), "w");
+    if (f == nullptr) {
+        fprintf(stderr, "cannot write %s: %s\n", options.output.c_str(), strerror(errno));
+        return false;
+    }
+
+#if defined(__x86_64__)
+    const char* arch = "x86_64";
+#elif defined(__aarch64__)
+    const char* arch = "aarch64";
+#else
+    const char* arch = "unknown";
+#endif
+    
+    fprintf(f, "{\n");
+    fprintf(f, "  \"host\": { \"arch\": \"%s\", \"cpus\": %u },\n", arch, std::thread::hardware_concurrency());
+    fprintf(f, "  \"budget_per_vcpu\": %llu,\n", static_cast<unsigned long long>(options.budget));
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        fprintf(f, "    { \"workload\": \"%s\", \"mode\": \"%s\", \"memory\": \"%s\", \"vcpus\": %d, \"status\": \"%s\", ",
+                r.workload.c_str(), r.mode.c_str(), r.memory.c_str(), r.vcpus, r.completed ? "ok" : "trapped");
+        fprintf(f, "\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.4f, ",
+                static_cast<unsigned long long>(r.instructions), r.seconds, r.mips(),
+                r.instructions ? r.seconds * 1e9 / r.instructions : 0.0);
+        if (cyclesCounted && r.instructions != 0) {
+            fprintf(f, "\"host_cycles_per_instruction\": %.3f, ", static_cast<double>(r.cycles) / r.instructions);
+        } else {
+            fprintf(f, "\"host_cycles_per_instruction\": null, ");
+        }
+        fprintf(f, "\"scaling\": %.3f }%s\n", r.scaling, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    
+    bool ok = fclose(f) == 0;
+    if (!ok) {
+        fprintf(stderr, "cannot write %s: %s\n", options.output.c_str(), strerror(errno));
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 2;
+    }
+    
+    CycleCounter counter;
+    std::vector<Result> results;
+    bool allCompleted = true;
+    
+    for (const Workload& workload : WORKLOADS) {
+        if (!options.workloads.empty() && !contains(options.workloads, workload.name)) {
+            continue;
+        }
+        for (const std::string& modeName : options.modes) {
+            ExecutionMode mode = modeName == "jit" ? ExecutionMode::Jit : ExecutionMode::Interpreter;
+            for (const std::string& backendName : options.backends) {
+                MemoryBackend backend = backendName == "hostmapped" ? MemoryBackend::HostMapped : MemoryBackend::SoftMmu;
+                double singleMips = 0;
+                
+                for (int vcpus : vcpuCounts(options.maxVcpus)) {
+                    Result r = run(workload, mode, backend, vcpus, options.budget, counter);
+                    if (vcpus == 1) {
+                        singleMips = r.mips();
+                    }
+                    r.scaling = singleMips > 0 ? r.mips() / (singleMips * vcpus) : 0;
+                    allCompleted &= r.completed;
+                    
+                    printf("%-8s %-12s %-10s %2d vCPU  %-7s %10.2f MIPS", r.workload.c_str(), r.mode.c_str(),
+                           r.memory.c_str(), r.vcpus, r.completed ? "ok" : "trapped", r.mips());
+                    if (counter.available() && r.instructions != 0) {
+                        printf("  %7.2f cycles/insn", static_cast<double>(r.cycles) / r.instructions);
+                    }
+                    printf("  scaling %.2f\n", r.scaling);
+                    results.push_back(r);
+                }
+            }
+        }
+    }
+    
+    if (!writeJson(options, results, counter.available())) {
+        return 1;
+    }
+    
+    // A workload that traps no longer measures what it was written for
+    return allCompleted ? 0 : 1;
+}
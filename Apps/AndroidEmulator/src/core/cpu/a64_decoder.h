@@ -0,0 +1,1733 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <iterator>
+
+// Register file indices used by decoded ops. X0-X30 are 0-30. Encodings
+// use 31 for either the zero register or the stack pointer depending on
+// the operand; the decoder resolves that so executors can index the
+// register file directly.
+constexpr uint8_t REG_LR = 30;
+constexpr uint8_t REG_ZR = 31;      // always reads as zero; writes are discarded
+constexpr uint8_t REG_SP = 32;
+constexpr size_t REG_COUNT = 33;
+
+// Decoded form of a single guest instruction. All operand fields are
+// extracted once at decode time so the dispatcher never looks at the raw
+// instruction word again.
+//
+// Field use beyond rd/rn/rm:
+//   AddReg/SubReg/And/Orr/Eor   opt = shift type, shift = amount
+//   AddExt/SubExt               opt = extend type, shift = left shift
+//   Sbfm/Bfm/Ubfm               opt = immr, shift = imms
+//   Extr                        shift = lsb
+//   MovK                        imm = imm16 already shifted, shift = position
+//   Csel                        opt = condition, ra = 0 CSEL, 1 CSINC, 2 CSINV, 3 CSNEG
+//   Ccmp/Ccmn                   opt = condition, ra = NZCV if false, imm or rm (OP_REGISTER)
+//   ShiftVar                    opt = shift type
+//   Rev                         opt = log2 bytes per reversed container
+//   Madd/Msub/*Long             ra = addend
+//   Load/Store and variants     opt = log2 access size, rd = transfer register,
+//                               ra = second transfer register (pairs) or the
+//                               extend type of a register offset, shift = index shift
+//   *Exclusive, *ExclusivePair  as Load/Store and LoadPair/StorePair, rm = status
+//                               register of store-exclusive
+//   CompareSwap                 opt = log2 access size, rm = compare value, which
+//                               receives the old value
+//   AtomicRmw                   opt = log2 access size, shift = a64::AtomicOp, rm = operand,
+//                               rd = old value
+//   BranchCond                  opt = condition
+//   TestBranch                  shift = bit number
+//   Mrs/Msr                     imm = system register (see sysreg())
+//   MsrImm                      opt = op1:op2 of the PSTATE field, imm = CRm
+//   Sys                         imm = op1:CRn:CRm:op2
+//   Sev                         opt = 1 for SEVL
+//   Simd                        opt = a64::SimdOp, shift = log2 element size, OP_SF = 128-bit
+//                               (Q) form, imm = shift amount, lane, byte position or the
+//                               expanded 64-bit immediate, ra = source lane of INS (element)
+//   Fp                          opt = a64::FpOp, shift = log2 element size (2 single, 3 double),
+//                               ra = addend (FMADD and friends) or NZCV if false (FCCMP),
+//                               imm = condition, a64::FpRounding, destination size of FCVT,
+//                               bit pattern of FMOV (immediate) or 1 for the upper half of
+//                               FMOV (general); OP_SF = 64-bit general register
+//   VecLoad/VecStore and pairs  as Load/Store, with opt = 4 for Q registers
+//   VecLoadMulti/VecStoreMulti  opt = 3 or 4 for 64 or 128 bits per register, ra = number
+//                               of consecutive registers, rm = post-index register (OP_REGISTER)
+//   Undefined                   imm = raw instruction
+enum class MicroOpKind : uint8_t {
+    Nop,
+    Undefined,
+    
+    // Data processing, immediate
+    Adr,
+    Adrp,
+    AddImm,
+    SubImm,
+    AndImm,
+    OrrImm,
+    EorImm,
+    MovImm,         // MOVZ and MOVN, with the final value in imm
+    MovK,
+    Sbfm,
+    Bfm,
+    Ubfm,
+    Extr,
+    
+    // Data processing, register
+    AddReg,
+    SubReg,
+    AddExt,
+    SubExt,
+    Adc,
+    Sbc,
+    And,
+    Orr,
+    Eor,
+    Csel,
+    Ccmp,
+    Ccmn,
+    Udiv,
+    Sdiv,
+    ShiftVar,
+    Rbit,
+    Rev,
+    Clz,
+    Cls,
+    Madd,
+    Msub,
+    MaddLong,
+    MsubLong,
+    MulHigh,
+    
+    // Loads and stores
+    Load,
+    Store,
+    LoadPair,
+    StorePair,
+    LoadLiteral,
+    LoadAcquire,
+    StoreRelease,
+    LoadExclusive,
+    StoreExclusive,
+    LoadExclusivePair,
+    StoreExclusivePair,
+    CompareSwap,        // CAS
+    AtomicRmw,          // LDADD, LDCLR, LDEOR, LDSET, LD{S,U}{MAX,MIN}, SWP
+    
+    // Loads and stores, SIMD and floating-point registers
+    VecLoad,
+    VecStore,
+    VecLoadPair,
+    VecStorePair,
+    VecLoadLiteral,
+    VecLoadMulti,       // LD1 (multiple structures)
+    VecStoreMulti,      // ST1 (multiple structures)
+    
+    // Branches
+    Branch,
+    BranchCond,
+    CompareBranch,
+    TestBranch,
+    BranchReg,
+    
+    // Exceptions and system
+    Svc,
+    Brk,
+    Eret,
+    Barrier,
+    Clrex,
+    Mrs,
+    Msr,
+    MsrImm,
+    Sys,
+    Wfi,
+    Wfe,
+    Sev,
+    
+    // Advanced SIMD data processing, executed by SimdUnit
+    Simd,
+    
+    // Scalar floating point, executed by FpUnit
+    Fp
+};
+
+enum MicroOpFlag : uint8_t {
+    OP_SF = 1u << 0,            // 64-bit operation; sign-extending loads extend to 64 bits
+    OP_SETFLAGS = 1u << 1,      // S form, writes NZCV
+    OP_INVERT = 1u << 2,        // BIC/ORN/EON/BICS, CBNZ, TBNZ
+    OP_SIGNED = 1u << 3,        // sign-extending load, signed long multiply
+    OP_WRITEBACK = 1u << 4,     // pre- or post-indexed, base register updated
+    OP_POSTINDEX = 1u << 5,     // access at the unmodified base
+    OP_REGISTER = 1u << 6,      // register offset, CCMP/CCMN register form
+    OP_LINK = 1u << 7           // BL, BLR
+};
+
+struct MicroOp {
+    MicroOpKind kind;
+    uint8_t rd;
+    uint8_t rn;
+    uint8_t rm;
+    uint8_t ra;
+    uint8_t opt;
+    uint8_t shift;
+    uint8_t flags;
+    int64_t imm;
+};
+
+// Ops after which the block has to end: anything that can change the PC,
+// the translation regime or the exception state.
+inline bool endsBlock(MicroOpKind kind) {
+    switch (kind) {
+        case MicroOpKind::Branch:
+        case MicroOpKind::BranchCond:
+        case MicroOpKind::CompareBranch:
+        case MicroOpKind::TestBranch:
+        case MicroOpKind::BranchReg:
+        case MicroOpKind::Svc:
+        case MicroOpKind::Brk:
+        case MicroOpKind::Eret:
+        case MicroOpKind::Msr:
+        case MicroOpKind::MsrImm:
+        case MicroOpKind::Sys:
+        case MicroOpKind::Wfi:
+        case MicroOpKind::Wfe:
+        case MicroOpKind::Undefined:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether an op read back from outside this process is one the decoder
+// could have produced, as far as the executors rely on: a known kind (Fp
+// is the last one), general registers within the register file and SIMD
+// and FP registers within the vector file. The base and offset registers
+// of vector loads and stores are general registers.
+inline bool validOp(const MicroOp& op) {
+    if (static_cast<uint8_t>(op.kind) > static_cast<uint8_t>(MicroOpKind::Fp)) {
+        return false;
+    }
+    if (op.rd > REG_SP || op.rn > REG_SP || op.rm > REG_SP || op.ra > REG_SP) {
+        return false;
+    }
+    switch (op.kind) {
+        case MicroOpKind::Simd:
+        case MicroOpKind::Fp:
+            return op.rd < 32 && op.rn < 32 && op.rm < 32 && op.ra < 32;
+        case MicroOpKind::VecLoad:
+        case MicroOpKind::VecStore:
+        case MicroOpKind::VecLoadPair:
+        case MicroOpKind::VecStorePair:
+        case MicroOpKind::VecLoadLiteral:
+        case MicroOpKind::VecLoadMulti:
+        case MicroOpKind::VecStoreMulti:
+            return op.rd < 32 && op.ra < 32;
+        default:
+            return true;
+    }
+}
+
+// Table-driven A64 decoder. Every supported encoding group is one
+// mask/value entry with its own field extractor. At compile time the
+// table is folded into an index over instruction bits [31:21]; each slot
+// lists the few entries that can match there, most specific first, so
+// decoding is one indexed load plus at most MAX_BUCKET compares.
+namespace a64 {
+    
+    constexpr uint32_t field(uint32_t insn, unsigned lo, unsigned width) {
+        return (insn >> lo) & ((1u << width) - 1);
+    }
+    
+    constexpr int64_t signedField(uint32_t insn, unsigned lo, unsigned width) {
+        return static_cast<int64_t>(static_cast<uint64_t>(field(insn, lo, width)) << (64 - width)) >> (64 - width);
+    }
+    
+    constexpr uint8_t regOrSp(uint32_t reg) {
+        return reg == 31 ? REG_SP : static_cast<uint8_t>(reg);
+    }
+    
+    constexpr uint16_t sysreg(unsigned op0, unsigned op1, unsigned crn, unsigned crm, unsigned op2) {
+        return static_cast<uint16_t>((op0 << 14) | (op1 << 11) | (crn << 7) | (crm << 3) | op2);
+    }
+    
+    // System registers by their MRS/MSR encoding
+    enum SystemRegister : uint16_t {
+        MIDR_EL1 = sysreg(3, 0, 0, 0, 0),
+        MPIDR_EL1 = sysreg(3, 0, 0, 0, 5),
+        ID_AA64ISAR0_EL1 = sysreg(3, 0, 0, 6, 0),
+        SCTLR_EL1 = sysreg(3, 0, 1, 0, 0),
+        CPACR_EL1 = sysreg(3, 0, 1, 0, 2),
+        TTBR0_EL1 = sysreg(3, 0, 2, 0, 0),
+        TTBR1_EL1 = sysreg(3, 0, 2, 0, 1),
+        TCR_EL1 = sysreg(3, 0, 2, 0, 2),
+        SPSR_EL1 = sysreg(3, 0, 4, 0, 0),
+        ELR_EL1 = sysreg(3, 0, 4, 0, 1),
+        SP_EL0 = sysreg(3, 0, 4, 1, 0),
+        SPSEL = sysreg(3, 0, 4, 2, 0),
+        CURRENT_EL = sysreg(3, 0, 4, 2, 2),
+        ESR_EL1 = sysreg(3, 0, 5, 2, 0),
+        FAR_EL1 = sysreg(3, 0, 6, 0, 0),
+        PAR_EL1 = sysreg(3, 0, 7, 4, 0),
+        MAIR_EL1 = sysreg(3, 0, 10, 2, 0),
+        AMAIR_EL1 = sysreg(3, 0, 10, 3, 0),
+        VBAR_EL1 = sysreg(3, 0, 12, 0, 0),
+        CONTEXTIDR_EL1 = sysreg(3, 0, 13, 0, 1),
+        TPIDR_EL1 = sysreg(3, 0, 13, 0, 4),
+        CTR_EL0 = sysreg(3, 3, 0, 0, 1),
+        DCZID_EL0 = sysreg(3, 3, 0, 0, 7),
+        NZCV = sysreg(3, 3, 4, 2, 0),
+        DAIF = sysreg(3, 3, 4, 2, 1),
+        FPCR = sysreg(3, 3, 4, 4, 0),
+        FPSR = sysreg(3, 3, 4, 4, 1),
+        TPIDR_EL0 = sysreg(3, 3, 13, 0, 2),
+        TPIDRRO_EL0 = sysreg(3, 3, 13, 0, 3),
+        
+        // Generic timer
+        CNTKCTL_EL1 = sysreg(3, 0, 14, 1, 0),
+        CNTFRQ_EL0 = sysreg(3, 3, 14, 0, 0),
+        CNTPCT_EL0 = sysreg(3, 3, 14, 0, 1),
+        CNTVCT_EL0 = sysreg(3, 3, 14, 0, 2),
+        CNTV_TVAL_EL0 = sysreg(3, 3, 14, 3, 0),
+        CNTV_CTL_EL0 = sysreg(3, 3, 14, 3, 1),
+        CNTV_CVAL_EL0 = sysreg(3, 3, 14, 3, 2),
+        
+        // Interrupts and the GICv3 CPU interface
+        ISR_EL1 = sysreg(3, 0, 12, 1, 0),
+        ICC_PMR_EL1 = sysreg(3, 0, 4, 6, 0),
+        ICC_IAR1_EL1 = sysreg(3, 0, 12, 12, 0),
+        ICC_EOIR1_EL1 = sysreg(3, 0, 12, 12, 1),
+        ICC_SRE_EL1 = sysreg(3, 0, 12, 12, 5),
+        ICC_IGRPEN1_EL1 = sysreg(3, 0, 12, 12, 7)
+    };
+    
+    // The ID_AA64* feature registers; op0=3, op1=0, CRn=0, CRm=1..7
+    constexpr bool isIdRegister(uint16_t reg) {
+        return (reg & 0xFFC0) == sysreg(3, 0, 0, 0, 0) && ((reg >> 3) & 0xF) != 0;
+    }
+    
+    // PSTATE fields writable with MSR (immediate), as op1:op2
+    constexpr uint8_t PSTATE_SPSEL = (0 << 3) | 5;
+    constexpr uint8_t PSTATE_DAIFSET = (3 << 3) | 6;
+    constexpr uint8_t PSTATE_DAIFCLR = (3 << 3) | 7;
+    
+    // Read-modify-write operations of the LSE atomics, in MicroOp::shift
+    // of AtomicRmw ops. The first eight follow the opc field.
+    enum AtomicOp : uint8_t {
+        ATOMIC_ADD,
+        ATOMIC_CLR,
+        ATOMIC_EOR,
+        ATOMIC_SET,
+        ATOMIC_SMAX,
+        ATOMIC_SMIN,
+        ATOMIC_UMAX,
+        ATOMIC_UMIN,
+        ATOMIC_SWP
+    };
+    
+    // Advanced SIMD operations, in MicroOp::opt of Simd ops
+    enum SimdOp : uint8_t {
+        // Integer, three registers
+        SIMD_ADD,
+        SIMD_SUB,
+        SIMD_MUL,
+        SIMD_MLA,
+        SIMD_MLS,
+        SIMD_ADDP,
+        SIMD_SQADD,
+        SIMD_UQADD,
+        SIMD_SQSUB,
+        SIMD_UQSUB,
+        SIMD_SMAX,
+        SIMD_SMIN,
+        SIMD_UMAX,
+        SIMD_UMIN,
+        SIMD_CMEQ,
+        SIMD_CMGT,
+        SIMD_CMHI,
+        SIMD_CMGE,
+        SIMD_CMHS,
+        SIMD_CMTST,
+        
+        // Bitwise
+        SIMD_AND,
+        SIMD_BIC,
+        SIMD_ORR,
+        SIMD_ORN,
+        SIMD_EOR,
+        SIMD_BSL,
+        SIMD_BIT,
+        SIMD_BIF,
+        SIMD_NOT,
+        
+        // Integer, two registers
+        SIMD_NEG,
+        SIMD_ABS,
+        SIMD_CNT,
+        SIMD_REV,           // imm = log2 container size in bytes
+        SIMD_CMEQ0,
+        SIMD_CMGT0,
+        SIMD_CMGE0,
+        SIMD_CMLE0,
+        SIMD_CMLT0,
+        
+        // Floating point
+        SIMD_FADD,
+        SIMD_FSUB,
+        SIMD_FMUL,
+        SIMD_FDIV,
+        SIMD_FMAX,
+        SIMD_FMIN,
+        SIMD_FMLA,
+        SIMD_FMLS,
+        SIMD_FADDP,
+        SIMD_FABD,
+        SIMD_FCMEQ,
+        SIMD_FCMGE,
+        SIMD_FCMGT,
+        SIMD_FABS,
+        SIMD_FNEG,
+        SIMD_FSQRT,
+        SIMD_SCVTF,
+        SIMD_UCVTF,
+        SIMD_FCVTZS,
+        SIMD_FCVTZU,
+        
+        // Shifts by immediate; imm = shift amount
+        SIMD_SHL,
+        SIMD_SSHR,
+        SIMD_USHR,
+        SIMD_SSRA,
+        SIMD_USRA,
+        SIMD_SSHLL,         // shift = source element size
+        SIMD_USHLL,
+        SIMD_SHRN,          // and XTN; shift = destination element size
+        
+        // Across lanes
+        SIMD_ADDV,
+        SIMD_SMAXV,
+        SIMD_SMINV,
+        SIMD_UMAXV,
+        SIMD_UMINV,
+        
+        // Permutes; EXT has the byte position in imm
+        SIMD_ZIP1,
+        SIMD_ZIP2,
+        SIMD_UZP1,
+        SIMD_UZP2,
+        SIMD_TRN1,
+        SIMD_TRN2,
+        SIMD_EXT,
+        
+        // Element copies; imm = lane, rn/rd a general register where the
+        // instruction takes one
+        SIMD_DUP_ELEMENT,
+        SIMD_DUP_GENERAL,
+        SIMD_INS_GENERAL,
+        SIMD_INS_ELEMENT,
+        SIMD_UMOV,
+        SIMD_SMOV,
+        
+        // Modified immediates (MOVI, MVNI, FMOV), imm = 64-bit pattern
+        SIMD_MOVI,
+        SIMD_ORR_IMM,
+        SIMD_BIC_IMM
+    };
+    
+    // Scalar floating-point operations, in MicroOp::opt of Fp ops
+    enum FpOp : uint8_t {
+        // One source
+        FP_MOV,
+        FP_ABS,
+        FP_NEG,
+        FP_SQRT,
+        FP_CVT,             // to the precision in imm
+        FP_RINT,            // FRINT*; imm = a64::FpRounding
+        
+        // Two sources
+        FP_MUL,
+        FP_DIV,
+        FP_ADD,
+        FP_SUB,
+        FP_MAX,
+        FP_MIN,
+        FP_MAXNM,
+        FP_MINNM,
+        FP_NMUL,
+        
+        // Three sources; ra = addend
+        FP_MADD,
+        FP_MSUB,
+        FP_NMADD,
+        FP_NMSUB,
+        
+        // Compares and selects; FCMPE is FCMP, as exceptions are not trapped
+        FP_CMP,
+        FP_CMP_ZERO,
+        FP_CCMP,
+        FP_CSEL,
+        FP_MOV_IMM,
+        
+        // Conversions; rn of SCVTF/UCVTF, rd of FCVT*S/U and FMOV to general
+        // registers are general registers
+        FP_SCVTF,
+        FP_UCVTF,
+        FP_CVTS,            // imm = a64::FpRounding
+        FP_CVTU,
+        FP_MOV_TO_GENERAL,
+        FP_MOV_FROM_GENERAL
+    };
+    
+    // Rounding of FRINT* and FCVT*S/U. The first four follow FPCR.RMode.
+    enum FpRounding : uint8_t {
+        FP_ROUND_TIEEVEN,
+        FP_ROUND_POSINF,
+        FP_ROUND_NEGINF,
+        FP_ROUND_ZERO,
+        FP_ROUND_TIEAWAY,
+        FP_ROUND_FPCR           // FRINTI, FRINTX
+    };
+    
+    constexpr MicroOp makeOp(MicroOpKind kind, uint32_t rd, uint32_t rn, uint32_t rm, int64_t imm, uint8_t flags) {
+        return { kind, static_cast<uint8_t>(rd), static_cast<uint8_t>(rn), static_cast<uint8_t>(rm), 0, 0, 0, flags, imm };
+    }
+    
+    constexpr MicroOp undefined(uint32_t insn) {
+        return makeOp(MicroOpKind::Undefined, 0, 0, 0, insn, 0);
+    }
+    
+    constexpr uint8_t sf(uint32_t insn) {
+        return (insn >> 31) ? OP_SF : 0;
+    }
+    
+    constexpr uint8_t setFlags(uint32_t insn) {
+        return field(insn, 29, 1) ? OP_SETFLAGS : 0;
+    }
+    
+    // DecodeBitMasks() from the Arm ARM, for logical immediates
+    constexpr bool decodeBitMask(unsigned n, unsigned imms, unsigned immr, unsigned regSize, uint64_t& mask) {
+        unsigned combined = (n << 6) | (~imms & 0x3F);
+        if (combined <= 1) {
+            return false;
+        }
+        unsigned len = 31 - __builtin_clz(combined);
+        unsigned esize = 1u << len;
+        unsigned levels = esize - 1;
+        unsigned s = imms & levels;
+        unsigned r = immr & levels;
+        if (s == levels || esize > regSize) {
+            return false;
+        }
+        
+        uint64_t elementMask = esize == 64 ? ~0ull : (1ull << esize) - 1;
+        uint64_t ones = (1ull << (s + 1)) - 1;
+        uint64_t element = r == 0 ? ones : ((ones >> r) | (ones << (esize - r))) & elementMask;
+        
+        mask = 0;
+        for (unsigned i = 0; i < regSize; i += esize) {
+            mask |= element << i;
+        }
+        return true;
+    }
+    
+    // Branches, exception generation and system
+    
+    inline MicroOp decodeBranchImm(uint32_t insn) {
+        return makeOp(MicroOpKind::Branch, REG_LR, 0, 0, signedField(insn, 0, 26) * 4,
+                      (insn >> 31) ? OP_LINK : 0);
+    }
+    
+    inline MicroOp decodeBranchCond(uint32_t insn) {
+        MicroOp op = makeOp(MicroOpKind::BranchCond, 0, 0, 0, signedField(insn, 5, 19) * 4, 0);
+        op.opt = field(insn, 0, 4);
+        return op;
+    }
+    
+    inline MicroOp decodeCompareBranch(uint32_t insn) {
+        return makeOp(MicroOpKind::CompareBranch, field(insn, 0, 5), 0, 0, signedField(insn, 5, 19) * 4,
+                      sf(insn) | (field(insn, 24, 1) ? OP_INVERT : 0));
+    }
+    
+    inline MicroOp decodeTestBranch(uint32_t insn) {
+        MicroOp op = makeOp(MicroOpKind::TestBranch, field(insn, 0, 5), 0, 0, signedField(insn, 5, 14) * 4,
+                            field(insn, 24, 1) ? OP_INVERT : 0);
+        op.shift = (field(insn, 31, 1) << 5) | field(insn, 19, 5);
+        return op;
+    }
+    
+    inline MicroOp decodeBranchReg(uint32_t insn) {
+        switch (field(insn, 21, 2)) {
+            case 0: // BR
+            case 2: // RET
+                return makeOp(MicroOpKind::BranchReg, REG_LR, field(insn, 5, 5), 0, 0, 0);
+            case 1: // BLR
+                return makeOp(MicroOpKind::BranchReg, REG_LR, field(insn, 5, 5), 0, 0, OP_LINK);
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    inline MicroOp decodeEret(uint32_t) {
+        return makeOp(MicroOpKind::Eret, 0, 0, 0, 0, 0);
+    }
+    
+    inline MicroOp decodeException(uint32_t insn) {
+        unsigned opc = field(insn, 21, 3);
+        unsigned ll = field(insn, 0, 2);
+        int64_t imm16 = field(insn, 5, 16);
+        if (opc == 0 && ll == 1) {
+            return makeOp(MicroOpKind::Svc, 0, 0, 0, imm16, 0);
+        }
+        if (opc == 1 && ll == 0) {
+            return makeOp(MicroOpKind::Brk, 0, 0, 0, imm16, 0);
+        }
+        // HVC and SMC: EL2 and EL3 are not implemented
+        return undefined(insn);
+    }
+    
+    inline MicroOp decodeHint(uint32_t insn) {
+        switch (field(insn, 5, 7)) {
+            case 2:
+                return makeOp(MicroOpKind::Wfe, 0, 0, 0, 0, 0);
+            case 3:
+                return makeOp(MicroOpKind::Wfi, 0, 0, 0, 0, 0);
+            case 4:
+            case 5:
+                {
+                    MicroOp op = makeOp(MicroOpKind::Sev, 0, 0, 0, 0, 0);
+                    op.opt = field(insn, 5, 7) == 5;
+                    return op;
+                }
+            default:
+                // NOP, YIELD and the pointer authentication hints
+                return makeOp(MicroOpKind::Nop, 0, 0, 0, 0, 0);
+        }
+    }
+    
+    inline MicroOp decodeBarrier(uint32_t insn) {
+        switch (field(insn, 5, 3)) {
+            case 2:
+                return makeOp(MicroOpKind::Clrex, 0, 0, 0, 0, 0);
+            case 4: // DSB
+            case 5: // DMB
+            case 6: // ISB
+            case 7: // SB
+                return makeOp(MicroOpKind::Barrier, 0, 0, 0, 0, 0);
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    inline MicroOp decodeMsrImm(uint32_t insn) {
+        uint8_t pstateField = static_cast<uint8_t>((field(insn, 16, 3) << 3) | field(insn, 5, 3));
+        if (pstateField != PSTATE_SPSEL && pstateField != PSTATE_DAIFSET && pstateField != PSTATE_DAIFCLR) {
+            return undefined(insn);
+        }
+        MicroOp op = makeOp(MicroOpKind::MsrImm, 0, 0, 0, field(insn, 8, 4), 0);
+        op.opt = pstateField;
+        return op;
+    }
+    
+    inline MicroOp decodeSys(uint32_t insn) {
+        return makeOp(MicroOpKind::Sys, field(insn, 0, 5), 0, 0, field(insn, 5, 14), 0);
+    }
+    
+    inline MicroOp decodeSysReg(uint32_t insn) {
+        return makeOp(field(insn, 21, 1) ? MicroOpKind::Mrs : MicroOpKind::Msr, field(insn, 0, 5), 0, 0,
+                      field(insn, 5, 16), 0);
+    }
+    
+    // Data processing, immediate
+    
+    inline MicroOp decodeAdr(uint32_t insn) {
+        int64_t imm = signedField(insn, 5, 19) * 4 + field(insn, 29, 2);
+        if (insn >> 31) {
+            return makeOp(MicroOpKind::Adrp, field(insn, 0, 5), 0, 0, imm * 4096, 0);
+        }
+        return makeOp(MicroOpKind::Adr, field(insn, 0, 5), 0, 0, imm, 0);
+    }
+    
+    inline MicroOp decodeAddSubImm(uint32_t insn) {
+        uint8_t flags = sf(insn) | setFlags(insn);
+        uint32_t rd = (flags & OP_SETFLAGS) ? field(insn, 0, 5) : regOrSp(field(insn, 0, 5));
+        int64_t imm = static_cast<int64_t>(field(insn, 10, 12)) << (field(insn, 22, 1) * 12);
+        return makeOp(field(insn, 30, 1) ? MicroOpKind::SubImm : MicroOpKind::AddImm,
+                      rd, regOrSp(field(insn, 5, 5)), 0, imm, flags);
+    }
+    
+    inline MicroOp decodeLogicalImm(uint32_t insn) {
+        uint64_t mask = 0;
+        if ((!(insn >> 31) && field(insn, 22, 1)) ||
+            !decodeBitMask(field(insn, 22, 1), field(insn, 10, 6), field(insn, 16, 6), (insn >> 31) ? 64 : 32, mask)) {
+            return undefined(insn);
+        }
+        
+        static constexpr MicroOpKind kinds[] = { MicroOpKind::AndImm, MicroOpKind::OrrImm,
+                                                 MicroOpKind::EorImm, MicroOpKind::AndImm };
+        unsigned opc = field(insn, 29, 2);
+        uint32_t rd = opc == 3 ? field(insn, 0, 5) : regOrSp(field(insn, 0, 5));
+        return makeOp(kinds[opc], rd, field(insn, 5, 5), 0, static_cast<int64_t>(mask),
+                      sf(insn) | (opc == 3 ? OP_SETFLAGS : 0));
+    }
+    
+    inline MicroOp decodeMoveWide(uint32_t insn) {
+        unsigned opc = field(insn, 29, 2);
+        unsigned shift = field(insn, 21, 2) * 16;
+        if (opc == 1 || (!(insn >> 31) && shift >= 32)) {
+            return undefined(insn);
+        }
+        
+        uint64_t imm = static_cast<uint64_t>(field(insn, 5, 16)) << shift;
+        if (opc == 3) {
+            MicroOp op = makeOp(MicroOpKind::MovK, field(insn, 0, 5), 0, 0, static_cast<int64_t>(imm), sf(insn));
+            op.shift = static_cast<uint8_t>(shift);
+            return op;
+        }
+        if (opc == 0) {
+            imm = ~imm;
+            if (!(insn >> 31)) {
+                imm &= 0xFFFFFFFFull;
+            }
+        }
+        return makeOp(MicroOpKind::MovImm, field(insn, 0, 5), 0, 0, static_cast<int64_t>(imm), sf(insn));
+    }
+    
+    inline MicroOp decodeBitfield(uint32_t insn) {
+        static constexpr MicroOpKind kinds[] = { MicroOpKind::Sbfm, MicroOpKind::Bfm, MicroOpKind::Ubfm };
+        unsigned opc = field(insn, 29, 2);
+        unsigned immr = field(insn, 16, 6);
+        unsigned imms = field(insn, 10, 6);
+        bool is64 = insn >> 31;
+        if (opc == 3 || field(insn, 22, 1) != is64 || (!is64 && (immr >= 32 || imms >= 32))) {
+            return undefined(insn);
+        }
+        
+        MicroOp op = makeOp(kinds[opc], field(insn, 0, 5), field(insn, 5, 5), 0, 0, sf(insn));
+        op.opt = static_cast<uint8_t>(immr);
+        op.shift = static_cast<uint8_t>(imms);
+        return op;
+    }
+    
+    inline MicroOp decodeExtract(uint32_t insn) {
+        bool is64 = insn >> 31;
+        unsigned lsb = field(insn, 10, 6);
+        if (field(insn, 22, 1) != is64 || (!is64 && lsb >= 32)) {
+            return undefined(insn);
+        }
+        MicroOp op = makeOp(MicroOpKind::Extr, field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), 0, sf(insn));
+        op.shift = static_cast<uint8_t>(lsb);
+        return op;
+    }
+    
+    // Data processing, register
+    
+    inline MicroOp decodeLogicalReg(uint32_t insn) {
+        static constexpr MicroOpKind kinds[] = { MicroOpKind::And, MicroOpKind::Orr,
+                                                 MicroOpKind::Eor, MicroOpKind::And };
+        unsigned opc = field(insn, 29, 2);
+        unsigned amount = field(insn, 10, 6);
+        if (!(insn >> 31) && amount >= 32) {
+            return undefined(insn);
+        }
+        
+        MicroOp op = makeOp(kinds[opc], field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), 0,
+                            sf(insn) | (opc == 3 ? OP_SETFLAGS : 0) | (field(insn, 21, 1) ? OP_INVERT : 0));
+        op.opt = field(insn, 22, 2);
+        op.shift = static_cast<uint8_t>(amount);
+        return op;
+    }
+    
+    inline MicroOp decodeAddSubShifted(uint32_t insn) {
+        unsigned type = field(insn, 22, 2);
+        unsigned amount = field(insn, 10, 6);
+        if (type == 3 || (!(insn >> 31) && amount >= 32)) {
+            return undefined(insn);
+        }
+        
+        MicroOp op = makeOp(field(insn, 30, 1) ? MicroOpKind::SubReg : MicroOpKind::AddReg,
+                            field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), 0, sf(insn) | setFlags(insn));
+        op.opt = static_cast<uint8_t>(type);
+        op.shift = static_cast<uint8_t>(amount);
+        return op;
+    }
+    
+    inline MicroOp decodeAddSubExtended(uint32_t insn) {
+        unsigned amount = field(insn, 10, 3);
+        if (field(insn, 22, 2) != 0 || amount > 4) {
+            return undefined(insn);
+        }
+        
+        uint8_t flags = sf(insn) | setFlags(insn);
+        uint32_t rd = (flags & OP_SETFLAGS) ? field(insn, 0, 5) : regOrSp(field(insn, 0, 5));
+        MicroOp op = makeOp(field(insn, 30, 1) ? MicroOpKind::SubExt : MicroOpKind::AddExt,
+                            rd, regOrSp(field(insn, 5, 5)), field(insn, 16, 5), 0, flags);
+        op.opt = field(insn, 13, 3);
+        op.shift = static_cast<uint8_t>(amount);
+        return op;
+    }
+    
+    inline MicroOp decodeAddSubCarry(uint32_t insn) {
+        return makeOp(field(insn, 30, 1) ? MicroOpKind::Sbc : MicroOpKind::Adc,
+                      field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), 0, sf(insn) | setFlags(insn));
+    }
+    
+    inline MicroOp decodeCondCompare(uint32_t insn) {
+        bool isImm = field(insn, 11, 1);
+        MicroOp op = makeOp(field(insn, 30, 1) ? MicroOpKind::Ccmp : MicroOpKind::Ccmn,
+                            0, field(insn, 5, 5), field(insn, 16, 5), isImm ? field(insn, 16, 5) : 0,
+                            sf(insn) | (isImm ? 0 : OP_REGISTER));
+        op.opt = field(insn, 12, 4);
+        op.ra = field(insn, 0, 4);
+        return op;
+    }
+    
+    inline MicroOp decodeCondSelect(uint32_t insn) {
+        MicroOp op = makeOp(MicroOpKind::Csel, field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), 0, sf(insn));
+        op.opt = field(insn, 12, 4);
+        op.ra = (field(insn, 30, 1) << 1) | field(insn, 10, 1);
+        return op;
+    }
+    
+    inline MicroOp decodeDataProc2(uint32_t insn) {
+        uint32_t rd = field(insn, 0, 5);
+        uint32_t rn = field(insn, 5, 5);
+        uint32_t rm = field(insn, 16, 5);
+        unsigned opcode = field(insn, 10, 6);
+        switch (opcode) {
+            case 0x02:
+                return makeOp(MicroOpKind::Udiv, rd, rn, rm, 0, sf(insn));
+            case 0x03:
+                return makeOp(MicroOpKind::Sdiv, rd, rn, rm, 0, sf(insn));
+            case 0x08: // LSLV
+            case 0x09: // LSRV
+            case 0x0A: // ASRV
+            case 0x0B: // RORV
+                {
+                    MicroOp op = makeOp(MicroOpKind::ShiftVar, rd, rn, rm, 0, sf(insn));
+                    op.opt = opcode & 3;
+                    return op;
+                }
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    inline MicroOp decodeDataProc1(uint32_t insn) {
+        uint32_t rd = field(insn, 0, 5);
+        uint32_t rn = field(insn, 5, 5);
+        bool is64 = insn >> 31;
+        MicroOp op = makeOp(MicroOpKind::Rev, rd, rn, 0, 0, sf(insn));
+        switch (field(insn, 10, 6)) {
+            case 0x00:
+                op.kind = MicroOpKind::Rbit;
+                return op;
+            case 0x01: // REV16
+                op.opt = 1;
+                return op;
+            case 0x02: // REV32, or REV of a W register
+                op.opt = 2;
+                return op;
+            case 0x03:
+                if (!is64) {
+                    return undefined(insn);
+                }
+                op.opt = 3;
+                return op;
+            case 0x04:
+                op.kind = MicroOpKind::Clz;
+                return op;
+            case 0x05:
+                op.kind = MicroOpKind::Cls;
+                return op;
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    inline MicroOp decodeDataProc3(uint32_t insn) {
+        bool is64 = insn >> 31;
+        bool subtract = field(insn, 15, 1);
+        MicroOp op = makeOp(subtract ? MicroOpKind::Msub : MicroOpKind::Madd,
+                            field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), 0, sf(insn));
+        op.ra = field(insn, 10, 5);
+        
+        unsigned op31 = field(insn, 21, 3);
+        if (field(insn, 29, 2) != 0 || (op31 != 0 && !is64)) {
+            return undefined(insn);
+        }
+        switch (op31) {
+            case 0:
+                return op;
+            case 1: // SMADDL, SMSUBL
+            case 5: // UMADDL, UMSUBL
+                op.kind = subtract ? MicroOpKind::MsubLong : MicroOpKind::MaddLong;
+                op.flags |= op31 == 1 ? OP_SIGNED : 0;
+                return op;
+            case 2: // SMULH
+            case 6: // UMULH
+                if (subtract) {
+                    return undefined(insn);
+                }
+                op.kind = MicroOpKind::MulHigh;
+                op.flags |= op31 == 2 ? OP_SIGNED : 0;
+                return op;
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    // Loads and stores
+    
+    // Kind, size and extension for the size:opc combinations shared by the
+    // single-register integer forms. Prefetches decode as Nop.
+    inline bool loadStoreKind(uint32_t insn, MicroOp& op) {
+        unsigned size = field(insn, 30, 2);
+        op.opt = static_cast<uint8_t>(size);
+        switch (field(insn, 22, 2)) {
+            case 0:
+                op.kind = MicroOpKind::Store;
+                return true;
+            case 1:
+                op.kind = MicroOpKind::Load;
+                return true;
+            case 2:
+                op.kind = size == 3 ? MicroOpKind::Nop : MicroOpKind::Load;
+                op.flags |= OP_SIGNED | OP_SF;
+                return true;
+            default:
+                op.kind = MicroOpKind::Load;
+                op.flags |= OP_SIGNED;
+                return size < 2;
+        }
+    }
+    
+    inline MicroOp decodeLoadStoreImm9(uint32_t insn) {
+        unsigned mode = field(insn, 10, 2);   // unscaled, post-index, unprivileged, pre-index
+        MicroOp op = makeOp(MicroOpKind::Load, field(insn, 0, 5), regOrSp(field(insn, 5, 5)), 0,
+                            signedField(insn, 12, 9),
+                            mode == 1 ? OP_WRITEBACK | OP_POSTINDEX : (mode == 3 ? OP_WRITEBACK : 0));
+        return loadStoreKind(insn, op) ? op : undefined(insn);
+    }
+    
+    inline MicroOp decodeLoadStoreRegOffset(uint32_t insn) {
+        unsigned option = field(insn, 13, 3);
+        if (!(option & 2)) {
+            return undefined(insn);
+        }
+        MicroOp op = makeOp(MicroOpKind::Load, field(insn, 0, 5), regOrSp(field(insn, 5, 5)), field(insn, 16, 5), 0,
+                            OP_REGISTER);
+        if (!loadStoreKind(insn, op)) {
+            return undefined(insn);
+        }
+        op.ra = static_cast<uint8_t>(option);
+        op.shift = field(insn, 12, 1) ? op.opt : 0;
+        return op;
+    }
+    
+    inline MicroOp decodeLoadStoreUnsigned(uint32_t insn) {
+        MicroOp op = makeOp(MicroOpKind::Load, field(insn, 0, 5), regOrSp(field(insn, 5, 5)), 0,
+                            static_cast<int64_t>(field(insn, 10, 12)) << field(insn, 30, 2), 0);
+        return loadStoreKind(insn, op) ? op : undefined(insn);
+    }
+    
+    inline MicroOp decodeLoadLiteral(uint32_t insn) {
+        MicroOp op = makeOp(MicroOpKind::LoadLiteral, field(insn, 0, 5), 0, 0, signedField(insn, 5, 19) * 4, 0);
+        switch (field(insn, 30, 2)) {
+            case 0:
+                op.opt = 2;
+                return op;
+            case 1:
+                op.opt = 3;
+                return op;
+            case 2: // LDRSW
+                op.opt = 2;
+                op.flags = OP_SIGNED | OP_SF;
+                return op;
+            default: // PRFM
+                return makeOp(MicroOpKind::Nop, 0, 0, 0, 0, 0);
+        }
+    }
+    
+    inline MicroOp decodeLoadStorePair(uint32_t insn) {
+        unsigned opc = field(insn, 30, 2);
+        bool load = field(insn, 22, 1);
+        if (opc == 3 || (opc == 1 && !load)) {
+            return undefined(insn);
+        }
+        
+        unsigned size = opc == 2 ? 3 : 2;
+        unsigned mode = field(insn, 23, 2);   // no-allocate, post-index, offset, pre-index
+        MicroOp op = makeOp(load ? MicroOpKind::LoadPair : MicroOpKind::StorePair,
+                            field(insn, 0, 5), regOrSp(field(insn, 5, 5)), 0, signedField(insn, 15, 7) << size,
+                            (mode == 1 ? OP_WRITEBACK | OP_POSTINDEX : (mode == 3 ? OP_WRITEBACK : 0)) |
+                            (opc == 1 ? OP_SIGNED | OP_SF : 0));
+        op.ra = field(insn, 10, 5);
+        op.opt = static_cast<uint8_t>(size);
+        return op;
+    }
+    
+    inline MicroOp decodeLoadStoreOrdered(uint32_t insn) {
+        // o2:o1 select exclusive, exclusive pair, LDAR/STLR and CAS. The
+        // acquire and release bits are not decoded; every form is ordered
+        // as the strongest of them.
+        unsigned size = field(insn, 30, 2);
+        bool load = field(insn, 22, 1);
+        MicroOp op = makeOp(MicroOpKind::Undefined, field(insn, 0, 5), regOrSp(field(insn, 5, 5)),
+                            field(insn, 16, 5), 0, 0);
+        op.opt = static_cast<uint8_t>(size);
+        switch ((field(insn, 23, 1) << 1) | field(insn, 21, 1)) {
+            case 0:
+                op.kind = load ? MicroOpKind::LoadExclusive : MicroOpKind::StoreExclusive;
+                return op;
+            case 1:
+                if (size < 2) {
+                    // CASP
+                    return undefined(insn);
+                }
+                op.kind = load ? MicroOpKind::LoadExclusivePair : MicroOpKind::StoreExclusivePair;
+                op.ra = field(insn, 10, 5);
+                return op;
+            case 2:
+                // LDAR, STLR, LDLAR and STLLR
+                op.kind = load ? MicroOpKind::LoadAcquire : MicroOpKind::StoreRelease;
+                op.rm = 0;
+                return op;
+            default:
+                if (field(insn, 10, 5) != 31) {
+                    return undefined(insn);
+                }
+                op.kind = MicroOpKind::CompareSwap;
+                return op;
+        }
+    }
+    
+    inline MicroOp decodeAtomicMemory(uint32_t insn) {
+        unsigned opc = field(insn, 12, 3);
+        MicroOp op = makeOp(MicroOpKind::AtomicRmw, field(insn, 0, 5), regOrSp(field(insn, 5, 5)),
+                            field(insn, 16, 5), 0, 0);
+        op.opt = field(insn, 30, 2);
+        if (!field(insn, 15, 1)) {
+            op.shift = static_cast<uint8_t>(opc);
+            return op;
+        }
+        if (opc == 0) {
+            op.shift = ATOMIC_SWP;
+            return op;
+        }
+        // LDAPR needs RCpc, which the ID registers do not advertise
+        return undefined(insn);
+    }
+    
+    // Loads and stores, SIMD and floating-point registers
+    
+    // Kind and access size from size:opc. opc<1> with size 0 selects a Q
+    // register, access size 4.
+    inline bool vecLoadStoreKind(uint32_t insn, MicroOp& op) {
+        unsigned size = field(insn, 30, 2);
+        bool wide = field(insn, 23, 1);
+        op.kind = field(insn, 22, 1) ? MicroOpKind::VecLoad : MicroOpKind::VecStore;
+        op.opt = static_cast<uint8_t>(wide ? 4 : size);
+        return !wide || size == 0;
+    }
+    
+    inline MicroOp decodeVecLoadStoreImm9(uint32_t insn) {
+        unsigned mode = field(insn, 10, 2);   // unscaled, post-index, (unprivileged), pre-index
+        MicroOp op = makeOp(MicroOpKind::VecLoad, field(insn, 0, 5), regOrSp(field(insn, 5, 5)), 0,
+                            signedField(insn, 12, 9),
+                            mode == 1 ? OP_WRITEBACK | OP_POSTINDEX : (mode == 3 ? OP_WRITEBACK : 0));
+        return mode != 2 && vecLoadStoreKind(insn, op) ? op : undefined(insn);
+    }
+    
+    inline MicroOp decodeVecLoadStoreRegOffset(uint32_t insn) {
+        unsigned option = field(insn, 13, 3);
+        MicroOp op = makeOp(MicroOpKind::VecLoad, field(insn, 0, 5), regOrSp(field(insn, 5, 5)), field(insn, 16, 5), 0,
+                            OP_REGISTER);
+        if (!(option & 2) || !vecLoadStoreKind(insn, op)) {
+            return undefined(insn);
+        }
+        op.ra = static_cast<uint8_t>(option);
+        op.shift = field(insn, 12, 1) ? op.opt : 0;
+        return op;
+    }
+    
+    inline MicroOp decodeVecLoadStoreUnsigned(uint32_t insn) {
+        MicroOp op = makeOp(MicroOpKind::VecLoad, field(insn, 0, 5), regOrSp(field(insn, 5, 5)), 0, 0, 0);
+        if (!vecLoadStoreKind(insn, op)) {
+            return undefined(insn);
+        }
+        op.imm = static_cast<int64_t>(field(insn, 10, 12)) << op.opt;
+        return op;
+    }
+    
+    inline MicroOp decodeVecLoadLiteral(uint32_t insn) {
+        unsigned opc = field(insn, 30, 2);
+        if (opc == 3) {
+            return undefined(insn);
+        }
+        MicroOp op = makeOp(MicroOpKind::VecLoadLiteral, field(insn, 0, 5), 0, 0, signedField(insn, 5, 19) * 4, 0);
+        op.opt = static_cast<uint8_t>(2 + opc);
+        return op;
+    }
+    
+    inline MicroOp decodeVecLoadStorePair(uint32_t insn) {
+        unsigned opc = field(insn, 30, 2);
+        if (opc == 3) {
+            return undefined(insn);
+        }
+        
+        unsigned size = 2 + opc;
+        unsigned mode = field(insn, 23, 2);   // no-allocate, post-index, offset, pre-index
+        MicroOp op = makeOp(field(insn, 22, 1) ? MicroOpKind::VecLoadPair : MicroOpKind::VecStorePair,
+                            field(insn, 0, 5), regOrSp(field(insn, 5, 5)), 0, signedField(insn, 15, 7) << size,
+                            mode == 1 ? OP_WRITEBACK | OP_POSTINDEX : (mode == 3 ? OP_WRITEBACK : 0));
+        op.ra = field(insn, 10, 5);
+        op.opt = static_cast<uint8_t>(size);
+        return op;
+    }
+    
+    // LD1/ST1 with one to four consecutive registers. On a little-endian
+    // guest the element size does not change the bytes transferred, so it
+    // is ignored. LD2-LD4 and the single-structure forms are not supported.
+    inline MicroOp decodeVecLoadStoreMulti(uint32_t insn) {
+        unsigned count;
+        switch (field(insn, 12, 4)) {
+            case 0x7: count = 1; break;
+            case 0xA: count = 2; break;
+            case 0x6: count = 3; break;
+            case 0x2: count = 4; break;
+            default: return undefined(insn);
+        }
+        
+        uint32_t rm = field(insn, 16, 5);
+        MicroOp op = makeOp(field(insn, 22, 1) ? MicroOpKind::VecLoadMulti : MicroOpKind::VecStoreMulti,
+                            field(insn, 0, 5), regOrSp(field(insn, 5, 5)), rm, 0, 0);
+        op.opt = field(insn, 30, 1) ? 4 : 3;
+        op.ra = static_cast<uint8_t>(count);
+        if (field(insn, 23, 1)) {
+            // Post-indexed by the transfer size, or by Xm
+            op.flags = OP_WRITEBACK | OP_POSTINDEX | (rm == 31 ? 0 : OP_REGISTER);
+            op.imm = static_cast<int64_t>(count) << op.opt;
+        }
+        return op;
+    }
+    
+    // Advanced SIMD data processing
+    
+    inline MicroOp simd(uint32_t insn, SimdOp operation, unsigned size, int64_t imm = 0) {
+        MicroOp op = makeOp(MicroOpKind::Simd, field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), imm,
+                            field(insn, 30, 1) ? OP_SF : 0);
+        op.opt = operation;
+        op.shift = static_cast<uint8_t>(size);
+        return op;
+    }
+    
+    inline MicroOp decodeSimdThreeSame(uint32_t insn) {
+        bool q = field(insn, 30, 1);
+        unsigned u = field(insn, 29, 1);
+        unsigned size = field(insn, 22, 2);
+        unsigned opcode = field(insn, 11, 5);
+        SimdOp operation;
+        
+        if (opcode >= 0x18) {
+            // Floating point: size<1> selects the operation, size<0> double
+            // precision
+            switch ((u << 6) | ((size >> 1) << 5) | opcode) {
+                case 0x19: operation = SIMD_FMLA; break;
+                case 0x1A: operation = SIMD_FADD; break;
+                case 0x1C: operation = SIMD_FCMEQ; break;
+                case 0x1E: operation = SIMD_FMAX; break;
+                case 0x39: operation = SIMD_FMLS; break;
+                case 0x3A: operation = SIMD_FSUB; break;
+                case 0x3E: operation = SIMD_FMIN; break;
+                case 0x5A: operation = SIMD_FADDP; break;
+                case 0x5B: operation = SIMD_FMUL; break;
+                case 0x5C: operation = SIMD_FCMGE; break;
+                case 0x5F: operation = SIMD_FDIV; break;
+                case 0x7A: operation = SIMD_FABD; break;
+                case 0x7C: operation = SIMD_FCMGT; break;
+                default: return undefined(insn);
+            }
+            if ((size & 1) && !q) {
+                return undefined(insn);
+            }
+            return simd(insn, operation, 2 + (size & 1));
+        }
+        
+        if (opcode == 0x03) {
+            // Logical ops: U:size picks the operation, lanes do not matter
+            static constexpr SimdOp logical[] = { SIMD_AND, SIMD_BIC, SIMD_ORR, SIMD_ORN,
+                                                  SIMD_EOR, SIMD_BSL, SIMD_BIT, SIMD_BIF };
+            return simd(insn, logical[(u << 2) | size], 0);
+        }
+        
+        switch ((u << 5) | opcode) {
+            case 0x01: operation = SIMD_SQADD; break;
+            case 0x05: operation = SIMD_SQSUB; break;
+            case 0x06: operation = SIMD_CMGT; break;
+            case 0x07: operation = SIMD_CMGE; break;
+            case 0x0C: operation = SIMD_SMAX; break;
+            case 0x0D: operation = SIMD_SMIN; break;
+            case 0x10: operation = SIMD_ADD; break;
+            case 0x11: operation = SIMD_CMTST; break;
+            case 0x12: operation = SIMD_MLA; break;
+            case 0x13: operation = SIMD_MUL; break;
+            case 0x17: operation = SIMD_ADDP; break;
+            case 0x21: operation = SIMD_UQADD; break;
+            case 0x25: operation = SIMD_UQSUB; break;
+            case 0x26: operation = SIMD_CMHI; break;
+            case 0x27: operation = SIMD_CMHS; break;
+            case 0x2C: operation = SIMD_UMAX; break;
+            case 0x2D: operation = SIMD_UMIN; break;
+            case 0x30: operation = SIMD_SUB; break;
+            case 0x31: operation = SIMD_CMEQ; break;
+            case 0x32: operation = SIMD_MLS; break;
+            default: return undefined(insn);
+        }
+        
+        // 64-bit lanes need Q, and max/min and the multiplies have none
+        bool noDoubleword = opcode == 0x0C || opcode == 0x0D || opcode == 0x12 || opcode == 0x13;
+        if (size == 3 && (!q || noDoubleword)) {
+            return undefined(insn);
+        }
+        return simd(insn, operation, size);
+    }
+    
+    inline MicroOp decodeSimdTwoReg(uint32_t insn) {
+        bool q = field(insn, 30, 1);
+        unsigned u = field(insn, 29, 1);
+        unsigned size = field(insn, 22, 2);
+        unsigned opcode = field(insn, 12, 5);
+        SimdOp operation;
+        
+        if (opcode == 0x0F || opcode == 0x1B || opcode == 0x1D || opcode == 0x1F) {
+            // Floating point, size<1> selecting the operation as above
+            switch ((u << 6) | ((size >> 1) << 5) | opcode) {
+                case 0x1D: operation = SIMD_SCVTF; break;
+                case 0x2F: operation = SIMD_FABS; break;
+                case 0x3B: operation = SIMD_FCVTZS; break;
+                case 0x5D: operation = SIMD_UCVTF; break;
+                case 0x6F: operation = SIMD_FNEG; break;
+                case 0x7B: operation = SIMD_FCVTZU; break;
+                case 0x7F: operation = SIMD_FSQRT; break;
+                default: return undefined(insn);
+            }
+            if ((size & 1) && !q) {
+                return undefined(insn);
+            }
+            return simd(insn, operation, 2 + (size & 1));
+        }
+        
+        switch ((u << 5) | opcode) {
+            case 0x00: // REV64
+                return size < 3 ? simd(insn, SIMD_REV, size, 3) : undefined(insn);
+            case 0x01: // REV16
+                return size == 0 ? simd(insn, SIMD_REV, size, 1) : undefined(insn);
+            case 0x20: // REV32
+                return size < 2 ? simd(insn, SIMD_REV, size, 2) : undefined(insn);
+            case 0x05:
+                return size == 0 ? simd(insn, SIMD_CNT, size) : undefined(insn);
+            case 0x25:
+                return size == 0 ? simd(insn, SIMD_NOT, size) : undefined(insn);
+            case 0x12: // XTN, XTN2: a narrowing shift by zero
+                return size < 3 ? simd(insn, SIMD_SHRN, size, 0) : undefined(insn);
+            case 0x08: operation = SIMD_CMGT0; break;
+            case 0x09: operation = SIMD_CMEQ0; break;
+            case 0x0A: operation = SIMD_CMLT0; break;
+            case 0x0B: operation = SIMD_ABS; break;
+            case 0x28: operation = SIMD_CMGE0; break;
+            case 0x29: operation = SIMD_CMLE0; break;
+            case 0x2B: operation = SIMD_NEG; break;
+            default: return undefined(insn);
+        }
+        if (size == 3 && !q) {
+            return undefined(insn);
+        }
+        return simd(insn, operation, size);
+    }
+    
+    inline MicroOp decodeSimdAcrossLanes(uint32_t insn) {
+        bool q = field(insn, 30, 1);
+        unsigned size = field(insn, 22, 2);
+        SimdOp operation;
+        switch ((field(insn, 29, 1) << 5) | field(insn, 12, 5)) {
+            case 0x0A: operation = SIMD_SMAXV; break;
+            case 0x1A: operation = SIMD_SMINV; break;
+            case 0x1B: operation = SIMD_ADDV; break;
+            case 0x2A: operation = SIMD_UMAXV; break;
+            case 0x3A: operation = SIMD_UMINV; break;
+            default: return undefined(insn);
+        }
+        if (size == 3 || (size == 2 && !q)) {
+            return undefined(insn);
+        }
+        return simd(insn, operation, size);
+    }
+    
+    // DUP, INS, SMOV, UMOV. imm5 encodes the element size as its lowest
+    // set bit and the lane index above it.
+    inline MicroOp decodeSimdCopy(uint32_t insn) {
+        bool q = field(insn, 30, 1);
+        unsigned imm5 = field(insn, 16, 5);
+        unsigned imm4 = field(insn, 11, 4);
+        if ((imm5 & 0xF) == 0) {
+            return undefined(insn);
+        }
+        unsigned size = __builtin_ctz(imm5);
+        int64_t index = imm5 >> (size + 1);
+        
+        if (field(insn, 29, 1)) {
+            if (!q) {
+                return undefined(insn);
+            }
+            MicroOp op = simd(insn, SIMD_INS_ELEMENT, size, index);
+            op.ra = static_cast<uint8_t>(imm4 >> size);
+            return op;
+        }
+        
+        switch (imm4) {
+            case 0x0:
+                return size < 3 || q ? simd(insn, SIMD_DUP_ELEMENT, size, index) : undefined(insn);
+            case 0x1:
+                return size < 3 || q ? simd(insn, SIMD_DUP_GENERAL, size) : undefined(insn);
+            case 0x3:
+                return q ? simd(insn, SIMD_INS_GENERAL, size, index) : undefined(insn);
+            case 0x5: // SMOV to X (Q) or W
+                return size < (q ? 3u : 2u) ? simd(insn, SIMD_SMOV, size, index) : undefined(insn);
+            case 0x7: // UMOV; only 64-bit lanes go to an X register
+                return (size == 3) == q ? simd(insn, SIMD_UMOV, size, index) : undefined(insn);
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    inline MicroOp decodeSimdPermute(uint32_t insn) {
+        SimdOp operation;
+        switch (field(insn, 12, 3)) {
+            case 1: operation = SIMD_UZP1; break;
+            case 2: operation = SIMD_TRN1; break;
+            case 3: operation = SIMD_ZIP1; break;
+            case 5: operation = SIMD_UZP2; break;
+            case 6: operation = SIMD_TRN2; break;
+            case 7: operation = SIMD_ZIP2; break;
+            default: return undefined(insn);
+        }
+        unsigned size = field(insn, 22, 2);
+        if (size == 3 && !field(insn, 30, 1)) {
+            return undefined(insn);
+        }
+        return simd(insn, operation, size);
+    }
+    
+    inline MicroOp decodeSimdExtract(uint32_t insn) {
+        unsigned position = field(insn, 11, 4);
+        if (!field(insn, 30, 1) && position >= 8) {
+            return undefined(insn);
+        }
+        return simd(insn, SIMD_EXT, 0, position);
+    }
+    
+    constexpr uint64_t replicate(uint64_t element, unsigned bits) {
+        uint64_t value = 0;
+        for (unsigned i = 0; i < 64; i += bits) {
+            value |= element << i;
+        }
+        return value;
+    }
+    
+    // VFPExpandImm() from the Arm ARM: sign, a 3-bit exponent and a 4-bit
+    // fraction, as a single or double precision bit pattern
+    constexpr uint64_t expandFpImm(uint64_t imm8, bool isDouble) {
+        uint64_t sign = imm8 >> 7;
+        bool b6 = (imm8 >> 6) & 1;
+        if (isDouble) {
+            return (sign << 63) | (b6 ? 0x3FC0000000000000ull : 0x4000000000000000ull) | ((imm8 & 0x3F) << 48);
+        }
+        return (sign << 31) | (b6 ? 0x3E000000 : 0x40000000) | ((imm8 & 0x3F) << 19);
+    }
+    
+    // MOVI, MVNI, ORR and BIC (immediate) and FMOV (vector, immediate),
+    // with AdvSIMDExpandImm() from the Arm ARM done here
+    inline MicroOp decodeSimdModifiedImm(uint32_t insn) {
+        bool q = field(insn, 30, 1);
+        bool op = field(insn, 29, 1);
+        unsigned cmode = field(insn, 12, 4);
+        uint64_t imm8 = (field(insn, 16, 3) << 5) | field(insn, 5, 5);
+        if (field(insn, 11, 1)) {
+            // Half-precision FMOV
+            return undefined(insn);
+        }
+        
+        uint64_t imm;
+        bool invert = op;
+        switch (cmode >> 1) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+                imm = replicate(imm8 << (8 * (cmode >> 1)), 32);
+                break;
+            case 4:
+            case 5:
+                imm = replicate(imm8 << (8 * ((cmode >> 1) & 1)), 16);
+                break;
+            case 6: // shifting ones in (MSL)
+                imm = replicate((imm8 << (8 * ((cmode & 1) + 1))) | ((cmode & 1) ? 0xFFFF : 0xFF), 32);
+                break;
+            default:
+                invert = false;
+                if (!(cmode & 1) && !op) {
+                    imm = replicate(imm8, 8);
+                } else if (!(cmode & 1)) {
+                    // Each bit of imm8 becomes a byte of ones or zeros
+                    imm = 0;
+                    for (unsigned i = 0; i < 8; i++) {
+                        imm |= ((imm8 >> i) & 1) ? 0xFFull << (8 * i) : 0;
+                    }
+                } else if (!op) {
+                    // FMOV, single precision
+                    imm = replicate(expandFpImm(imm8, false), 32);
+                } else if (q) {
+                    // FMOV, double precision
+                    imm = expandFpImm(imm8, true);
+                } else {
+                    return undefined(insn);
+                }
+                break;
+        }
+        
+        if ((cmode & 1) && cmode < 12) {
+            return simd(insn, op ? SIMD_BIC_IMM : SIMD_ORR_IMM, 0, static_cast<int64_t>(imm));
+        }
+        return simd(insn, SIMD_MOVI, 0, static_cast<int64_t>(invert ? ~imm : imm));
+    }
+    
+    // immh gives the element size as its highest set bit; the shift amount
+    // is immh:immb less (left) or subtracted from (right) the element size
+    inline MicroOp decodeSimdShiftImm(uint32_t insn) {
+        bool q = field(insn, 30, 1);
+        unsigned immh = field(insn, 19, 4);
+        unsigned size = 31 - __builtin_clz(immh);
+        unsigned bits = 8u << size;
+        unsigned encoded = (immh << 3) | field(insn, 16, 3);
+        unsigned left = encoded - bits;
+        unsigned right = 2 * bits - encoded;
+        
+        switch ((field(insn, 29, 1) << 5) | field(insn, 11, 5)) {
+            case 0x00:
+                return size < 3 || q ? simd(insn, SIMD_SSHR, size, right) : undefined(insn);
+            case 0x02:
+                return size < 3 || q ? simd(insn, SIMD_SSRA, size, right) : undefined(insn);
+            case 0x0A:
+                return size < 3 || q ? simd(insn, SIMD_SHL, size, left) : undefined(insn);
+            case 0x10: // SHRN, SHRN2
+                return size < 3 ? simd(insn, SIMD_SHRN, size, right) : undefined(insn);
+            case 0x14: // SSHLL, SSHLL2, SXTL
+                return size < 3 ? simd(insn, SIMD_SSHLL, size, left) : undefined(insn);
+            case 0x20:
+                return size < 3 || q ? simd(insn, SIMD_USHR, size, right) : undefined(insn);
+            case 0x22:
+                return size < 3 || q ? simd(insn, SIMD_USRA, size, right) : undefined(insn);
+            case 0x34: // USHLL, USHLL2, UXTL
+                return size < 3 ? simd(insn, SIMD_USHLL, size, left) : undefined(insn);
+            default:
+                return undefined(insn);
+        }
+    }
+    
+    // Scalar floating point
+    
+    // type is 0 for single and 1 for double precision; half precision is
+    // not implemented
+    inline MicroOp fp(uint32_t insn, FpOp operation, int64_t imm = 0) {
+        MicroOp op = makeOp(MicroOpKind::Fp, field(insn, 0, 5), field(insn, 5, 5), field(insn, 16, 5), imm, 0);
+        op.opt = operation;
+        op.shift = static_cast<uint8_t>(2 + field(insn, 22, 1));
+        return op;
+    }
+    
+    // Conversions between floating-point and general registers, FMOV
+    // (general) included. rmode selects the rounding of FCVT*S/U.
+    inline MicroOp decodeFpConvert(uint32_t insn) {
+        unsigned type = field(insn, 22, 2);
+        unsigned rmode = field(insn, 19, 2);
+        unsigned opcode = field(insn, 16, 3);
+        uint8_t wide = sf(insn);
+        MicroOp op;
+        
+        if (opcode >= 6) {
+            // FMOV between W and S, X and D, or X and the top of a V register
+            unsigned form = (wide ? 4 : 0) | type;
+            bool upper = form == 6 && rmode == 1;
+            if (!upper && (rmode != 0 || (form != 0 && form != 5))) {
+                return undefined(insn);
+            }
+            op = fp(insn, opcode == 6 ? FP_MOV_TO_GENERAL : FP_MOV_FROM_GENERAL, upper ? 1 : 0);
+            op.shift = form == 0 ? 2 : 3;
+            op.flags = wide;
+            return op;
+        }
+        
+        if (type > 1) {
+            return undefined(insn);
+        }
+        switch (opcode) {
+            case 0: op = fp(insn, FP_CVTS, rmode); break;
+            case 1: op = fp(insn, FP_CVTU, rmode); break;
+            case 2: op = fp(insn, FP_SCVTF); break;
+            case 3: op = fp(insn, FP_UCVTF); break;
+            case 4: op = fp(insn, FP_CVTS, FP_ROUND_TIEAWAY); break;
+            default: op = fp(insn, FP_CVTU, FP_ROUND_TIEAWAY); break;
+        }
+        if (opcode >= 2 && rmode != 0) {
+            return undefined(insn);
+        }
+        op.flags = wide;
+        return op;
+    }
+    
+    inline MicroOp decodeFpDataProc1(uint32_t insn) {
+        unsigned opcode = field(insn, 15, 6);
+        switch (opcode) {
+            case 0x00: return fp(insn, FP_MOV);
+            case 0x01: return fp(insn, FP_ABS);
+            case 0x02: return fp(insn, FP_NEG);
+            case 0x03: return fp(insn, FP_SQRT);
+            case 0x04:
+            case 0x05:
+                // FCVT to the other precision
+                return (opcode & 1) != field(insn, 22, 1) ? fp(insn, FP_CVT, 2 + (opcode & 1)) : undefined(insn);
+            case 0x08: return fp(insn, FP_RINT, FP_ROUND_TIEEVEN);
+            case 0x09: return fp(insn, FP_RINT, FP_ROUND_POSINF);
+            case 0x0A: return fp(insn, FP_RINT, FP_ROUND_NEGINF);
+            case 0x0B: return fp(insn, FP_RINT, FP_ROUND_ZERO);
+            case 0x0C: return fp(insn, FP_RINT, FP_ROUND_TIEAWAY);
+            case 0x0E:
+            case 0x0F:
+                return fp(insn, FP_RINT, FP_ROUND_FPCR);
+            default: return undefined(insn);
+        }
+    }
+    
+    inline MicroOp decodeFpDataProc2(uint32_t insn) {
+        static constexpr FpOp OPERATIONS[] = {
+            FP_MUL, FP_DIV, FP_ADD, FP_SUB, FP_MAX, FP_MIN, FP_MAXNM, FP_MINNM, FP_NMUL
+        };
+        unsigned opcode = field(insn, 12, 4);
+        return opcode < std::size(OPERATIONS) ? fp(insn, OPERATIONS[opcode]) : undefined(insn);
+    }
+    
+    // FCMP, FCMPE, FCCMP, FCCMPE, FCSEL, FMOV (immediate) and the groups
+    // above, which share bits [31:21] and are told apart by bits [15:10]
+    inline MicroOp decodeFp(uint32_t insn) {
+        if (field(insn, 10, 6) == 0) {
+            return decodeFpConvert(insn);
+        }
+        if (field(insn, 31, 1) || field(insn, 23, 1)) {
+            return undefined(insn);
+        }
+        
+        MicroOp op;
+        switch (field(insn, 10, 2)) {
+            case 1: // FCCMP, FCCMPE
+                op = fp(insn, FP_CCMP, field(insn, 12, 4));
+                op.ra = field(insn, 0, 4);
+                return op;
+            case 2:
+                return decodeFpDataProc2(insn);
+            case 3: // FCSEL
+                return fp(insn, FP_CSEL, field(insn, 12, 4));
+            default:
+                break;
+        }
+        
+        if (field(insn, 10, 5) == 0x10) {
+            return decodeFpDataProc1(insn);
+        }
+        if (field(insn, 10, 4) == 0x8 && field(insn, 14, 2) == 0 && field(insn, 0, 3) == 0) {
+            return fp(insn, field(insn, 3, 1) ? FP_CMP_ZERO : FP_CMP);
+        }
+        if (field(insn, 10, 3) == 0x4 && field(insn, 5, 5) == 0) {
+            return fp(insn, FP_MOV_IMM, static_cast<int64_t>(expandFpImm(field(insn, 13, 8), field(insn, 22, 1))));
+        }
+        return undefined(insn);
+    }
+    
+    // FMADD, FMSUB, FNMADD, FNMSUB
+    inline MicroOp decodeFpDataProc3(uint32_t insn) {
+        static constexpr FpOp OPERATIONS[] = { FP_MADD, FP_MSUB, FP_NMADD, FP_NMSUB };
+        if (field(insn, 23, 1)) {
+            return undefined(insn);
+        }
+        MicroOp op = fp(insn, OPERATIONS[(field(insn, 21, 1) << 1) | field(insn, 15, 1)]);
+        op.ra = field(insn, 10, 5);
+        return op;
+    }
+    
+    using DecodeFn = MicroOp (*)(uint32_t insn);
+    
+    struct Encoding {
+        uint32_t mask;
+        uint32_t value;
+        DecodeFn decode;
+    };
+    
+    // Entries that overlap must be listed most specific first
+    constexpr Encoding ENCODINGS[] = {
+        // Branches, exception generation and system
+        { 0x7C000000, 0x14000000, decodeBranchImm },          // B, BL
+        { 0xFF000000, 0x54000000, decodeBranchCond },         // B.cond, BC.cond
+        { 0x7E000000, 0x34000000, decodeCompareBranch },      // CBZ, CBNZ
+        { 0x7E000000, 0x36000000, decodeTestBranch },         // TBZ, TBNZ
+        { 0xFF00001C, 0xD4000000, decodeException },          // SVC, HVC, SMC, BRK
+        { 0xFFFFFFFF, 0xD69F03E0, decodeEret },
+        { 0xFF9FFC1F, 0xD61F0000, decodeBranchReg },          // BR, BLR, RET
+        { 0xFFFFF01F, 0xD503201F, decodeHint },
+        { 0xFFFFF01F, 0xD503301F, decodeBarrier },            // CLREX, DSB, DMB, ISB, SB
+        { 0xFFF8F01F, 0xD500401F, decodeMsrImm },
+        { 0xFFF80000, 0xD5080000, decodeSys },                // SYS: TLBI, DC, IC, AT
+        { 0xFFD00000, 0xD5100000, decodeSysReg },             // MSR, MRS (register)
+        
+        // Data processing, immediate
+        { 0x1F000000, 0x10000000, decodeAdr },                // ADR, ADRP
+        { 0x1F800000, 0x11000000, decodeAddSubImm },
+        { 0x1F800000, 0x12000000, decodeLogicalImm },
+        { 0x1F800000, 0x12800000, decodeMoveWide },           // MOVN, MOVZ, MOVK
+        { 0x1F800000, 0x13000000, decodeBitfield },           // SBFM, BFM, UBFM
+        { 0x7FA00000, 0x13800000, decodeExtract },            // EXTR
+        
+        // Data processing, register
+        { 0x1F000000, 0x0A000000, decodeLogicalReg },
+        { 0x1F200000, 0x0B000000, decodeAddSubShifted },
+        { 0x1F200000, 0x0B200000, decodeAddSubExtended },
+        { 0x1FE0FC00, 0x1A000000, decodeAddSubCarry },        // ADC, SBC
+        { 0x3FE00410, 0x3A400000, decodeCondCompare },        // CCMN, CCMP
+        { 0x3FE00800, 0x1A800000, decodeCondSelect },         // CSEL, CSINC, CSINV, CSNEG
+        { 0x5FE00000, 0x1AC00000, decodeDataProc2 },          // UDIV, SDIV, shifts by register
+        { 0x5FFF0000, 0x5AC00000, decodeDataProc1 },          // RBIT, REV*, CLZ, CLS
+        { 0x1F000000, 0x1B000000, decodeDataProc3 },          // multiply-add
+        
+        // Loads and stores, general-purpose registers
+        { 0x3F000000, 0x08000000, decodeLoadStoreOrdered },
+        { 0x3F000000, 0x18000000, decodeLoadLiteral },
+        { 0x3E000000, 0x28000000, decodeLoadStorePair },
+        { 0x3F200000, 0x38000000, decodeLoadStoreImm9 },      // unscaled, pre/post-indexed
+        { 0x3F200C00, 0x38200800, decodeLoadStoreRegOffset },
+        { 0x3F200C00, 0x38200000, decodeAtomicMemory },       // LSE atomics
+        { 0x3F000000, 0x39000000, decodeLoadStoreUnsigned },
+        
+        // Loads and stores, SIMD and floating-point registers
+        { 0x3F000000, 0x1C000000, decodeVecLoadLiteral },
+        { 0x3E000000, 0x2C000000, decodeVecLoadStorePair },
+        { 0x3F200000, 0x3C000000, decodeVecLoadStoreImm9 },
+        { 0x3F200C00, 0x3C200800, decodeVecLoadStoreRegOffset },
+        { 0x3F000000, 0x3D000000, decodeVecLoadStoreUnsigned },
+        { 0xBFBF0000, 0x0C000000, decodeVecLoadStoreMulti },  // LD1, ST1
+        { 0xBFA00000, 0x0C800000, decodeVecLoadStoreMulti },  // LD1, ST1, post-indexed
+        
+        // Advanced SIMD data processing
+        { 0x9F200400, 0x0E200400, decodeSimdThreeSame },
+        { 0x9F3E0C00, 0x0E200800, decodeSimdTwoReg },
+        { 0x9F3E0C00, 0x0E300800, decodeSimdAcrossLanes },
+        { 0x9FE08400, 0x0E000400, decodeSimdCopy },           // DUP, INS, SMOV, UMOV
+        { 0xBF208C00, 0x0E000800, decodeSimdPermute },        // UZP, TRN, ZIP
+        { 0xBFE08400, 0x2E000000, decodeSimdExtract },        // EXT
+        { 0x9FF80400, 0x0F000400, decodeSimdModifiedImm },    // MOVI, MVNI, ORR, BIC, FMOV
+        { 0x9F800400, 0x0F000400, decodeSimdShiftImm },
+        
+        // Scalar floating point
+        { 0x7F200000, 0x1E200000, decodeFp },
+        { 0xFF000000, 0x1F000000, decodeFpDataProc3 }
+    };
+    
+    constexpr unsigned KEY_SHIFT = 21;
+    constexpr uint32_t KEY_MASK = (1u << (32 - KEY_SHIFT)) - 1;
+    constexpr unsigned MAX_BUCKET = 6;
+    
+    struct DecodeBucket {
+        uint8_t count;
+        uint8_t entries[MAX_BUCKET];
+    };
+    
+    using DecodeIndex = std::array<DecodeBucket, KEY_MASK + 1>;
+    
+    // Adds every entry to each slot whose key bits it can match. A slot
+    // overflowing MAX_BUCKET is an out-of-bounds write, which fails
+    // constant evaluation and therefore the build.
+    constexpr DecodeIndex buildIndex() {
+        DecodeIndex index = {};
+        for (size_t i = 0; i < std::size(ENCODINGS); i++) {
+            uint32_t fixed = ENCODINGS[i].mask >> KEY_SHIFT;
+            uint32_t value = ENCODINGS[i].value >> KEY_SHIFT;
+            uint32_t free = ~fixed & KEY_MASK;
+            uint32_t sub = 0;
+            do {
+                DecodeBucket& bucket = index[value | sub];
+                bucket.entries[bucket.count++] = static_cast<uint8_t>(i);
+                sub = (sub - free) & free;
+            } while (sub != 0);
+        }
+        return index;
+    }
+    
+    constexpr bool encodingsConsistent() {
+        for (const Encoding& e : ENCODINGS) {
+            if ((e.value & ~e.mask) != 0) {
+                return false;
+            }
+        }
+        return std::size(ENCODINGS) <= 256;
+    }
+    
+    static_assert(encodingsConsistent(), "encoding value has bits outside its mask");
+    
+    inline constexpr DecodeIndex DECODE_INDEX = buildIndex();
+    
+    // True when every instruction matching mask/value is routed to fn
+    constexpr bool covers(DecodeFn fn, uint32_t mask, uint32_t value) {
+        for (const Encoding& e : ENCODINGS) {
+            if (e.decode == fn) {
+                return (mask & e.mask) == e.mask && (value & e.mask) == e.value;
+            }
+        }
+        return false;
+    }
+    
+    // The groups ChOma already knows (Apps/trollstore/ChOma/src/arm64.c)
+    // are the reference for these encodings: everything its arm64_dec_*
+    // functions accept must reach the matching entry above.
+    static_assert(covers(decodeBranchImm, 0x7C000000, 0x14000000), "arm64_dec_b_l");
+    static_assert(covers(decodeAdr, 0x1F000000, 0x10000000), "arm64_dec_adr_p");
+    static_assert(covers(decodeMoveWide, 0x1F800000, 0x12800000), "arm64_dec_mov_imm");
+    static_assert(covers(decodeAddSubImm, 0x7F800000, 0x11000000), "arm64_dec_add_imm");
+    static_assert(covers(decodeLoadLiteral, 0xBF000000, 0x18000000), "arm64_dec_ldr_lit");
+    static_assert(covers(decodeCompareBranch, 0x7E000000, 0x34000000), "arm64_dec_cb_n_z");
+    static_assert(covers(decodeTestBranch, 0x7E000000, 0x36000000), "arm64_dec_tb_n_z");
+    static_assert(covers(decodeBranchCond, 0xFF000000, 0x54000000), "arm64_dec_b_c_cond");
+    
+    // ChOma's immediate loads and stores leave bit 21 unchecked for the
+    // pre- and post-indexed forms, where it is set only for PAC loads and
+    // unallocated encodings, and take the V bit as given for LDRS
+    static_assert(covers(decodeLoadStoreUnsigned, 0x3F400000, 0x39400000), "arm64_dec_ldr_imm");
+    static_assert(covers(decodeLoadStoreImm9, 0x3F600400, 0x38400400), "arm64_dec_ldr_imm");
+    static_assert(covers(decodeVecLoadStoreUnsigned, 0x3F400000, 0x3D400000), "arm64_dec_ldr_imm");
+    static_assert(covers(decodeVecLoadStoreImm9, 0x3F600400, 0x3C400400), "arm64_dec_ldr_imm");
+    static_assert(covers(decodeLoadStoreUnsigned, 0x3FC00000, 0x39800000), "arm64_dec_ldrs_imm");
+    static_assert(covers(decodeLoadStoreImm9, 0x3FE00400, 0x38800400), "arm64_dec_ldrs_imm");
+    static_assert(covers(decodeLoadStoreUnsigned, 0x3F400000, 0x39000000), "arm64_dec_str_imm");
+    static_assert(covers(decodeLoadStoreImm9, 0x3F600400, 0x38000400), "arm64_dec_str_imm");
+    static_assert(covers(decodeVecLoadStoreUnsigned, 0x3F400000, 0x3D000000), "arm64_dec_str_imm");
+    static_assert(covers(decodeVecLoadStoreImm9, 0x3F600400, 0x3C000400), "arm64_dec_str_imm");
+    
+    inline MicroOp decode(uint32_t insn) {
+        const DecodeBucket& bucket = DECODE_INDEX[insn >> KEY_SHIFT];
+        for (unsigned i = 0; i < bucket.count; i++) {
+            const Encoding& encoding = ENCODINGS[bucket.entries[i]];
+            if ((insn & encoding.mask) == encoding.value) {
+                return encoding.decode(insn);
+            }
+        }
+        return undefined(insn);
+    }
+    
+}
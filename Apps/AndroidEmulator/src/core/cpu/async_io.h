@@ -0,0 +1,422 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Android's app seccomp policy kills a process that calls io_uring_setup
+// instead of failing the call, so the thread pool is all there is there
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup) && !defined(__ANDROID__)
+#include <linux/io_uring.h>
+#define AEMU_HAVE_IO_URING 1
+#endif
+
+enum class AsyncIoOp : int {
+    Read = 0,
+    Write = 1,
+    Flush = 2
+};
+
+// One vectored transfer against a file. The iovecs must stay valid until
+// the request completes.
+struct AsyncIoRequest {
+    AsyncIoOp op;
+    int fd;
+    uint64_t offset;
+    std::vector<iovec> iov;
+    uint64_t tag;
+};
+
+// Bytes transferred, or -errno
+struct AsyncIoResult {
+    uint64_t tag;
+    int64_t result;
+};
+
+// Runs batches of file I/O in the background and reports completions,
+// several at a time when they arrive together, on a thread of its own.
+// Uses io_uring where the kernel allows it, and a small pool of threads
+// doing preadv/pwritev otherwise.
+class AsyncIo {
+public:
+    using Completion = std::function<void(const AsyncIoResult* results, size_t count)>;
+    
+    // Requests that may be in flight at once
+    static constexpr unsigned QUEUE_DEPTH = 256;
+    static constexpr unsigned POOL_THREADS = 4;
+    
+    explicit AsyncIo(Completion completion) : completion(std::move(completion)) {
+#ifdef AEMU_HAVE_IO_URING
+        if (setupRing()) {
+            reaper = std::thread([this]() { reapRing(); });
+            return;
+        }
+#endif
+        for (unsigned i = 0; i < POOL_THREADS; i++) {
+            workers.emplace_back([this]() { runWorker(); });
+        }
+    }
+    
+    // Waits for everything submitted to complete
+    ~AsyncIo() {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            stopping = true;
+            idleCv.wait(lock, [this]() { return inFlight == 0; });
+        }
+        workCv.notify_all();
+#ifdef AEMU_HAVE_IO_URING
+        if (ringFd >= 0) {
+            wakeReaper();
+            reaper.join();
+            unmapRing();
+            close(ringFd);
+            return;
+        }
+#endif
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    AsyncIo(const AsyncIo&) = delete;
+    AsyncIo& operator=(const AsyncIo&) = delete;
+    
+    const char* backendName() const {
+        return usingRing() ? "io_uring" : "thread pool";
+    }
+    
+    // Queues the requests, waiting for earlier ones to complete while
+    // QUEUE_DEPTH are in flight
+    void submit(std::vector<AsyncIoRequest> requests) {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (size_t next = 0; next < requests.size(); ) {
+            roomCv.wait(lock, [this]() { return inFlight < QUEUE_DEPTH; });
+            size_t count = std::min(requests.size() - next, QUEUE_DEPTH - inFlight);
+            inFlight += count;
+#ifdef AEMU_HAVE_IO_URING
+            if (ringFd >= 0) {
+                submitRing(&requests[next], count);
+                next += count;
+                continue;
+            }
+#endif
+            for (size_t i = next; i < next + count; i++) {
+                pending.push_back(std::move(requests[i]));
+            }
+            next += count;
+            workCv.notify_all();
+        }
+    }
+    
+    // Runs a request on the calling thread, finishing transfers the
+    // kernel cut short
+    static int64_t perform(const AsyncIoRequest& request) {
+        if (request.op == AsyncIoOp::Flush) {
+            return fdatasync(request.fd) == 0 ? 0 : -errno;
+        }
+        std::vector<iovec> iov = request.iov;
+        return finish(request, iov.data(), iov.size(), 0);
+    }
+    
+private:
+    Completion completion;
+    
+    std::mutex mtx;
+    std::condition_variable workCv;
+    std::condition_variable roomCv;
+    std::condition_variable idleCv;
+    size_t inFlight = 0;
+    bool stopping = false;
+    
+    // Thread pool
+    std::deque<AsyncIoRequest> pending;
+    std::vector<std::thread> workers;
+    
+    bool usingRing() const {
+#ifdef AEMU_HAVE_IO_URING
+        return ringFd >= 0;
+#else
+        return false;
+#endif
+    }
+    
+    // Transfers what is left of request from iov onwards, done bytes in
+    static int64_t finish(const AsyncIoRequest& request, iovec* iov, size_t count, int64_t done) {
+        while (count > 0) {
+            ssize_t n = request.op == AsyncIoOp::Read ?
+                preadv(request.fd, iov, static_cast<int>(count), static_cast<off_t>(request.offset + done)) :
+                pwritev(request.fd, iov, static_cast<int>(count), static_cast<off_t>(request.offset + done));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            if (n == 0) {
+                // Reading past the end of the file
+                return -EIO;
+            }
+            done += n;
+            skip(iov, count, static_cast<size_t>(n));
+        }
+        return done;
+    }
+    
+    // Drops bytes from the front of an iovec array
+    static void skip(iovec*& iov, size_t& count, size_t bytes) {
+        while (count > 0 && bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    
+    void completed(const AsyncIoResult* results, size_t count) {
+        completion(results, count);
+        std::lock_guard<std::mutex> lock(mtx);
+        inFlight -= count;
+        roomCv.notify_all();
+        if (inFlight == 0) {
+            idleCv.notify_all();
+        }
+    }
+    
+    void runWorker() {
+        for (;;) {
+            AsyncIoRequest request;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                workCv.wait(lock, [this]() { return stopping || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                request = std::move(pending.front());
+                pending.pop_front();
+            }
+            AsyncIoResult result = { request.tag, perform(request) };
+            completed(&result, 1);
+        }
+    }
+
+#ifdef AEMU_HAVE_IO_URING
+    // Tag of the no-op that wakes the reaper for shutdown
+    static constexpr uint64_t WAKE_TAG = ~0ull;
+    
+    int ringFd = -1;
+    std::thread reaper;
+    
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    
+    // Requests the kernel is working on, by slot; free slots are listed
+    // in freeSlots. Both are guarded by mtx.
+    std::vector<std::unique_ptr<AsyncIoRequest>> slots;
+    std::vector<uint32_t> freeSlots;
+    
+    bool setupRing() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params));
+        if (fd < 0) {
+            return false;
+        }
+        ringFd = fd;
+        
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing :
+                 mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqeMem = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMem == MAP_FAILED) {
+            sqes = sqeMem == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqeMem);
+            unmapRing();
+            close(fd);
+            ringFd = -1;
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqeMem);
+        
+        uint8_t* sq = static_cast<uint8_t*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        uint8_t* cq = static_cast<uint8_t*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        
+        slots.resize(QUEUE_DEPTH);
+        for (uint32_t i = QUEUE_DEPTH; i > 0; i--) {
+            freeSlots.push_back(i - 1);
+        }
+        return true;
+    }
+    
+    void unmapRing() {
+        if (sqRing != nullptr && sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (cqRing != nullptr && cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqes != nullptr) {
+            munmap(sqes, sqesSize);
+        }
+    }
+    
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+    
+    // Fills one submission queue entry. Called with mtx held; the queue
+    // is never full, as it is as deep as the in-flight limit and every
+    // entry is handed to the kernel right away.
+    void queueEntry(uint8_t opcode, int fd, uint64_t offset, const iovec* iov, unsigned count, uint64_t userData) {
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        io_uring_sqe& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = reinterpret_cast<uint64_t>(iov);
+        sqe.len = count;
+        if (opcode == IORING_OP_FSYNC) {
+            sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+        sqe.user_data = userData;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    }
+    
+    // Called with mtx held and a free slot for every request
+    void submitRing(AsyncIoRequest* requests, size_t count) {
+        unsigned queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            AsyncIoRequest& request = requests[i];
+            uint32_t slot = freeSlots.back();
+            freeSlots.pop_back();
+            slots[slot].reset(new AsyncIoRequest(std::move(request)));
+            const AsyncIoRequest& r = *slots[slot];
+            
+            uint8_t opcode = r.op == AsyncIoOp::Read ? IORING_OP_READV :
+                             r.op == AsyncIoOp::Write ? IORING_OP_WRITEV : IORING_OP_FSYNC;
+            queueEntry(opcode, r.fd, r.offset, r.iov.data(), static_cast<unsigned>(r.iov.size()), slot);
+            queued++;
+        }
+        
+        while (queued > 0) {
+            int submitted = enter(queued, 0, 0);
+            if (submitted < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    continue;
+                }
+                break;
+            }
+            queued -= static_cast<unsigned>(submitted);
+        }
+    }
+    
+    void wakeReaper() {
+        std::lock_guard<std::mutex> lock(mtx);
+        queueEntry(IORING_OP_NOP, -1, 0, nullptr, 0, WAKE_TAG);
+        while (enter(1, 0, 0) < 0 && errno == EINTR) {
+        }
+    }
+    
+    void reapRing() {
+        std::vector<AsyncIoResult> results;
+        for (;;) {
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                return;
+            }
+            
+            bool wake = false;
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes[head & cqMask];
+                if (cqe.user_data == WAKE_TAG) {
+                    wake = true;
+                    continue;
+                }
+                uint32_t slot = static_cast<uint32_t>(cqe.user_data);
+                results.push_back({ slot, cqe.res });
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            
+            if (!results.empty()) {
+                finishRing(results);
+                results.clear();
+            }
+            if (wake) {
+                return;
+            }
+        }
+    }
+    
+    // Turns slots into tags, completes short transfers and frees the slots
+    void finishRing(std::vector<AsyncIoResult>& results) {
+        std::vector<std::unique_ptr<AsyncIoRequest>> done;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (AsyncIoResult& result : results) {
+                done.push_back(std::move(slots[result.tag]));
+                freeSlots.push_back(static_cast<uint32_t>(result.tag));
+            }
+        }
+        
+        for (size_t i = 0; i < results.size(); i++) {
+            AsyncIoRequest& request = *done[i];
+            int64_t res = results[i].result;
+            if (res >= 0 && request.op != AsyncIoOp::Flush) {
+                iovec* iov = request.iov.data();
+                size_t count = request.iov.size();
+                skip(iov, count, static_cast<size_t>(res));
+                res = finish(request, iov, count, res);
+            }
+            results[i] = { request.tag, res };
+        }
+        completed(results.data(), results.size());
+    }
+#endif
+};
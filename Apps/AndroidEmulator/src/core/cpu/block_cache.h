@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+
+#include "a64_decoder.h"
+
+// A straight-line run of guest code. Blocks end after the first op that
+// endsBlock(), at a page boundary or after MAX_BLOCK_OPS ops.
+struct DecodedBlock {
+    uint64_t startPc;
+    uint64_t endPc;
+    uint64_t physPc;
+    std::vector<MicroOp> ops;
+    
+    // Hash of the code window it was decoded from, set while a shared code
+    // cache is in use
+    uint64_t codeHash = 0;
+    
+    // Times the interpreter has run this block; drives JIT tier-up
+    mutable std::atomic<uint32_t> execCount{0};
+};
+
+// Map from guest virtual PC to decoded block. Cached code is tracked by
+// physical address so stores through any mapping find it, in granules
+// smaller than a page: guest JITs keep writing new code and data next to
+// code that is already running, and only a store that lands on cached
+// code has to drop anything. Only isCode and containsCode are safe to
+// call concurrently; the owner serializes everything else.
+class BlockCache {
+public:
+    static constexpr unsigned PAGE_SHIFT = 12;
+    static constexpr uint64_t PAGE_SIZE = 1ull << PAGE_SHIFT;
+    static constexpr size_t MAX_BLOCK_OPS = 64;
+    static constexpr size_t MAX_BLOCK_BYTES = MAX_BLOCK_OPS * 4;
+    static constexpr unsigned CODE_GRANULE_SHIFT = 8;
+    static constexpr uint64_t CODE_GRANULE_SIZE = 1ull << CODE_GRANULE_SHIFT;
+    static constexpr size_t GRANULES_PER_PAGE = PAGE_SIZE / CODE_GRANULE_SIZE;
+    
+    explicit BlockCache(size_t memorySize) :
+        numGranules((memorySize + CODE_GRANULE_SIZE - 1) >> CODE_GRANULE_SHIFT),
+        codeGranules(new std::atomic<uint8_t>[numGranules]()) {}
+    
+    std::shared_ptr<const DecodedBlock> lookup(uint64_t pc) const {
+        auto it = blocks.find(pc);
+        return it != blocks.end() ? it->second : nullptr;
+    }
+    
+    std::shared_ptr<const DecodedBlock> insert(std::unique_ptr<DecodedBlock> block) {
+        CodeRange range = { block->startPc, block->physPc, block->physPc + (block->endPc - block->startPc) };
+        std::shared_ptr<const DecodedBlock> entry(std::move(block));
+        
+        auto inserted = blocks.emplace(entry->startPc, entry);
+        if (!inserted.second) {
+            if (inserted.first->second->physPc == entry->physPc) {
+                // Another vCPU decoded the same block first
+                return inserted.first->second;
+            }
+            // Same virtual PC, different mapping. The old block's range
+            // stays in the index, as translations of it may still run.
+            inserted.first->second = entry;
+        }
+        pageIndex[range.physStart >> PAGE_SHIFT].push_back(range);
+        for (uint64_t g = range.physStart >> CODE_GRANULE_SHIFT; g <= (range.physEnd - 1) >> CODE_GRANULE_SHIFT; g++) {
+            if (g < numGranules) {
+                codeGranules[g].store(1, std::memory_order_release);
+            }
+        }
+        return entry;
+    }
+    
+    // Cheap check used on every guest store, by physical address. Safe to
+    // call without holding the lock that guards lookup/insert.
+    bool isCode(uint64_t addr) const {
+        uint64_t granule = addr >> CODE_GRANULE_SHIFT;
+        return granule < numGranules && codeGranules[granule].load(std::memory_order_acquire);
+    }
+    
+    // Whether [addr, addr + size) touches cached code, for writes larger
+    // than a single store
+    bool containsCode(uint64_t addr, uint64_t size) const {
+        for (uint64_t g = addr >> CODE_GRANULE_SHIFT; g <= (addr + size - 1) >> CODE_GRANULE_SHIFT; g++) {
+            if (g < numGranules && codeGranules[g].load(std::memory_order_acquire)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // The same flags, one byte per CODE_GRANULE_SIZE bytes, for translated
+    // code that checks its own stores
+    const std::atomic<uint8_t>* codeMap() const {
+        return codeGranules.get();
+    }
+    
+    // Drops the blocks decoded from physical memory overlapping
+    // [addr, addr + size); other blocks in the same pages stay. Blocks that
+    // are currently executing stay alive through their shared_ptr. True
+    // if any block was dropped.
+    bool invalidateRange(uint64_t addr, uint64_t size) {
+        bool dropped = false;
+        uint64_t end = addr + size;
+        for (uint64_t page = addr >> PAGE_SHIFT; page <= (end - 1) >> PAGE_SHIFT; page++) {
+            auto it = pageIndex.find(page);
+            if (it == pageIndex.end()) {
+                continue;
+            }
+            
+            std::vector<CodeRange>& ranges = it->second;
+            for (size_t i = 0; i < ranges.size();) {
+                const CodeRange& range = ranges[i];
+                if (range.physStart >= end || range.physEnd <= addr) {
+                    i++;
+                    continue;
+                }
+                auto block = blocks.find(range.pc);
+                if (block != blocks.end() && block->second->physPc == range.physStart) {
+                    blocks.erase(block);
+                }
+                ranges[i] = ranges.back();
+                ranges.pop_back();
+                dropped = true;
+            }
+            updateGranules(page, ranges);
+            if (ranges.empty()) {
+                pageIndex.erase(it);
+            }
+        }
+        return dropped;
+    }
+    
+    void clear() {
+        blocks.clear();
+        pageIndex.clear();
+        for (size_t i = 0; i < numGranules; i++) {
+            codeGranules[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    size_t size() const {
+        return blocks.size();
+    }
+    
+private:
+    // Guest code a block was decoded from
+    struct CodeRange {
+        uint64_t pc;
+        uint64_t physStart;
+        uint64_t physEnd;
+    };
+    
+    std::unordered_map<uint64_t, std::shared_ptr<const DecodedBlock>> blocks;
+    std::unordered_map<uint64_t, std::vector<CodeRange>> pageIndex;
+    size_t numGranules;
+    std::unique_ptr<std::atomic<uint8_t>[]> codeGranules;
+    
+    // Clears the flags of granules in page that no longer hold code.
+    // Flags that stay set are never cleared in passing, as stores on
+    // other vCPUs read them without the lock.
+    void updateGranules(uint64_t page, const std::vector<CodeRange>& ranges) {
+        uint8_t used[GRANULES_PER_PAGE] = {};
+        uint64_t first = page << (PAGE_SHIFT - CODE_GRANULE_SHIFT);
+        for (const CodeRange& range : ranges) {
+            for (uint64_t g = range.physStart >> CODE_GRANULE_SHIFT; g <= (range.physEnd - 1) >> CODE_GRANULE_SHIFT; g++) {
+                used[g - first] = 1;
+            }
+        }
+        for (size_t i = 0; i < GRANULES_PER_PAGE && first + i < numGranules; i++) {
+            if (!used[i]) {
+                codeGranules[first + i].store(0, std::memory_order_release);
+            }
+        }
+    }
+};
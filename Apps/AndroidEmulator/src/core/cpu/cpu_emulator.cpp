@@ -1,182 +1,75 @@
 #include <jni.h>
-#include <android/log.h>
-#include <string>
-#include <vector>
-#include <memory>
-#include <thread>
-#include <mutex>
 
-#define LOG_TAG "CPUEmulator"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#include "cpu_emulator.h"
 
-class CPUEmulator {
-private:
-    std::mutex mtx;
-    std::vector<std::thread> threads;
-    bool running = false;
-    
-    // CPU State
-    struct CPUState {
-        uint64_t registers[32];
-        uint64_t pc;
-        uint64_t sp;
-        uint64_t flags;
-    } state;
-    
-    // Memory Management
-    std::unique_ptr<uint8_t[]> memory;
-    size_t memorySize;
-    
-public:
-    CPUEmulator(size_t memSize = 1024 * 1024 * 512) : // 512MB default
-        memorySize(memSize),
-        memory(std::make_unique<uint8_t[]>(memSize)) {
-        
-        LOGI("CPU Emulator initialized with %zu bytes of memory", memSize);
-        resetState();
-    }
-    
-    void resetState() {
-        std::lock_guard<std::mutex> lock(mtx);
-        memset(&state, 0, sizeof(state));
-        memset(memory.get(), 0, memorySize);
-        LOGI("CPU state reset");
-    }
-    
-    bool loadProgram(const uint8_t* program, size_t size) {
-        if (size > memorySize) {
-            LOGE("Program size %zu exceeds memory size %zu", size, memorySize);
-            return false;
-        }
-        
-        std::lock_guard<std::mutex> lock(mtx);
-        memcpy(memory.get(), program, size);
-        state.pc = 0;
-        LOGI("Program loaded, size: %zu bytes", size);
-        return true;
-    }
+// JNI Interface
+extern "C" {
+    static CPUEmulator* emulator = nullptr;
     
-    void start() {
-        std::lock_guard<std::mutex> lock(mtx);
-        if (running) {
-            LOGI("CPU already running");
-            return;
+    JNIEXPORT jint JNICALL
+    Java_com_android_emulator_CPUEmulator_init(JNIEnv* env, jobject obj, jlong memSize) {
+        if (emulator != nullptr) {
+            delete emulator;
+            emulator = nullptr;
         }
         
-        running = true;
-        threads.clear();
-        
-        // Start execution threads
-        const int numThreads = std::thread::hardware_concurrency();
-        LOGI("Starting %d execution threads", numThreads);
-        
-        for (int i = 0; i < numThreads; i++) {
-            threads.emplace_back([this, i]() {
-                executeThread(i);
-            });
+        try {
+            emulator = new CPUEmulator(static_cast<size_t>(memSize));
+            return 0;
+        } catch (const std::exception& e) {
+            LOGE("Failed to initialize CPU emulator: %s", e.what());
+            return -1;
         }
     }
     
-    void stop() {
-        std::lock_guard<std::mutex> lock(mtx);
-        if (!running) {
-            LOGI("CPU already stopped");
-            return;
+    JNIEXPORT jint JNICALL
+    Java_com_android_emulator_CPUEmulator_initWithVcpus(JNIEnv* env, jobject obj, jlong memSize, jint numVcpus) {
+        if (emulator != nullptr) {
+            delete emulator;
+            emulator = nullptr;
         }
         
-        running = false;
-        for (auto& thread : threads) {
-            if (thread.joinable()) {
-                thread.join();
-            }
+        try {
+            emulator = new CPUEmulator(static_cast<size_t>(memSize), numVcpus);
+            return 0;
+        } catch (const std::exception& e) {
+            LOGE("Failed to initialize CPU emulator: %s", e.what());
+            return -1;
         }
-        threads.clear();
-        LOGI("CPU stopped");
     }
     
-private:
-    void executeThread(int threadId) {
-        LOGI("Thread %d started", threadId);
-        
-        while (running) {
-            std::lock_guard<std::mutex> lock(mtx);
-            
-            // Fetch instruction
-            uint32_t instruction = fetchInstruction();
-            
-            // Decode and execute
-            executeInstruction(instruction);
-            
-            // Update PC
-            state.pc += 4;
+    JNIEXPORT jint JNICALL
+    Java_com_android_emulator_CPUEmulator_initWithMode(JNIEnv* env, jobject obj, jlong memSize, jint numVcpus, jint mode) {
+        if (emulator != nullptr) {
+            delete emulator;
+            emulator = nullptr;
         }
         
-        LOGI("Thread %d stopped", threadId);
-    }
-    
-    uint32_t fetchInstruction() {
-        if (state.pc + 4 > memorySize) {
-            LOGE("PC out of bounds: %llu", state.pc);
-            stop();
+        try {
+            emulator = new CPUEmulator(static_cast<size_t>(memSize), numVcpus,
+                                       mode == static_cast<jint>(ExecutionMode::Jit) ?
+                                       ExecutionMode::Jit : ExecutionMode::Interpreter);
             return 0;
+        } catch (const std::exception& e) {
+            LOGE("Failed to initialize CPU emulator: %s", e.what());
+            return -1;
         }
-        
-        return *reinterpret_cast<uint32_t*>(memory.get() + state.pc);
-    }
-    
-    void executeInstruction(uint32_t instruction) {
-        // Implement ARM64 instruction execution
-        // This is a simplified example
-        uint8_t opcode = (instruction >> 24) & 0xFF;
-        
-        switch (opcode) {
-            case 0x00: // NOP
-                break;
-                
-            case 0x01: // ADD
-                {
-                    uint8_t rd = (instruction >> 16) & 0xFF;
-                    uint8_t rn = (instruction >> 8) & 0xFF;
-                    uint8_t rm = instruction & 0xFF;
-                    
-                    if (rd < 32 && rn < 32 && rm < 32) {
-                        state.registers[rd] = state.registers[rn] + state.registers[rm];
-                    }
-                }
-                break;
-                
-            case 0x02: // SUB
-                {
-                    uint8_t rd = (instruction >> 16) & 0xFF;
-                    uint8_t rn = (instruction >> 8) & 0xFF;
-                    uint8_t rm = instruction & 0xFF;
-                    
-                    if (rd < 32 && rn < 32 && rm < 32) {
-                        state.registers[rd] = state.registers[rn] - state.registers[rm];
-                    }
-                }
-                break;
-                
-            default:
-                LOGE("Unknown opcode: 0x%02X", opcode);
-                break;
-        }
-    }
-};
-
-// JNI Interface
-extern "C" {
-    static CPUEmulator* emulator = nullptr;
+    }
     
     JNIEXPORT jint JNICALL
-    Java_com_android_emulator_CPUEmulator_init(JNIEnv* env, jobject obj, jlong memSize) {
+    Java_com_android_emulator_CPUEmulator_initWithBackend(JNIEnv* env, jobject obj, jlong memSize, jint numVcpus,
+                                                          jint mode, jint backend) {
         if (emulator != nullptr) {
             delete emulator;
+            emulator = nullptr;
         }
         
         try {
-            emulator = new CPUEmulator(static_cast<size_t>(memSize));
+            emulator = new CPUEmulator(static_cast<size_t>(memSize), numVcpus,
+                                       mode == static_cast<jint>(ExecutionMode::Jit) ?
+                                       ExecutionMode::Jit : ExecutionMode::Interpreter,
+                                       backend == static_cast<jint>(MemoryBackend::HostMapped) ?
+                                       MemoryBackend::HostMapped : MemoryBackend::SoftMmu);
             return 0;
         } catch (const std::exception& e) {
             LOGE("Failed to initialize CPU emulator: %s", e.what());
@@ -206,6 +99,104 @@ extern "C" {
         return result ? JNI_TRUE : JNI_FALSE;
     }
     
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_loadElf(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->loadElf(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_loadLinuxProcess(JNIEnv* env, jobject obj, jstring path, jobjectArray args) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        std::vector<std::string> argv;
+        jsize count = args != nullptr ? env->GetArrayLength(args) : 0;
+        for (jsize i = 0; i < count; i++) {
+            jstring arg = static_cast<jstring>(env->GetObjectArrayElement(args, i));
+            const char* argChars = arg != nullptr ? env->GetStringUTFChars(arg, nullptr) : nullptr;
+            if (argChars == nullptr) {
+                env->DeleteLocalRef(arg);
+                return JNI_FALSE;
+            }
+            argv.push_back(argChars);
+            env->ReleaseStringUTFChars(arg, argChars);
+            env->DeleteLocalRef(arg);
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->loadLinuxProcess(pathChars, argv);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jint JNICALL
+    Java_com_android_emulator_CPUEmulator_getExitStatus(JNIEnv* env, jobject obj) {
+        return emulator != nullptr ? emulator->getExitStatus() : -1;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_attachCodeCache(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->attachCodeCache(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_attachDisk(JNIEnv* env, jobject obj, jstring path, jboolean readOnly) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->attachDisk(pathChars, readOnly == JNI_TRUE);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    // Needs no running emulator, so overlays can be made before the first
+    // instance starts
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_createOverlayDisk(JNIEnv* env, jobject obj, jstring path, jstring basePath) {
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        const char* baseChars = basePath != nullptr ? env->GetStringUTFChars(basePath, nullptr) : nullptr;
+        if (baseChars == nullptr) {
+            env->ReleaseStringUTFChars(path, pathChars);
+            return JNI_FALSE;
+        }
+        bool result = CPUEmulator::createOverlayDisk(pathChars, baseChars);
+        env->ReleaseStringUTFChars(basePath, baseChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
     JNIEXPORT void JNICALL
     Java_com_android_emulator_CPUEmulator_start(JNIEnv* env, jobject obj) {
         if (emulator != nullptr) {
@@ -220,6 +211,148 @@ extern "C" {
         }
     }
     
+    JNIEXPORT void JNICALL
+    Java_com_android_emulator_CPUEmulator_setHostThreads(JNIEnv* env, jobject obj, jint count) {
+        if (emulator != nullptr) {
+            emulator->setHostThreads(count);
+        }
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_saveSnapshot(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->saveSnapshot(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_restoreSnapshot(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->restoreSnapshot(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_startRecording(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->startRecording(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_stopRecording(JNIEnv* env, jobject obj) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        return emulator->stopRecording() ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_startReplay(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->startReplay(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT void JNICALL
+    Java_com_android_emulator_CPUEmulator_stopReplay(JNIEnv* env, jobject obj) {
+        if (emulator != nullptr) {
+            emulator->stopReplay();
+        }
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_enableMemoryDedup(JNIEnv* env, jobject obj, jstring path) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* pathChars = path != nullptr ? env->GetStringUTFChars(path, nullptr) : nullptr;
+        if (pathChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->enableMemoryDedup(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT void JNICALL
+    Java_com_android_emulator_CPUEmulator_disableMemoryDedup(JNIEnv* env, jobject obj) {
+        if (emulator != nullptr) {
+            emulator->disableMemoryDedup();
+        }
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_trimMemory(JNIEnv* env, jobject obj) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        return emulator->trimMemory() ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_startProfiling(JNIEnv* env, jobject obj, jint hz) {
+        if (emulator == nullptr || hz <= 0) {
+            return JNI_FALSE;
+        }
+        return emulator->startProfiling(static_cast<unsigned>(hz)) ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT void JNICALL
+    Java_com_android_emulator_CPUEmulator_stopProfiling(JNIEnv* env, jobject obj) {
+        if (emulator != nullptr) {
+            emulator->stopProfiling();
+        }
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_CPUEmulator_dumpProfile(JNIEnv* env, jobject obj, jstring prefix) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        const char* prefixChars = prefix != nullptr ? env->GetStringUTFChars(prefix, nullptr) : nullptr;
+        if (prefixChars == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->dumpProfile(prefixChars);
+        env->ReleaseStringUTFChars(prefix, prefixChars);
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
     JNIEXPORT void JNICALL
     Java_com_android_emulator_CPUEmulator_cleanup(JNIEnv* env, jobject obj) {
         if (emulator != nullptr) {
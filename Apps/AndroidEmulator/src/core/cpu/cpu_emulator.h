@@ -0,0 +1,3261 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <unistd.h>
+
+#include "block_cache.h"
+#include "vcpu.h"
+#include "jit.h"
+#include "soft_mmu.h"
+#include "guest_memory.h"
+#include "host_access_guard.h"
+#include "snapshot.h"
+#include "elf_loader.h"
+#include "timer.h"
+#include "profiler.h"
+#include "replay.h"
+#include "shared_code_cache.h"
+#include "virtio_block.h"
+#include "page_merger.h"
+#include "fp_unit.h"
+#include "vcpu_scheduler.h"
+#include "linux_syscalls.h"
+
+#define LOG_TAG "CPUEmulator"
+#ifdef __ANDROID__
+#include <android/log.h>
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#else
+// Host builds, such as the benchmarks, log to stderr
+#include <cstdio>
+#define LOGI(...) (fprintf(stderr, LOG_TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#define LOGE(...) (fprintf(stderr, LOG_TAG " error: " __VA_ARGS__), fputc('\n', stderr))
+#endif
+
+class CPUEmulator {
+private:
+    std::mutex mtx;
+    std::atomic<bool> running{false};
+    
+    // Virtual CPUs, each with its own register file and host thread
+    std::vector<std::unique_ptr<VCPU>> vcpus;
+    
+    // With fewer host threads than vCPUs, the vCPUs run in time slices on
+    // a pool of that many workers instead. 0 for a thread per vCPU.
+    int hostThreads = 0;
+    bool pooled = false;
+    std::unique_ptr<VcpuScheduler> scheduler;
+    
+    // Rendezvous used to park every vCPU at a block boundary
+    std::mutex syncMtx;
+    std::condition_variable syncCv;
+    bool pauseRequested = false;
+    int parkedVcpus = 0;
+    int activeVcpus = 0;
+    
+    // Memory Management
+    MemoryBackend memoryBackend;
+    GuestMemory memory;
+    size_t memorySize;
+    
+    // Guest virtual to physical translation, backed by per-vCPU TLBs
+    SoftMMU mmu;
+    
+    // Predecoded straight-line blocks keyed by guest PC, shared by all vCPUs
+    BlockCache blockCache;
+    std::shared_mutex blockCacheMtx;
+    
+    // Snapshot the dirty map is relative to; saving there again is incremental
+    std::string lastSnapshotPath;
+    
+    // Second tier: host code for hot blocks, only present in JIT mode
+    std::unique_ptr<JitTranslator> jit;
+    std::atomic<bool> jitFlushPending{false};
+    
+    // Decoded blocks and translations shared with other instances, if any
+    std::unique_ptr<SharedCodeCache> sharedCode;
+    
+    // Instructions each vCPU may retire before it halts, 0 for no limit
+    std::atomic<uint64_t> instructionBudget{0};
+    
+    // Virtual timer deadlines of all vCPUs
+    std::unique_ptr<TimerService> timers;
+    
+    // Guest sampling profiler, idle unless started
+    std::unique_ptr<Profiler> profiler;
+    
+    // Record/replay. While either is active the vCPUs take turns on a run
+    // token instead of running in parallel, so the trace fixes their
+    // interleaving along with every other input.
+    std::atomic<ReplayMode> replayMode{ReplayMode::Off};
+    std::unique_ptr<ReplayLog> replayLog;
+    std::atomic<int> tokenHolder{-1};
+    uint64_t sliceStart = 0;        // holder's retired count when it got the token
+    bool replayStarted = false;
+    bool replayFinished = false;    // guarded by syncMtx
+    bool replayDiverged = false;
+    
+    // Instructions the token holder runs before recording offers the token
+    // to the next vCPU
+    static constexpr uint64_t REPLAY_QUANTUM = 20000;
+    
+    // Instructions a pooled vCPU runs before its worker moves on to the
+    // next runnable one
+    static constexpr uint64_t SLICE_INSTRUCTIONS = 100000;
+    
+    // Appended to a trace's path for the snapshot it starts from
+    static constexpr const char* TRACE_SNAPSHOT_SUFFIX = ".snapshot";
+    
+    // System calls of a program loaded by loadLinuxProcess, which then
+    // runs without a guest kernel; null otherwise
+    std::unique_ptr<LinuxSyscalls> userMode;
+    std::atomic<int> exitStatus{-1};
+    
+    // Guest disk, if one is attached. Declared after everything its I/O
+    // thread uses so it is destroyed first: that thread still raises
+    // interrupts and writes guest RAM while in-flight requests drain.
+    std::unique_ptr<VirtioBlockDevice> blockDevice;
+    
+    // Background deduplication of guest RAM, if enabled; destroyed before
+    // the disk it checks. Its thread takes mtx to pause the vCPUs, so it
+    // is replaced under mergerMtx instead.
+    std::mutex mergerMtx;
+    std::unique_ptr<PageMerger> pageMerger;
+
+#ifndef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+    // Serializes 128-bit store-exclusives on hosts without a 16-byte
+    // compare-and-swap
+    std::mutex wideExclusiveMtx;
+#endif
+
+public:
+    CPUEmulator(size_t memSize = 1024 * 1024 * 512, // 512MB default
+                int numVcpus = 0,                  // 0 = one per host core
+                ExecutionMode mode = ExecutionMode::Interpreter,
+                MemoryBackend backend = MemoryBackend::SoftMmu) :
+        memoryBackend(usableBackend(backend, memSize)),
+        memory(memSize, memoryBackend == MemoryBackend::HostMapped ?
+                        HostAccessGuard::WINDOW + HostAccessGuard::GUARD_SIZE : 0),
+        memorySize(memSize),
+        mmu(memory),
+        blockCache(memSize) {
+        
+        if (memoryBackend == MemoryBackend::HostMapped) {
+            HostFaultHandler::install();
+        }
+        if (mode == ExecutionMode::Jit) {
+            jit = std::make_unique<JitTranslator>();
+            if (!jit->available()) {
+                LOGE("JIT unavailable on this host, falling back to the interpreter");
+                jit.reset();
+            }
+        }
+        
+        if (numVcpus <= 0) {
+            numVcpus = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < numVcpus; i++) {
+            vcpus.push_back(std::make_unique<VCPU>());
+            vcpus.back()->id = i;
+        }
+        scheduler = std::make_unique<VcpuScheduler>(vcpus.size(), [this](int id) {
+            return runSlice(*vcpus[id]);
+        });
+        timers = std::make_unique<TimerService>(vcpus.size(), [this](int id) {
+            timerExpired(*vcpus[id]);
+        });
+        profiler = std::make_unique<Profiler>(vcpus.size(), [this](int id) {
+            // Translated code only returns to the dispatcher when its
+            // budget runs out, always at the same point of a loop; cutting
+            // the budget short samples wherever the guest is right now.
+            // Record and replay leave it alone, as it moves block
+            // boundaries.
+            VCPU& vcpu = *vcpus[id];
+            vcpu.exitRequest.fetch_or(VCPU_EXIT_SAMPLE, std::memory_order_release);
+            if (replayMode.load(std::memory_order_relaxed) == ReplayMode::Off) {
+                __atomic_store_n(&vcpu.jit.budget, 0, __ATOMIC_RELAXED);
+            }
+        });
+        
+        LOGI("CPU Emulator initialized with %zu bytes of memory and %d vCPUs (%s, %s memory)",
+             memSize, numVcpus, jit ? "jit" : "interpreter",
+             memoryBackend == MemoryBackend::HostMapped ? "host-mapped" : "soft MMU");
+        resetState();
+    }
+    
+    ~CPUEmulator() {
+        stop();
+    }
+    
+    void resetState() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!replayInactive("reset")) {
+            return;
+        }
+        ScopedPause pause(*this);
+        
+        for (auto& vcpu : vcpus) {
+            memset(&vcpu->state, 0, sizeof(vcpu->state));
+            vcpu->state.registers[0] = vcpu->id;
+            vcpu->state.daif = PSTATE_DAIF;
+            vcpu->halted = false;
+            vcpu->retired.store(0, std::memory_order_relaxed);
+            vcpu->waitState = VCPU_RUNNING;
+            vcpu->pendingInterrupts.store(0, std::memory_order_relaxed);
+            vcpu->tlb.flush();
+            clearExclusive(*vcpu);
+        }
+        timers->disarmAll();
+        memory.reset();
+        userMode.reset();
+        lastSnapshotPath.clear();
+        clearBlockCache();
+        flushJit();
+        LOGI("CPU state reset");
+    }
+    
+    bool loadProgram(const uint8_t* program, size_t size) {
+        if (size > memorySize) {
+            LOGE("Program size %zu exceeds memory size %zu", size, memorySize);
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!replayInactive("load a program")) {
+            return false;
+        }
+        ScopedPause pause(*this);
+        
+        userMode.reset();
+        memcpy(memory.data(), program, size);
+        memory.markDirtyRange(0, size);
+        clearBlockCache();
+        flushJit();
+        
+        // Every vCPU enters at the same address; x0 holds its index so the
+        // guest can tell the boot CPU from secondaries.
+        for (auto& vcpu : vcpus) {
+            vcpu->state.pc = 0;
+            vcpu->state.registers[0] = vcpu->id;
+            vcpu->halted = false;
+            vcpu->waitState = VCPU_RUNNING;
+            vcpu->tlb.flush();
+            clearExclusive(*vcpu);
+        }
+        LOGI("Program loaded, size: %zu bytes", size);
+        return true;
+    }
+    
+    // Starts a fresh guest from an AArch64 ELF image, mapped copy-on-write
+    // from the file instead of copied. vCPU 0 enters it with the Linux
+    // initial process stack; the others stay halted, as a new process
+    // has a single thread.
+    bool loadElf(const std::string& path) {
+        return loadImage(path, {}, {}, false);
+    }
+    
+    // Runs an AArch64 Linux program without a guest kernel: vCPU 0 enters
+    // it, through its dynamic linker if it names one, with args and env as
+    // argv and environment, and its system calls are serviced on the host.
+    // Threads it starts take over the other vCPUs, so it can have at most
+    // getVcpuCount() at a time.
+    bool loadLinuxProcess(const std::string& path, const std::vector<std::string>& args = {},
+                          const std::vector<std::string>& env = {}) {
+        return loadImage(path, args, env, true);
+    }
+    
+    // What the process loadLinuxProcess started exited with: its exit
+    // status, or 128 plus the signal that killed it, as a shell reports
+    // it. -1 while it runs.
+    int getExitStatus() const {
+        return exitStatus.load(std::memory_order_acquire);
+    }
+    
+    void start() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running) {
+            LOGI("CPU already running");
+            return;
+        }
+        if (replayMode.load(std::memory_order_relaxed) != ReplayMode::Off) {
+            // Stopping and restarting would not happen at the same point
+            // of the replay
+            if (replayStarted) {
+                LOGE("A trace covers a single run; stop recording or replaying first");
+                return;
+            }
+            replayStarted = true;
+        }
+        
+        // The run token of record/replay hands a vCPU's host thread over
+        // to another one, so tracing always runs a thread per vCPU
+        pooled = hostThreads > 0 && static_cast<size_t>(hostThreads) < vcpus.size() &&
+                 replayMode.load(std::memory_order_relaxed) == ReplayMode::Off;
+        
+        // A user mode process only has vCPUs for the threads it has; clone()
+        // starts the others when it needs them
+        std::vector<int> started;
+        for (auto& vcpu : vcpus) {
+            if (!userMode || userMode->threadAlive(vcpu->id)) {
+                started.push_back(vcpu->id);
+            }
+        }
+        
+        running = true;
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            activeVcpus = static_cast<int>(started.size());
+            // Pooled vCPUs count as parked whenever no worker runs them
+            parkedVcpus = pooled ? activeVcpus : 0;
+            if (replayStarted) {
+                replayFinished = false;
+                auto first = std::find_if(vcpus.begin(), vcpus.end(), [](const std::unique_ptr<VCPU>& vcpu) {
+                    return !vcpu->halted;
+                });
+                tokenHolder.store(first != vcpus.end() ? (*first)->id : -1, std::memory_order_relaxed);
+                sliceStart = first != vcpus.end() ? (*first)->retired.load(std::memory_order_relaxed) : 0;
+            }
+        }
+        
+        timers->start();
+        for (auto& vcpu : vcpus) {
+            vcpu->exitRequest.store(0, std::memory_order_relaxed);
+        }
+        if (pooled) {
+            LOGI("Starting %zu vCPUs on %d host threads", started.size(), hostThreads);
+            scheduler->start(static_cast<size_t>(hostThreads), started);
+            return;
+        }
+        
+        LOGI("Starting %zu vCPUs", started.size());
+        for (int id : started) {
+            VCPU* target = vcpus[id].get();
+            target->thread = std::thread([this, target]() {
+                executeThread(*target);
+            });
+        }
+    }
+    
+    void stop() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!running) {
+            LOGI("CPU already stopped");
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            running = false;
+            for (auto& vcpu : vcpus) {
+                vcpu->exitRequest.fetch_or(VCPU_EXIT_STOP, std::memory_order_release);
+            }
+        }
+        syncCv.notify_all();
+        
+        for (auto& vcpu : vcpus) {
+            kick(*vcpu);
+            if (vcpu->thread.joinable()) {
+                vcpu->thread.join();
+            }
+        }
+        scheduler->join();
+        timers->stop();
+        LOGI("CPU stopped");
+    }
+    
+    // Runs the vCPUs on count host threads from the next start() on, each
+    // taking turns of SLICE_INSTRUCTIONS on whichever thread is free. For
+    // guests with many more vCPUs than the host has cores. 0, or at least
+    // one thread per vCPU, goes back to a thread of its own for each.
+    void setHostThreads(int count) {
+        std::lock_guard<std::mutex> lock(mtx);
+        hostThreads = std::max(count, 0);
+    }
+    
+    // Latches an interrupt line on one vCPU and wakes it if it is in WFI.
+    // It is taken at the vCPU's next block boundary, never in the middle
+    // of a block, and stays pending until the guest acknowledges it
+    // through ICC_IAR1_EL1. A replay ignores it and raises what the
+    // trace says instead.
+    void raiseInterrupt(int vcpuId, uint32_t irq) {
+        if (vcpuId < 0 || vcpuId >= static_cast<int>(vcpus.size()) || irq >= 32) {
+            return;
+        }
+        
+        raiseExternal(*vcpus[vcpuId], 1u << irq);
+    }
+    
+    size_t getVcpuCount() const {
+        return vcpus.size();
+    }
+    
+    // The mode actually in use; JIT requests fall back to the interpreter
+    // on hosts without a backend
+    ExecutionMode getExecutionMode() const {
+        return jit ? ExecutionMode::Jit : ExecutionMode::Interpreter;
+    }
+    
+    // Likewise for the memory backend
+    MemoryBackend getMemoryBackend() const {
+        return memoryBackend;
+    }
+    
+    // Halts each vCPU once it has retired this many guest instructions,
+    // counted from reset. The check runs between blocks, so a vCPU can
+    // overshoot by up to one dispatcher iteration; 0 removes the limit.
+    void setInstructionBudget(uint64_t instructions) {
+        instructionBudget.store(instructions, std::memory_order_relaxed);
+    }
+    
+    uint64_t getRetiredInstructions(int vcpuId) const {
+        if (vcpuId < 0 || vcpuId >= static_cast<int>(vcpus.size())) {
+            return 0;
+        }
+        return vcpus[vcpuId]->retired.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t getRetiredInstructions() const {
+        uint64_t total = 0;
+        for (const auto& vcpu : vcpus) {
+            total += vcpu->retired.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    
+    // Blocks until every vCPU has halted on its own, e.g. on reaching the
+    // instruction budget, then stops the emulator.
+    void waitUntilHalted() {
+        {
+            std::unique_lock<std::mutex> syncLock(syncMtx);
+            syncCv.wait(syncLock, [this]() {
+                return activeVcpus == 0;
+            });
+        }
+        stop();
+    }
+    
+    // Saves all vCPU state and guest RAM. Saving to the snapshot that was
+    // last saved or restored only writes pages dirtied since then.
+    bool saveSnapshot(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mtx);
+        ScopedPause pause(*this);
+        
+        // The file holds architectural NZCV, never pending flag operands
+        std::vector<CPUState> states;
+        for (auto& vcpu : vcpus) {
+            materializeFlags(vcpu->state);
+            states.push_back(vcpu->state);
+        }
+        
+        bool incremental = path == lastSnapshotPath;
+        std::string error;
+        if (!Snapshot::save(path, states, memory, incremental, error)) {
+            LOGE("Failed to save snapshot %s: %s", path.c_str(), error.c_str());
+            lastSnapshotPath.clear();
+            return false;
+        }
+        
+        // Start a new dirty epoch; TLB write tags cache the old one
+        memory.clearDirty();
+        for (auto& vcpu : vcpus) {
+            vcpu->tlb.flush();
+        }
+        lastSnapshotPath = path;
+        LOGI("Snapshot saved to %s (%s)", path.c_str(), incremental ? "incremental" : "full");
+        return true;
+    }
+    
+    // Resumes from a snapshot. Guest RAM becomes a copy-on-write mapping
+    // of the file, so this takes time proportional to the vCPU count,
+    // not the RAM size.
+    bool restoreSnapshot(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!replayInactive("restore a snapshot")) {
+            return false;
+        }
+        ScopedPause pause(*this);
+        
+        std::vector<CPUState> states(vcpus.size());
+        std::string error;
+        if (!Snapshot::restore(path, states, memory, error)) {
+            LOGE("Failed to restore snapshot %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        
+        for (size_t i = 0; i < vcpus.size(); i++) {
+            vcpus[i]->state = states[i];
+            vcpus[i]->halted = false;
+            vcpus[i]->waitState = VCPU_RUNNING;
+            vcpus[i]->pendingInterrupts.store(0, std::memory_order_relaxed);
+            vcpus[i]->tlb.flush();
+            clearExclusive(*vcpus[i]);
+            updateTimer(*vcpus[i]);
+        }
+        // A snapshot holds no host state, such as open files
+        userMode.reset();
+        clearBlockCache();
+        flushJit();
+        lastSnapshotPath = path;
+        LOGI("Snapshot restored from %s", path.c_str());
+        return true;
+    }
+    
+    // Samples the guest PC and frame-pointer call chain of every vCPU hz
+    // times per second and counts interpreted ops by kind. Starting again
+    // discards the previous profile.
+    bool startProfiling(unsigned hz) {
+        if (!profiler->start(hz)) {
+            LOGE("Invalid profiling rate %u Hz", hz);
+            return false;
+        }
+        LOGI("Profiling at %u Hz", hz);
+        return true;
+    }
+    
+    void stopProfiling() {
+        profiler->stop();
+        LOGI("Profiling stopped");
+    }
+    
+    // Writes the profile collected so far to prefix.flat.txt and
+    // prefix.collapsed.txt. Works while profiling is running.
+    bool dumpProfile(const std::string& prefix) {
+        std::string error;
+        if (!profiler->dump(prefix, error)) {
+            LOGE("Failed to write profile: %s", error.c_str());
+            return false;
+        }
+        LOGI("Profile written to %s.*", prefix.c_str());
+        return true;
+    }
+    
+    // Symbols profiles are reported against, e.g. those of a loaded image
+    void setGuestSymbols(std::vector<GuestSymbol> symbols) {
+        profiler->setSymbols(std::move(symbols));
+    }
+    
+    // Records every nondeterministic input of the next run to path: how
+    // the vCPUs interleave, interrupts raised from outside and counter
+    // reads. The guest as it is now goes to path.snapshot, which a replay
+    // starts from. Call while stopped; the trace is complete once
+    // stopRecording returns.
+    bool startRecording(const std::string& path) {
+        if (running || replayMode.load() != ReplayMode::Off) {
+            LOGE("Recording has to start while stopped and not replaying");
+            return false;
+        }
+        if (blockDevice) {
+            LOGE("Disk I/O cannot be recorded");
+            return false;
+        }
+        if (!saveSnapshot(path + TRACE_SNAPSHOT_SUFFIX)) {
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<TraceVcpuState> states;
+        for (auto& vcpu : vcpus) {
+            TraceVcpuState state = {};
+            state.pendingInterrupts = vcpu->pendingInterrupts.load(std::memory_order_relaxed);
+            state.halted = vcpu->halted;
+            state.waitState = static_cast<uint8_t>(vcpu->waitState);
+            state.eventRegister = vcpu->eventRegister.load(std::memory_order_relaxed);
+            states.push_back(state);
+        }
+        
+        std::string error;
+        std::unique_ptr<ReplayLog> log = ReplayLog::create(path, traceHeader(), states, error);
+        if (!log) {
+            LOGE("Failed to create trace %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        beginTrace(std::move(log), ReplayMode::Record);
+        LOGI("Recording to %s", path.c_str());
+        return true;
+    }
+    
+    bool stopRecording() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running || replayMode.load() != ReplayMode::Record) {
+            LOGE("Recording has to stop while stopped");
+            return false;
+        }
+        
+        // Where the holder stopped, so a replay stops at the same point
+        int holder = tokenHolder.load(std::memory_order_relaxed);
+        const VCPU& last = *vcpus[holder >= 0 ? holder : 0];
+        replayLog->event(TRACE_END, last.id, last.replaySteps, stateHash());
+        
+        std::string error;
+        bool ok = replayLog->finish(error);
+        if (!ok) {
+            LOGE("Failed to write trace: %s", error.c_str());
+        }
+        endTrace();
+        LOGI("Recording stopped");
+        return ok;
+    }
+    
+    // Replays a trace written by startRecording on an emulator configured
+    // the same way. Interrupts and counter values come from the trace,
+    // not from the host, and idle periods take no time. Once the trace
+    // ends every vCPU leaves its dispatch loop, so waitUntilHalted
+    // returns; the log says whether the final state matched.
+    bool startReplay(const std::string& path) {
+        if (running || replayMode.load() != ReplayMode::Off) {
+            LOGE("Replay has to start while stopped and not recording");
+            return false;
+        }
+        if (blockDevice) {
+            LOGE("Disk I/O cannot be replayed");
+            return false;
+        }
+        if (!restoreSnapshot(path + TRACE_SNAPSHOT_SUFFIX)) {
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(mtx);
+        TraceHeader header;
+        std::vector<TraceVcpuState> states;
+        std::string error;
+        std::unique_ptr<ReplayLog> log = ReplayLog::load(path, header, states, error);
+        if (!log) {
+            LOGE("Failed to open trace %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        TraceHeader expected = traceHeader();
+        if (memcmp(&header, &expected, sizeof(header)) != 0) {
+            LOGE("Trace %s was recorded with a different emulator configuration", path.c_str());
+            return false;
+        }
+        
+        for (size_t i = 0; i < vcpus.size(); i++) {
+            vcpus[i]->pendingInterrupts.store(states[i].pendingInterrupts, std::memory_order_relaxed);
+            vcpus[i]->halted = states[i].halted;
+            vcpus[i]->waitState = static_cast<VCPUWaitState>(states[i].waitState);
+            vcpus[i]->eventRegister.store(states[i].eventRegister, std::memory_order_relaxed);
+        }
+        timers->disarmAll();
+        beginTrace(std::move(log), ReplayMode::Replay);
+        LOGI("Replaying %s", path.c_str());
+        return true;
+    }
+    
+    void stopReplay() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running || replayMode.load() != ReplayMode::Replay) {
+            LOGE("Replay has to stop while stopped");
+            return;
+        }
+        endTrace();
+        LOGI("Replay stopped");
+    }
+    
+    // Shares decoded blocks and translations with every instance attached
+    // to the cache file at path, creating it if needed. Code some instance
+    // has already translated runs as host code from its first use here.
+    // Record and replay leave the cache alone, as it changes when blocks
+    // get translated.
+    bool attachCodeCache(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mtx);
+        ScopedPause pause(*this);
+        
+        std::string error;
+        std::unique_ptr<SharedCodeCache> cache =
+            SharedCodeCache::attach(path, SharedCodeCache::DEFAULT_SIZE, codeCacheBuildId(), error);
+        if (!cache) {
+            LOGE("Failed to attach code cache %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        sharedCode = std::move(cache);
+        
+        // Blocks decoded so far have no code hash to share them under
+        clearBlockCache();
+        flushJit();
+        LOGI("Code cache %s attached, %llu bytes in use", path.c_str(),
+             static_cast<unsigned long long>(sharedCode->usedBytes()));
+        return true;
+    }
+    
+    // Attaches a raw disk image, which may be sparse, or an overlay made by
+    // createOverlayDisk as a virtio-mmio block device at
+    // VirtioBlockDevice::MMIO_BASE that signals IRQ_VIRTIO_BLOCK on vCPU 0.
+    // Replaces the disk attached before, once its requests in flight are
+    // done. Device state is not part of snapshots, and record and replay
+    // refuse to run with a disk.
+    bool attachDisk(const std::string& path, bool readOnly) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!replayInactive("attach a disk")) {
+            return false;
+        }
+        ScopedPause pause(*this);
+        
+        auto device = std::make_unique<VirtioBlockDevice>(memory, [this]() {
+            raiseExternal(*vcpus[0], 1u << IRQ_VIRTIO_BLOCK);
+        }, [this](uint64_t pa, size_t size) {
+            deviceWrote(pa, size);
+        });
+        std::string error;
+        if (!device->open(path, readOnly, error)) {
+            LOGE("Failed to attach disk %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        blockDevice = std::move(device);
+        LOGI("Disk %s attached: %llu sectors, %s, %s, %s I/O", path.c_str(),
+             static_cast<unsigned long long>(blockDevice->sectors()), blockDevice->formatName(),
+             readOnly ? "read-only" : "read-write", blockDevice->backendName());
+        return true;
+    }
+    
+    // Creates an empty copy-on-write overlay over a raw base image, for
+    // attachDisk. Instances that each attach an overlay of their own over
+    // one base share its unmodified clusters, page cache included.
+    static bool createOverlayDisk(const std::string& path, const std::string& basePath) {
+        std::string error;
+        if (!DiskImage::createOverlay(path, basePath, error)) {
+            LOGE("Failed to create overlay %s over %s: %s", path.c_str(), basePath.c_str(), error.c_str());
+            return false;
+        }
+        LOGI("Overlay %s created over %s", path.c_str(), basePath.c_str());
+        return true;
+    }
+    
+    // Starts merging guest pages with identical pages of every instance,
+    // in this process or another, that uses the page store at path. Merged
+    // pages are copy-on-write, so sharing ends where the guest writes.
+    // Replaces the store used before; pages merged so far stay merged.
+    bool enableMemoryDedup(const std::string& path) {
+        std::string error;
+        std::unique_ptr<SharedPageStore> store = SharedPageStore::attach(path, SharedPageStore::DEFAULT_SIZE, error);
+        if (!store) {
+            LOGE("Failed to attach page store %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(mergerMtx);
+        pageMerger.reset();
+        pageMerger = std::make_unique<PageMerger>(memory, std::move(store), [this](const std::function<void()>& work) {
+            return runStopped(work);
+        });
+        pageMerger->start();
+        LOGI("Memory deduplication enabled with page store %s (%llu pages)", path.c_str(),
+             static_cast<unsigned long long>(pageMerger->storePages()));
+        return true;
+    }
+    
+    void disableMemoryDedup() {
+        std::lock_guard<std::mutex> lock(mergerMtx);
+        if (!pageMerger) {
+            return;
+        }
+        pageMerger->stop();
+        LOGI("Memory deduplication disabled: %zu bytes shared, %zu zero bytes released",
+             pageMerger->sharedBytes(), pageMerger->releasedZeroBytes());
+        pageMerger.reset();
+    }
+    
+    // Releases resident guest RAM of an idle instance back to the kernel
+    bool trimMemory() {
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t before = memory.residentBytes();
+        bool trimmed = memory.trim();
+        LOGI("Guest memory trim %s: %zu -> %zu resident bytes", trimmed ? "done" : "unsupported",
+             before, memory.residentBytes());
+        return trimmed;
+    }
+    
+private:
+    // Parks all running vCPUs at a block boundary for the lifetime of the
+    // object so the caller can safely touch shared state.
+    class ScopedPause {
+    public:
+        explicit ScopedPause(CPUEmulator& cpu) : cpu(cpu) {
+            cpu.pauseVcpus();
+        }
+        
+        ~ScopedPause() {
+            cpu.resumeVcpus();
+        }
+        
+    private:
+        CPUEmulator& cpu;
+    };
+    
+    // Runs work for the page merger with the vCPUs parked and no disk DMA
+    // in flight. Parked vCPUs cannot queue new disk requests.
+    bool runStopped(const std::function<void()>& work) {
+        std::lock_guard<std::mutex> lock(mtx);
+        ScopedPause pause(*this);
+        if (blockDevice && !blockDevice->idle()) {
+            return false;
+        }
+        work();
+        return true;
+    }
+    
+    void pauseVcpus() {
+        std::unique_lock<std::mutex> syncLock(syncMtx);
+        if (!running) {
+            return;
+        }
+        
+        // Wait out a vCPU that is inside runExclusive
+        syncCv.wait(syncLock, [this]() {
+            return !pauseRequested;
+        });
+        pauseRequested = true;
+        for (auto& vcpu : vcpus) {
+            vcpu->exitRequest.fetch_or(VCPU_EXIT_PAUSE, std::memory_order_release);
+            kick(*vcpu);
+        }
+        syncCv.wait(syncLock, [this]() {
+            return parkedVcpus == activeVcpus;
+        });
+    }
+    
+    void resumeVcpus() {
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            if (!pauseRequested) {
+                return;
+            }
+            pauseRequested = false;
+        }
+        syncCv.notify_all();
+    }
+    
+    // Called by a vCPU thread when its exitRequest is non-zero. Returns
+    // false when the vCPU should leave its dispatch loop.
+    bool syncPoint(VCPU& vcpu) {
+        uint32_t reasons = vcpu.exitRequest.exchange(0, std::memory_order_acquire);
+        
+        if (reasons & VCPU_EXIT_TLB_FLUSH) {
+            vcpu.tlb.flush();
+        }
+        
+        if (reasons & VCPU_EXIT_SAMPLE) {
+            takeSample(vcpu);
+        }
+        
+        if (reasons & VCPU_EXIT_HALT) {
+            vcpu.halted = true;
+        }
+        
+        if (reasons & VCPU_EXIT_INTERRUPT) {
+            // Masked interrupts stay latched in pendingInterrupts and are
+            // requested again when the guest unmasks them
+            deliverInterrupt(vcpu);
+        }
+        
+        if (reasons & (VCPU_EXIT_PAUSE | VCPU_EXIT_STOP)) {
+            std::unique_lock<std::mutex> syncLock(syncMtx);
+            if (pauseRequested && running) {
+                parkedVcpus++;
+                syncCv.notify_all();
+                syncCv.wait(syncLock, [this]() {
+                    return !pauseRequested || !running;
+                });
+                parkedVcpus--;
+            }
+        }
+        
+        return running.load(std::memory_order_acquire) && !vcpu.halted;
+    }
+    
+    // Records the PC and the call sites in the chain of frame records
+    // starting at x29, as far as the guest's stack can be read. Code
+    // built without frame pointers shows up with a truncated chain.
+    void takeSample(VCPU& vcpu) {
+        ProfileSample sample;
+        sample.frames[0] = vcpu.state.pc;
+        sample.depth = 1;
+        
+        uint64_t fp = vcpu.state.registers[29];
+        while (sample.depth < ProfileSample::MAX_FRAMES && fp != 0 && !(fp & 7)) {
+            uint64_t caller;
+            uint64_t lr;
+            MMUFault fault = {};
+            if (!readMemory(vcpu, fp, 3, caller, fault) || !readMemory(vcpu, fp + 8, 3, lr, fault) || lr < 4) {
+                break;
+            }
+            // The call itself, so it symbolizes inside the caller
+            sample.frames[sample.depth++] = lr - 4;
+            if (caller <= fp) {
+                // Frame records move up the stack; anything else is garbage
+                break;
+            }
+            fp = caller;
+        }
+        profiler->record(vcpu.id, sample);
+    }
+    
+    // Runs fn on a vCPU thread while every other vCPU is parked at a block
+    // boundary, i.e. outside translated code.
+    template <typename F>
+    void runExclusive(VCPU& self, F fn) {
+        std::unique_lock<std::mutex> syncLock(syncMtx);
+        while (pauseRequested) {
+            // Someone else got there first; park until they are done
+            parkedVcpus++;
+            syncCv.notify_all();
+            syncCv.wait(syncLock, [this]() {
+                return !pauseRequested || !running;
+            });
+            parkedVcpus--;
+            if (!running) {
+                return;
+            }
+        }
+        
+        pauseRequested = true;
+        for (auto& vcpu : vcpus) {
+            if (vcpu.get() != &self) {
+                vcpu->exitRequest.fetch_or(VCPU_EXIT_PAUSE, std::memory_order_release);
+                kick(*vcpu);
+            }
+        }
+        syncCv.wait(syncLock, [this]() {
+            return parkedVcpus == activeVcpus - 1 || !running;
+        });
+        
+        fn();
+        
+        pauseRequested = false;
+        syncLock.unlock();
+        syncCv.notify_all();
+    }
+    
+    void retire(VCPU& vcpu, uint64_t instructions) {
+        vcpu.retired.store(vcpu.retired.load(std::memory_order_relaxed) + instructions,
+                           std::memory_order_relaxed);
+    }
+    
+    bool budgetExhausted(const VCPU& vcpu) const {
+        uint64_t budget = instructionBudget.load(std::memory_order_relaxed);
+        return budget != 0 && vcpu.retired.load(std::memory_order_relaxed) >= budget;
+    }
+    
+    void vcpuExited() {
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            activeVcpus--;
+        }
+        syncCv.notify_all();
+    }
+    
+    // Wakes a vCPU parked in WFI or WFE so it re-evaluates why it sleeps.
+    // Callers update the vCPU's atomics first.
+    void kick(VCPU& vcpu) {
+        {
+            std::lock_guard<std::mutex> waitLock(vcpu.waitMtx);
+        }
+        vcpu.waitCv.notify_all();
+        scheduler->wake(vcpu.id);
+    }
+    
+    // Parks the vCPU thread until its WFI/WFE completes or another thread
+    // needs it at a sync point. Costs no host CPU while the guest idles.
+    void waitForWakeup(VCPU& vcpu) {
+        std::unique_lock<std::mutex> waitLock(vcpu.waitMtx);
+        vcpu.waitCv.wait(waitLock, [this, &vcpu]() {
+            return wakeupPending(vcpu) || vcpu.exitRequest.load(std::memory_order_acquire) != 0;
+        });
+    }
+    
+    // WFI completes on any pending interrupt, even a masked one; WFE also
+    // on an event
+    bool wakeupPending(VCPU& vcpu) {
+        bool wake = pendingUnacknowledged(vcpu) != 0 ||
+                    (vcpu.waitState == VCPU_WAIT_EVENT && vcpu.eventRegister.exchange(false, std::memory_order_acq_rel));
+        if (wake) {
+            vcpu.waitState = VCPU_RUNNING;
+        }
+        return wake;
+    }
+    
+    static uint32_t pendingUnacknowledged(const VCPU& vcpu) {
+        return vcpu.pendingInterrupts.load(std::memory_order_acquire) & ~static_cast<uint32_t>(vcpu.state.gic.active);
+    }
+    
+    // Interrupts the CPU interface signals to the core, before PSTATE.I
+    static uint32_t signalledInterrupts(const VCPU& vcpu) {
+        if (!(vcpu.state.gic.igrpen1 & 1)) {
+            return 0;
+        }
+        return pendingUnacknowledged(vcpu);
+    }
+    
+    // Takes the IRQ exception at a block boundary if an unmasked interrupt
+    // is signalled. Without a vector table it stays pending.
+    void deliverInterrupt(VCPU& vcpu) {
+        CPUState& state = vcpu.state;
+        refreshTimerLine(vcpu);
+        if ((state.daif & PSTATE_I) || signalledInterrupts(vcpu) == 0 || state.el1.vbar == 0) {
+            return;
+        }
+        
+        state.el1.spsr = materializeFlags(state) | state.daif | PSTATE_EL1H;
+        state.el1.elr = state.pc;
+        state.daif = PSTATE_DAIF;
+        state.pc = state.el1.vbar + VECTOR_CURRENT_SPX_IRQ;
+        vcpu.waitState = VCPU_RUNNING;
+    }
+    
+    // After the guest may have unmasked something: ask for delivery at the
+    // next block boundary
+    void recheckInterrupts(VCPU& vcpu) {
+        if (!(vcpu.state.daif & PSTATE_I) && signalledInterrupts(vcpu) != 0) {
+            vcpu.exitRequest.fetch_or(VCPU_EXIT_INTERRUPT, std::memory_order_release);
+        }
+    }
+    
+    // ICC_IAR1_EL1: the lowest signalled ID becomes active
+    uint64_t acknowledgeInterrupt(VCPU& vcpu) {
+        refreshTimerLine(vcpu);
+        uint32_t signalled = signalledInterrupts(vcpu);
+        if (signalled == 0) {
+            return INTID_SPURIOUS;
+        }
+        
+        uint32_t intid = __builtin_ctz(signalled);
+        vcpu.pendingInterrupts.fetch_and(~(1u << intid), std::memory_order_acq_rel);
+        vcpu.state.gic.active |= 1ull << intid;
+        return intid;
+    }
+    
+    // ICC_EOIR1_EL1. The timer is level-triggered, so it pends again right
+    // away if the guest did not reprogram it.
+    void endInterrupt(VCPU& vcpu, uint64_t intid) {
+        if (intid >= 32) {
+            return;
+        }
+        vcpu.state.gic.active &= ~(1ull << intid);
+        if (intid == IRQ_VIRTUAL_TIMER) {
+            updateTimer(vcpu);
+        }
+        recheckInterrupts(vcpu);
+    }
+    
+    static bool timerAsserted(const CPUState& state, uint64_t now) {
+        return (state.timer.ctl & (TIMER_ENABLE | TIMER_IMASK)) == TIMER_ENABLE && now >= state.timer.cval;
+    }
+    
+    // Brings the timer line and the armed deadline in line with the timer
+    // registers after the guest changed them
+    void updateTimer(VCPU& vcpu) {
+        const CPUState& state = vcpu.state;
+        uint32_t line = 1u << IRQ_VIRTUAL_TIMER;
+        
+        if (timerAsserted(state, guestCounter())) {
+            timers->disarm(vcpu.id);
+            vcpu.pendingInterrupts.fetch_or(line, std::memory_order_release);
+            vcpu.exitRequest.fetch_or(VCPU_EXIT_INTERRUPT, std::memory_order_release);
+            return;
+        }
+        
+        vcpu.pendingInterrupts.fetch_and(~line, std::memory_order_release);
+        if ((state.timer.ctl & (TIMER_ENABLE | TIMER_IMASK)) == TIMER_ENABLE) {
+            timers->arm(vcpu.id, state.timer.cval);
+        } else {
+            timers->disarm(vcpu.id);
+        }
+    }
+    
+    // Drops a timer interrupt that an expiry raised just before the guest
+    // moved the deadline
+    void refreshTimerLine(VCPU& vcpu) {
+        uint32_t line = 1u << IRQ_VIRTUAL_TIMER;
+        if ((vcpu.pendingInterrupts.load(std::memory_order_acquire) & line) &&
+            !timerAsserted(vcpu.state, guestCounter())) {
+            vcpu.pendingInterrupts.fetch_and(~line, std::memory_order_acq_rel);
+        }
+    }
+    
+    // Runs on the timer thread
+    void timerExpired(VCPU& vcpu) {
+        raiseExternal(vcpu, 1u << IRQ_VIRTUAL_TIMER);
+    }
+    
+    // Interrupt lines raised by a thread other than the vCPU's own. While
+    // recording they reach the guest through the trace, at a dispatcher
+    // boundary of the vCPU they are for.
+    void raiseExternal(VCPU& vcpu, uint32_t lines) {
+        ReplayMode mode = replayMode.load(std::memory_order_acquire);
+        if (mode == ReplayMode::Off) {
+            vcpu.pendingInterrupts.fetch_or(lines, std::memory_order_release);
+            vcpu.exitRequest.fetch_or(VCPU_EXIT_INTERRUPT, std::memory_order_release);
+            kick(vcpu);
+        } else if (mode == ReplayMode::Record) {
+            // Whoever holds the token may be idle waiting for this
+            vcpu.externalInterrupts.fetch_or(lines, std::memory_order_release);
+            for (auto& other : vcpus) {
+                kick(*other);
+            }
+        }
+    }
+    
+    void takeExternalInterrupts(VCPU& vcpu, uint32_t lines) {
+        vcpu.pendingInterrupts.fetch_or(lines, std::memory_order_release);
+        vcpu.exitRequest.fetch_or(VCPU_EXIT_INTERRUPT, std::memory_order_release);
+    }
+    
+    // CNTVCT_EL0 as the guest sees it. Recording logs every read and a
+    // replay returns the logged values, so guest time repeats exactly.
+    uint64_t guestCounter() {
+        ReplayMode mode = replayMode.load(std::memory_order_relaxed);
+        uint64_t now;
+        if (mode == ReplayMode::Replay) {
+            if (replayLog->takeValue(now)) {
+                return now;
+            }
+            replayDivergence("counter read not in the trace");
+        }
+        now = GuestCounter::now();
+        if (mode == ReplayMode::Record) {
+            replayLog->value(now);
+        }
+        return now;
+    }
+    
+    // Host calls that change guest state behind the guest's back cannot be
+    // replayed
+    bool replayInactive(const char* action) {
+        if (replayMode.load() != ReplayMode::Off) {
+            LOGE("Cannot %s while recording or replaying", action);
+            return false;
+        }
+        return true;
+    }
+    
+    TraceHeader traceHeader() const {
+        TraceHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ReplayLog::MAGIC, sizeof(header.magic));
+        header.version = ReplayLog::VERSION;
+        header.numVcpus = static_cast<uint32_t>(vcpus.size());
+        header.memorySize = memorySize;
+        header.executionMode = static_cast<uint32_t>(getExecutionMode());
+        header.memoryBackend = static_cast<uint32_t>(memoryBackend);
+        return header;
+    }
+    
+    // Recording and replay start from the same place: the state of a
+    // snapshot, with cold caches and nothing retired, so every dispatcher
+    // iteration lines up
+    void beginTrace(std::unique_ptr<ReplayLog> log, ReplayMode mode) {
+        clearBlockCache();
+        flushJit();
+        for (auto& vcpu : vcpus) {
+            vcpu->tlb.flush();
+            clearExclusive(*vcpu);
+            vcpu->retired.store(0, std::memory_order_relaxed);
+            vcpu->externalInterrupts.store(0, std::memory_order_relaxed);
+            vcpu->replaySteps = 0;
+        }
+        replayLog = std::move(log);
+        tokenHolder.store(-1, std::memory_order_relaxed);
+        replayStarted = false;
+        replayFinished = false;
+        replayDiverged = false;
+        replayMode.store(mode);
+    }
+    
+    void endTrace() {
+        replayMode.store(ReplayMode::Off);
+        replayLog.reset();
+        tokenHolder.store(-1, std::memory_order_relaxed);
+        replayStarted = false;
+        for (auto& vcpu : vcpus) {
+            // Raised while recording but never logged
+            uint32_t lines = vcpu->externalInterrupts.exchange(0, std::memory_order_relaxed);
+            vcpu->pendingInterrupts.fetch_or(lines, std::memory_order_relaxed);
+        }
+    }
+    
+    enum ReplayStep {
+        REPLAY_RUN,         // carry on with this iteration
+        REPLAY_YIELD,       // token passed on
+        REPLAY_EXIT         // trace over, leave the dispatch loop
+    };
+    
+    // Start of every dispatcher iteration while recording or replaying.
+    // Iterations are counted so that events land on the same one again.
+    bool replayEnter(VCPU& vcpu) {
+        if (!waitForToken(vcpu)) {
+            return false;
+        }
+        // A recording may have stopped before this vCPU ran with the
+        // token it was just handed
+        if (replayMode.load(std::memory_order_relaxed) == ReplayMode::Replay &&
+            replayEvents(vcpu) == REPLAY_EXIT) {
+            return false;
+        }
+        vcpu.replaySteps++;
+        return true;
+    }
+    
+    // After the sync point, where a stopped recording ends
+    ReplayStep replayBoundary(VCPU& vcpu) {
+        if (replayMode.load(std::memory_order_relaxed) == ReplayMode::Record) {
+            return recordBoundary(vcpu);
+        }
+        return replayEvents(vcpu);
+    }
+    
+    // Blocks until this vCPU holds the run token. Waiting counts as
+    // parked, so pauses and exclusive sections do not wait on it.
+    bool waitForToken(VCPU& vcpu) {
+        if (tokenHolder.load(std::memory_order_acquire) == vcpu.id) {
+            return true;
+        }
+        std::unique_lock<std::mutex> syncLock(syncMtx);
+        parkedVcpus++;
+        syncCv.notify_all();
+        syncCv.wait(syncLock, [this, &vcpu]() {
+            return (tokenHolder.load(std::memory_order_relaxed) == vcpu.id && !pauseRequested) ||
+                   replayFinished || !running;
+        });
+        parkedVcpus--;
+        return !replayFinished && running;
+    }
+    
+    void passToken(int target) {
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            tokenHolder.store(target, std::memory_order_release);
+            if (target >= 0) {
+                sliceStart = vcpus[target]->retired.load(std::memory_order_relaxed);
+            }
+        }
+        syncCv.notify_all();
+    }
+    
+    // Takes in interrupts raised from outside and moves on to another vCPU
+    // once this one has used its quantum or has nothing to do
+    ReplayStep recordBoundary(VCPU& vcpu) {
+        uint32_t external = vcpu.externalInterrupts.exchange(0, std::memory_order_acq_rel);
+        if (external != 0) {
+            replayLog->event(TRACE_INTERRUPT, vcpu.id, vcpu.replaySteps, external);
+            takeExternalInterrupts(vcpu, external);
+        }
+        
+        bool idle = vcpu.waitState != VCPU_RUNNING && !canWake(vcpu);
+        if (idle || vcpu.retired.load(std::memory_order_relaxed) - sliceStart >= REPLAY_QUANTUM) {
+            int next = nextVcpu(vcpu, true);
+            if (next >= 0) {
+                replayLog->event(TRACE_SWITCH, vcpu.id, vcpu.replaySteps, next + 1);
+                passToken(next);
+                return REPLAY_YIELD;
+            }
+            sliceStart = vcpu.retired.load(std::memory_order_relaxed);
+        }
+        return REPLAY_RUN;
+    }
+    
+    // Applies the events recorded at this iteration
+    ReplayStep replayEvents(VCPU& vcpu) {
+        TraceEvent event;
+        while (!replayDiverged) {
+            if (!replayLog->peek(vcpu.id, event)) {
+                LOGI("Replay reached the end of a truncated trace");
+                finishReplay();
+                return REPLAY_EXIT;
+            }
+            if (event.type == TRACE_VALUE || event.step > vcpu.replaySteps) {
+                return REPLAY_RUN;
+            }
+            if (event.step < vcpu.replaySteps) {
+                break;
+            }
+            
+            replayLog->consume(vcpu.id);
+            if (event.type == TRACE_INTERRUPT) {
+                takeExternalInterrupts(vcpu, static_cast<uint32_t>(event.arg));
+            } else if (event.type == TRACE_SWITCH && event.arg != 0) {
+                passToken(static_cast<int>(event.arg - 1));
+                return REPLAY_YIELD;
+            } else if (event.type == TRACE_SWITCH) {
+                // Every vCPU halted; only the end marker is left
+                if (replayLog->peek(vcpu.id, event) && event.type == TRACE_END) {
+                    checkFinalState(event.arg);
+                }
+                finishReplay();
+                return REPLAY_EXIT;
+            } else {
+                checkFinalState(event.arg);
+                finishReplay();
+                return REPLAY_EXIT;
+            }
+        }
+        
+        replayDivergence("event missed");
+        finishReplay();
+        return REPLAY_EXIT;
+    }
+    
+    // A vCPU that halts while holding the token hands it on. That counts
+    // as an iteration of its own, so a replay does not take the switch
+    // before running the instruction that halted.
+    void replayExit(VCPU& vcpu) {
+        if (tokenHolder.load(std::memory_order_acquire) != vcpu.id || !running) {
+            return;
+        }
+        vcpu.replaySteps++;
+        if (replayMode.load(std::memory_order_relaxed) == ReplayMode::Replay) {
+            replayEvents(vcpu);
+            return;
+        }
+        
+        int next = nextVcpu(vcpu, true);
+        if (next < 0) {
+            next = nextVcpu(vcpu, false);
+        }
+        replayLog->event(TRACE_SWITCH, vcpu.id, vcpu.replaySteps, next + 1);
+        passToken(next);
+    }
+    
+    void finishReplay() {
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            replayFinished = true;
+            tokenHolder.store(-1, std::memory_order_relaxed);
+        }
+        syncCv.notify_all();
+    }
+    
+    void checkFinalState(uint64_t recorded) {
+        if (stateHash() == recorded) {
+            LOGI("Replay finished in the recorded state");
+        } else {
+            LOGE("Replay finished in a different state than recorded");
+        }
+    }
+    
+    void replayDivergence(const char* what) {
+        if (!replayDiverged) {
+            LOGE("Replay diverged from the trace: %s", what);
+            replayDiverged = true;
+        }
+    }
+    
+    // Next vCPU after self in round-robin order that has not halted and,
+    // with runnable set, has something to do
+    int nextVcpu(const VCPU& self, bool runnable) {
+        for (size_t i = 1; i < vcpus.size(); i++) {
+            const VCPU& other = *vcpus[(self.id + i) % vcpus.size()];
+            if (other.halted) {
+                continue;
+            }
+            if (!runnable || other.waitState == VCPU_RUNNING || canWake(other) ||
+                other.externalInterrupts.load(std::memory_order_acquire) != 0) {
+                return other.id;
+            }
+        }
+        return -1;
+    }
+    
+    // wakeupPending without consuming the event
+    static bool canWake(const VCPU& vcpu) {
+        return pendingUnacknowledged(vcpu) != 0 ||
+               (vcpu.waitState == VCPU_WAIT_EVENT && vcpu.eventRegister.load(std::memory_order_acquire));
+    }
+    
+    // Recording with the token holder idle and nobody else to run: sleep
+    // until an interrupt arrives for any vCPU
+    void waitForExternalInterrupt(VCPU& vcpu) {
+        std::unique_lock<std::mutex> waitLock(vcpu.waitMtx);
+        vcpu.waitCv.wait(waitLock, [this, &vcpu]() {
+            for (auto& other : vcpus) {
+                if (!other->halted && other->externalInterrupts.load(std::memory_order_acquire) != 0) {
+                    return true;
+                }
+            }
+            return vcpu.exitRequest.load(std::memory_order_acquire) != 0;
+        });
+    }
+    
+    // Registers and retired count of every vCPU, to check that a replay
+    // ended where the recording did
+    uint64_t stateHash() const {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const void* data, size_t size) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; i++) {
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+            }
+        };
+        for (const auto& vcpu : vcpus) {
+            const CPUState& state = vcpu->state;
+            uint64_t nzcv = currentNzcv(state);
+            uint64_t retired = vcpu->retired.load(std::memory_order_relaxed);
+            mix(state.registers, sizeof(state.registers));
+            mix(&state.pc, sizeof(state.pc));
+            mix(&nzcv, sizeof(nzcv));
+            mix(state.vregs, sizeof(state.vregs));
+            mix(&retired, sizeof(retired));
+        }
+        return hash;
+    }
+    
+    // Host-mapped memory needs a 64-bit address space for its window, and
+    // RAM that ends on a host page so the guard starts right after it
+    static MemoryBackend usableBackend(MemoryBackend requested, size_t memSize) {
+        if (requested != MemoryBackend::HostMapped) {
+            return MemoryBackend::SoftMmu;
+        }
+        if (sizeof(void*) < 8 || memSize > HostAccessGuard::WINDOW ||
+            memSize % static_cast<size_t>(sysconf(_SC_PAGESIZE)) != 0) {
+            LOGE("Host-mapped memory unavailable for this configuration, using the soft MMU");
+            return MemoryBackend::SoftMmu;
+        }
+        return MemoryBackend::HostMapped;
+    }
+    
+    // Blocks of flat code can be translated with host-mapped accesses
+    bool flatMemory(const VCPU& vcpu) const {
+        return memoryBackend == MemoryBackend::HostMapped && !(vcpu.state.sys.sctlr & SoftMMU::SCTLR_M);
+    }
+    
+    // Runs fn with the vCPU's host-mapped accesses armed. An access that
+    // lands in the guard region unwinds straight back here and becomes a
+    // data abort, so nothing fn calls may own resources across a guest
+    // memory access. Returns false when that happened.
+    template <typename F>
+    bool runGuarded(VCPU& vcpu, F fn) {
+        if (memoryBackend != MemoryBackend::HostMapped) {
+            fn();
+            return true;
+        }
+        
+        HostAccessGuard& guard = vcpu.guard;
+        if (sigsetjmp(guard.env, 0) != 0) {
+            HostFaultHandler::unblock();
+            bool write = guard.access & HostAccessGuard::ACCESS_WRITE;
+            MMUFault fault = { guard.faultAddress, write ? MMU_WRITE : MMU_READ, MMU_FAULT_ADDRESS_SIZE, 0 };
+            vcpu.state.pc = takeAbort(vcpu, fault, guard.access & ~HostAccessGuard::ACCESS_WRITE);
+            return false;
+        }
+        guard.armed = true;
+        fn();
+        guard.armed = false;
+        return true;
+    }
+    
+    void clearBlockCache() {
+        std::unique_lock<std::shared_mutex> cacheLock(blockCacheMtx);
+        blockCache.clear();
+    }
+    
+    void flushJit() {
+        if (jit) {
+            jit->flush();
+            jitFlushPending.store(false, std::memory_order_relaxed);
+        }
+    }
+    
+    // Asks for every translation to be dropped. The flush itself happens
+    // at the next dispatcher iteration, once no vCPU is in translated code.
+    void requestJitFlush() {
+        if (jit) {
+            jitFlushPending.store(true, std::memory_order_release);
+        }
+    }
+    
+    // Trampoline for ops the JIT leaves to the interpreter. Returns non-zero
+    // when the translated block must exit to ctx->exitPc.
+    static uint64_t jitInterpret(JitContext* ctx, uint64_t opLo, uint64_t opHi, uint64_t pc) {
+        CPUEmulator* self = static_cast<CPUEmulator*>(ctx->owner);
+        VCPU& vcpu = *static_cast<VCPU*>(ctx->vcpu);
+        
+        uint64_t nextPc = pc + 4;
+        MicroOp op = unpackMicroOp(opLo, opHi);
+        if (self->profiler->isEnabled()) {
+            self->profiler->countOp(vcpu.id, op.kind);
+        }
+        if (self->executeOp(vcpu, op, pc, nextPc) && !vcpu.halted) {
+            return 0;
+        }
+        ctx->exitPc = nextPc;
+        return 1;
+    }
+    
+    static JitKey jitKey(const VCPU& vcpu, uint64_t pc) {
+        const SystemRegisters& sys = vcpu.state.sys;
+        if (!(sys.sctlr & SoftMMU::SCTLR_M)) {
+            return { pc, ~0ull, ~0ull };
+        }
+        return { pc, sys.ttbr0, sys.ttbr1 };
+    }
+    
+    // Runs the translation for the current PC, if there is one, and chains
+    // the exit it took to the next translation.
+    bool runTranslated(VCPU& vcpu, JitContext& ctx) {
+        const uint8_t* entry = jit->lookup(jitKey(vcpu, vcpu.state.pc));
+        if (entry == nullptr) {
+            return false;
+        }
+        
+        __atomic_store_n(&ctx.budget, JitTranslator::CHAIN_BUDGET, __ATOMIC_RELAXED);
+        ctx.chainSite = 0;
+        ctx.retired = 0;
+        vcpu.state.pc = jit->enter(ctx, entry);
+        retire(vcpu, ctx.retired);
+        
+        if (ctx.chainSite != 0 && !jitFlushPending.load(std::memory_order_relaxed)) {
+            jit->chain(ctx.chainSite, jitKey(vcpu, vcpu.state.pc));
+        }
+        return true;
+    }
+    
+    std::shared_ptr<const DecodedBlock> lookupBlock(uint64_t pc, uint64_t physPc) {
+        {
+            std::shared_lock<std::shared_mutex> cacheLock(blockCacheMtx);
+            std::shared_ptr<const DecodedBlock> block = blockCache.lookup(pc);
+            if (block && block->physPc == physPc) {
+                return block;
+            }
+        }
+        return decodeBlock(pc, physPc);
+    }
+    
+    // Backs loadElf and, with process, loadLinuxProcess
+    bool loadImage(const std::string& path, const std::vector<std::string>& args,
+                   const std::vector<std::string>& env, bool process) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!replayInactive("load a program")) {
+            return false;
+        }
+        ScopedPause pause(*this);
+        
+        memory.reset();
+        userMode.reset();
+        ElfImage image;
+        std::string error;
+        bool loaded = process ? ElfLoader::loadProcess(path, args, env, true, memory, image, error) :
+                                ElfLoader::load(path, memory, image, error);
+        if (!loaded) {
+            LOGE("Failed to load %s: %s", path.c_str(), error.c_str());
+            memory.reset();
+            return false;
+        }
+        if (process) {
+            userMode.reset(new LinuxSyscalls(memory, vcpus.size(), path, image.end, [this](uint64_t addr, uint64_t size) {
+                deviceWrote(addr, size);
+            }));
+            exitStatus.store(-1, std::memory_order_release);
+        }
+        lastSnapshotPath.clear();
+        clearBlockCache();
+        flushJit();
+        
+        for (auto& vcpu : vcpus) {
+            memset(&vcpu->state, 0, sizeof(vcpu->state));
+            vcpu->state.daif = PSTATE_DAIF;
+            vcpu->state.pc = image.entry;
+            vcpu->state.registers[REG_SP] = image.stackPointer;
+            vcpu->halted = vcpu->id != 0;
+            vcpu->waitState = VCPU_RUNNING;
+            vcpu->pendingInterrupts.store(0, std::memory_order_relaxed);
+            vcpu->tlb.flush();
+            clearExclusive(*vcpu);
+        }
+        timers->disarmAll();
+        
+        LOGI("Loaded %s, entry 0x%llx, %zu symbols", path.c_str(),
+             static_cast<unsigned long long>(image.entry), image.symbols.size());
+        profiler->setSymbols(std::move(image.symbols));
+        return true;
+    }
+    
+    void executeThread(VCPU& vcpu) {
+        LOGI("vCPU %d started", vcpu.id);
+        bindVcpu(vcpu);
+        dispatch(vcpu, 0);
+        unbindVcpu();
+        vcpuFinished(vcpu);
+    }
+    
+    // One turn of a pooled vCPU on a worker thread. Between turns it counts
+    // as parked, so it is only picked up again once a pause is over.
+    VcpuScheduler::SliceResult runSlice(VCPU& vcpu) {
+        {
+            std::unique_lock<std::mutex> syncLock(syncMtx);
+            syncCv.wait(syncLock, [this]() {
+                return !pauseRequested || !running;
+            });
+            parkedVcpus--;
+        }
+        
+        bindVcpu(vcpu);
+        VcpuScheduler::SliceResult result = dispatch(vcpu, SLICE_INSTRUCTIONS);
+        unbindVcpu();
+        if (result == VcpuScheduler::SLICE_EXIT) {
+            vcpuFinished(vcpu);
+            return result;
+        }
+        
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            parkedVcpus++;
+        }
+        syncCv.notify_all();
+        return result;
+    }
+    
+    // Points the calling host thread at vcpu
+    void bindVcpu(VCPU& vcpu) {
+        JitContext& ctx = vcpu.jit;
+        ctx.regs = vcpu.state.registers;
+        ctx.interpret = &CPUEmulator::jitInterpret;
+        ctx.owner = this;
+        ctx.vcpu = &vcpu;
+        ctx.access = &vcpu.guard.access;
+        ctx.memoryBase = memory.data();
+        ctx.dirtyPages = memory.dirtyMap();
+        ctx.codeMap = blockCache.codeMap();
+        
+        if (memoryBackend == MemoryBackend::HostMapped) {
+            vcpu.guard.begin = reinterpret_cast<uintptr_t>(memory.data());
+            vcpu.guard.end = vcpu.guard.begin + memory.reserved();
+            HostFaultHandler::current() = &vcpu.guard;
+        }
+    }
+    
+    void unbindVcpu() {
+        HostFaultHandler::current() = nullptr;
+        HostFpEnvironment::reset();
+    }
+    
+    void vcpuFinished(VCPU& vcpu) {
+        if (replayMode.load(std::memory_order_relaxed) != ReplayMode::Off) {
+            replayExit(vcpu);
+        }
+        vcpuExited();
+        LOGI("vCPU %d stopped", vcpu.id);
+        if (userMode) {
+            // Last, as clone() may restart the vCPU from here on
+            userMode->releaseThread(vcpu.id, vcpu.halted);
+        }
+    }
+    
+    // The dispatcher loop. With a slice length it returns once the vCPU
+    // has retired that many instructions, or has nothing to do until it is
+    // woken, instead of sleeping on the host thread; without one it only
+    // returns when the vCPU stops.
+    VcpuScheduler::SliceResult dispatch(VCPU& vcpu, uint64_t slice) {
+        JitContext& ctx = vcpu.jit;
+        uint64_t sliceEnd = vcpu.retired.load(std::memory_order_relaxed) + slice;
+        
+        while (!vcpu.halted) {
+            bool tracing = replayMode.load(std::memory_order_relaxed) != ReplayMode::Off;
+            if (tracing && !replayEnter(vcpu)) {
+                break;
+            }
+            if (vcpu.exitRequest.load(std::memory_order_relaxed) && !syncPoint(vcpu)) {
+                break;
+            }
+            if (tracing) {
+                ReplayStep step = replayBoundary(vcpu);
+                if (step == REPLAY_YIELD) {
+                    continue;
+                }
+                if (step == REPLAY_EXIT) {
+                    break;
+                }
+            }
+            if (budgetExhausted(vcpu)) {
+                LOGI("vCPU %d reached its instruction budget", vcpu.id);
+                vcpu.halted = true;
+                break;
+            }
+            if (vcpu.waitState != VCPU_RUNNING) {
+                ReplayMode mode = replayMode.load(std::memory_order_relaxed);
+                if (mode == ReplayMode::Off && slice != 0) {
+                    // A kick after this check wakes the task again
+                    if (!wakeupPending(vcpu) && vcpu.exitRequest.load(std::memory_order_acquire) == 0) {
+                        return VcpuScheduler::SLICE_BLOCK;
+                    }
+                } else if (mode == ReplayMode::Off) {
+                    waitForWakeup(vcpu);
+                } else if (!wakeupPending(vcpu) && mode == ReplayMode::Record) {
+                    waitForExternalInterrupt(vcpu);
+                }
+                continue;
+            }
+            if (slice != 0 && (vcpu.retired.load(std::memory_order_relaxed) >= sliceEnd || vcpu.syscallBlocked)) {
+                vcpu.syscallBlocked = false;
+                return VcpuScheduler::SLICE_YIELD;
+            }
+            
+            // Translate the PC first so every tier sees a valid, executable
+            // mapping; on a TLB hit this is a single compare.
+            uint64_t physPc;
+            MMUFault fault = {};
+            if (vcpu.state.pc & 3) {
+                vcpu.state.el1.far = vcpu.state.pc;
+                vcpu.state.pc = takeException(vcpu, EC_PC_ALIGNMENT, 0, vcpu.state.pc, vcpu.state.pc);
+                continue;
+            }
+            if (!mmu.fetchAddress(vcpu.tlb, vcpu.state.sys, vcpu.state.pc, physPc, fault)) {
+                vcpu.state.pc = takeAbort(vcpu, fault, vcpu.state.pc);
+                continue;
+            }
+            
+            if (jit) {
+                if (jitFlushPending.load(std::memory_order_acquire)) {
+                    runExclusive(vcpu, [this]() {
+                        flushJit();
+                    });
+                    continue;
+                }
+                bool translated = false;
+                if (!runGuarded(vcpu, [&]() { translated = runTranslated(vcpu, ctx); })) {
+                    // Aborted inside translated code; count the blocks entered
+                    retire(vcpu, ctx.retired);
+                    continue;
+                }
+                if (translated) {
+                    continue;
+                }
+            }
+            
+            std::shared_ptr<const DecodedBlock> block = lookupBlock(vcpu.state.pc, physPc);
+            
+            if (jit) {
+                // A block someone else translated skips the warm-up
+                uint32_t runs = block->execCount.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (runs == 1 && sharingCode() && translateBlock(vcpu, *block, true)) {
+                    continue;
+                }
+                if (runs == JitTranslator::HOT_THRESHOLD) {
+                    if (translateBlock(vcpu, *block, false)) {
+                        continue;
+                    }
+                    // Code cache is full; start over with an empty one
+                    requestJitFlush();
+                }
+            }
+            
+            runGuarded(vcpu, [&]() {
+                vcpu.state.pc = executeBlock(vcpu, *block);
+            });
+        }
+        return VcpuScheduler::SLICE_EXIT;
+    }
+    
+    bool sharingCode() const {
+        return sharedCode && replayMode.load(std::memory_order_relaxed) == ReplayMode::Off;
+    }
+    
+    // What shared entries depend on besides the cache format: the compiler
+    // this was built with and the layouts and granularities that decoded
+    // blocks and translated code bake in
+    static uint64_t codeCacheBuildId() {
+        const uint64_t layout[] = {
+            sizeof(MicroOp), sizeof(JitContext), BlockCache::PAGE_SHIFT, BlockCache::CODE_GRANULE_SHIFT,
+            BlockCache::MAX_BLOCK_OPS, GuestMemory::PAGE_SHIFT, sizeof(Vec128)
+        };
+#if defined(__VERSION__)
+        const char compiler[] = __VERSION__;
+#else
+        const char compiler[] = "";
+#endif
+        return SharedCodeCache::hashCode(reinterpret_cast<const uint8_t*>(layout), sizeof(layout)) ^
+               SharedCodeCache::hashCode(reinterpret_cast<const uint8_t*>(compiler), sizeof(compiler));
+    }
+    
+    // Bytes of code a block at physPc can span: up to the end of the page
+    // and at most MAX_BLOCK_OPS instructions. Everything a decoded block or
+    // its translation holds follows from these and the PC.
+    size_t codeWindow(uint64_t physPc) const {
+        uint64_t pageEnd = (physPc & ~(BlockCache::PAGE_SIZE - 1)) + BlockCache::PAGE_SIZE;
+        if (pageEnd > memorySize) {
+            pageEnd = memorySize;
+        }
+        return std::min<uint64_t>(pageEnd - physPc, BlockCache::MAX_BLOCK_BYTES);
+    }
+    
+    // Decodes from an already translated PC. The block stops at the end of
+    // the page, so one translation covers all of it.
+    std::shared_ptr<const DecodedBlock> decodeBlock(uint64_t pc, uint64_t physPc) {
+        auto block = std::make_unique<DecodedBlock>();
+        block->startPc = pc;
+        block->physPc = physPc;
+        
+        size_t size = codeWindow(physPc);
+        const uint8_t* code = memory.data() + physPc;
+        uint8_t window[BlockCache::MAX_BLOCK_BYTES];
+        bool sharing = sharingCode();
+        if (sharing) {
+            // Decode a copy, so the hash is of exactly what was decoded
+            memcpy(window, code, size);
+            code = window;
+            block->codeHash = SharedCodeCache::hashCode(window, size);
+        }
+        
+        if (!sharing || !loadSharedBlock(*block, code, size)) {
+            for (size_t offset = 0; offset + 4 <= size; offset += 4) {
+                uint32_t insn;
+                memcpy(&insn, code + offset, sizeof(insn));
+                MicroOp op = a64::decode(insn);
+                block->ops.push_back(op);
+                
+                if (endsBlock(op.kind)) {
+                    break;
+                }
+            }
+            if (sharing) {
+                sharedCode->publish(SHARED_DECODED, pc, block->codeHash, code, block->ops.size() * 4,
+                                    block->ops.data(), block->ops.size() * sizeof(MicroOp));
+            }
+        }
+        
+        block->endPc = pc + block->ops.size() * 4;
+        
+        std::unique_lock<std::shared_mutex> cacheLock(blockCacheMtx);
+        return blockCache.insert(std::move(block));
+    }
+    
+    bool loadSharedBlock(DecodedBlock& block, const uint8_t* code, size_t size) {
+        uint32_t payloadSize;
+        const uint8_t* ops = sharedCode->find(SHARED_DECODED, block.startPc, block.codeHash, code, size, payloadSize);
+        size_t count = payloadSize / sizeof(MicroOp);
+        if (ops == nullptr || count == 0 || count * 4 > size) {
+            return false;
+        }
+        block.ops.resize(count);
+        memcpy(block.ops.data(), ops, count * sizeof(MicroOp));
+        // Every instance sharing the file can write to it
+        for (const MicroOp& op : block.ops) {
+            if (!validOp(op)) {
+                block.ops.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Makes host code for a hot block. With a shared code cache, a
+    // translation of the same code by any instance is copied in instead,
+    // and new ones are offered to the others. sharedOnly skips translating
+    // here. False when there is no translation or the code cache is full.
+    bool translateBlock(VCPU& vcpu, const DecodedBlock& block, bool sharedOnly) {
+        JitKey key = jitKey(vcpu, block.startPc);
+        bool flat = flatMemory(vcpu);
+        
+        // A store to the block's code may have dropped it since it was
+        // looked up. Holding the lock keeps that from happening until the
+        // translation is indexed, where the next such store will find it.
+        std::shared_lock<std::shared_mutex> cacheLock(blockCacheMtx);
+        if (blockCache.lookup(block.startPc).get() != &block) {
+            return false;
+        }
+        
+        // Code that changed since the block was decoded is not shared
+        uint8_t window[BlockCache::MAX_BLOCK_BYTES];
+        size_t size = codeWindow(block.physPc);
+        bool sharing = sharingCode();
+        if (sharing) {
+            memcpy(window, memory.data() + block.physPc, size);
+            sharing = SharedCodeCache::hashCode(window, size) == block.codeHash;
+        }
+        if (!sharing) {
+            return !sharedOnly && jit->translate(block, key, flat) != nullptr;
+        }
+        
+        SharedCodeKind kind = flat ? SHARED_JIT_FLAT : SHARED_JIT;
+        uint32_t imageSize;
+        const uint8_t* shared = sharedCode->find(kind, block.startPc, block.codeHash, window, size, imageSize);
+        if (shared != nullptr) {
+            return jit->install(block, key, shared, imageSize) != nullptr;
+        }
+        if (sharedOnly) {
+            return false;
+        }
+        
+        std::vector<uint8_t> image;
+        if (jit->translate(block, key, flat, &image) == nullptr) {
+            return false;
+        }
+        if (!image.empty()) {
+            sharedCode->publish(kind, block.startPc, block.codeHash, window,
+                                static_cast<uint32_t>(block.endPc - block.startPc), image.data(), image.size());
+        }
+        return true;
+    }
+    
+    // Runs a decoded block and returns the next guest PC
+    uint64_t executeBlock(VCPU& vcpu, const DecodedBlock& block) {
+        uint64_t pc = block.startPc;
+        bool counting = profiler->isEnabled();
+        
+        for (size_t i = 0; i < block.ops.size(); i++) {
+            uint64_t nextPc = pc + 4;
+            if (counting) {
+                profiler->countOp(vcpu.id, block.ops[i].kind);
+            }
+            if (!executeOp(vcpu, block.ops[i], pc, nextPc)) {
+                retire(vcpu, i + 1);
+                return nextPc;
+            }
+            pc = nextPc;
+        }
+        
+        retire(vcpu, block.ops.size());
+        return block.endPc;
+    }
+    
+    // Takes a synchronous exception to EL1 and returns the PC to continue
+    // at. Without a vector table (VBAR_EL1 still zero) nothing could
+    // handle it, so the vCPU is halted instead.
+    uint64_t takeException(VCPU& vcpu, uint32_t ec, uint32_t iss, uint64_t returnPc, uint64_t pc) {
+        CPUState& state = vcpu.state;
+        uint64_t esr = (static_cast<uint64_t>(ec) << 26) | ESR_IL | iss;
+        if (state.el1.vbar == 0) {
+            LOGE("vCPU %d: unhandled exception at pc 0x%llx, ESR 0x%llx, FAR 0x%llx", vcpu.id,
+                 static_cast<unsigned long long>(pc), static_cast<unsigned long long>(esr),
+                 static_cast<unsigned long long>(state.el1.far));
+            if (userMode) {
+                // What the kernel would have sent the process
+                int signal = ec == EC_BRK64 ? SIGTRAP : ec == EC_UNKNOWN ? SIGILL :
+                             ec == EC_PC_ALIGNMENT || (ec == EC_DATA_ABORT && (iss & 0x3F) == ISS_ALIGNMENT_FAULT) ? SIGBUS :
+                             SIGSEGV;
+                exitProcess(vcpu, 128 + signal);
+            }
+            vcpu.halted = true;
+            return pc;
+        }
+        
+        state.el1.spsr = materializeFlags(state) | state.daif | PSTATE_EL1H;
+        state.el1.elr = returnPc;
+        state.el1.esr = esr;
+        state.daif = PSTATE_DAIF;
+        return state.el1.vbar + VECTOR_CURRENT_SPX_SYNC;
+    }
+    
+    // Turns a failed translation into an instruction or data abort
+    uint64_t takeAbort(VCPU& vcpu, const MMUFault& fault, uint64_t pc) {
+        // Fault status codes are grouped by type, four levels each
+        uint32_t iss = static_cast<uint32_t>((fault.type - MMU_FAULT_ADDRESS_SIZE) * 4 + fault.level);
+        if (fault.access == MMU_WRITE) {
+            iss |= ISS_WNR;
+        }
+        vcpu.state.el1.far = fault.address;
+        return takeException(vcpu, fault.access == MMU_EXEC ? EC_INSTRUCTION_ABORT : EC_DATA_ABORT, iss, pc, pc);
+    }
+    
+    uint64_t undefinedInstruction(VCPU& vcpu, uint64_t pc) {
+        return takeException(vcpu, EC_UNKNOWN, 0, pc, pc);
+    }
+    
+    // An SVC of the user mode process: the call number is in x8, its
+    // arguments in x0-x5 and the result goes to x0. Returns the PC to
+    // continue at, which is the SVC again for a call that has to be
+    // restarted after a stop or pause.
+    uint64_t systemCall(VCPU& vcpu, uint64_t pc) {
+        uint64_t* x = vcpu.state.registers;
+        int64_t result;
+        switch (x[8]) {
+            case LINUX_CLONE:
+                result = cloneThread(vcpu, pc);
+                break;
+            case LINUX_EXIT:
+                if (userMode->exitThread(vcpu.id) == 0) {
+                    exitProcess(vcpu, static_cast<int>(x[0] & 0xFF));
+                }
+                vcpu.halted = true;
+                return pc;
+            case LINUX_EXIT_GROUP:
+                exitProcess(vcpu, static_cast<int>(x[0] & 0xFF));
+                return pc;
+            case LINUX_KILL:
+            case LINUX_TKILL:
+            case LINUX_TGKILL:
+                result = sendSignal(vcpu);
+                break;
+            default:
+                if (userMode->call(vcpu.id, x, result, vcpu.exitRequest, pooled) == SYSCALL_RESTART) {
+                    vcpu.syscallBlocked = pooled;
+                    return pc;
+                }
+                break;
+        }
+        x[0] = static_cast<uint64_t>(result);
+        return vcpu.halted ? pc : pc + 4;
+    }
+    
+    // clone() of a thread, which runs on a vCPU no other thread uses.
+    // New processes (fork) are not supported.
+    int64_t cloneThread(VCPU& parent, uint64_t pc) {
+        const uint64_t* x = parent.state.registers;
+        uint64_t flags = x[0];
+        const uint64_t thread = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD;
+        if ((flags & thread) != thread || (flags & CLONE_VFORK)) {
+            return -ENOSYS;
+        }
+        int id = userMode->claimThread();
+        if (id < 0) {
+            return -EAGAIN;
+        }
+        
+        VCPU& child = *vcpus[id];
+        child.state = parent.state;
+        child.state.registers[0] = 0;
+        if (x[1] != 0) {
+            child.state.registers[REG_SP] = x[1];
+        }
+        if (flags & CLONE_SETTLS) {
+            for (size_t i = 0; i < STORED_SYSREG_COUNT; i++) {
+                if (STORED_SYSREGS[i] == a64::TPIDR_EL0) {
+                    child.state.storedSysregs[i] = x[3];
+                }
+            }
+        }
+        child.state.pc = pc + 4;
+        child.halted = false;
+        child.waitState = VCPU_RUNNING;
+        child.pendingInterrupts.store(0, std::memory_order_relaxed);
+        child.tlb.flush();
+        clearExclusive(child);
+        
+        if ((flags & CLONE_PARENT_SETTID) && !userMode->storeTid(x[2], id)) {
+            userMode->releaseThread(id, true);
+            return -EFAULT;
+        }
+        if (flags & CLONE_CHILD_SETTID) {
+            userMode->storeTid(x[4], id);
+        }
+        userMode->setClearChildTid(id, (flags & CLONE_CHILD_CLEARTID) ? x[4] : 0);
+        
+        std::lock_guard<std::mutex> syncLock(syncMtx);
+        if (!running || exitStatus.load(std::memory_order_acquire) >= 0) {
+            userMode->releaseThread(id, true);
+            return -EAGAIN;
+        }
+        // It joins a pause that is already under way at its first block
+        activeVcpus++;
+        child.exitRequest.store(pauseRequested ? static_cast<uint32_t>(VCPU_EXIT_PAUSE) : 0u, std::memory_order_release);
+        if (pooled) {
+            parkedVcpus++;
+            scheduler->spawn(id);
+        } else {
+            // The thread that ran the slot before is past its last use of
+            // syncMtx once the slot is free
+            if (child.thread.joinable()) {
+                child.thread.join();
+            }
+            child.thread = std::thread([this, &child]() {
+                executeThread(child);
+            });
+        }
+        return userMode->tid(id);
+    }
+    
+    // Ends the user mode process. The other vCPUs halt at their next block
+    // boundary, including those blocked in system calls, as these give up
+    // at the exit request.
+    void exitProcess(VCPU& self, int status) {
+        {
+            std::lock_guard<std::mutex> syncLock(syncMtx);
+            int none = -1;
+            if (exitStatus.compare_exchange_strong(none, status, std::memory_order_acq_rel)) {
+                LOGI("Process exited with status %d", status);
+            }
+            for (auto& vcpu : vcpus) {
+                if (vcpu.get() != &self) {
+                    vcpu->exitRequest.fetch_or(VCPU_EXIT_HALT, std::memory_order_release);
+                }
+            }
+        }
+        for (auto& vcpu : vcpus) {
+            if (vcpu.get() != &self) {
+                kick(*vcpu);
+            }
+        }
+        self.halted = true;
+    }
+    
+    // kill(), tkill() and tgkill() within the process. Signals are never
+    // delivered: one that would not end the process is dropped, any other
+    // ends it as its default action would.
+    int64_t sendSignal(VCPU& vcpu) {
+        const uint64_t* x = vcpu.state.registers;
+        int64_t target = static_cast<int32_t>(x[0]);
+        int signal = static_cast<int>(x[x[8] == LINUX_TGKILL ? 2 : 1]);
+        if (signal < 0 || signal >= _NSIG) {
+            return -EINVAL;
+        }
+        if (x[8] == LINUX_KILL) {
+            if (target != 0 && target != userMode->processId()) {
+                // Other host processes are not the guest's to signal
+                return -EPERM;
+            }
+        } else {
+            int64_t tid = x[8] == LINUX_TGKILL ? static_cast<int32_t>(x[1]) : target;
+            if ((x[8] == LINUX_TGKILL && target != userMode->processId()) || userMode->threadOf(tid) < 0) {
+                return -ESRCH;
+            }
+        }
+        if (signal != 0 && !userMode->signalDropped(signal)) {
+            LOGE("vCPU %d: process killed by signal %d", vcpu.id, signal);
+            exitProcess(vcpu, 128 + signal);
+        }
+        return 0;
+    }
+    
+    // Drops cached translations after the guest changed its page tables.
+    // Other vCPUs flush at their next block boundary.
+    void flushTlbs(VCPU& self) {
+        self.tlb.flush();
+        for (auto& vcpu : vcpus) {
+            if (vcpu.get() != &self) {
+                vcpu->exitRequest.fetch_or(VCPU_EXIT_TLB_FLUSH, std::memory_order_release);
+            }
+        }
+        requestJitFlush();
+    }
+    
+    bool readSysreg(VCPU& vcpu, uint16_t reg, uint64_t& value) {
+        const CPUState& state = vcpu.state;
+        switch (reg) {
+            case a64::MIDR_EL1: value = 0x000F0000; return true;    // architecture defined by ID registers
+            case a64::MPIDR_EL1: value = (1ull << 31) | static_cast<uint64_t>(vcpu.id); return true;
+            case a64::ID_AA64ISAR0_EL1: value = 2ull << 20; return true;   // LSE atomics
+            case a64::SCTLR_EL1: value = state.sys.sctlr; return true;
+            case a64::TTBR0_EL1: value = state.sys.ttbr0; return true;
+            case a64::TTBR1_EL1: value = state.sys.ttbr1; return true;
+            case a64::TCR_EL1: value = state.sys.tcr; return true;
+            case a64::VBAR_EL1: value = state.el1.vbar; return true;
+            case a64::ELR_EL1: value = state.el1.elr; return true;
+            case a64::SPSR_EL1: value = state.el1.spsr; return true;
+            case a64::ESR_EL1: value = state.el1.esr; return true;
+            case a64::FAR_EL1: value = state.el1.far; return true;
+            case a64::NZCV: value = currentNzcv(state); return true;
+            case a64::DAIF: value = state.daif; return true;
+            case a64::FPCR: value = state.fpcr; return true;
+            case a64::FPSR: value = state.fpsr; return true;
+            case a64::CURRENT_EL: value = 1 << 2; return true;
+            case a64::SPSEL: value = 1; return true;
+            case a64::CTR_EL0: value = 0x8444C004; return true;     // 64-byte lines
+            case a64::DCZID_EL0: value = 1 << 4; return true;       // DC ZVA prohibited
+            
+            case a64::CNTFRQ_EL0: value = GuestCounter::FREQUENCY; return true;
+            case a64::CNTPCT_EL0:
+            case a64::CNTVCT_EL0: value = guestCounter(); return true;
+            case a64::CNTKCTL_EL1: value = state.timer.kctl; return true;
+            case a64::CNTV_CVAL_EL0: value = state.timer.cval; return true;
+            case a64::CNTV_CTL_EL0:
+                value = state.timer.ctl;
+                if ((value & TIMER_ENABLE) && guestCounter() >= state.timer.cval) {
+                    value |= TIMER_ISTATUS;
+                }
+                return true;
+            case a64::CNTV_TVAL_EL0:
+                value = signExtend(truncate(state.timer.cval - guestCounter(), false), 32);
+                return true;
+                
+            case a64::ISR_EL1: value = signalledInterrupts(vcpu) ? PSTATE_I : 0; return true;
+            case a64::ICC_PMR_EL1: value = state.gic.pmr; return true;
+            case a64::ICC_IGRPEN1_EL1: value = state.gic.igrpen1; return true;
+            case a64::ICC_SRE_EL1: value = 0x7; return true;       // system register interface only
+            case a64::ICC_IAR1_EL1: value = acknowledgeInterrupt(vcpu); return true;
+        }
+        
+        if (a64::isIdRegister(reg)) {
+            // No optional features
+            value = 0;
+            return true;
+        }
+        for (size_t i = 0; i < STORED_SYSREG_COUNT; i++) {
+            if (STORED_SYSREGS[i] == reg) {
+                value = state.storedSysregs[i];
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool writeSysreg(VCPU& vcpu, uint16_t reg, uint64_t value) {
+        CPUState& state = vcpu.state;
+        switch (reg) {
+            case a64::SCTLR_EL1:
+            case a64::TTBR0_EL1:
+            case a64::TTBR1_EL1:
+            case a64::TCR_EL1:
+                if (reg == a64::SCTLR_EL1) {
+                    state.sys.sctlr = value;
+                } else if (reg == a64::TTBR0_EL1) {
+                    state.sys.ttbr0 = value;
+                } else if (reg == a64::TTBR1_EL1) {
+                    state.sys.ttbr1 = value;
+                } else {
+                    state.sys.tcr = value;
+                }
+                // New translation regime for this vCPU
+                vcpu.tlb.flush();
+                return true;
+            case a64::VBAR_EL1: state.el1.vbar = value; return true;
+            case a64::ELR_EL1: state.el1.elr = value; return true;
+            case a64::SPSR_EL1: state.el1.spsr = value; return true;
+            case a64::ESR_EL1: state.el1.esr = value; return true;
+            case a64::FAR_EL1: state.el1.far = value; return true;
+            case a64::NZCV: setNzcv(state, value); return true;
+            case a64::DAIF:
+                state.daif = value & PSTATE_DAIF;
+                recheckInterrupts(vcpu);
+                return true;
+            case a64::SPSEL: return true;
+            case a64::FPCR: state.fpcr = value; return true;
+            case a64::FPSR: state.fpsr = value; return true;
+            
+            case a64::CNTKCTL_EL1: state.timer.kctl = value; return true;
+            case a64::CNTV_CTL_EL0:
+                state.timer.ctl = value & (TIMER_ENABLE | TIMER_IMASK);
+                updateTimer(vcpu);
+                return true;
+            case a64::CNTV_CVAL_EL0:
+                state.timer.cval = value;
+                updateTimer(vcpu);
+                return true;
+            case a64::CNTV_TVAL_EL0:
+                state.timer.cval = guestCounter() + signExtend(truncate(value, false), 32);
+                updateTimer(vcpu);
+                return true;
+                
+            case a64::ICC_PMR_EL1: state.gic.pmr = value & 0xFF; return true;
+            case a64::ICC_SRE_EL1: return true;
+            case a64::ICC_IGRPEN1_EL1:
+                state.gic.igrpen1 = value & 1;
+                recheckInterrupts(vcpu);
+                return true;
+            case a64::ICC_EOIR1_EL1:
+                endInterrupt(vcpu, value & 0xFFFFFF);
+                return true;
+        }
+        
+        for (size_t i = 0; i < STORED_SYSREG_COUNT; i++) {
+            if (STORED_SYSREGS[i] == reg) {
+                state.storedSysregs[i] = value;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static void setReg(uint64_t* regs, uint8_t reg, uint64_t value) {
+        regs[reg] = value;
+        regs[REG_ZR] = 0;
+    }
+    
+    static uint64_t truncate(uint64_t value, bool wide) {
+        return wide ? value : value & 0xFFFFFFFFull;
+    }
+    
+    static uint64_t lowMask(unsigned width) {
+        return width >= 64 ? ~0ull : (1ull << width) - 1;
+    }
+    
+    static uint64_t signExtend(uint64_t value, unsigned bits) {
+        return bits >= 64 ? value : static_cast<uint64_t>(static_cast<int64_t>(value << (64 - bits)) >> (64 - bits));
+    }
+    
+    // EQ and NE only need the Z flag, which comes straight from a recorded
+    // result; everything else evaluates the flags.
+    static bool conditionHolds(unsigned cond, CPUState& state) {
+        if ((cond >> 1) == 0 && state.flags.op != FLAGS_VALUE) {
+            return (state.flags.result == 0) != (cond & 1);
+        }
+        
+        uint64_t nzcv = materializeFlags(state);
+        bool n = nzcv & PSTATE_N;
+        bool z = nzcv & PSTATE_Z;
+        bool c = nzcv & PSTATE_C;
+        bool v = nzcv & PSTATE_V;
+        
+        bool result;
+        switch (cond >> 1) {
+            case 0: result = z; break;              // EQ, NE
+            case 1: result = c; break;              // CS, CC
+            case 2: result = n; break;              // MI, PL
+            case 3: result = v; break;              // VS, VC
+            case 4: result = c && !z; break;        // HI, LS
+            case 5: result = n == v; break;         // GE, LT
+            case 6: result = n == v && !z; break;   // GT, LE
+            default: return true;                   // AL, NV
+        }
+        return (cond & 1) ? !result : result;
+    }
+    
+    // AddWithCarry() from the Arm ARM. OP_SETFLAGS ops record their
+    // operands for lazy NZCV evaluation.
+    static uint64_t addWithCarry(CPUState& state, uint64_t a, uint64_t b, bool carry, uint8_t flags) {
+        bool wide = flags & OP_SF;
+        a = truncate(a, wide);
+        b = truncate(b, wide);
+        uint64_t result = truncate(a + b + carry, wide);
+        
+        if (flags & OP_SETFLAGS) {
+            state.flags = { wide ? FLAGS_ADD64 : FLAGS_ADD32, a, b, result };
+        }
+        return result;
+    }
+    
+    static uint64_t logicalResult(CPUState& state, uint64_t result, uint8_t flags) {
+        bool wide = flags & OP_SF;
+        result = truncate(result, wide);
+        if (flags & OP_SETFLAGS) {
+            state.flags = { wide ? FLAGS_LOGIC64 : FLAGS_LOGIC32, 0, 0, result };
+        }
+        return result;
+    }
+    
+    static uint64_t shiftReg(uint64_t value, unsigned type, unsigned amount, bool wide) {
+        value = truncate(value, wide);
+        if (amount == 0) {
+            return value;
+        }
+        unsigned size = wide ? 64 : 32;
+        switch (type) {
+            case 0: // LSL
+                return truncate(value << amount, wide);
+            case 1: // LSR
+                return value >> amount;
+            case 2: // ASR
+                return truncate(static_cast<uint64_t>(static_cast<int64_t>(signExtend(value, size)) >> amount), wide);
+            default: // ROR
+                return truncate((value >> amount) | (value << (size - amount)), wide);
+        }
+    }
+    
+    static uint64_t extendReg(uint64_t value, unsigned type, unsigned shift) {
+        switch (type) {
+            case 0: value &= 0xFF; break;                   // UXTB
+            case 1: value &= 0xFFFF; break;                 // UXTH
+            case 2: value &= 0xFFFFFFFF; break;             // UXTW
+            case 4: value = signExtend(value, 8); break;    // SXTB
+            case 5: value = signExtend(value, 16); break;   // SXTH
+            case 6: value = signExtend(value, 32); break;   // SXTW
+            default: break;                                 // UXTX, SXTX
+        }
+        return value << shift;
+    }
+    
+    // SBFM, BFM and UBFM, which cover the shift-by-immediate, extend and
+    // bitfield extract/insert aliases
+    static uint64_t bitfieldMove(const MicroOp& op, uint64_t src, uint64_t dst) {
+        bool wide = op.flags & OP_SF;
+        unsigned immr = op.opt;
+        unsigned imms = op.shift;
+        
+        unsigned width;
+        unsigned pos;
+        if (imms >= immr) {
+            // Field at immr moves to the bottom
+            width = imms - immr + 1;
+            pos = 0;
+            src >>= immr;
+        } else {
+            // Bottom field moves up to size - immr
+            width = imms + 1;
+            pos = (wide ? 64 : 32) - immr;
+        }
+        
+        uint64_t bits = src & lowMask(width);
+        if (op.kind == MicroOpKind::Bfm) {
+            return truncate((dst & ~(lowMask(width) << pos)) | (bits << pos), wide);
+        }
+        if (op.kind == MicroOpKind::Sbfm) {
+            bits = signExtend(bits, width);
+        }
+        return truncate(bits << pos, wide);
+    }
+    
+    static uint64_t reverseBits(uint64_t v) {
+        v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+        v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+        return __builtin_bswap64(v);
+    }
+    
+    static uint64_t reverseBytes(uint64_t v, unsigned container, bool wide) {
+        switch (container) {
+            case 1: // REV16
+                return truncate(((v >> 8) & 0x00FF00FF00FF00FFull) | ((v & 0x00FF00FF00FF00FFull) << 8), wide);
+            case 2: // REV32, REV of a W register
+                v = __builtin_bswap64(v);
+                return truncate((v >> 32) | (v << 32), wide);
+            default:
+                return __builtin_bswap64(v);
+        }
+    }
+    
+    static unsigned countLeadingZeros(uint64_t v, bool wide) {
+        if (wide) {
+            return v == 0 ? 64 : __builtin_clzll(v);
+        }
+        uint32_t w = static_cast<uint32_t>(v);
+        return w == 0 ? 32 : __builtin_clz(w);
+    }
+    
+    // Guest RAM a device wrote, e.g. disk reads landing in a buffer
+    void deviceWrote(uint64_t pa, size_t size) {
+        memory.markDirtyRange(pa, size);
+        if (size != 0 && blockCache.containsCode(pa, size)) {
+            invalidateCode(pa, size);
+        }
+    }
+    
+    // Called after every guest store with the physical address written.
+    // True when cached code was dropped and the block has to end.
+    bool checkCodeWrite(uint64_t pa, unsigned bytes) {
+        if (!blockCache.isCode(pa) && !blockCache.isCode(pa + bytes - 1)) {
+            return false;
+        }
+        return invalidateCode(pa, bytes);
+    }
+    
+    // Drops the decoded blocks and translations made from guest physical
+    // [pa, pa + size). Code elsewhere in the same pages stays cached, and
+    // so do translations chained to it.
+    bool invalidateCode(uint64_t pa, uint64_t size) {
+        std::unique_lock<std::shared_mutex> cacheLock(blockCacheMtx);
+        bool dropped = blockCache.invalidateRange(pa, size);
+        if (jit) {
+            dropped |= jit->invalidateRange(pa, size);
+        }
+        return dropped;
+    }
+    
+    // Flat addresses inside the window of an armed host-mapped vCPU skip
+    // the soft TLB; the guard region takes care of the bounds
+    static bool flatAccess(const VCPU& vcpu, uint64_t va) {
+        return vcpu.guard.armed && !(vcpu.state.sys.sctlr & SoftMMU::SCTLR_M) &&
+               (va >> HostAccessGuard::WINDOW_BITS) == 0;
+    }
+    
+    template <typename T>
+    bool readGuest(VCPU& vcpu, uint64_t va, uint64_t& value, MMUFault& fault) {
+        T data;
+        if (flatAccess(vcpu, va)) {
+            memcpy(&data, memory.data() + va, sizeof(T));
+        } else if (!mmu.load(vcpu.tlb, vcpu.state.sys, va, data, fault)) {
+            return deviceAccess(vcpu, va, sizeof(T), MMU_READ, value, fault);
+        }
+        value = data;
+        return true;
+    }
+    
+    template <typename T>
+    bool writeGuest(VCPU& vcpu, uint64_t va, uint64_t value, MMUFault& fault, bool& codeWritten) {
+        if (flatAccess(vcpu, va)) {
+            T data = static_cast<T>(value);
+            memcpy(memory.data() + va, &data, sizeof(T));
+            memory.markDirtyRange(va, sizeof(T));
+            codeWritten |= checkCodeWrite(va, sizeof(T));
+            return true;
+        }
+        
+        uint64_t pa;
+        if (!mmu.store(vcpu.tlb, vcpu.state.sys, va, static_cast<T>(value), pa, fault)) {
+            return deviceAccess(vcpu, va, sizeof(T), MMU_WRITE, value, fault);
+        }
+        codeWritten |= checkCodeWrite(pa, sizeof(T));
+        return true;
+    }
+    
+    // An access that faulted for being past the end of RAM may be meant
+    // for device registers instead
+    bool deviceAccess(VCPU& vcpu, uint64_t va, unsigned size, int access, uint64_t& value, const MMUFault& fault) {
+        uint64_t pa;
+        if (fault.type != MMU_FAULT_ADDRESS_SIZE || !blockDevice ||
+            !mmu.ioAddress(vcpu.state.sys, va, access, pa) || !VirtioBlockDevice::contains(pa)) {
+            return false;
+        }
+        if (access == MMU_WRITE) {
+            blockDevice->write(pa - VirtioBlockDevice::MMIO_BASE, size, value);
+        } else {
+            value = blockDevice->read(pa - VirtioBlockDevice::MMIO_BASE, size);
+        }
+        return true;
+    }
+    
+    bool readMemory(VCPU& vcpu, uint64_t va, unsigned size, uint64_t& value, MMUFault& fault) {
+        switch (size) {
+            case 0: return readGuest<uint8_t>(vcpu, va, value, fault);
+            case 1: return readGuest<uint16_t>(vcpu, va, value, fault);
+            case 2: return readGuest<uint32_t>(vcpu, va, value, fault);
+            default: return readGuest<uint64_t>(vcpu, va, value, fault);
+        }
+    }
+    
+    bool writeMemory(VCPU& vcpu, uint64_t va, unsigned size, uint64_t value, MMUFault& fault, bool& codeWritten) {
+        switch (size) {
+            case 0: return writeGuest<uint8_t>(vcpu, va, value, fault, codeWritten);
+            case 1: return writeGuest<uint16_t>(vcpu, va, value, fault, codeWritten);
+            case 2: return writeGuest<uint32_t>(vcpu, va, value, fault, codeWritten);
+            default: return writeGuest<uint64_t>(vcpu, va, value, fault, codeWritten);
+        }
+    }
+    
+    static uint64_t extendLoad(uint64_t value, unsigned size, uint8_t flags) {
+        if (!(flags & OP_SIGNED)) {
+            return value;
+        }
+        return truncate(signExtend(value, 8u << size), flags & OP_SF);
+    }
+    
+    // Loads and stores. Same contract as executeOp.
+    bool executeMemoryOp(VCPU& vcpu, const MicroOp& op, uint64_t pc, uint64_t& nextPc) {
+        uint64_t* regs = vcpu.state.registers;
+        unsigned size = op.opt;
+        
+        uint64_t base = op.kind == MicroOpKind::LoadLiteral ? pc : regs[op.rn];
+        uint64_t offset = (op.flags & OP_REGISTER) ? extendReg(regs[op.rm], op.ra, op.shift) : op.imm;
+        uint64_t addr = (op.flags & OP_POSTINDEX) ? base : base + offset;
+        
+        MMUFault fault = {};
+        bool ok = true;
+        bool codeWritten = false;
+        uint64_t first = 0;
+        uint64_t second = 0;
+        
+        // Where a host-mapped fault gets reported
+        bool isStore = op.kind == MicroOpKind::Store || op.kind == MicroOpKind::StorePair;
+        vcpu.guard.access = pc | (isStore ? HostAccessGuard::ACCESS_WRITE : 0);
+        
+        switch (op.kind) {
+            case MicroOpKind::Load:
+            case MicroOpKind::LoadLiteral:
+                ok = readMemory(vcpu, addr, size, first, fault);
+                if (ok) {
+                    setReg(regs, op.rd, extendLoad(first, size, op.flags));
+                }
+                break;
+                
+            case MicroOpKind::LoadPair:
+                ok = readMemory(vcpu, addr, size, first, fault) &&
+                     readMemory(vcpu, addr + (1ull << size), size, second, fault);
+                if (ok) {
+                    setReg(regs, op.rd, extendLoad(first, size, op.flags));
+                    setReg(regs, op.ra, extendLoad(second, size, op.flags));
+                }
+                break;
+                
+            case MicroOpKind::Store:
+                ok = writeMemory(vcpu, addr, size, regs[op.rd], fault, codeWritten);
+                break;
+                
+            default: // StorePair
+                ok = writeMemory(vcpu, addr, size, regs[op.rd], fault, codeWritten) &&
+                     writeMemory(vcpu, addr + (1ull << size), size, regs[op.ra], fault, codeWritten);
+                break;
+        }
+        
+        if (!ok) {
+            nextPc = takeAbort(vcpu, fault, pc);
+            return false;
+        }
+        if (op.flags & OP_WRITEBACK) {
+            regs[op.rn] = base + offset;
+        }
+        return !codeWritten;
+    }
+    
+    // Host address for an aligned atomic access. pa gets the physical
+    // address, flat whether the access bypassed the soft TLB.
+    uint8_t* atomicAddress(VCPU& vcpu, uint64_t va, unsigned bytes, int access, uint64_t& pa, bool& flat,
+                           MMUFault& fault) {
+        flat = flatAccess(vcpu, va);
+        if (flat) {
+            pa = va;
+            return memory.data() + va;
+        }
+        uint8_t* host = mmu.translate(vcpu.tlb, vcpu.state.sys, va, bytes, access, fault);
+        if (host != nullptr) {
+            pa = host - memory.data();
+        }
+        return host;
+    }
+    
+    static uint64_t atomicLoad(const uint8_t* host, unsigned size) {
+        switch (size) {
+            case 0: return __atomic_load_n(host, __ATOMIC_SEQ_CST);
+            case 1: return __atomic_load_n(reinterpret_cast<const uint16_t*>(host), __ATOMIC_SEQ_CST);
+            case 2: return __atomic_load_n(reinterpret_cast<const uint32_t*>(host), __ATOMIC_SEQ_CST);
+            default: return __atomic_load_n(reinterpret_cast<const uint64_t*>(host), __ATOMIC_SEQ_CST);
+        }
+    }
+    
+    static void atomicStore(uint8_t* host, unsigned size, uint64_t value) {
+        switch (size) {
+            case 0: __atomic_store_n(host, static_cast<uint8_t>(value), __ATOMIC_SEQ_CST); break;
+            case 1: __atomic_store_n(reinterpret_cast<uint16_t*>(host), static_cast<uint16_t>(value), __ATOMIC_SEQ_CST); break;
+            case 2: __atomic_store_n(reinterpret_cast<uint32_t*>(host), static_cast<uint32_t>(value), __ATOMIC_SEQ_CST); break;
+            default: __atomic_store_n(reinterpret_cast<uint64_t*>(host), value, __ATOMIC_SEQ_CST); break;
+        }
+    }
+    
+    template <typename T>
+    static bool compareAndSwapAs(uint8_t* host, uint64_t& expected, uint64_t desired) {
+        T old = static_cast<T>(expected);
+        bool swapped = __atomic_compare_exchange_n(reinterpret_cast<T*>(host), &old, static_cast<T>(desired), false,
+                                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        expected = old;
+        return swapped;
+    }
+    
+    // On failure expected gets the value found in memory
+    static bool compareAndSwap(uint8_t* host, unsigned size, uint64_t& expected, uint64_t desired) {
+        switch (size) {
+            case 0: return compareAndSwapAs<uint8_t>(host, expected, desired);
+            case 1: return compareAndSwapAs<uint16_t>(host, expected, desired);
+            case 2: return compareAndSwapAs<uint32_t>(host, expected, desired);
+            default: return compareAndSwapAs<uint64_t>(host, expected, desired);
+        }
+    }
+    
+    bool compareAndSwap128(uint8_t* host, const uint64_t expected[2], const uint64_t desired[2]) {
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+        unsigned __int128 from = (static_cast<unsigned __int128>(expected[1]) << 64) | expected[0];
+        unsigned __int128 to = (static_cast<unsigned __int128>(desired[1]) << 64) | desired[0];
+        return __sync_bool_compare_and_swap(reinterpret_cast<unsigned __int128*>(host), from, to);
+#else
+        std::lock_guard<std::mutex> lock(wideExclusiveMtx);
+        if (memcmp(host, expected, 16) != 0) {
+            return false;
+        }
+        memcpy(host, desired, 16);
+        return true;
+#endif
+    }
+    
+    // Returns the old value. The min/max forms have no host fetch
+    // operation and loop on compare-and-swap.
+    template <typename T>
+    static T atomicRmwAs(uint8_t* host, unsigned operation, T operand) {
+        T* p = reinterpret_cast<T*>(host);
+        switch (operation) {
+            case a64::ATOMIC_ADD: return __atomic_fetch_add(p, operand, __ATOMIC_SEQ_CST);
+            case a64::ATOMIC_CLR: return __atomic_fetch_and(p, static_cast<T>(~operand), __ATOMIC_SEQ_CST);
+            case a64::ATOMIC_EOR: return __atomic_fetch_xor(p, operand, __ATOMIC_SEQ_CST);
+            case a64::ATOMIC_SET: return __atomic_fetch_or(p, operand, __ATOMIC_SEQ_CST);
+            case a64::ATOMIC_SWP: return __atomic_exchange_n(p, operand, __ATOMIC_SEQ_CST);
+            default: break;
+        }
+        
+        using S = typename std::make_signed<T>::type;
+        T old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        T next;
+        do {
+            switch (operation) {
+                case a64::ATOMIC_SMAX: next = static_cast<S>(old) > static_cast<S>(operand) ? old : operand; break;
+                case a64::ATOMIC_SMIN: next = static_cast<S>(old) < static_cast<S>(operand) ? old : operand; break;
+                case a64::ATOMIC_UMAX: next = old > operand ? old : operand; break;
+                default: next = old < operand ? old : operand; break;
+            }
+        } while (!__atomic_compare_exchange_n(p, &old, next, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        return old;
+    }
+    
+    static uint64_t atomicRmw(uint8_t* host, unsigned size, unsigned operation, uint64_t operand) {
+        switch (size) {
+            case 0: return atomicRmwAs<uint8_t>(host, operation, static_cast<uint8_t>(operand));
+            case 1: return atomicRmwAs<uint16_t>(host, operation, static_cast<uint16_t>(operand));
+            case 2: return atomicRmwAs<uint32_t>(host, operation, static_cast<uint32_t>(operand));
+            default: return atomicRmwAs<uint64_t>(host, operation, operand);
+        }
+    }
+    
+    void clearExclusive(VCPU& vcpu) {
+        vcpu.monitor.open = false;
+        vcpu.monitorGranule.store(NO_GRANULE, std::memory_order_relaxed);
+    }
+    
+    // A store to a granule other vCPUs are monitoring clears their
+    // monitors, and clearing one generates a WFE wakeup event. Only
+    // exclusives, atomics and store-release do this; plain stores would
+    // cost every guest store a scan.
+    void clearMonitors(VCPU& self, uint64_t pa) {
+        uint64_t granule = pa >> MONITOR_GRANULE_SHIFT;
+        for (auto& vcpu : vcpus) {
+            uint64_t expected = granule;
+            if (vcpu.get() != &self && vcpu->monitorGranule.load(std::memory_order_seq_cst) == granule &&
+                vcpu->monitorGranule.compare_exchange_strong(expected, NO_GRANULE)) {
+                vcpu->eventRegister.store(true, std::memory_order_release);
+                kick(*vcpu);
+            }
+        }
+    }
+    
+    // Load-acquire/store-release, exclusives and the LSE atomics. They
+    // have to be single-copy atomic against other vCPUs, so they run as
+    // host atomics on guest RAM with sequentially consistent ordering,
+    // which covers every acquire/release variant; unaligned addresses
+    // take an alignment fault. Same contract as executeOp.
+    bool executeAtomicOp(VCPU& vcpu, const MicroOp& op, uint64_t pc, uint64_t& nextPc) {
+        uint64_t* regs = vcpu.state.registers;
+        unsigned size = op.opt;
+        bool pair = op.kind == MicroOpKind::LoadExclusivePair || op.kind == MicroOpKind::StoreExclusivePair;
+        bool isLoad = op.kind == MicroOpKind::LoadAcquire || op.kind == MicroOpKind::LoadExclusive ||
+                      op.kind == MicroOpKind::LoadExclusivePair;
+        unsigned bytes = (pair ? 2u : 1u) << size;
+        uint64_t addr = regs[op.rn];
+        
+        if (addr & (bytes - 1)) {
+            vcpu.state.el1.far = addr;
+            nextPc = takeException(vcpu, EC_DATA_ABORT, ISS_ALIGNMENT_FAULT | (isLoad ? 0 : ISS_WNR), pc, pc);
+            return false;
+        }
+        
+        MMUFault fault = {};
+        uint64_t pa;
+        bool flat;
+        vcpu.guard.access = pc | (isLoad ? 0 : HostAccessGuard::ACCESS_WRITE);
+        uint8_t* host = atomicAddress(vcpu, addr, bytes, isLoad ? MMU_READ : MMU_WRITE, pa, flat, fault);
+        if (host == nullptr) {
+            nextPc = takeAbort(vcpu, fault, pc);
+            return false;
+        }
+        
+        ExclusiveMonitor& monitor = vcpu.monitor;
+        bool written = true;
+        switch (op.kind) {
+            case MicroOpKind::LoadAcquire:
+                setReg(regs, op.rd, atomicLoad(host, size));
+                return true;
+                
+            case MicroOpKind::LoadExclusive:
+            case MicroOpKind::LoadExclusivePair:
+                // Publishing the granule before loading means a racing
+                // store either sees it or is seen by the load
+                vcpu.monitorGranule.store(pa >> MONITOR_GRANULE_SHIFT, std::memory_order_seq_cst);
+                monitor.open = true;
+                monitor.bytes = bytes;
+                monitor.address = addr;
+                monitor.value[0] = atomicLoad(host, pair ? 3 : size);
+                monitor.value[1] = bytes == 16 ? atomicLoad(host + 8, 3) : 0;
+                if (!pair) {
+                    setReg(regs, op.rd, monitor.value[0]);
+                } else if (size == 2) {
+                    setReg(regs, op.rd, truncate(monitor.value[0], false));
+                    setReg(regs, op.ra, monitor.value[0] >> 32);
+                } else {
+                    setReg(regs, op.rd, monitor.value[0]);
+                    setReg(regs, op.ra, monitor.value[1]);
+                }
+                return true;
+                
+            case MicroOpKind::StoreRelease:
+                atomicStore(host, size, regs[op.rd]);
+                break;
+                
+            case MicroOpKind::StoreExclusive:
+            case MicroOpKind::StoreExclusivePair:
+                written = monitor.open && monitor.address == addr && monitor.bytes == bytes;
+                if (written && bytes == 16) {
+                    uint64_t desired[2] = { regs[op.rd], regs[op.ra] };
+                    written = compareAndSwap128(host, monitor.value, desired);
+                } else if (written) {
+                    uint64_t expected = monitor.value[0];
+                    uint64_t desired = pair ? truncate(regs[op.rd], false) | (regs[op.ra] << 32) : regs[op.rd];
+                    written = compareAndSwap(host, pair ? 3 : size, expected, desired);
+                }
+                clearExclusive(vcpu);
+                setReg(regs, op.rm, written ? 0 : 1);
+                break;
+                
+            case MicroOpKind::CompareSwap:
+                {
+                    uint64_t expected = regs[op.rm];
+                    written = compareAndSwap(host, size, expected, regs[op.rd]);
+                    setReg(regs, op.rm, expected);
+                }
+                break;
+                
+            default: // AtomicRmw
+                setReg(regs, op.rd, atomicRmw(host, size, op.shift, regs[op.rm]));
+                break;
+        }
+        
+        if (!written) {
+            return true;
+        }
+        if (flat) {
+            memory.markDirtyRange(pa, bytes);
+        }
+        clearMonitors(vcpu, pa);
+        return !checkCodeWrite(pa, bytes);
+    }
+    
+    // Q registers move as two 64-bit halves; narrower loads zero the rest
+    // of the register
+    bool readVector(VCPU& vcpu, uint64_t va, unsigned size, Vec128& value, MMUFault& fault) {
+        value = Vec128{0, 0};
+        if (size < 4) {
+            return readMemory(vcpu, va, size, value.lo, fault);
+        }
+        return readMemory(vcpu, va, 3, value.lo, fault) && readMemory(vcpu, va + 8, 3, value.hi, fault);
+    }
+    
+    bool writeVector(VCPU& vcpu, uint64_t va, unsigned size, const Vec128& value, MMUFault& fault,
+                     bool& codeWritten) {
+        if (size < 4) {
+            return writeMemory(vcpu, va, size, value.lo, fault, codeWritten);
+        }
+        return writeMemory(vcpu, va, 3, value.lo, fault, codeWritten) &&
+               writeMemory(vcpu, va + 8, 3, value.hi, fault, codeWritten);
+    }
+    
+    // Loads and stores of V registers. Same contract as executeOp.
+    bool executeVectorMemoryOp(VCPU& vcpu, const MicroOp& op, uint64_t pc, uint64_t& nextPc) {
+        uint64_t* regs = vcpu.state.registers;
+        Vec128* vregs = vcpu.state.vregs;
+        unsigned size = op.opt;
+        bool multiple = op.kind == MicroOpKind::VecLoadMulti || op.kind == MicroOpKind::VecStoreMulti;
+        bool pair = op.kind == MicroOpKind::VecLoadPair || op.kind == MicroOpKind::VecStorePair;
+        unsigned count = multiple ? op.ra : (pair ? 2 : 1);
+        
+        uint64_t base = op.kind == MicroOpKind::VecLoadLiteral ? pc : regs[op.rn];
+        uint64_t offset = op.imm;
+        if (op.flags & OP_REGISTER) {
+            offset = multiple ? regs[op.rm] : extendReg(regs[op.rm], op.ra, op.shift);
+        }
+        uint64_t addr = (op.flags & OP_POSTINDEX) ? base : base + offset;
+        
+        bool isStore = op.kind == MicroOpKind::VecStore || op.kind == MicroOpKind::VecStorePair ||
+                       op.kind == MicroOpKind::VecStoreMulti;
+        vcpu.guard.access = pc | (isStore ? HostAccessGuard::ACCESS_WRITE : 0);
+        
+        // Registers are only written once every access has succeeded. LD1
+        // and ST1 wrap around from V31 to V0.
+        MMUFault fault = {};
+        bool ok = true;
+        bool codeWritten = false;
+        Vec128 loaded[4];
+        for (unsigned i = 0; ok && i < count; i++) {
+            unsigned reg = pair && i == 1 ? op.ra : (op.rd + i) & 31;
+            uint64_t at = addr + (static_cast<uint64_t>(i) << size);
+            ok = isStore ? writeVector(vcpu, at, size, vregs[reg], fault, codeWritten)
+                         : readVector(vcpu, at, size, loaded[i], fault);
+        }
+        
+        if (!ok) {
+            nextPc = takeAbort(vcpu, fault, pc);
+            return false;
+        }
+        for (unsigned i = 0; !isStore && i < count; i++) {
+            vregs[pair && i == 1 ? op.ra : (op.rd + i) & 31] = loaded[i];
+        }
+        if (op.flags & OP_WRITEBACK) {
+            regs[op.rn] = base + offset;
+        }
+        return !codeWritten;
+    }
+    
+    // Advanced SIMD data processing. Encodings SimdUnit does not cover
+    // trap as undefined.
+    bool executeSimd(VCPU& vcpu, const MicroOp& op, uint64_t pc, uint64_t& nextPc) {
+        HostFpEnvironment::apply(vcpu.state.fpcr);
+        if (!SimdUnit::execute(op, vcpu.state.vregs, vcpu.state.registers)) {
+            nextPc = undefinedInstruction(vcpu, pc);
+            return false;
+        }
+        return true;
+    }
+    
+    // Scalar floating point on the host FPU. The host's rounding mode only
+    // changes when this vCPU's FPCR differs from what the thread last ran.
+    bool executeFp(VCPU& vcpu, const MicroOp& op, uint64_t pc, uint64_t& nextPc) {
+        CPUState& state = vcpu.state;
+        HostFpEnvironment::apply(state.fpcr);
+        bool conditional = op.opt == a64::FP_CSEL || op.opt == a64::FP_CCMP;
+        bool conditionHeld = conditional && conditionHolds(static_cast<unsigned>(op.imm), state);
+        uint64_t nzcv = 0;
+        if (!FpUnit::execute(op, state.vregs, state.registers, state.fpcr, conditionHeld, nzcv)) {
+            nextPc = undefinedInstruction(vcpu, pc);
+            return false;
+        }
+        if (FpUnit::setsFlags(op)) {
+            setNzcv(state, nzcv);
+        }
+        return true;
+    }
+    
+    // Executes one micro-op at pc. Returns false when the block has to end
+    // here; nextPc then holds where execution continues.
+    bool executeOp(VCPU& vcpu, const MicroOp& op, uint64_t pc, uint64_t& nextPc) {
+        CPUState& state = vcpu.state;
+        uint64_t* regs = state.registers;
+        bool wide = op.flags & OP_SF;
+        
+        switch (op.kind) {
+            case MicroOpKind::Nop:
+                break;
+                
+            case MicroOpKind::Adr:
+                setReg(regs, op.rd, pc + op.imm);
+                break;
+                
+            case MicroOpKind::Adrp:
+                setReg(regs, op.rd, (pc & ~0xFFFull) + op.imm);
+                break;
+                
+            case MicroOpKind::AddImm:
+                setReg(regs, op.rd, addWithCarry(state, regs[op.rn], op.imm, false, op.flags));
+                break;
+                
+            case MicroOpKind::SubImm:
+                setReg(regs, op.rd, addWithCarry(state, regs[op.rn], ~op.imm, true, op.flags));
+                break;
+                
+            case MicroOpKind::AddReg:
+            case MicroOpKind::SubReg:
+            case MicroOpKind::AddExt:
+            case MicroOpKind::SubExt:
+                {
+                    bool extended = op.kind == MicroOpKind::AddExt || op.kind == MicroOpKind::SubExt;
+                    bool subtract = op.kind == MicroOpKind::SubReg || op.kind == MicroOpKind::SubExt;
+                    uint64_t operand = extended ? extendReg(regs[op.rm], op.opt, op.shift) :
+                                                  shiftReg(regs[op.rm], op.opt, op.shift, wide);
+                    setReg(regs, op.rd, addWithCarry(state, regs[op.rn], subtract ? ~operand : operand,
+                                                     subtract, op.flags));
+                }
+                break;
+                
+            case MicroOpKind::Adc:
+            case MicroOpKind::Sbc:
+                {
+                    uint64_t operand = op.kind == MicroOpKind::Sbc ? ~regs[op.rm] : regs[op.rm];
+                    setReg(regs, op.rd, addWithCarry(state, regs[op.rn], operand, materializeFlags(state) & PSTATE_C, op.flags));
+                }
+                break;
+                
+            case MicroOpKind::AndImm:
+                setReg(regs, op.rd, logicalResult(state, regs[op.rn] & op.imm, op.flags));
+                break;
+                
+            case MicroOpKind::OrrImm:
+                setReg(regs, op.rd, logicalResult(state, regs[op.rn] | op.imm, op.flags));
+                break;
+                
+            case MicroOpKind::EorImm:
+                setReg(regs, op.rd, logicalResult(state, regs[op.rn] ^ op.imm, op.flags));
+                break;
+                
+            case MicroOpKind::And:
+            case MicroOpKind::Orr:
+            case MicroOpKind::Eor:
+                {
+                    uint64_t operand = shiftReg(regs[op.rm], op.opt, op.shift, wide);
+                    if (op.flags & OP_INVERT) {
+                        operand = ~operand;
+                    }
+                    uint64_t result = op.kind == MicroOpKind::And ? regs[op.rn] & operand :
+                                      op.kind == MicroOpKind::Orr ? regs[op.rn] | operand : regs[op.rn] ^ operand;
+                    setReg(regs, op.rd, logicalResult(state, result, op.flags));
+                }
+                break;
+                
+            case MicroOpKind::MovImm:
+                setReg(regs, op.rd, static_cast<uint64_t>(op.imm));
+                break;
+                
+            case MicroOpKind::MovK:
+                setReg(regs, op.rd, truncate((regs[op.rd] & ~(0xFFFFull << op.shift)) | static_cast<uint64_t>(op.imm), wide));
+                break;
+                
+            case MicroOpKind::Sbfm:
+            case MicroOpKind::Bfm:
+            case MicroOpKind::Ubfm:
+                setReg(regs, op.rd, bitfieldMove(op, regs[op.rn], regs[op.rd]));
+                break;
+                
+            case MicroOpKind::Extr:
+                if (wide) {
+                    setReg(regs, op.rd, op.shift == 0 ? regs[op.rm] :
+                           (regs[op.rm] >> op.shift) | (regs[op.rn] << (64 - op.shift)));
+                } else {
+                    uint64_t concat = (truncate(regs[op.rn], false) << 32) | truncate(regs[op.rm], false);
+                    setReg(regs, op.rd, truncate(concat >> op.shift, false));
+                }
+                break;
+                
+            case MicroOpKind::Csel:
+                {
+                    uint64_t value = regs[op.rn];
+                    if (!conditionHolds(op.opt, state)) {
+                        value = regs[op.rm];
+                        if (op.ra & 2) {
+                            value = ~value;
+                        }
+                        if (op.ra & 1) {
+                            value += 1;
+                        }
+                    }
+                    setReg(regs, op.rd, truncate(value, wide));
+                }
+                break;
+                
+            case MicroOpKind::Ccmp:
+            case MicroOpKind::Ccmn:
+                if (conditionHolds(op.opt, state)) {
+                    uint64_t operand = (op.flags & OP_REGISTER) ? regs[op.rm] : static_cast<uint64_t>(op.imm);
+                    bool subtract = op.kind == MicroOpKind::Ccmp;
+                    addWithCarry(state, regs[op.rn], subtract ? ~operand : operand, subtract, op.flags | OP_SETFLAGS);
+                } else {
+                    setNzcv(state, static_cast<uint64_t>(op.ra) << 28);
+                }
+                break;
+                
+            case MicroOpKind::Udiv:
+                {
+                    uint64_t divisor = truncate(regs[op.rm], wide);
+                    setReg(regs, op.rd, divisor == 0 ? 0 : truncate(regs[op.rn], wide) / divisor);
+                }
+                break;
+                
+            case MicroOpKind::Sdiv:
+                {
+                    unsigned size = wide ? 64 : 32;
+                    int64_t dividend = static_cast<int64_t>(signExtend(truncate(regs[op.rn], wide), size));
+                    int64_t divisor = static_cast<int64_t>(signExtend(truncate(regs[op.rm], wide), size));
+                    uint64_t result;
+                    if (divisor == 0) {
+                        result = 0;
+                    } else if (divisor == -1) {
+                        // Also covers INT_MIN / -1, which wraps
+                        result = 0 - static_cast<uint64_t>(dividend);
+                    } else {
+                        result = static_cast<uint64_t>(dividend / divisor);
+                    }
+                    setReg(regs, op.rd, truncate(result, wide));
+                }
+                break;
+                
+            case MicroOpKind::ShiftVar:
+                setReg(regs, op.rd, shiftReg(regs[op.rn], op.opt, regs[op.rm] & (wide ? 63 : 31), wide));
+                break;
+                
+            case MicroOpKind::Rbit:
+                setReg(regs, op.rd, wide ? reverseBits(regs[op.rn]) : reverseBits(regs[op.rn]) >> 32);
+                break;
+                
+            case MicroOpKind::Rev:
+                setReg(regs, op.rd, reverseBytes(regs[op.rn], op.opt, wide));
+                break;
+                
+            case MicroOpKind::Clz:
+                setReg(regs, op.rd, countLeadingZeros(regs[op.rn], wide));
+                break;
+                
+            case MicroOpKind::Cls:
+                {
+                    // Leading zeros after folding the sign bit away, minus the sign bit itself
+                    uint64_t value = truncate(regs[op.rn], wide);
+                    uint64_t sign = static_cast<uint64_t>(static_cast<int64_t>(signExtend(value, wide ? 64 : 32)) >> 63);
+                    setReg(regs, op.rd, countLeadingZeros(truncate(value ^ sign, wide), wide) - 1);
+                }
+                break;
+                
+            case MicroOpKind::Madd:
+                setReg(regs, op.rd, truncate(regs[op.ra] + regs[op.rn] * regs[op.rm], wide));
+                break;
+                
+            case MicroOpKind::Msub:
+                setReg(regs, op.rd, truncate(regs[op.ra] - regs[op.rn] * regs[op.rm], wide));
+                break;
+                
+            case MicroOpKind::MaddLong:
+            case MicroOpKind::MsubLong:
+                {
+                    uint64_t a = truncate(regs[op.rn], false);
+                    uint64_t b = truncate(regs[op.rm], false);
+                    if (op.flags & OP_SIGNED) {
+                        a = signExtend(a, 32);
+                        b = signExtend(b, 32);
+                    }
+                    uint64_t product = a * b;
+                    setReg(regs, op.rd, op.kind == MicroOpKind::MaddLong ? regs[op.ra] + product : regs[op.ra] - product);
+                }
+                break;
+                
+            case MicroOpKind::MulHigh:
+                if (op.flags & OP_SIGNED) {
+                    __int128 product = static_cast<__int128>(static_cast<int64_t>(regs[op.rn])) *
+                                       static_cast<int64_t>(regs[op.rm]);
+                    setReg(regs, op.rd, static_cast<uint64_t>(product >> 64));
+                } else {
+                    unsigned __int128 product = static_cast<unsigned __int128>(regs[op.rn]) * regs[op.rm];
+                    setReg(regs, op.rd, static_cast<uint64_t>(product >> 64));
+                }
+                break;
+                
+            case MicroOpKind::Load:
+            case MicroOpKind::Store:
+            case MicroOpKind::LoadPair:
+            case MicroOpKind::StorePair:
+            case MicroOpKind::LoadLiteral:
+                return executeMemoryOp(vcpu, op, pc, nextPc);
+                
+            case MicroOpKind::LoadAcquire:
+            case MicroOpKind::StoreRelease:
+            case MicroOpKind::LoadExclusive:
+            case MicroOpKind::StoreExclusive:
+            case MicroOpKind::LoadExclusivePair:
+            case MicroOpKind::StoreExclusivePair:
+            case MicroOpKind::CompareSwap:
+            case MicroOpKind::AtomicRmw:
+                return executeAtomicOp(vcpu, op, pc, nextPc);
+                
+            case MicroOpKind::VecLoad:
+            case MicroOpKind::VecStore:
+            case MicroOpKind::VecLoadPair:
+            case MicroOpKind::VecStorePair:
+            case MicroOpKind::VecLoadLiteral:
+            case MicroOpKind::VecLoadMulti:
+            case MicroOpKind::VecStoreMulti:
+                return executeVectorMemoryOp(vcpu, op, pc, nextPc);
+                
+            case MicroOpKind::Branch:
+                if (op.flags & OP_LINK) {
+                    setReg(regs, REG_LR, pc + 4);
+                }
+                nextPc = pc + op.imm;
+                return false;
+                
+            case MicroOpKind::BranchCond:
+                if (conditionHolds(op.opt, state)) {
+                    nextPc = pc + op.imm;
+                }
+                return false;
+                
+            case MicroOpKind::CompareBranch:
+                if ((truncate(regs[op.rd], wide) != 0) == ((op.flags & OP_INVERT) != 0)) {
+                    nextPc = pc + op.imm;
+                }
+                return false;
+                
+            case MicroOpKind::TestBranch:
+                if (((regs[op.rd] >> op.shift) & 1) == ((op.flags & OP_INVERT) ? 1u : 0u)) {
+                    nextPc = pc + op.imm;
+                }
+                return false;
+                
+            case MicroOpKind::BranchReg:
+                nextPc = regs[op.rn];
+                if (op.flags & OP_LINK) {
+                    setReg(regs, REG_LR, pc + 4);
+                }
+                return false;
+                
+            case MicroOpKind::Svc:
+                nextPc = userMode ? systemCall(vcpu, pc) :
+                                    takeException(vcpu, EC_SVC64, static_cast<uint32_t>(op.imm), pc + 4, pc);
+                return false;
+                
+            case MicroOpKind::Brk:
+                nextPc = takeException(vcpu, EC_BRK64, static_cast<uint32_t>(op.imm), pc, pc);
+                return false;
+                
+            case MicroOpKind::Eret:
+                setNzcv(state, state.el1.spsr);
+                state.daif = state.el1.spsr & PSTATE_DAIF;
+                nextPc = state.el1.elr;
+                clearExclusive(vcpu);
+                recheckInterrupts(vcpu);
+                return false;
+                
+            case MicroOpKind::Barrier:
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                break;
+                
+            case MicroOpKind::Clrex:
+                clearExclusive(vcpu);
+                break;
+                
+            case MicroOpKind::Mrs:
+                {
+                    uint64_t value;
+                    if (!readSysreg(vcpu, static_cast<uint16_t>(op.imm), value)) {
+                        nextPc = undefinedInstruction(vcpu, pc);
+                        return false;
+                    }
+                    setReg(regs, op.rd, value);
+                }
+                break;
+                
+            case MicroOpKind::Msr:
+                if (!writeSysreg(vcpu, static_cast<uint16_t>(op.imm), regs[op.rd])) {
+                    nextPc = undefinedInstruction(vcpu, pc);
+                }
+                return false;
+                
+            case MicroOpKind::MsrImm:
+                if (op.opt == a64::PSTATE_DAIFSET) {
+                    state.daif |= static_cast<uint64_t>(op.imm) << 6;
+                } else if (op.opt == a64::PSTATE_DAIFCLR) {
+                    state.daif &= ~(static_cast<uint64_t>(op.imm) << 6);
+                    recheckInterrupts(vcpu);
+                }
+                return false;
+                
+            case MicroOpKind::Sys:
+                // Only TLB maintenance (CRn == 8) needs work. Guest RAM is
+                // coherent and code writes are caught on store, so DC and
+                // IC are no-ops; AT is not modelled.
+                if (((op.imm >> 7) & 0xF) == 8) {
+                    flushTlbs(vcpu);
+                }
+                return false;
+                
+            case MicroOpKind::Wfi:
+                // The dispatcher parks the thread before the next block
+                vcpu.waitState = VCPU_WAIT_INTERRUPT;
+                return false;
+                
+            case MicroOpKind::Wfe:
+                if (!vcpu.eventRegister.exchange(false, std::memory_order_acq_rel)) {
+                    vcpu.waitState = VCPU_WAIT_EVENT;
+                }
+                return false;
+                
+            case MicroOpKind::Sev:
+                if (op.opt) {
+                    vcpu.eventRegister.store(true, std::memory_order_release);
+                    break;
+                }
+                for (auto& other : vcpus) {
+                    other->eventRegister.store(true, std::memory_order_release);
+                    if (other.get() != &vcpu) {
+                        kick(*other);
+                    }
+                }
+                break;
+                
+            case MicroOpKind::Simd:
+                return executeSimd(vcpu, op, pc, nextPc);
+                
+            case MicroOpKind::Fp:
+                return executeFp(vcpu, op, pc, nextPc);
+                
+            case MicroOpKind::Undefined:
+                LOGE("vCPU %d: undefined instruction 0x%08x at pc 0x%llx", vcpu.id,
+                     static_cast<uint32_t>(op.imm), static_cast<unsigned long long>(pc));
+                nextPc = undefinedInstruction(vcpu, pc);
+                return false;
+        }
+        
+        return true;
+    }
+};
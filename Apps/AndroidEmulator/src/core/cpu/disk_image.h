@@ -0,0 +1,430 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Overlay file layout, in clusters of 1 << clusterBits bytes:
+//
+//   cluster 0     OverlayHeader, then the base image path
+//   cluster 1..   L1 table, one u64 per L2 table
+//   rest          L2 tables and data clusters, allocated at the end
+//
+// An L2 table is one cluster of u64 entries, each the file offset of a
+// data cluster. Zero means not allocated: the cluster still reads from
+// the base image, or as zeroes past its end.
+struct OverlayHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clusterBits;
+    uint64_t size;              // virtual disk size in bytes
+    uint64_t l1Offset;
+    uint32_t l1Entries;
+    uint32_t basePathLength;    // bytes right after the header
+};
+
+// A piece of a disk range as it lies in a file. fd < 0 reads as zeroes.
+struct DiskExtent {
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Disk contents behind a block device. Either a raw image, or a thin
+// copy-on-write overlay over a read-only raw base image. Many instances
+// can share one base, each with an overlay of its own that only holds
+// the clusters it wrote; clusters it never wrote are read from the base
+// file, so instances share them in the page cache.
+//
+// The tables live in memory and are written through to the overlay as
+// clusters are allocated. They are durable once the overlay is synced.
+// Not thread-safe; the block device maps requests under its own lock.
+class DiskImage {
+public:
+    static constexpr char OVERLAY_MAGIC[8] = { 'A', 'E', 'M', 'U', 'O', 'V', 'L', 'Y' };
+    static constexpr uint32_t OVERLAY_VERSION = 1;
+    static constexpr uint32_t CLUSTER_BITS = 16;
+    static constexpr uint32_t MIN_CLUSTER_BITS = 12;
+    static constexpr uint32_t MAX_CLUSTER_BITS = 21;
+    
+    ~DiskImage() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (baseFd >= 0) {
+            close(baseFd);
+        }
+    }
+    
+    DiskImage(const DiskImage&) = delete;
+    DiskImage& operator=(const DiskImage&) = delete;
+    
+    // Opens an overlay or, for any other file, a raw image. An overlay
+    // opens its base image read-only, whatever readOnly says.
+    static std::unique_ptr<DiskImage> open(const std::string& path, bool readOnly, std::string& error) {
+        std::unique_ptr<DiskImage> image(new DiskImage());
+        image->fd = ::open(path.c_str(), (readOnly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+        if (image->fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return nullptr;
+        }
+        uint64_t fileSize;
+        if (!fileSizeOf(image->fd, fileSize, error)) {
+            return nullptr;
+        }
+        
+        OverlayHeader header;
+        if (fileSize < sizeof(header) || !readExact(image->fd, &header, sizeof(header), 0) ||
+            memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0) {
+            image->virtualSize = fileSize;
+            return image;
+        }
+        if (!image->openOverlay(path, header, fileSize, error)) {
+            return nullptr;
+        }
+        return image;
+    }
+    
+    // Writes an empty overlay over basePath, which must be a raw image. A
+    // relative basePath is taken relative to the overlay's directory, so
+    // the pair can move together. Never overwrites an existing file.
+    static bool createOverlay(const std::string& path, const std::string& basePath, std::string& error) {
+        uint32_t clusterSize = 1u << CLUSTER_BITS;
+        if (sizeof(OverlayHeader) + basePath.size() > clusterSize) {
+            error = "base path too long";
+            return false;
+        }
+        
+        int base = ::open(resolveBase(path, basePath).c_str(), O_RDONLY | O_CLOEXEC);
+        if (base < 0) {
+            error = "cannot open base image: " + std::string(strerror(errno));
+            return false;
+        }
+        uint64_t baseSize;
+        bool ok = fileSizeOf(base, baseSize, error) && checkRawBase(base, baseSize, error);
+        close(base);
+        if (!ok) {
+            return false;
+        }
+        
+        OverlayHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+        header.version = OVERLAY_VERSION;
+        header.clusterBits = CLUSTER_BITS;
+        header.size = baseSize;
+        header.l1Offset = clusterSize;
+        header.l1Entries = static_cast<uint32_t>(l1EntriesFor(baseSize, CLUSTER_BITS));
+        header.basePathLength = static_cast<uint32_t>(basePath.size());
+        
+        std::vector<uint8_t> first(clusterSize, 0);
+        memcpy(first.data(), &header, sizeof(header));
+        memcpy(first.data() + sizeof(header), basePath.data(), basePath.size());
+        uint64_t l1Bytes = roundUp(static_cast<uint64_t>(header.l1Entries) * 8, clusterSize);
+        
+        int out = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (out < 0) {
+            error = "create failed: " + std::string(strerror(errno));
+            return false;
+        }
+        // The L1 table starts out as a hole, which reads as all zeroes
+        ok = writeExact(out, first.data(), first.size(), 0) &&
+             ftruncate(out, static_cast<off_t>(clusterSize + l1Bytes)) == 0 && fdatasync(out) == 0;
+        if (!ok) {
+            error = "write failed: " + std::string(strerror(errno));
+            close(out);
+            unlink(path.c_str());
+            return false;
+        }
+        close(out);
+        return true;
+    }
+    
+    uint64_t size() const {
+        return virtualSize;
+    }
+    
+    bool isOverlay() const {
+        return baseFd >= 0;
+    }
+    
+    const char* formatName() const {
+        return isOverlay() ? "overlay" : "raw";
+    }
+    
+    // File a flush has to sync; the base never changes
+    int syncFd() const {
+        return fd;
+    }
+    
+    // Appends where bytes [offset, offset + length) of the disk live, in
+    // order, merging neighbours. For a write, every overlay cluster the
+    // range touches is allocated first, copying in the rest of the
+    // cluster from the base. False if an allocation failed.
+    bool map(uint64_t offset, uint64_t length, bool write, std::vector<DiskExtent>& extents) {
+        if (!isOverlay()) {
+            extents.push_back({ fd, offset, length });
+            return true;
+        }
+        
+        uint64_t clusterSize = 1ull << clusterBits;
+        while (length > 0) {
+            uint64_t inCluster = offset & (clusterSize - 1);
+            uint64_t chunk = std::min(length, clusterSize - inCluster);
+            uint64_t cluster = offset >> clusterBits;
+            
+            uint64_t location = lookup(cluster);
+            if (location == 0 && write && !allocate(cluster, inCluster == 0 && chunk == clusterSize, location)) {
+                return false;
+            }
+            if (location != 0) {
+                append(extents, { fd, location + inCluster, chunk });
+            } else {
+                uint64_t fromBase = offset < baseSize ? std::min(chunk, baseSize - offset) : 0;
+                if (fromBase > 0) {
+                    append(extents, { baseFd, offset, fromBase });
+                }
+                if (fromBase < chunk) {
+                    append(extents, { -1, 0, chunk - fromBase });
+                }
+            }
+            offset += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+    
+private:
+    int fd = -1;                // the raw image, or the overlay
+    int baseFd = -1;
+    uint64_t baseSize = 0;
+    uint64_t virtualSize = 0;
+    
+    uint32_t clusterBits = 0;
+    uint64_t l1Offset = 0;
+    std::vector<uint64_t> l1;
+    std::vector<std::vector<uint64_t>> l2;     // empty where not allocated
+    uint64_t fileEnd = 0;                      // where the next cluster goes
+    
+    DiskImage() = default;
+    
+    static uint64_t roundUp(uint64_t value, uint64_t alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+    
+    static uint64_t l1EntriesFor(uint64_t size, uint32_t bits) {
+        uint64_t clusters = roundUp(size, 1ull << bits) >> bits;
+        uint64_t perTable = 1ull << (bits - 3);
+        return (clusters + perTable - 1) / perTable;
+    }
+    
+    static std::string resolveBase(const std::string& overlayPath, const std::string& basePath) {
+        size_t slash = overlayPath.rfind('/');
+        if (basePath.empty() || basePath[0] == '/' || slash == std::string::npos) {
+            return basePath;
+        }
+        return overlayPath.substr(0, slash + 1) + basePath;
+    }
+    
+    static bool fileSizeOf(int file, uint64_t& size, std::string& error) {
+        struct stat st;
+        if (fstat(file, &st) != 0) {
+            error = "stat failed: " + std::string(strerror(errno));
+            return false;
+        }
+        size = static_cast<uint64_t>(st.st_size);
+        return true;
+    }
+    
+    // Overlays do not stack
+    static bool checkRawBase(int base, uint64_t baseSize, std::string& error) {
+        char magic[sizeof(OVERLAY_MAGIC)];
+        if (baseSize >= sizeof(magic) && readExact(base, magic, sizeof(magic), 0) &&
+            memcmp(magic, OVERLAY_MAGIC, sizeof(magic)) == 0) {
+            error = "base image is itself an overlay";
+            return false;
+        }
+        return true;
+    }
+    
+    static bool readExact(int file, void* data, size_t size, uint64_t offset) {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        while (size > 0) {
+            ssize_t n = pread(file, p, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            offset += n;
+            size -= n;
+        }
+        return true;
+    }
+    
+    static bool writeExact(int file, const void* data, size_t size, uint64_t offset) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t n = pwrite(file, p, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            offset += n;
+            size -= n;
+        }
+        return true;
+    }
+    
+    static void append(std::vector<DiskExtent>& extents, const DiskExtent& extent) {
+        if (!extents.empty()) {
+            DiskExtent& last = extents.back();
+            if (last.fd == extent.fd && (extent.fd < 0 || last.offset + last.length == extent.offset)) {
+                last.length += extent.length;
+                return;
+            }
+        }
+        extents.push_back(extent);
+    }
+    
+    bool openOverlay(const std::string& path, const OverlayHeader& header, uint64_t fileSize, std::string& error) {
+        if (header.version != OVERLAY_VERSION || header.clusterBits < MIN_CLUSTER_BITS ||
+            header.clusterBits > MAX_CLUSTER_BITS) {
+            error = "unsupported overlay version or cluster size";
+            return false;
+        }
+        uint64_t clusterSize = 1ull << header.clusterBits;
+        uint64_t l1Bytes = static_cast<uint64_t>(header.l1Entries) * 8;
+        if (header.l1Entries != l1EntriesFor(header.size, header.clusterBits) ||
+            sizeof(header) + header.basePathLength > clusterSize || (header.l1Offset & (clusterSize - 1)) != 0 ||
+            header.l1Offset == 0 || header.l1Offset + l1Bytes > fileSize) {
+            error = "corrupt overlay header";
+            return false;
+        }
+        clusterBits = header.clusterBits;
+        virtualSize = header.size;
+        l1Offset = header.l1Offset;
+        fileEnd = roundUp(fileSize, clusterSize);
+        
+        std::string basePath(header.basePathLength, '\0');
+        if (!readExact(fd, &basePath[0], basePath.size(), sizeof(header))) {
+            error = "cannot read base path";
+            return false;
+        }
+        baseFd = ::open(resolveBase(path, basePath).c_str(), O_RDONLY | O_CLOEXEC);
+        if (baseFd < 0) {
+            error = "cannot open base image " + basePath + ": " + strerror(errno);
+            return false;
+        }
+        if (!fileSizeOf(baseFd, baseSize, error) || !checkRawBase(baseFd, baseSize, error)) {
+            return false;
+        }
+        
+        // Pull every table into memory, checking that it and everything
+        // it points at are clusters inside the file
+        l1.assign(header.l1Entries, 0);
+        l2.assign(header.l1Entries, std::vector<uint64_t>());
+        if (!readExact(fd, l1.data(), l1Bytes, l1Offset)) {
+            error = "cannot read L1 table";
+            return false;
+        }
+        size_t perTable = clusterSize / 8;
+        for (size_t i = 0; i < l1.size(); i++) {
+            if (l1[i] == 0) {
+                continue;
+            }
+            std::vector<uint64_t>& table = l2[i];
+            table.assign(perTable, 0);
+            if (!validCluster(l1[i]) || !readExact(fd, table.data(), clusterSize, l1[i])) {
+                error = "corrupt L1 table";
+                return false;
+            }
+            for (uint64_t entry : table) {
+                if (entry != 0 && !validCluster(entry)) {
+                    error = "corrupt L2 table";
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    
+    // Past the header and the L1 table and inside the file
+    bool validCluster(uint64_t offset) const {
+        uint64_t clusterSize = 1ull << clusterBits;
+        uint64_t l1End = roundUp(l1Offset + l1.size() * 8, clusterSize);
+        return (offset & (clusterSize - 1)) == 0 && offset >= l1End && offset + clusterSize <= fileEnd;
+    }
+    
+    // Overlay offset of a cluster, 0 if it is not allocated
+    uint64_t lookup(uint64_t cluster) const {
+        uint64_t index = cluster >> (clusterBits - 3);
+        if (index >= l2.size() || l2[index].empty()) {
+            return 0;
+        }
+        return l2[index][cluster & ((1ull << (clusterBits - 3)) - 1)];
+    }
+    
+    // Gives the cluster a place in the overlay holding its current
+    // contents, unless the caller is about to overwrite all of it. The
+    // data goes in before the table entries that point at it.
+    bool allocate(uint64_t cluster, bool overwritten, uint64_t& location) {
+        uint64_t clusterSize = 1ull << clusterBits;
+        uint64_t index = cluster >> (clusterBits - 3);
+        uint64_t slot = cluster & ((1ull << (clusterBits - 3)) - 1);
+        if (index >= l2.size()) {
+            return false;
+        }
+        
+        uint64_t at = fileEnd;
+        if (overwritten) {
+            // Still inside the file should the write never land
+            if (ftruncate(fd, static_cast<off_t>(at + clusterSize)) != 0) {
+                return false;
+            }
+        } else {
+            std::vector<uint8_t> data(clusterSize, 0);
+            uint64_t start = cluster << clusterBits;
+            uint64_t fromBase = start < baseSize ? std::min(clusterSize, baseSize - start) : 0;
+            if ((fromBase > 0 && !readExact(baseFd, data.data(), fromBase, start)) ||
+                !writeExact(fd, data.data(), clusterSize, at)) {
+                return false;
+            }
+        }
+        
+        uint64_t next = at + clusterSize;
+        if (l2[index].empty()) {
+            // A fresh L2 table right after the data cluster
+            std::vector<uint64_t> table(clusterSize / 8, 0);
+            table[slot] = at;
+            uint64_t tableAt = next;
+            if (!writeExact(fd, table.data(), clusterSize, tableAt) ||
+                !writeExact(fd, &tableAt, sizeof(tableAt), l1Offset + index * 8)) {
+                return false;
+            }
+            l1[index] = tableAt;
+            l2[index] = std::move(table);
+            next += clusterSize;
+        } else if (!writeExact(fd, &at, sizeof(at), l1[index] + slot * 8)) {
+            return false;
+        } else {
+            l2[index][slot] = at;
+        }
+        fileEnd = next;
+        location = at;
+        return true;
+    }
+};
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+#include <random>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "guest_memory.h"
+#include "profiler.h"
+
+// Where a loaded image starts running
+struct ElfImage {
+    uint64_t entry;
+    uint64_t stackPointer;
+    uint64_t end;           // past everything loaded; a process heap starts here
+    std::vector<GuestSymbol> symbols;
+};
+
+// Loads an AArch64 ELF64 executable or shared object into guest RAM the
+// way the Linux kernel starts a process. The guest runs with the MMU off,
+// so virtual addresses are guest physical addresses.
+//
+// PT_LOAD segments are mapped copy-on-write straight from the file, so
+// loading costs a few mmap calls however large the image is, and pages
+// the guest never touches are never read. BSS beyond the last file page
+// is fresh anonymous memory. A segment whose file offset and address do
+// not agree modulo the host page size, or that shares a host page with
+// the previous segment, is read in instead.
+//
+// load() ignores PT_INTERP and applies no relocations, so shared objects
+// are mapped but not ready to run. loadProcess() also maps the program
+// interpreter, the dynamic linker, which then loads the libraries itself
+// through the guest's mmap calls.
+class ElfLoader {
+public:
+    // Shared objects are placed here
+    static constexpr uint64_t DYN_BASE = 0x10000;
+    
+    // Room left for the stack below the top of RAM
+    static constexpr uint64_t STACK_SIZE = 1024 * 1024;
+    
+    static bool load(const std::string& path, GuestMemory& memory, ElfImage& image, std::string& error) {
+        return loadProcess(path, { path }, {}, false, memory, image, error);
+    }
+    
+    // As the kernel starts a program with args as argv and env as envp;
+    // argv[0] is path when args is empty. With interpreter, an image that
+    // names one starts in it, loaded after the image itself.
+    static bool loadProcess(const std::string& path, const std::vector<std::string>& args,
+                            const std::vector<std::string>& env, bool interpreter, GuestMemory& memory,
+                            ElfImage& image, std::string& error) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return false;
+        }
+        MappedImage program;
+        bool ok = mapImage(fd, memory, DYN_BASE, program, error);
+        if (ok) {
+            image.symbols = readSymbols(fd, program.header, program.bias);
+        }
+        close(fd);
+        if (!ok) {
+            return false;
+        }
+        
+        image.entry = program.entry;
+        image.end = program.end;
+        uint64_t interpreterBase = 0;
+        if (interpreter && !program.interpreter.empty()) {
+            MappedImage linker;
+            fd = open(program.interpreter.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                error = "interpreter " + program.interpreter + ": " + strerror(errno);
+                return false;
+            }
+            ok = mapImage(fd, memory, program.end, linker, error);
+            close(fd);
+            if (!ok) {
+                error = "interpreter " + program.interpreter + ": " + error;
+                return false;
+            }
+            if (linker.header.e_type != ET_DYN) {
+                error = "interpreter " + program.interpreter + " is not a shared object";
+                return false;
+            }
+            image.entry = linker.entry;
+            image.end = linker.end;
+            interpreterBase = linker.bias;
+        }
+        
+        std::vector<std::string> argv = args.empty() ? std::vector<std::string>{ path } : args;
+        image.stackPointer = buildStack(memory, path, argv, env, program, interpreterBase);
+        if (image.stackPointer == 0) {
+            error = "arguments do not fit on the stack";
+            return false;
+        }
+        return true;
+    }
+    
+private:
+    // HWCAP_FP, HWCAP_ASIMD and HWCAP_ATOMICS
+    static constexpr uint64_t HWCAP = (1u << 0) | (1u << 1) | (1u << 8);
+    
+    // Where mapImage put an image
+    struct MappedImage {
+        Elf64_Ehdr header;
+        uint64_t bias;
+        uint64_t entry;
+        uint64_t phdrAddress;
+        uint64_t end;
+        std::string interpreter;
+    };
+    
+    // Maps the segments of an image. A shared object is placed at the
+    // first address from base that keeps its segment alignment.
+    static bool mapImage(int fd, GuestMemory& memory, uint64_t base, MappedImage& image, std::string& error) {
+        Elf64_Ehdr& header = image.header;
+        if (!readAll(fd, &header, sizeof(header), 0) || memcmp(header.e_ident, ELFMAG, SELFMAG) != 0) {
+            error = "not an ELF file";
+            return false;
+        }
+        if (header.e_ident[EI_CLASS] != ELFCLASS64 || header.e_ident[EI_DATA] != ELFDATA2LSB ||
+            header.e_machine != EM_AARCH64 || (header.e_type != ET_EXEC && header.e_type != ET_DYN) ||
+            header.e_phentsize != sizeof(Elf64_Phdr)) {
+            error = "not a little-endian AArch64 ELF64 executable or shared object";
+            return false;
+        }
+        
+        std::vector<Elf64_Phdr> segments(header.e_phnum);
+        if (!readAll(fd, segments.data(), segments.size() * sizeof(Elf64_Phdr), header.e_phoff)) {
+            error = "truncated program headers";
+            return false;
+        }
+        
+        uint64_t pageSize = GuestMemory::hostPageSize();
+        uint64_t lowest = ~0ull;
+        uint64_t align = pageSize;
+        for (const Elf64_Phdr& segment : segments) {
+            if (segment.p_type == PT_LOAD) {
+                lowest = std::min(lowest, segment.p_vaddr);
+                align = std::max<uint64_t>(align, segment.p_align);
+            }
+        }
+        if (lowest == ~0ull) {
+            error = "no loadable segments";
+            return false;
+        }
+        
+        // Executables run where they were linked
+        uint64_t bias = 0;
+        if (header.e_type == ET_DYN) {
+            bias = ((base + align - 1) & ~(align - 1)) - (lowest & ~(align - 1));
+        }
+        
+        uint64_t limit = memory.size() > STACK_SIZE ? memory.size() - STACK_SIZE : 0;
+        uint64_t mappedEnd = 0;
+        uint64_t phdrAddress = 0;
+        for (const Elf64_Phdr& segment : segments) {
+            if (segment.p_type == PT_PHDR) {
+                phdrAddress = segment.p_vaddr + bias;
+            }
+            if (segment.p_type == PT_INTERP && segment.p_filesz > 1 && segment.p_filesz <= PATH_MAX) {
+                std::vector<char> name(segment.p_filesz);
+                if (!readAll(fd, name.data(), name.size(), segment.p_offset)) {
+                    error = "truncated interpreter name";
+                    return false;
+                }
+                image.interpreter.assign(name.data(), strnlen(name.data(), name.size()));
+            }
+            if (segment.p_type != PT_LOAD || segment.p_memsz == 0) {
+                continue;
+            }
+            
+            uint64_t start = segment.p_vaddr + bias;
+            if (segment.p_filesz > segment.p_memsz || start > limit || segment.p_memsz > limit - start) {
+                error = "segment does not fit in guest RAM";
+                return false;
+            }
+            if (phdrAddress == 0 && header.e_phoff >= segment.p_offset &&
+                header.e_phoff - segment.p_offset < segment.p_filesz) {
+                phdrAddress = start + (header.e_phoff - segment.p_offset);
+            }
+            if (!loadSegment(fd, memory, segment, start, pageSize, mappedEnd)) {
+                error = "mapping segment failed: " + std::string(strerror(errno));
+                return false;
+            }
+        }
+        
+        image.bias = bias;
+        image.entry = header.e_entry + bias;
+        image.phdrAddress = phdrAddress;
+        image.end = mappedEnd;
+        return true;
+    }
+    
+    static bool loadSegment(int fd, GuestMemory& memory, const Elf64_Phdr& segment, uint64_t start,
+                            uint64_t pageSize, uint64_t& mappedEnd) {
+        uint64_t fileEnd = start + segment.p_filesz;
+        uint64_t mapStart = start & ~(pageSize - 1);
+        uint64_t mapEnd = (fileEnd + pageSize - 1) & ~(pageSize - 1);
+        bool mappable = ((start - segment.p_offset) & (pageSize - 1)) == 0 && mapStart >= mappedEnd;
+        
+        if (segment.p_filesz > 0) {
+            if (mappable) {
+                if (!memory.mapFileRange(mapStart, mapEnd - mapStart, fd,
+                                         static_cast<off_t>(segment.p_offset - (start - mapStart)))) {
+                    return false;
+                }
+                // The last page also maps whatever follows the segment in
+                // the file
+                memory.zeroRange(fileEnd, mapEnd - fileEnd);
+            } else {
+                if (!readAll(fd, memory.data() + start, segment.p_filesz, segment.p_offset)) {
+                    return false;
+                }
+                memory.markDirtyRange(start, segment.p_filesz);
+            }
+        }
+        
+        // BSS
+        memory.zeroRange(fileEnd, start + segment.p_memsz - fileEnd);
+        mappedEnd = std::max(mappedEnd, (start + segment.p_memsz + pageSize - 1) & ~(pageSize - 1));
+        return true;
+    }
+    
+    // Initial process stack at the top of RAM, as the kernel lays it out:
+    // argc, argv, envp and the auxiliary vector, followed by the strings
+    // they point to. Returns the initial SP, which points at argc, or 0
+    // if the strings take up too much of the stack.
+    static uint64_t buildStack(GuestMemory& memory, const std::string& path, const std::vector<std::string>& argv,
+                               const std::vector<std::string>& env, const MappedImage& program,
+                               uint64_t interpreterBase) {
+        uint64_t top = memory.size() & ~15ull;
+        uint64_t bottom = top - STACK_SIZE / 2;
+        uint64_t next = top;
+        auto push = [&](const std::string& text) {
+            next = (next - text.size() - 1) & ~15ull;
+            if (next >= bottom) {
+                memcpy(memory.data() + next, text.c_str(), text.size() + 1);
+            }
+            return next;
+        };
+        
+        uint64_t pathAddress = push(path);
+        std::vector<uint64_t> words = { argv.size() };
+        for (const std::string& arg : argv) {
+            words.push_back(push(arg));
+        }
+        words.push_back(0);
+        for (const std::string& var : env) {
+            words.push_back(push(var));
+        }
+        words.push_back(0);
+        if (next < bottom) {
+            return 0;
+        }
+        
+        uint64_t randomAddress = next - 16;
+        std::random_device device;
+        for (unsigned i = 0; i < 16; i += 4) {
+            uint32_t word = device();
+            memcpy(memory.data() + randomAddress + i, &word, sizeof(word));
+        }
+        
+        const uint64_t auxv[][2] = {
+            { AT_PHDR, program.phdrAddress },
+            { AT_PHENT, sizeof(Elf64_Phdr) },
+            { AT_PHNUM, program.header.e_phnum },
+            { AT_PAGESZ, GuestMemory::PAGE_SIZE },
+            { AT_BASE, interpreterBase },
+            { AT_FLAGS, 0 },
+            { AT_ENTRY, program.entry },
+            { AT_UID, 0 },
+            { AT_EUID, 0 },
+            { AT_GID, 0 },
+            { AT_EGID, 0 },
+            { AT_SECURE, 0 },
+            { AT_HWCAP, HWCAP },
+            { AT_RANDOM, randomAddress },
+            { AT_EXECFN, pathAddress },
+            { AT_NULL, 0 }
+        };
+        
+        for (const auto& pair : auxv) {
+            words.push_back(pair[0]);
+            words.push_back(pair[1]);
+        }
+        
+        uint64_t sp = (randomAddress - words.size() * sizeof(uint64_t)) & ~15ull;
+        memcpy(memory.data() + sp, words.data(), words.size() * sizeof(uint64_t));
+        memory.markDirtyRange(sp, top - sp);
+        return sp;
+    }
+    
+    // Function symbols from .symtab, or .dynsym when the image is
+    // stripped, for profiles. Missing or malformed tables give none.
+    static std::vector<GuestSymbol> readSymbols(int fd, const Elf64_Ehdr& header, uint64_t bias) {
+        std::vector<GuestSymbol> symbols;
+        if (header.e_shoff == 0 || header.e_shentsize != sizeof(Elf64_Shdr)) {
+            return symbols;
+        }
+        std::vector<Elf64_Shdr> sections(header.e_shnum);
+        if (!readAll(fd, sections.data(), sections.size() * sizeof(Elf64_Shdr), header.e_shoff)) {
+            return symbols;
+        }
+        
+        const Elf64_Shdr* table = nullptr;
+        for (const Elf64_Shdr& section : sections) {
+            if (section.sh_type == SHT_SYMTAB || (section.sh_type == SHT_DYNSYM && table == nullptr)) {
+                table = &section;
+            }
+        }
+        if (table == nullptr || table->sh_link >= sections.size() || table->sh_entsize != sizeof(Elf64_Sym)) {
+            return symbols;
+        }
+        
+        const Elf64_Shdr& strtab = sections[table->sh_link];
+        std::vector<Elf64_Sym> entries(table->sh_size / sizeof(Elf64_Sym));
+        std::vector<char> names(strtab.sh_size + 1, '\0');
+        if (!readAll(fd, entries.data(), entries.size() * sizeof(Elf64_Sym), table->sh_offset) ||
+            !readAll(fd, names.data(), strtab.sh_size, strtab.sh_offset)) {
+            return symbols;
+        }
+        
+        for (const Elf64_Sym& entry : entries) {
+            if (ELF64_ST_TYPE(entry.st_info) == STT_FUNC && entry.st_value != 0 && entry.st_name < strtab.sh_size) {
+                symbols.push_back({ entry.st_value + bias, entry.st_size, names.data() + entry.st_name });
+            }
+        }
+        return symbols;
+    }
+    
+    static bool readAll(int fd, void* data, size_t size, uint64_t offset) {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        while (size > 0) {
+            ssize_t got = pread(fd, p, size, static_cast<off_t>(offset));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += got;
+            size -= got;
+            offset += got;
+        }
+        return true;
+    }
+};
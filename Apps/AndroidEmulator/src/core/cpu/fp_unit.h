@@ -0,0 +1,376 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#include "a64_decoder.h"
+#include "simd.h"
+#include "vcpu.h"
+
+// FPCR fields the emulator honours
+constexpr uint64_t FPCR_RMODE_SHIFT = 22;
+constexpr uint64_t FPCR_RMODE = 3ull << FPCR_RMODE_SHIFT;
+constexpr uint64_t FPCR_FZ = 1ull << 24;
+constexpr uint64_t FPCR_DN = 1ull << 25;
+
+// The host FPU's rounding mode and denormal flushing, kept in step with
+// the guest's FPCR.
+//
+// Guest FP runs on host instructions, which round and flush according to
+// MXCSR on x86-64 and FPCR on arm64. Writing either register is slow
+// (LDMXCSR and MSR FPCR serialize the FP pipeline), so the setting is not
+// saved and restored around guest instructions. Each host thread caches
+// the FPCR value it last applied, and apply() only touches the hardware
+// when the vCPU running on the thread has a different one: once after a
+// guest writes FPCR, and never in a loop that does not.
+//
+// Threads start with the host default, which is what a guest FPCR of
+// zero asks for: round to nearest even, no flushing.
+class HostFpEnvironment {
+public:
+    static void apply(uint64_t fpcr) {
+        uint64_t mode = fpcr & (FPCR_RMODE | FPCR_FZ);
+        uint64_t& current = applied();
+        if (mode != current) {
+            write(mode);
+            current = mode;
+        }
+    }
+    
+    // Back to the host default, for threads that stop running guest code
+    static void reset() {
+        apply(0);
+    }
+    
+private:
+    static uint64_t& applied() {
+        thread_local uint64_t mode = 0;
+        return mode;
+    }
+    
+    // The memory clobber keeps the compiler from moving FP loads, and the
+    // arithmetic depending on them, across the mode change
+    static void write(uint64_t mode) {
+#if defined(__aarch64__)
+        uint64_t fpcr;
+        asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+        fpcr = (fpcr & ~(FPCR_RMODE | FPCR_FZ)) | mode;
+        asm volatile("msr fpcr, %0" : : "r"(fpcr) : "memory");
+#else
+        // MXCSR.RC orders the directed modes the other way round from
+        // FPCR.RMode. FZ flushes denormal inputs (DAZ) and results (FTZ).
+        static constexpr uint32_t ROUNDING[4] = { 0x0000, 0x4000, 0x2000, 0x6000 };
+        constexpr uint32_t MXCSR_RC = 0x6000;
+        constexpr uint32_t MXCSR_FTZ = 0x8000;
+        constexpr uint32_t MXCSR_DAZ = 0x0040;
+        uint32_t csr;
+        asm volatile("stmxcsr %0" : "=m"(csr));
+        csr &= ~(MXCSR_RC | MXCSR_FTZ | MXCSR_DAZ);
+        csr |= ROUNDING[(mode & FPCR_RMODE) >> FPCR_RMODE_SHIFT];
+        if (mode & FPCR_FZ) {
+            csr |= MXCSR_FTZ | MXCSR_DAZ;
+        }
+        asm volatile("ldmxcsr %0" : : "m"(csr) : "memory");
+#endif
+    }
+};
+
+// Executes decoded scalar floating-point ops (MicroOpKind::Fp) in single
+// and double precision. Arithmetic, square root, fused multiply-add and
+// conversions are single host instructions, which round as FPCR says
+// once HostFpEnvironment::apply() has run for the vCPU. What the host
+// does differently from the architecture is patched up afterwards, off
+// the common path:
+//
+//   - a NaN result goes through the Arm NaN rules (signalling before
+//     quiet, first operand first, the positive default NaN, FPCR.DN);
+//     x86 returns the first operand's NaN and a negative default NaN
+//   - FMAX/FMIN and their NM forms, and the rounding of FRINT* and
+//     FCVT{N,P,M,Z,A}{S,U}, are worked out in software
+//
+// x86 flushes to zero after rounding while Arm flushes before, so with FZ
+// set a result just below the smallest normal may round up there on x86
+// instead of becoming zero. FPSR's cumulative exception bits are not
+// raised.
+class FpUnit {
+public:
+    // v is the V register file, x the general registers. conditionHeld is
+    // the outcome of the condition of FCSEL and FCCMP. Compares store
+    // their result in nzcv. False for an op this unit does not implement.
+    static bool execute(const MicroOp& op, Vec128* v, uint64_t* x, uint64_t fpcr, bool conditionHeld, uint64_t& nzcv) {
+        if (op.shift == 2) {
+            return run<float>(op, v, x, fpcr, conditionHeld, nzcv);
+        }
+        return run<double>(op, v, x, fpcr, conditionHeld, nzcv);
+    }
+    
+    static bool setsFlags(const MicroOp& op) {
+        return op.opt == a64::FP_CMP || op.opt == a64::FP_CMP_ZERO || op.opt == a64::FP_CCMP;
+    }
+    
+private:
+    template <typename F>
+    using Bits = typename std::conditional<sizeof(F) == 4, uint32_t, uint64_t>::type;
+    
+    template <typename F>
+    static F get(const Vec128& reg) {
+        Bits<F> bits = static_cast<Bits<F>>(reg.lo);
+        F value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    
+    template <typename F>
+    static Bits<F> bitsOf(F value) {
+        Bits<F> bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+    
+    template <typename F>
+    static F fromBits(Bits<F> bits) {
+        F value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    
+    // Scalar writes clear the rest of the V register
+    template <typename F>
+    static void put(Vec128& reg, F value) {
+        reg = Vec128{ bitsOf(value), 0 };
+    }
+    
+    static void setGeneral(uint64_t* x, uint8_t reg, uint64_t value) {
+        x[reg] = value;
+        x[REG_ZR] = 0;
+    }
+    
+    template <typename F>
+    static constexpr Bits<F> quietBit() {
+        return Bits<F>(1) << (std::numeric_limits<F>::digits - 2);
+    }
+    
+    template <typename F>
+    static bool isSignalling(F value) {
+        return std::isnan(value) && !(bitsOf(value) & quietBit<F>());
+    }
+    
+    template <typename F>
+    static F defaultNaN() {
+        Bits<F> exponent = static_cast<Bits<F>>(~Bits<F>(0) >> 1) & ~(quietBit<F>() - 1);
+        return fromBits<F>(exponent);
+    }
+    
+    template <typename F>
+    static F processNaN(F value, uint64_t fpcr) {
+        if (fpcr & FPCR_DN) {
+            return defaultNaN<F>();
+        }
+        return fromBits<F>(bitsOf(value) | quietBit<F>());
+    }
+    
+    // FPProcessNaNs(): a signalling NaN wins over a quiet one, and earlier
+    // operands over later ones. count is 2 or 3.
+    template <typename F>
+    static F processNaNs(const F* operands, unsigned count, uint64_t fpcr) {
+        for (unsigned i = 0; i < count; i++) {
+            if (isSignalling(operands[i])) {
+                return processNaN(operands[i], fpcr);
+            }
+        }
+        for (unsigned i = 0; i < count; i++) {
+            if (std::isnan(operands[i])) {
+                return processNaN(operands[i], fpcr);
+            }
+        }
+        return defaultNaN<F>();
+    }
+    
+    // The host produced a NaN; replace it with the one Arm would
+    template <typename F>
+    static F fixNaN(F result, const F* operands, unsigned count, uint64_t fpcr) {
+        if (!std::isnan(result)) {
+            return result;
+        }
+        return processNaNs(operands, count, fpcr);
+    }
+    
+    // Rounds to an integral value in mode, an a64::FpRounding. The sign
+    // of a zero result follows the operand.
+    template <typename F>
+    static F roundToIntegral(F value, unsigned mode, uint64_t fpcr) {
+        if (!std::isfinite(value)) {
+            return std::isnan(value) ? processNaN(value, fpcr) : value;
+        }
+        if (mode == a64::FP_ROUND_FPCR) {
+            mode = static_cast<unsigned>((fpcr & FPCR_RMODE) >> FPCR_RMODE_SHIFT);
+        }
+        F r;
+        switch (mode) {
+            case a64::FP_ROUND_POSINF: r = std::ceil(value); break;
+            case a64::FP_ROUND_NEGINF: r = std::floor(value); break;
+            case a64::FP_ROUND_ZERO: r = std::trunc(value); break;
+            case a64::FP_ROUND_TIEAWAY: r = std::round(value); break;
+            default: {
+                // Nearest, ties to even. value - floor(value) is exact.
+                r = std::floor(value);
+                F fraction = value - r;
+                if (fraction > F(0.5) || (fraction == F(0.5) && std::fmod(r, F(2)) != 0)) {
+                    r += 1;
+                }
+                break;
+            }
+        }
+        return r == 0 ? std::copysign(F(0), value) : r;
+    }
+    
+    // FMAX, FMIN and the NM forms, which take a number over a quiet NaN.
+    // Zeros of either sign are ordered -0 < +0.
+    template <typename F>
+    static F maxMin(F a, F b, bool max, bool numeric, uint64_t fpcr) {
+        if (std::isnan(a) || std::isnan(b)) {
+            if (numeric && !isSignalling(a) && !isSignalling(b)) {
+                if (!std::isnan(a)) {
+                    return a;
+                }
+                if (!std::isnan(b)) {
+                    return b;
+                }
+            }
+            F operands[2] = { a, b };
+            return processNaNs(operands, 2, fpcr);
+        }
+        if (a == b) {
+            return std::signbit(a) == max ? b : a;
+        }
+        return (a > b) == max ? a : b;
+    }
+    
+    // NZCV of FCMP: N for less, ZC for equal, C for greater, CV for
+    // unordered
+    template <typename F>
+    static uint64_t compare(F a, F b) {
+        if (std::isnan(a) || std::isnan(b)) {
+            return PSTATE_C | PSTATE_V;
+        }
+        if (a == b) {
+            return PSTATE_Z | PSTATE_C;
+        }
+        return a < b ? PSTATE_N : PSTATE_C;
+    }
+    
+    // FCVT*S/U: round in mode, then saturate; NaN converts to zero
+    template <typename I, typename F>
+    static uint64_t toInt(F value, unsigned mode, uint64_t fpcr) {
+        if (std::isnan(value)) {
+            return 0;
+        }
+        F rounded = roundToIntegral(value, mode, fpcr);
+        if (rounded <= static_cast<F>(std::numeric_limits<I>::min())) {
+            return static_cast<uint64_t>(std::numeric_limits<I>::min());
+        }
+        if (rounded >= static_cast<F>(std::numeric_limits<I>::max())) {
+            return static_cast<uint64_t>(std::numeric_limits<I>::max());
+        }
+        return static_cast<uint64_t>(static_cast<I>(rounded));
+    }
+    
+    template <typename F>
+    static bool run(const MicroOp& op, Vec128* v, uint64_t* x, uint64_t fpcr, bool conditionHeld, uint64_t& nzcv) {
+        F a = get<F>(v[op.rn]);
+        F b = get<F>(v[op.rm]);
+        F operands[3] = { a, b, F(0) };
+        Vec128& d = v[op.rd];
+        unsigned mode = static_cast<unsigned>(op.imm);
+        bool wide = op.flags & OP_SF;
+        
+        switch (op.opt) {
+            case a64::FP_MOV: put(d, a); break;
+            case a64::FP_ABS: put(d, fromBits<F>(bitsOf(a) & ~(Bits<F>(1) << (8 * sizeof(F) - 1)))); break;
+            case a64::FP_NEG: put(d, fromBits<F>(bitsOf(a) ^ (Bits<F>(1) << (8 * sizeof(F) - 1)))); break;
+            case a64::FP_SQRT: put(d, fixNaN(std::sqrt(a), operands, 1, fpcr)); break;
+            case a64::FP_RINT: put(d, roundToIntegral(a, mode, fpcr)); break;
+            case a64::FP_CVT:
+                // To the other precision; NaNs keep their sign and the top
+                // of their payload, as on the guest
+                if (std::is_same<F, float>::value) {
+                    double r = static_cast<double>(a);
+                    put(d, std::isnan(a) ? processNaN(r, fpcr) : r);
+                } else {
+                    float r = static_cast<float>(a);
+                    put(d, std::isnan(a) ? processNaN(r, fpcr) : r);
+                }
+                break;
+                
+            case a64::FP_ADD: put(d, fixNaN(a + b, operands, 2, fpcr)); break;
+            case a64::FP_SUB: put(d, fixNaN(a - b, operands, 2, fpcr)); break;
+            case a64::FP_MUL: put(d, fixNaN(a * b, operands, 2, fpcr)); break;
+            case a64::FP_DIV: put(d, fixNaN(a / b, operands, 2, fpcr)); break;
+            case a64::FP_NMUL: put(d, fixNaN(-(a * b), operands, 2, fpcr)); break;
+            case a64::FP_MAX: put(d, maxMin(a, b, true, false, fpcr)); break;
+            case a64::FP_MIN: put(d, maxMin(a, b, false, false, fpcr)); break;
+            case a64::FP_MAXNM: put(d, maxMin(a, b, true, true, fpcr)); break;
+            case a64::FP_MINNM: put(d, maxMin(a, b, false, true, fpcr)); break;
+            
+            case a64::FP_MADD:
+            case a64::FP_MSUB:
+            case a64::FP_NMADD:
+            case a64::FP_NMSUB: {
+                // One rounding; negating an operand is exact
+                F addend = get<F>(v[op.ra]);
+                bool negateProduct = op.opt == a64::FP_MSUB || op.opt == a64::FP_NMADD;
+                bool negateAddend = op.opt == a64::FP_NMADD || op.opt == a64::FP_NMSUB;
+                F r = std::fma(negateProduct ? -a : a, b, negateAddend ? -addend : addend);
+                if (std::isnan(r)) {
+                    // A quiet NaN addend does not hide an invalid product
+                    bool invalid = (std::isinf(a) && b == 0) || (a == 0 && std::isinf(b));
+                    F ordered[3] = { addend, a, b };
+                    r = invalid && std::isnan(addend) && !isSignalling(addend) ? defaultNaN<F>()
+                                                                               : processNaNs(ordered, 3, fpcr);
+                }
+                put(d, r);
+                break;
+            }
+            
+            case a64::FP_CMP: nzcv = compare(a, b); break;
+            case a64::FP_CMP_ZERO: nzcv = compare(a, F(0)); break;
+            case a64::FP_CCMP: nzcv = conditionHeld ? compare(a, b) : static_cast<uint64_t>(op.ra) << 28; break;
+            case a64::FP_CSEL: put(d, conditionHeld ? a : b); break;
+            case a64::FP_MOV_IMM: d = Vec128{ static_cast<uint64_t>(op.imm), 0 }; break;
+            
+            // Conversions from and to general registers
+            case a64::FP_SCVTF:
+                put(d, wide ? static_cast<F>(static_cast<int64_t>(x[op.rn]))
+                            : static_cast<F>(static_cast<int32_t>(x[op.rn])));
+                break;
+            case a64::FP_UCVTF:
+                put(d, wide ? static_cast<F>(x[op.rn]) : static_cast<F>(static_cast<uint32_t>(x[op.rn])));
+                break;
+            case a64::FP_CVTS:
+                setGeneral(x, op.rd, wide ? toInt<int64_t>(a, mode, fpcr)
+                                          : static_cast<uint32_t>(toInt<int32_t>(a, mode, fpcr)));
+                break;
+            case a64::FP_CVTU:
+                setGeneral(x, op.rd, wide ? toInt<uint64_t>(a, mode, fpcr) : toInt<uint32_t>(a, mode, fpcr));
+                break;
+            case a64::FP_MOV_TO_GENERAL:
+                setGeneral(x, op.rd, op.imm ? v[op.rn].hi : static_cast<uint64_t>(bitsOf(a)));
+                break;
+            case a64::FP_MOV_FROM_GENERAL:
+                if (op.imm) {
+                    // FMOV Vd.D[1], Xn keeps the lower half
+                    d.hi = x[op.rn];
+                } else {
+                    d = Vec128{ wide ? x[op.rn] : x[op.rn] & 0xFFFFFFFFull, 0 };
+                }
+                break;
+                
+            default:
+                return false;
+        }
+        return true;
+    }
+};
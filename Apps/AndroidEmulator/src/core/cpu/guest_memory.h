@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Guest RAM as one anonymous reservation. Nothing is committed up front:
+// pages are faulted in (zero-filled) by the kernel on first touch, and
+// reset() hands touched pages back instead of writing zeros over all of
+// them, so the cost of both is proportional to what the guest used.
+//
+// RAM can also be replaced by a private (copy-on-write) view of a file,
+// which is how snapshots are restored. A per-page dirty map records what
+// the guest wrote since the last clearDirty().
+//
+// With a reservation larger than size, RAM is placed at the start of that
+// much address space and the remainder stays inaccessible, so stray
+// accesses past the end of RAM fault instead of touching host memory.
+class GuestMemory {
+public:
+    static constexpr unsigned PAGE_SHIFT = 12;
+    static constexpr uint64_t PAGE_SIZE = 1ull << PAGE_SHIFT;
+    
+    explicit GuestMemory(size_t size, size_t reservation = 0) :
+        length(size),
+        reservedLength(std::max(size, reservation)),
+        numPages((size + PAGE_SIZE - 1) >> PAGE_SHIFT),
+        dirty(new std::atomic<uint8_t>[numPages]()) {
+        int prot = reservedLength > length ? PROT_NONE : PROT_READ | PROT_WRITE;
+        void* mem = mmap(nullptr, reservedLength, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        base = static_cast<uint8_t*>(mem);
+        if (prot == PROT_NONE && mprotect(base, length, PROT_READ | PROT_WRITE) != 0) {
+            munmap(base, reservedLength);
+            throw std::bad_alloc();
+        }
+    }
+    
+    ~GuestMemory() {
+        munmap(base, reservedLength);
+    }
+    
+    GuestMemory(const GuestMemory&) = delete;
+    GuestMemory& operator=(const GuestMemory&) = delete;
+    
+    uint8_t* data() const {
+        return base;
+    }
+    
+    size_t size() const {
+        return length;
+    }
+    
+    // Address space owned starting at data(); only the first size() bytes
+    // are accessible
+    size_t reserved() const {
+        return reservedLength;
+    }
+    
+    size_t pageCount() const {
+        return numPages;
+    }
+    
+    // One byte per page, for code that marks stores itself
+    std::atomic<uint8_t>* dirtyMap() const {
+        return dirty.get();
+    }
+    
+    // Zeroes all of guest RAM and clears the dirty map. Private anonymous
+    // pages read back as zero after MADV_DONTNEED, and the kernel only has
+    // work to do for pages that were actually populated.
+    void reset() {
+        if (fileBacked) {
+            // DONTNEED would bring back the file contents; swap in fresh
+            // anonymous memory at the same address instead.
+            void* mem = mmap(base, length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            if (mem == MAP_FAILED) {
+                memset(base, 0, length);
+            }
+            fileBacked = false;
+        } else if (madvise(base, length, MADV_DONTNEED) != 0) {
+            // Should not happen for our own mapping, but stay correct
+            memset(base, 0, length);
+        }
+        clearDirty();
+        replacements.fetch_add(1, std::memory_order_release);
+    }
+    
+    // Replaces guest RAM with a copy-on-write view of fd starting at
+    // offset. Pages are read from the file lazily on first touch.
+    bool mapFile(int fd, off_t offset) {
+        void* mem = mmap(base, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        fileBacked = true;
+        clearDirty();
+        replacements.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+    
+    bool isFileBacked() const {
+        return fileBacked;
+    }
+    
+    // Changes whenever reset() or mapFile() replaces all of guest RAM, for
+    // anyone keeping state about how its pages are mapped
+    uint64_t generation() const {
+        return replacements.load(std::memory_order_acquire);
+    }
+    
+    // Maps size bytes of fd at offset copy-on-write over guest RAM at
+    // addr. addr, size and offset must be multiples of hostPageSize().
+    bool mapFileRange(uint64_t addr, size_t size, int fd, off_t offset) {
+        if (addr > length || size > length - addr) {
+            return false;
+        }
+        void* mem = mmap(base + addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        fileBacked = true;
+        return true;
+    }
+    
+    // Zeroes part of guest RAM. Whole host pages are replaced with fresh
+    // anonymous memory, so they cost nothing until the guest touches them.
+    void zeroRange(uint64_t addr, size_t size) {
+        if (addr >= length) {
+            return;
+        }
+        size = std::min<size_t>(size, length - addr);
+        uint64_t pageSize = hostPageSize();
+        uint64_t first = (addr + pageSize - 1) & ~(pageSize - 1);
+        uint64_t last = (addr + size) & ~(pageSize - 1);
+        if (first >= last) {
+            memset(base + addr, 0, size);
+            return;
+        }
+        
+        memset(base + addr, 0, first - addr);
+        memset(base + last, 0, addr + size - last);
+        void* mem = mmap(base + first, last - first, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED) {
+            memset(base + first, 0, last - first);
+        }
+    }
+    
+    static uint64_t hostPageSize() {
+        return static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+    
+    void markDirty(uint64_t addr) {
+        uint64_t page = addr >> PAGE_SHIFT;
+        if (page < numPages) {
+            dirty[page].store(1, std::memory_order_relaxed);
+        }
+    }
+    
+    void markDirtyRange(uint64_t addr, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        for (uint64_t page = addr >> PAGE_SHIFT; page <= (addr + size - 1) >> PAGE_SHIFT && page < numPages; page++) {
+            dirty[page].store(1, std::memory_order_relaxed);
+        }
+    }
+    
+    bool isDirty(uint64_t addr) const {
+        uint64_t page = addr >> PAGE_SHIFT;
+        return page < numPages && dirty[page].load(std::memory_order_relaxed);
+    }
+    
+    bool isPageDirty(size_t page) const {
+        return dirty[page].load(std::memory_order_relaxed);
+    }
+    
+    // Anyone caching "page is dirty" (the soft TLBs) must be flushed too
+    void clearDirty() {
+        for (size_t i = 0; i < numPages; i++) {
+            dirty[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    // Asks the kernel to reclaim resident pages of an idle guest without
+    // losing their contents. Returns false where that is not supported.
+    bool trim() {
+#ifdef MADV_PAGEOUT
+        return madvise(base, length, MADV_PAGEOUT) == 0;
+#else
+        return false;
+#endif
+    }
+    
+    size_t residentBytes() const {
+        size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        std::vector<unsigned char> pages((length + pageSize - 1) / pageSize);
+        if (mincore(base, length, pages.data()) != 0) {
+            return 0;
+        }
+        
+        size_t resident = 0;
+        for (unsigned char page : pages) {
+            resident += page & 1;
+        }
+        return resident * pageSize;
+    }
+    
+private:
+    uint8_t* base = nullptr;
+    size_t length;
+    size_t reservedLength;
+    size_t numPages;
+    std::unique_ptr<std::atomic<uint8_t>[]> dirty;
+    bool fileBacked = false;
+    std::atomic<uint64_t> replacements{0};
+};
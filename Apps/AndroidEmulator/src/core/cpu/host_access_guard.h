@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <csetjmp>
+#include <mutex>
+#include <signal.h>
+#include <pthread.h>
+
+// How guest physical memory is reached
+enum class MemoryBackend : int {
+    SoftMmu = 0,        // every access goes through the soft TLB
+    HostMapped = 1      // flat accesses go straight to host memory
+};
+
+// Per-vCPU state for host-mapped accesses. Guest RAM sits at the start of
+// a WINDOW-sized reservation followed by a guard region, and everything
+// past RAM is inaccessible, so a flat access only has to check that its
+// address is inside the window. Touching the rest faults and is turned
+// into a guest data abort by HostFaultHandler.
+struct HostAccessGuard {
+    static constexpr unsigned WINDOW_BITS = 32;
+    static constexpr uint64_t WINDOW = 1ull << WINDOW_BITS;
+    static constexpr uint64_t GUARD_SIZE = 64 * 1024;
+    
+    // Low bit of access marks a store
+    static constexpr uint64_t ACCESS_WRITE = 1;
+    
+    sigjmp_buf env;
+    bool armed = false;
+    uintptr_t begin = 0;        // guest physical address 0
+    uintptr_t end = 0;          // end of the guard region
+    uint64_t access = 0;        // guest PC | ACCESS_WRITE of the access in flight
+    uint64_t faultAddress = 0;  // guest physical address that faulted
+};
+
+// SIGSEGV/SIGBUS handler shared by every emulator in the process. Faults
+// inside the reservation of the calling thread's armed guard jump back to
+// the guard's sigsetjmp; anything else goes to whoever had the signal
+// before us.
+class HostFaultHandler {
+public:
+    static void install() {
+        static std::once_flag once;
+        std::call_once(once, []() {
+            struct sigaction action = {};
+            action.sa_sigaction = &HostFaultHandler::handle;
+            action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &previousSegv());
+            sigaction(SIGBUS, &action, &previousBus());
+        });
+    }
+    
+    // Guard of the vCPU running on this thread, if any
+    static HostAccessGuard*& current() {
+        static thread_local HostAccessGuard* guard = nullptr;
+        return guard;
+    }
+    
+    // Chained handlers may have left the fault signals blocked when they
+    // passed control to us
+    static void unblock() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGSEGV);
+        sigaddset(&set, SIGBUS);
+        pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    }
+    
+private:
+    static struct sigaction& previousSegv() {
+        static struct sigaction action = {};
+        return action;
+    }
+    
+    static struct sigaction& previousBus() {
+        static struct sigaction action = {};
+        return action;
+    }
+    
+    static void handle(int sig, siginfo_t* info, void* context) {
+        HostAccessGuard* guard = current();
+        uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+        if (guard != nullptr && guard->armed && addr >= guard->begin && addr < guard->end) {
+            guard->armed = false;
+            guard->faultAddress = addr - guard->begin;
+            siglongjmp(guard->env, 1);
+        }
+        
+        const struct sigaction& previous = sig == SIGBUS ? previousBus() : previousSegv();
+        if (previous.sa_handler == SIG_DFL || previous.sa_handler == SIG_IGN) {
+            // Returning re-runs the faulting instruction, which then gets
+            // the default action
+            signal(sig, SIG_DFL);
+        } else if (previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(sig, info, context);
+        } else {
+            previous.sa_handler(sig);
+        }
+    }
+};
@@ -0,0 +1,1057 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <climits>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <sys/mman.h>
+
+#include "block_cache.h"
+#include "host_access_guard.h"
+
+enum class ExecutionMode : int {
+    Interpreter = 0,
+    Jit = 1
+};
+
+// Per-vCPU context handed to translated code. The generated code keeps a
+// pointer to it in a callee-saved register and addresses the fields by
+// fixed offset, so the layout must not change without updating the
+// emitters below.
+struct JitContext {
+    uint64_t* regs;         // guest register file
+    int64_t budget;         // blocks left before returning to the dispatcher
+    uint64_t chainSite;     // patchable jump of the exit taken, 0 if none
+    uint64_t exitPc;        // next PC when a helper forces an exit
+    uint64_t (*interpret)(JitContext* ctx, uint64_t opLo, uint64_t opHi, uint64_t pc);
+    void* owner;
+    void* vcpu;
+    uint64_t retired;       // guest instructions in the blocks entered
+    
+    // Host-mapped memory, used by translations of flat (MMU off) code
+    uint64_t* access;                       // HostAccessGuard::access
+    uint8_t* memoryBase;                    // guest physical address 0
+    std::atomic<uint8_t>* dirtyPages;       // GuestMemory::dirtyMap()
+    const std::atomic<uint8_t>* codeMap;    // BlockCache::codeMap(), a flag per code granule
+};
+
+static_assert(offsetof(JitContext, regs) == 0, "JitContext layout");
+static_assert(offsetof(JitContext, budget) == 8, "JitContext layout");
+static_assert(offsetof(JitContext, chainSite) == 16, "JitContext layout");
+static_assert(offsetof(JitContext, exitPc) == 24, "JitContext layout");
+static_assert(offsetof(JitContext, interpret) == 32, "JitContext layout");
+static_assert(offsetof(JitContext, retired) == 56, "JitContext layout");
+static_assert(offsetof(JitContext, access) == 64, "JitContext layout");
+static_assert(offsetof(JitContext, memoryBase) == 72, "JitContext layout");
+static_assert(offsetof(JitContext, dirtyPages) == 80, "JitContext layout");
+static_assert(offsetof(JitContext, codeMap) == 88, "JitContext layout");
+static_assert(sizeof(std::atomic<uint8_t>) == 1, "page maps are addressed as bytes");
+static_assert(sizeof(MicroOp) == 16, "MicroOp must fit in two registers");
+
+// Translations are specific to the address space they were made in, so
+// the lookup key carries the translation table bases next to the PC.
+struct JitKey {
+    uint64_t pc;
+    uint64_t ttbr0;
+    uint64_t ttbr1;
+    
+    bool operator==(const JitKey& other) const {
+        return pc == other.pc && ttbr0 == other.ttbr0 && ttbr1 == other.ttbr1;
+    }
+};
+
+struct JitKeyHash {
+    size_t operator()(const JitKey& key) const {
+        uint64_t h = key.pc * 0x9E3779B97F4A7C15ull;
+        h ^= key.ttbr0 + 0x7F4A7C159E3779B9ull + (h << 6) + (h >> 2);
+        h ^= key.ttbr1 + 0x94D049BB133111EBull + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h);
+    }
+};
+
+inline void packMicroOp(const MicroOp& op, uint64_t& lo, uint64_t& hi) {
+    uint64_t packed[2];
+    memcpy(packed, &op, sizeof(packed));
+    lo = packed[0];
+    hi = packed[1];
+}
+
+inline MicroOp unpackMicroOp(uint64_t lo, uint64_t hi) {
+    uint64_t packed[2] = { lo, hi };
+    MicroOp op;
+    memcpy(&op, packed, sizeof(op));
+    return op;
+}
+
+// Translates hot decoded blocks into host code. Moves, flag-less ALU ops,
+// B/BL and CBZ/CBNZ are emitted natively; everything else calls back into
+// the interpreter via JitContext::interpret. Exits to a known guest PC are
+// patchable jumps that get chained straight to the target translation once
+// it exists, including the two successors of conditional branches the
+// interpreter evaluates. Entering a translation counts all of its ops as
+// retired.
+//
+// Blocks translated for flat, host-mapped memory also do plain loads and
+// stores natively: the address is only checked against the
+// HostAccessGuard window, and anything that falls outside RAM faults into
+// the guard region.
+//
+// Translations are indexed by the guest physical code they came from, so
+// a store to guest code drops just the ones that cover it. Their host code
+// stays in place until the next flush, as a vCPU may still be inside it;
+// jumps chained to them are reset to their exit stubs.
+class JitTranslator {
+public:
+    static constexpr size_t CODE_CACHE_SIZE = 16 * 1024 * 1024;
+    static constexpr uint32_t HOT_THRESHOLD = 32;
+    static constexpr int64_t CHAIN_BUDGET = 4096;
+    
+    JitTranslator() {
+#if defined(__x86_64__) || defined(__aarch64__)
+        void* mem = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            code = static_cast<uint8_t*>(mem);
+            emitTrampoline();
+            flush();
+        }
+#endif
+    }
+    
+    ~JitTranslator() {
+        if (code != nullptr) {
+            munmap(code, CODE_CACHE_SIZE);
+        }
+    }
+    
+    JitTranslator(const JitTranslator&) = delete;
+    JitTranslator& operator=(const JitTranslator&) = delete;
+    
+    bool available() const {
+        return code != nullptr;
+    }
+    
+    const uint8_t* lookup(const JitKey& key) {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = blocks.find(key);
+        return it != blocks.end() ? it->second : nullptr;
+    }
+    
+    // Returns the translation entry point, or nullptr when the code cache
+    // is full and needs a flush. flatMemory allows host-mapped accesses.
+    // A new translation is also copied to image, if given, in a form
+    // install() can place in any code buffer.
+    const uint8_t* translate(const DecodedBlock& block, const JitKey& key, bool flatMemory,
+                             std::vector<uint8_t>* image = nullptr) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = blocks.find(key);
+        if (it != blocks.end()) {
+            return it->second;
+        }
+        
+        size_t start = pos;
+        epilogueBranches.clear();
+        const uint8_t* entry = emitBlock(block, flatMemory);
+        if (entry == nullptr) {
+            pos = start;
+            return nullptr;
+        }
+        
+        // Chain sites are still unpatched here, so the image holds no
+        // reference to other translations
+        if (image != nullptr) {
+            uint32_t count = static_cast<uint32_t>(epilogueBranches.size());
+            image->resize(sizeof(uint32_t) * (1 + count) + (pos - start));
+            uint8_t* out = image->data();
+            memcpy(out, &count, sizeof(count));
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t offset = static_cast<uint32_t>(epilogueBranches[i] - start);
+                memcpy(out + sizeof(uint32_t) * (1 + i), &offset, sizeof(offset));
+            }
+            memcpy(out + sizeof(uint32_t) * (1 + count), code + start, pos - start);
+        }
+        
+        __builtin___clear_cache(reinterpret_cast<char*>(code + start),
+                                reinterpret_cast<char*>(code + pos));
+        add(block, key, entry);
+        return entry;
+    }
+    
+    // Copies a translation made by translate(), possibly by another
+    // instance, into this code cache. An image is
+    //
+    //   uint32_t count
+    //   uint32_t offsets[count]    of the branches to the epilogue
+    //   host code
+    //
+    // and everything else in it is position independent. Returns nullptr
+    // when the cache is full or the image is malformed. block is the code
+    // the image was made from.
+    const uint8_t* install(const DecodedBlock& block, const JitKey& key, const uint8_t* image, size_t size) {
+        uint32_t count;
+        if (size < sizeof(count)) {
+            return nullptr;
+        }
+        memcpy(&count, image, sizeof(count));
+        size_t header = sizeof(uint32_t) * (1 + static_cast<size_t>(count));
+        if (header > size) {
+            return nullptr;
+        }
+        size_t bytes = size - header;
+        
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = blocks.find(key);
+        if (it != blocks.end()) {
+            return it->second;
+        }
+        if (!fits(bytes)) {
+            return nullptr;
+        }
+        
+        size_t start = pos;
+        memcpy(code + start, image + header, bytes);
+        pos += bytes;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t offset;
+            memcpy(&offset, image + sizeof(uint32_t) * (1 + i), sizeof(offset));
+            if (offset + EPILOGUE_BRANCH_BYTES > bytes) {
+                pos = start;
+                return nullptr;
+            }
+            patchEpilogueBranch(start + offset);
+        }
+        
+        __builtin___clear_cache(reinterpret_cast<char*>(code + start),
+                                reinterpret_cast<char*>(code + pos));
+        const uint8_t* entry = code + start;
+        add(block, key, entry);
+        return entry;
+    }
+    
+    // Redirects a patchable exit jump straight to the translation for key,
+    // if there still is one.
+    void chain(uint64_t site, const JitKey& key) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        uint8_t* p = reinterpret_cast<uint8_t*>(site);
+        auto it = blocks.find(key);
+        if (p < code || p >= code + pos || it == blocks.end()) {
+            return;
+        }
+        chainedTo[it->second].push_back(p);
+        patchJump(p, it->second);
+    }
+    
+    // Drops the translations of guest code overlapping physical
+    // [addr, addr + size) and unchains the jumps into them. True if there
+    // were any. vCPUs may keep running translated code meanwhile.
+    bool invalidateRange(uint64_t addr, uint64_t size) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        bool dropped = false;
+        uint64_t end = addr + size;
+        for (uint64_t page = addr >> BlockCache::PAGE_SHIFT; page <= (end - 1) >> BlockCache::PAGE_SHIFT; page++) {
+            auto it = pageIndex.find(page);
+            if (it == pageIndex.end()) {
+                continue;
+            }
+            
+            std::vector<Translation>& translations = it->second;
+            for (size_t i = 0; i < translations.size();) {
+                const Translation& t = translations[i];
+                if (t.physStart >= end || t.physEnd <= addr) {
+                    i++;
+                    continue;
+                }
+                auto block = blocks.find(t.key);
+                if (block != blocks.end() && block->second == t.entry) {
+                    blocks.erase(block);
+                }
+                unchain(t.entry);
+                translations[i] = translations.back();
+                translations.pop_back();
+                dropped = true;
+            }
+            if (translations.empty()) {
+                pageIndex.erase(it);
+            }
+        }
+        return dropped;
+    }
+    
+    // Drops every translation. Callers must guarantee no vCPU is running
+    // translated code.
+    void flush() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        blocks.clear();
+        pageIndex.clear();
+        chainedTo.clear();
+        pos = trampolineEnd;
+    }
+    
+    uint64_t enter(JitContext& ctx, const uint8_t* entry) {
+        auto fn = reinterpret_cast<uint64_t (*)(JitContext*, const uint8_t*)>(code);
+        return fn(&ctx, entry);
+    }
+    
+private:
+    uint8_t* code = nullptr;
+    size_t pos = 0;
+    size_t trampolineEnd = 0;
+    size_t epilogue = 0;
+    
+    // Guest physical code a translation was made from
+    struct Translation {
+        JitKey key;
+        const uint8_t* entry;
+        uint64_t physStart;
+        uint64_t physEnd;
+    };
+    
+    std::shared_mutex mtx;
+    std::unordered_map<JitKey, const uint8_t*, JitKeyHash> blocks;
+    std::unordered_map<uint64_t, std::vector<Translation>> pageIndex;
+    
+    // Chain sites patched to jump to each entry point
+    std::unordered_map<const uint8_t*, std::vector<uint8_t*>> chainedTo;
+    
+    // Branches to the epilogue in the block being emitted, the one place
+    // translated code depends on where it is
+    std::vector<size_t> epilogueBranches;
+    
+    // Forward branch whose displacement is patched once the target is known
+    struct Fixup {
+        size_t at;
+    };
+    
+    bool fits(size_t bytes) const {
+        return pos + bytes <= CODE_CACHE_SIZE;
+    }
+    
+    // Called with mtx held
+    void add(const DecodedBlock& block, const JitKey& key, const uint8_t* entry) {
+        blocks.emplace(key, entry);
+        uint64_t physEnd = block.physPc + (block.endPc - block.startPc);
+        pageIndex[block.physPc >> BlockCache::PAGE_SHIFT].push_back({ key, entry, block.physPc, physEnd });
+    }
+    
+    // Points every jump chained to entry back at its own exit stub, which
+    // follows the patchable jump directly
+    void unchain(const uint8_t* entry) {
+        auto it = chainedTo.find(entry);
+        if (it == chainedTo.end()) {
+            return;
+        }
+        for (uint8_t* site : it->second) {
+            patchJump(site, site + 4);
+        }
+        chainedTo.erase(it);
+    }
+    
+    // Rewrites a chain site, atomically for vCPUs running through it
+    void patchJump(uint8_t* p, const uint8_t* target) {
+#if defined(__x86_64__)
+        int32_t rel = static_cast<int32_t>(target - (p + 4));
+        __atomic_store_n(reinterpret_cast<int32_t*>(p), rel, __ATOMIC_RELEASE);
+#elif defined(__aarch64__)
+        int64_t rel = (target - p) >> 2;
+        uint32_t insn = 0x14000000u | (static_cast<uint32_t>(rel) & 0x03FFFFFFu);
+        __atomic_store_n(reinterpret_cast<uint32_t*>(p), insn, __ATOMIC_RELEASE);
+        __builtin___clear_cache(reinterpret_cast<char*>(p), reinterpret_cast<char*>(p + 4));
+#endif
+    }
+    
+    void emit8(uint8_t v) {
+        code[pos++] = v;
+    }
+    
+    void emit32(uint32_t v) {
+        memcpy(code + pos, &v, 4);
+        pos += 4;
+    }
+    
+    void emit64(uint64_t v) {
+        memcpy(code + pos, &v, 8);
+        pos += 8;
+    }
+    
+    // Worst case bytes emitted for one micro-op, used for capacity checks
+    static constexpr size_t MAX_OP_BYTES = 256;
+    
+    // Flat stores check the code map for the granule of their first byte,
+    // so stores crossing into the next granule go to the interpreter
+    static constexpr uint32_t GRANULE = BlockCache::CODE_GRANULE_SIZE;
+    
+    // Both backends add a block's op count to JitContext::retired as an
+    // immediate
+    static_assert(BlockCache::MAX_BLOCK_OPS <= 4095, "block op count must fit an add immediate");
+    
+    static bool is64(const MicroOp& op) {
+        return op.flags & OP_SF;
+    }
+    
+    // Register-form ALU ops the backends translate: no flags, no shift,
+    // no inverted operand
+    static bool isSimpleAlu(const MicroOp& op) {
+        return !(op.flags & (OP_SETFLAGS | OP_INVERT)) && op.shift == 0;
+    }
+    
+    // Loads and stores the backends translate for host-mapped memory:
+    // zero-extending, immediate offset, no writeback
+    static bool isSimpleAccess(const MicroOp& op) {
+        return !(op.flags & (OP_SIGNED | OP_REGISTER | OP_WRITEBACK | OP_POSTINDEX)) &&
+               op.imm >= INT32_MIN && op.imm <= INT32_MAX;
+    }
+
+#if defined(__x86_64__)
+    // Register use: rbx = JitContext*, rbp = guest register file,
+    // r12 = host-mapped guest memory
+    
+    void emitTrampoline() {
+        pos = 0;
+        emit8(0x53);                                // push rbx
+        emit8(0x55);                                // push rbp
+        emit8(0x41); emit8(0x54);                   // push r12 (keeps rsp 16-aligned)
+        emit8(0x48); emit8(0x89); emit8(0xFB);      // mov rbx, rdi
+        emit8(0x48); emit8(0x8B); emit8(0x2F);      // mov rbp, [rdi]
+        emit8(0x4C); emit8(0x8B); emit8(0x67); emit8(0x48); // mov r12, [rdi + 72]
+        emit8(0xFF); emit8(0xE6);                   // jmp rsi
+        epilogue = pos;
+        emit8(0x41); emit8(0x5C);                   // pop r12
+        emit8(0x5D);                                // pop rbp
+        emit8(0x5B);                                // pop rbx
+        emit8(0xC3);                                // ret
+        trampolineEnd = (pos + 15) & ~size_t(15);
+    }
+    
+    static constexpr size_t EPILOGUE_BRANCH_BYTES = 5;
+    
+    void emitJmpEpilogue() {
+        epilogueBranches.push_back(pos);
+        emit8(0xE9);
+        emit32(0);
+        patchEpilogueBranch(pos - EPILOGUE_BRANCH_BYTES);
+    }
+    
+    // Points the jmp rel32 at the epilogue
+    void patchEpilogueBranch(size_t at) {
+        int32_t rel = static_cast<int32_t>(static_cast<int64_t>(epilogue) - static_cast<int64_t>(at + 5));
+        memcpy(code + at + 1, &rel, 4);
+    }
+    
+    // mov rax, [rbp + disp32], or mov eax for 32-bit ops
+    void emitLoadReg(uint8_t reg, bool wide) {
+        if (wide) {
+            emit8(0x48);
+        }
+        emit8(0x8B); emit8(0x85);
+        emit32(reg * 8u);
+    }
+    
+    // Opcode of <op> r64, r/m64
+    static uint8_t aluOpcode(MicroOpKind kind) {
+        switch (kind) {
+            case MicroOpKind::AddReg: return 0x03;
+            case MicroOpKind::SubReg: return 0x2B;
+            case MicroOpKind::And: return 0x23;
+            case MicroOpKind::Orr: return 0x0B;
+            default: return 0x33;      // Eor
+        }
+    }
+    
+    // <op> rax, [rbp + disp32], or the 32-bit form, which zero-extends
+    void emitAluReg(uint8_t opcode, uint8_t reg, bool wide) {
+        if (wide) {
+            emit8(0x48);
+        }
+        emit8(opcode); emit8(0x85);
+        emit32(reg * 8u);
+    }
+    
+    void emitStoreReg(uint8_t reg) {
+        emit8(0x48); emit8(0x89); emit8(0x85);      // mov [rbp + disp32], rax
+        emit32(reg * 8u);
+    }
+    
+    void emitClearChainSite() {
+        emit8(0x48); emit8(0xC7); emit8(0x43); emit8(0x10);
+        emit32(0);                                  // mov qword [rbx + 16], 0
+    }
+    
+    Fixup emitJcc(uint8_t cc) {
+        emit8(0x0F); emit8(cc);
+        Fixup f = { pos };
+        emit32(0);
+        return f;
+    }
+    
+    void bind(const Fixup& f) {
+        int32_t rel = static_cast<int32_t>(static_cast<int64_t>(pos) - static_cast<int64_t>(f.at + 4));
+        memcpy(code + f.at, &rel, 4);
+    }
+    
+    // Calls the interpreter for op; leaves its result in rax
+    void emitInterpretCall(const MicroOp& op, uint64_t pc) {
+        uint64_t lo, hi;
+        packMicroOp(op, lo, hi);
+        emit8(0x48); emit8(0x89); emit8(0xDF);      // mov rdi, rbx
+        emit8(0x48); emit8(0xBE); emit64(lo);       // mov rsi, opLo
+        emit8(0x48); emit8(0xBA); emit64(hi);       // mov rdx, opHi
+        emit8(0x48); emit8(0xB9); emit64(pc);       // mov rcx, pc
+        emit8(0xFF); emit8(0x53); emit8(0x20);      // call [rbx + 32]
+    }
+    
+    // Falls back to the interpreter for this op
+    void emitInterpret(const MicroOp& op, uint64_t pc, std::vector<Fixup>& helperExits) {
+        emitInterpretCall(op, pc);
+        emit8(0x48); emit8(0x85); emit8(0xC0);      // test rax, rax
+        helperExits.push_back(emitJcc(0x85));       // jnz helper_exit
+    }
+    
+    // Host-mapped load or store. The interpreter handles addresses outside
+    // the window, stores that straddle a code granule and stores to cached
+    // code; for the last the store has already happened, and repeating it
+    // there is harmless.
+    void emitFlatAccess(const MicroOp& op, uint64_t pc, std::vector<Fixup>& helperExits) {
+        bool store = op.kind == MicroOpKind::Store;
+        unsigned bytes = 1u << op.opt;
+        std::vector<Fixup> slow;
+        
+        emit8(0x48); emit8(0xB8);
+        emit64(pc | (store ? HostAccessGuard::ACCESS_WRITE : 0)); // mov rax, access
+        emit8(0x48); emit8(0x8B); emit8(0x53); emit8(0x40);     // mov rdx, [rbx + 64]
+        emit8(0x48); emit8(0x89); emit8(0x02);                  // mov [rdx], rax
+        
+        emitLoadReg(op.rn, true);
+        if (op.imm != 0) {
+            emit8(0x48); emit8(0x05);
+            emit32(static_cast<uint32_t>(op.imm));               // add rax, imm32
+        }
+        emit8(0x48); emit8(0x89); emit8(0xC1);                  // mov rcx, rax
+        emit8(0x48); emit8(0xC1); emit8(0xE9); emit8(HostAccessGuard::WINDOW_BITS); // shr rcx, WINDOW_BITS
+        slow.push_back(emitJcc(0x85));                          // jnz slow
+        
+        if (!store) {
+            switch (op.opt) {
+                case 0: emit8(0x41); emit8(0x0F); emit8(0xB6); break; // movzx eax, byte [r12 + rax]
+                case 1: emit8(0x41); emit8(0x0F); emit8(0xB7); break; // movzx eax, word [r12 + rax]
+                case 2: emit8(0x41); emit8(0x8B); break;              // mov eax, [r12 + rax]
+                default: emit8(0x49); emit8(0x8B); break;             // mov rax, [r12 + rax]
+            }
+            emit8(0x04); emit8(0x04);
+            if (op.rd != REG_ZR) {
+                emitStoreReg(op.rd);
+            }
+        } else {
+            if (bytes > 1) {
+                emit8(0x89); emit8(0xC1);                       // mov ecx, eax
+                emit8(0x81); emit8(0xE1); emit32(GRANULE - 1);      // and ecx, GRANULE - 1
+                emit8(0x81); emit8(0xF9); emit32(GRANULE - bytes);  // cmp ecx, GRANULE - bytes
+                slow.push_back(emitJcc(0x87));                      // ja slow
+            }
+            emit8(0x48); emit8(0x8B); emit8(0x95); emit32(op.rd * 8u); // mov rdx, [rbp + disp32]
+            switch (op.opt) {
+                case 0: emit8(0x41); emit8(0x88); break;              // mov [r12 + rax], dl
+                case 1: emit8(0x66); emit8(0x41); emit8(0x89); break; // mov [r12 + rax], dx
+                case 2: emit8(0x41); emit8(0x89); break;              // mov [r12 + rax], edx
+                default: emit8(0x49); emit8(0x89); break;             // mov [r12 + rax], rdx
+            }
+            emit8(0x14); emit8(0x04);
+            emit8(0x48); emit8(0x89); emit8(0xC1);              // mov rcx, rax
+            emit8(0x48); emit8(0xC1); emit8(0xE9); emit8(12);   // shr rcx, 12
+            emit8(0x48); emit8(0x8B); emit8(0x53); emit8(0x50); // mov rdx, [rbx + 80]
+            emit8(0xC6); emit8(0x04); emit8(0x0A); emit8(0x01); // mov byte [rdx + rcx], 1
+            emit8(0x48); emit8(0xC1); emit8(0xE8);
+            emit8(BlockCache::CODE_GRANULE_SHIFT);              // shr rax, CODE_GRANULE_SHIFT
+            emit8(0x48); emit8(0x8B); emit8(0x53); emit8(0x58); // mov rdx, [rbx + 88]
+            emit8(0x80); emit8(0x3C); emit8(0x02); emit8(0x00); // cmp byte [rdx + rax], 0
+            slow.push_back(emitJcc(0x85));                      // jne slow
+        }
+        
+        emit8(0xE9);
+        Fixup done = { pos };
+        emit32(0);                                              // jmp done
+        for (const Fixup& f : slow) {
+            bind(f);
+        }
+        emitInterpret(op, pc, helperExits);
+        bind(done);
+    }
+    
+    // jmp rel32 that initially falls through into its own exit stub. The
+    // displacement is 4-byte aligned so chain() can patch it atomically.
+    void emitChainExit(uint64_t targetPc) {
+        while ((pos + 1) % 4 != 0) {
+            emit8(0x90);
+        }
+        emit8(0xE9);
+        size_t site = pos;
+        emit32(0);
+        emit8(0x48); emit8(0xB8); emit64(targetPc); // mov rax, targetPc
+        emit8(0x48); emit8(0x8D); emit8(0x0D);
+        emit32(static_cast<uint32_t>(static_cast<int64_t>(site) - static_cast<int64_t>(pos + 4))); // lea rcx, [site]
+        emit8(0x48); emit8(0x89); emit8(0x4B); emit8(0x10); // mov [rbx + 16], rcx
+        emitJmpEpilogue();
+    }
+    
+    const uint8_t* emitBlock(const DecodedBlock& block, bool flatMemory) {
+        if (!fits((block.ops.size() + 4) * MAX_OP_BYTES)) {
+            return nullptr;
+        }
+        
+        const uint8_t* entry = code + pos;
+        std::vector<Fixup> helperExits;
+        
+        emit8(0x48); emit8(0x83); emit8(0x6B); emit8(0x08); emit8(0x01); // sub qword [rbx + 8], 1
+        Fixup budgetExit = emitJcc(0x8E);                                  // jle budget_exit
+        emit8(0x48); emit8(0x81); emit8(0x43); emit8(0x38);
+        emit32(static_cast<uint32_t>(block.ops.size()));                   // add qword [rbx + 56], ops
+        
+        uint64_t pc = block.startPc;
+        bool ended = false;
+        for (const MicroOp& op : block.ops) {
+            switch (op.kind) {
+                case MicroOpKind::Nop:
+                    break;
+                    
+                case MicroOpKind::MovImm:
+                    if (op.rd != REG_ZR) {
+                        emit8(0x48); emit8(0xB8);
+                        emit64(static_cast<uint64_t>(op.imm));         // mov rax, imm64
+                        emitStoreReg(op.rd);
+                    }
+                    break;
+                    
+                case MicroOpKind::AddImm:
+                case MicroOpKind::SubImm:
+                    if (op.flags & OP_SETFLAGS) {
+                        emitInterpret(op, pc, helperExits);
+                        break;
+                    }
+                    emitLoadReg(op.rn, is64(op));
+                    if (is64(op)) {
+                        emit8(0x48);
+                    }
+                    emit8(op.kind == MicroOpKind::AddImm ? 0x05 : 0x2D);
+                    emit32(static_cast<uint32_t>(op.imm));             // add/sub rax, imm32
+                    emitStoreReg(op.rd);
+                    break;
+                    
+                case MicroOpKind::AddReg:
+                case MicroOpKind::SubReg:
+                case MicroOpKind::And:
+                case MicroOpKind::Orr:
+                case MicroOpKind::Eor:
+                    if (!isSimpleAlu(op)) {
+                        emitInterpret(op, pc, helperExits);
+                        break;
+                    }
+                    emitLoadReg(op.rn, is64(op));
+                    emitAluReg(aluOpcode(op.kind), op.rm, is64(op));
+                    if (op.rd != REG_ZR) {
+                        emitStoreReg(op.rd);
+                    }
+                    break;
+                    
+                case MicroOpKind::Branch:
+                    if (op.flags & OP_LINK) {
+                        emit8(0x48); emit8(0xB8); emit64(pc + 4);      // mov rax, return address
+                        emitStoreReg(REG_LR);
+                    }
+                    emitChainExit(pc + op.imm);
+                    ended = true;
+                    break;
+                    
+                case MicroOpKind::Load:
+                case MicroOpKind::Store:
+                    if (flatMemory && isSimpleAccess(op)) {
+                        emitFlatAccess(op, pc, helperExits);
+                    } else {
+                        emitInterpret(op, pc, helperExits);
+                    }
+                    break;
+                    
+                case MicroOpKind::CompareBranch:
+                    {
+                        if (is64(op)) {
+                            emit8(0x48);
+                        }
+                        emit8(0x83); emit8(0xBD); emit32(op.rd * 8u); emit8(0x00); // cmp [rbp + disp32], 0
+                        Fixup notTaken = emitJcc((op.flags & OP_INVERT) ? 0x84 : 0x85); // je/jne not_taken
+                        emitChainExit(pc + op.imm);
+                        bind(notTaken);
+                        emitChainExit(pc + 4);
+                        ended = true;
+                    }
+                    break;
+                    
+                case MicroOpKind::BranchCond:
+                case MicroOpKind::TestBranch:
+                    {
+                        // The interpreter evaluates the condition and always
+                        // exits; chain whichever successor it picked
+                        emitInterpretCall(op, pc);
+                        emit8(0x48); emit8(0x8B); emit8(0x43); emit8(0x18); // mov rax, [rbx + 24]
+                        emit8(0x48); emit8(0xB9); emit64(pc + op.imm);      // mov rcx, taken
+                        emit8(0x48); emit8(0x39); emit8(0xC8);              // cmp rax, rcx
+                        Fixup notTaken = emitJcc(0x85);                     // jne not_taken
+                        emitChainExit(pc + op.imm);
+                        bind(notTaken);
+                        emit8(0x48); emit8(0xB9); emit64(pc + 4);           // mov rcx, next
+                        emit8(0x48); emit8(0x39); emit8(0xC8);              // cmp rax, rcx
+                        helperExits.push_back(emitJcc(0x85));               // jne helper_exit
+                        emitChainExit(pc + 4);
+                        ended = true;
+                    }
+                    break;
+                    
+                default:
+                    emitInterpret(op, pc, helperExits);
+                    break;
+            }
+            
+            if (ended) {
+                break;
+            }
+            pc += 4;
+        }
+        
+        if (!ended) {
+            emitChainExit(block.endPc);
+        }
+        
+        bind(budgetExit);
+        emit8(0x48); emit8(0xB8); emit64(block.startPc);    // mov rax, startPc
+        emitClearChainSite();
+        emitJmpEpilogue();
+        
+        if (!helperExits.empty()) {
+            for (const Fixup& f : helperExits) {
+                bind(f);
+            }
+            emit8(0x48); emit8(0x8B); emit8(0x43); emit8(0x18); // mov rax, [rbx + 24]
+            emitClearChainSite();
+            emitJmpEpilogue();
+        }
+        
+        return entry;
+    }
+#elif defined(__aarch64__)
+    // Register use: x19 = JitContext*, x20 = guest register file,
+    // x21 = host-mapped guest memory, x9-x11 = scratch
+    
+    void emitTrampoline() {
+        pos = 0;
+        emit32(0xA9BD7BFD);                         // stp x29, x30, [sp, #-48]!
+        emit32(0xA90153F3);                         // stp x19, x20, [sp, #16]
+        emit32(0xF90013F5);                         // str x21, [sp, #32]
+        emit32(0xAA0003F3);                         // mov x19, x0
+        emit32(0xF9400014);                         // ldr x20, [x0]
+        emit32(0xF9402415);                         // ldr x21, [x0, #72]
+        emit32(0xD61F0020);                         // br x1
+        epilogue = pos;
+        emit32(0xF94013F5);                         // ldr x21, [sp, #32]
+        emit32(0xA94153F3);                         // ldp x19, x20, [sp, #16]
+        emit32(0xA8C37BFD);                         // ldp x29, x30, [sp], #48
+        emit32(0xD65F03C0);                         // ret
+        trampolineEnd = (pos + 15) & ~size_t(15);
+    }
+    
+    static constexpr size_t EPILOGUE_BRANCH_BYTES = 4;
+    
+    void emitBranchToEpilogue() {
+        epilogueBranches.push_back(pos);
+        emit32(0);
+        patchEpilogueBranch(pos - EPILOGUE_BRANCH_BYTES);
+    }
+    
+    // Makes the instruction at the given offset a b to the epilogue
+    void patchEpilogueBranch(size_t at) {
+        int64_t rel = (static_cast<int64_t>(epilogue) - static_cast<int64_t>(at)) >> 2;
+        uint32_t insn = 0x14000000u | (static_cast<uint32_t>(rel) & 0x03FFFFFFu);
+        memcpy(code + at, &insn, 4);
+    }
+    
+    void emitMovImm64(uint32_t rd, uint64_t imm) {
+        emit32(0xD2800000u | (static_cast<uint32_t>(imm & 0xFFFF) << 5) | rd);  // movz
+        for (uint32_t hw = 1; hw < 4; hw++) {
+            uint32_t chunk = static_cast<uint32_t>((imm >> (hw * 16)) & 0xFFFF);
+            if (chunk != 0) {
+                emit32(0xF2800000u | (hw << 21) | (chunk << 5) | rd);          // movk
+            }
+        }
+    }
+    
+    void emitLoadReg(uint32_t rt, uint8_t reg) {
+        emit32(0xF9400000u | (static_cast<uint32_t>(reg) << 10) | (20u << 5) | rt); // ldr rt, [x20, #reg*8]
+    }
+    
+    void emitStoreReg(uint32_t rt, uint8_t reg) {
+        emit32(0xF9000000u | (static_cast<uint32_t>(reg) << 10) | (20u << 5) | rt); // str rt, [x20, #reg*8]
+    }
+    
+    // b.cond / cbz / cbnz with the imm19 field left for bind()
+    Fixup emitCondBranch(uint32_t insn) {
+        Fixup f = { pos };
+        emit32(insn);
+        return f;
+    }
+    
+    void bind(const Fixup& f) {
+        uint32_t insn;
+        memcpy(&insn, code + f.at, 4);
+        int64_t rel = (static_cast<int64_t>(pos) - static_cast<int64_t>(f.at)) >> 2;
+        insn |= (static_cast<uint32_t>(rel) & 0x7FFFFu) << 5;
+        memcpy(code + f.at, &insn, 4);
+    }
+    
+    // Shifted-register ALU opcode with all register fields zero
+    static uint32_t aluOpcode(MicroOpKind kind, bool wide) {
+        uint32_t opcode = 0;
+        switch (kind) {
+            case MicroOpKind::AddReg: opcode = 0x0B000000; break;
+            case MicroOpKind::SubReg: opcode = 0x4B000000; break;
+            case MicroOpKind::And: opcode = 0x0A000000; break;
+            case MicroOpKind::Orr: opcode = 0x2A000000; break;
+            default: opcode = 0x4A000000; break;      // Eor
+        }
+        return opcode | (wide ? 0x80000000u : 0);
+    }
+    
+    // Calls the interpreter for op; leaves its result in x0
+    void emitInterpretCall(const MicroOp& op, uint64_t pc) {
+        uint64_t lo, hi;
+        packMicroOp(op, lo, hi);
+        emit32(0xAA1303E0);                         // mov x0, x19
+        emitMovImm64(1, lo);
+        emitMovImm64(2, hi);
+        emitMovImm64(3, pc);
+        emit32(0xF9401270);                         // ldr x16, [x19, #32]
+        emit32(0xD63F0200);                         // blr x16
+    }
+    
+    // Falls back to the interpreter for this op
+    void emitInterpret(const MicroOp& op, uint64_t pc, std::vector<Fixup>& helperExits) {
+        emitInterpretCall(op, pc);
+        helperExits.push_back(emitCondBranch(0xB5000000));    // cbnz x0, helper_exit
+    }
+    
+    // Host-mapped load or store; see the x86-64 version
+    void emitFlatAccess(const MicroOp& op, uint64_t pc, std::vector<Fixup>& helperExits) {
+        bool store = op.kind == MicroOpKind::Store;
+        unsigned bytes = 1u << op.opt;
+        std::vector<Fixup> slow;
+        
+        emitMovImm64(9, pc | (store ? HostAccessGuard::ACCESS_WRITE : 0));
+        emit32(0xF940226A);                         // ldr x10, [x19, #64]
+        emit32(0xF9000149);                         // str x9, [x10]
+        
+        emitLoadReg(9, op.rn);
+        if (op.imm != 0) {
+            emitMovImm64(10, static_cast<uint64_t>(op.imm));
+            emit32(0x8B0A0129);                     // add x9, x9, x10
+        }
+        emit32(0xD340FC00u | (HostAccessGuard::WINDOW_BITS << 16) | (9u << 5) | 10u); // lsr x10, x9, #WINDOW_BITS
+        slow.push_back(emitCondBranch(0xB500000A)); // cbnz x10, slow
+        
+        // Size goes in bits 31:30 of the register-offset forms
+        uint32_t size = static_cast<uint32_t>(op.opt) << 30;
+        if (!store) {
+            emit32(0x38696AAAu | size);             // ldr{b,h} w10 / ldr x10, [x21, x9]
+            if (op.rd != REG_ZR) {
+                emitStoreReg(10, op.rd);
+            }
+        } else {
+            if (bytes > 1) {
+                emit32(0x92400000u | ((BlockCache::CODE_GRANULE_SHIFT - 1) << 10) | (9u << 5) | 10u); // and x10, x9, #(GRANULE - 1)
+                emit32(0xF100015Fu | ((GRANULE - bytes) << 10)); // cmp x10, #(GRANULE - bytes)
+                slow.push_back(emitCondBranch(0x54000008)); // b.hi slow
+            }
+            emitLoadReg(10, op.rd);
+            emit32(0x38296AAAu | size);             // str{b,h} w10 / str x10, [x21, x9]
+            emit32(0xD34CFD2A);                     // lsr x10, x9, #12
+            emit32(0xF9402A6B);                     // ldr x11, [x19, #80]
+            emit32(0x8B0A016A);                     // add x10, x11, x10
+            emit32(0x5280002B);                     // mov w11, #1
+            emit32(0x3900014B);                     // strb w11, [x10]
+            emit32(0xD340FC00u | (BlockCache::CODE_GRANULE_SHIFT << 16) | (9u << 5) | 9u); // lsr x9, x9, #CODE_GRANULE_SHIFT
+            emit32(0xF9402E6A);                     // ldr x10, [x19, #88]
+            emit32(0x3869694A);                     // ldrb w10, [x10, x9]
+            slow.push_back(emitCondBranch(0x3500000A)); // cbnz w10, slow
+        }
+        
+        Fixup done = emitCondBranch(0x5400000E);    // b.al done
+        for (const Fixup& f : slow) {
+            bind(f);
+        }
+        emitInterpret(op, pc, helperExits);
+        bind(done);
+    }
+    
+    // b that initially falls through into its own exit stub
+    void emitChainExit(uint64_t targetPc) {
+        size_t site = pos;
+        emit32(0x14000001);                         // b .+4
+        emitMovImm64(0, targetPc);                  // mov x0, targetPc
+        uint32_t rel = static_cast<uint32_t>(static_cast<int64_t>(site) - static_cast<int64_t>(pos)) & 0x1FFFFFu;
+        emit32(0x10000009u | ((rel & 3) << 29) | ((rel >> 2) << 5)); // adr x9, site
+        emit32(0xF9000A69);                         // str x9, [x19, #16]
+        emitBranchToEpilogue();
+    }
+    
+    const uint8_t* emitBlock(const DecodedBlock& block, bool flatMemory) {
+        if (!fits((block.ops.size() + 4) * MAX_OP_BYTES)) {
+            return nullptr;
+        }
+        
+        const uint8_t* entry = code + pos;
+        std::vector<Fixup> helperExits;
+        
+        emit32(0xF9400669);                         // ldr x9, [x19, #8]
+        emit32(0xF1000529);                         // subs x9, x9, #1
+        emit32(0xF9000669);                         // str x9, [x19, #8]
+        Fixup budgetExit = emitCondBranch(0x5400000D); // b.le budget_exit
+        emit32(0xF9401E69);                         // ldr x9, [x19, #56]
+        emit32(0x91000129 | static_cast<uint32_t>(block.ops.size()) << 10); // add x9, x9, #ops
+        emit32(0xF9001E69);                         // str x9, [x19, #56]
+        
+        uint64_t pc = block.startPc;
+        bool ended = false;
+        for (const MicroOp& op : block.ops) {
+            switch (op.kind) {
+                case MicroOpKind::Nop:
+                    break;
+                    
+                case MicroOpKind::MovImm:
+                    if (op.rd != REG_ZR) {
+                        emitMovImm64(9, static_cast<uint64_t>(op.imm));
+                        emitStoreReg(9, op.rd);
+                    }
+                    break;
+                    
+                case MicroOpKind::AddImm:
+                case MicroOpKind::SubImm:
+                    if (op.flags & OP_SETFLAGS) {
+                        emitInterpret(op, pc, helperExits);
+                        break;
+                    }
+                    emitLoadReg(9, op.rn);
+                    emitMovImm64(10, static_cast<uint64_t>(op.imm));
+                    emit32(aluOpcode(op.kind == MicroOpKind::AddImm ? MicroOpKind::AddReg : MicroOpKind::SubReg, is64(op)) |
+                           (10u << 16) | (9u << 5) | 9u);                 // add/sub x9, x9, x10
+                    emitStoreReg(9, op.rd);
+                    break;
+                    
+                case MicroOpKind::AddReg:
+                case MicroOpKind::SubReg:
+                case MicroOpKind::And:
+                case MicroOpKind::Orr:
+                case MicroOpKind::Eor:
+                    if (!isSimpleAlu(op)) {
+                        emitInterpret(op, pc, helperExits);
+                        break;
+                    }
+                    emitLoadReg(9, op.rn);
+                    emitLoadReg(10, op.rm);
+                    emit32(aluOpcode(op.kind, is64(op)) | (10u << 16) | (9u << 5) | 9u); // <op> x9, x9, x10
+                    if (op.rd != REG_ZR) {
+                        emitStoreReg(9, op.rd);
+                    }
+                    break;
+                    
+                case MicroOpKind::Branch:
+                    if (op.flags & OP_LINK) {
+                        emitMovImm64(9, pc + 4);
+                        emitStoreReg(9, REG_LR);
+                    }
+                    emitChainExit(pc + op.imm);
+                    ended = true;
+                    break;
+                    
+                case MicroOpKind::Load:
+                case MicroOpKind::Store:
+                    if (flatMemory && isSimpleAccess(op)) {
+                        emitFlatAccess(op, pc, helperExits);
+                    } else {
+                        emitInterpret(op, pc, helperExits);
+                    }
+                    break;
+                    
+                case MicroOpKind::CompareBranch:
+                    {
+                        emitLoadReg(9, op.rd);
+                        uint32_t skip = (op.flags & OP_INVERT) ? 0x34000009 : 0x35000009;   // cbz/cbnz w9
+                        Fixup notTaken = emitCondBranch(skip | (is64(op) ? 0x80000000u : 0));
+                        emitChainExit(pc + op.imm);
+                        bind(notTaken);
+                        emitChainExit(pc + 4);
+                        ended = true;
+                    }
+                    break;
+                    
+                case MicroOpKind::BranchCond:
+                case MicroOpKind::TestBranch:
+                    {
+                        // The interpreter evaluates the condition and always
+                        // exits; chain whichever successor it picked
+                        emitInterpretCall(op, pc);
+                        emit32(0xF9400E60);                                   // ldr x0, [x19, #24]
+                        emitMovImm64(9, pc + op.imm);
+                        emit32(0xEB09001F);                                   // cmp x0, x9
+                        Fixup notTaken = emitCondBranch(0x54000001);          // b.ne not_taken
+                        emitChainExit(pc + op.imm);
+                        bind(notTaken);
+                        emitMovImm64(9, pc + 4);
+                        emit32(0xEB09001F);                                   // cmp x0, x9
+                        helperExits.push_back(emitCondBranch(0x54000001));    // b.ne helper_exit
+                        emitChainExit(pc + 4);
+                        ended = true;
+                    }
+                    break;
+                    
+                default:
+                    emitInterpret(op, pc, helperExits);
+                    break;
+            }
+            
+            if (ended) {
+                break;
+            }
+            pc += 4;
+        }
+        
+        if (!ended) {
+            emitChainExit(block.endPc);
+        }
+        
+        bind(budgetExit);
+        emitMovImm64(0, block.startPc);
+        emit32(0xF9000A7F);                         // str xzr, [x19, #16]
+        emitBranchToEpilogue();
+        
+        if (!helperExits.empty()) {
+            for (const Fixup& f : helperExits) {
+                bind(f);
+            }
+            emit32(0xF9400E60);                     // ldr x0, [x19, #24]
+            emit32(0xF9000A7F);                     // str xzr, [x19, #16]
+            emitBranchToEpilogue();
+        }
+        
+        return entry;
+    }
+#else
+    static constexpr size_t EPILOGUE_BRANCH_BYTES = 0;
+    
+    void emitTrampoline() {}
+    
+    void patchEpilogueBranch(size_t) {}
+    
+    const uint8_t* emitBlock(const DecodedBlock&, bool) {
+        return nullptr;
+    }
+#endif
+};
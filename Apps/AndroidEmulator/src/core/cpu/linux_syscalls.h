@@ -0,0 +1,1690 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <linux/futex.h>
+
+#include "guest_memory.h"
+#include "elf_loader.h"
+
+// Newer than some host headers
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#ifndef PR_SET_VMA
+#define PR_SET_VMA 0x53564d41
+#endif
+
+// arm64 Linux system call numbers (asm-generic/unistd.h)
+enum LinuxSyscall : uint64_t {
+    LINUX_GETCWD = 17,
+    LINUX_DUP = 23,
+    LINUX_DUP3 = 24,
+    LINUX_FCNTL = 25,
+    LINUX_IOCTL = 29,
+    LINUX_MKDIRAT = 34,
+    LINUX_UNLINKAT = 35,
+    LINUX_RENAMEAT = 38,
+    LINUX_FTRUNCATE = 46,
+    LINUX_FACCESSAT = 48,
+    LINUX_CHDIR = 49,
+    LINUX_FCHDIR = 50,
+    LINUX_OPENAT = 56,
+    LINUX_CLOSE = 57,
+    LINUX_PIPE2 = 59,
+    LINUX_GETDENTS64 = 61,
+    LINUX_LSEEK = 62,
+    LINUX_READ = 63,
+    LINUX_WRITE = 64,
+    LINUX_READV = 65,
+    LINUX_WRITEV = 66,
+    LINUX_PREAD64 = 67,
+    LINUX_PWRITE64 = 68,
+    LINUX_PPOLL = 73,
+    LINUX_READLINKAT = 78,
+    LINUX_NEWFSTATAT = 79,
+    LINUX_FSTAT = 80,
+    LINUX_FSYNC = 82,
+    LINUX_FDATASYNC = 83,
+    LINUX_EXIT = 93,
+    LINUX_EXIT_GROUP = 94,
+    LINUX_SET_TID_ADDRESS = 96,
+    LINUX_FUTEX = 98,
+    LINUX_SET_ROBUST_LIST = 99,
+    LINUX_NANOSLEEP = 101,
+    LINUX_CLOCK_GETTIME = 113,
+    LINUX_CLOCK_GETRES = 114,
+    LINUX_CLOCK_NANOSLEEP = 115,
+    LINUX_SCHED_GETAFFINITY = 123,
+    LINUX_SCHED_YIELD = 124,
+    LINUX_KILL = 129,
+    LINUX_TKILL = 130,
+    LINUX_TGKILL = 131,
+    LINUX_SIGALTSTACK = 132,
+    LINUX_RT_SIGACTION = 134,
+    LINUX_RT_SIGPROCMASK = 135,
+    LINUX_UNAME = 160,
+    LINUX_GETRUSAGE = 165,
+    LINUX_UMASK = 166,
+    LINUX_PRCTL = 167,
+    LINUX_GETTIMEOFDAY = 169,
+    LINUX_GETPID = 172,
+    LINUX_GETPPID = 173,
+    LINUX_GETUID = 174,
+    LINUX_GETEUID = 175,
+    LINUX_GETGID = 176,
+    LINUX_GETEGID = 177,
+    LINUX_GETTID = 178,
+    LINUX_BRK = 214,
+    LINUX_MUNMAP = 215,
+    LINUX_MREMAP = 216,
+    LINUX_CLONE = 220,
+    LINUX_MMAP = 222,
+    LINUX_MPROTECT = 226,
+    LINUX_MSYNC = 227,
+    LINUX_MADVISE = 233,
+    LINUX_PRLIMIT64 = 261,
+    LINUX_RENAMEAT2 = 276,
+    LINUX_GETRANDOM = 278,
+    LINUX_STATX = 291,
+    LINUX_FACCESSAT2 = 439
+};
+
+// struct stat as arm64 lays it out
+struct LinuxStat {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t rdev;
+    uint64_t pad1;
+    int64_t size;
+    int32_t blksize;
+    int32_t pad2;
+    int64_t blocks;
+    int64_t atime;
+    uint64_t atimeNsec;
+    int64_t mtime;
+    uint64_t mtimeNsec;
+    int64_t ctime;
+    uint64_t ctimeNsec;
+    uint32_t unused[2];
+};
+
+static_assert(sizeof(LinuxStat) == 128, "arm64 struct stat layout");
+
+enum SyscallResult {
+    SYSCALL_DONE,       // the result goes to x0
+    SYSCALL_RESTART     // interrupted while blocked; run the SVC again
+};
+
+// The user mode personality: Linux system calls of a guest process,
+// serviced on the host. Guest RAM is the process's address space, as
+// the guest runs with the MMU off, so pointer arguments are translated in
+// place and handed to the host's own calls; only structures that arm64
+// lays out differently from the host are converted.
+//
+// Guest file descriptors index a table of host ones, so the guest cannot
+// close the emulator's own files, and relative paths resolve against a
+// working directory of the guest's. mmap hands out guest RAM from below
+// the stack down towards the heap; private file mappings are mapped
+// copy-on-write from the file like ELF segments.
+//
+// Calls that can block wait in short steps and give up when the vCPU is
+// asked to stop or pause, or straight away on a worker thread other
+// vCPUs need; the SVC then runs again (SYSCALL_RESTART), keeping any
+// deadline. Threads, process exit and signals need the vCPUs and are the
+// emulator's business. Signals are not delivered.
+class LinuxSyscalls {
+public:
+    // Guest RAM the host wrote on the guest's behalf
+    using MemoryWritten = std::function<void(uint64_t addr, uint64_t size)>;
+    
+    static constexpr int MAX_FDS = 1024;
+    // Blocking calls wait in steps this long, and shorter ones on a worker
+    // thread that other vCPUs share
+    static constexpr long WAIT_STEP_NS = 20 * 1000 * 1000;
+    static constexpr long SHARED_WAIT_STEP_NS = 1000 * 1000;
+    
+    LinuxSyscalls(GuestMemory& memory, size_t maxThreads, const std::string& exePath, uint64_t heapStart,
+                  MemoryWritten written) :
+        memory(memory),
+        written(std::move(written)),
+        threads(maxThreads),
+        fds(MAX_FDS, { -1, false }),
+        pid(getpid()),
+        heapStart(pageAlign(heapStart)),
+        brkEnd(this->heapStart),
+        mapLimit((memory.size() - ElfLoader::STACK_SIZE) & ~(GuestMemory::PAGE_SIZE - 1)) {
+        char path[PATH_MAX];
+        this->exePath = realpath(exePath.c_str(), path) != nullptr ? path : exePath;
+        cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        for (int fd = 0; fd < 3; fd++) {
+            int host = ::fcntl(fd, F_DUPFD_CLOEXEC, 3);
+            if (host >= 0) {
+                fds[fd] = { host, mayBlock(host) };
+            }
+        }
+        threads[0].busy = true;
+        threads[0].alive = true;
+    }
+    
+    ~LinuxSyscalls() {
+        for (const GuestFd& fd : fds) {
+            if (fd.host >= 0) {
+                close(fd.host);
+            }
+        }
+        if (cwd >= 0) {
+            close(cwd);
+        }
+    }
+    
+    LinuxSyscalls(const LinuxSyscalls&) = delete;
+    LinuxSyscalls& operator=(const LinuxSyscalls&) = delete;
+    
+    // Runs the system call in x8 with arguments x0-x5 for guest thread
+    // thread. interrupt is the vCPU's exit request word. With shared, the
+    // calling host thread runs other vCPUs too and a call that blocks
+    // gives it up after one step.
+    SyscallResult call(int thread, const uint64_t* x, int64_t& result, const std::atomic<uint32_t>& interrupt,
+                       bool shared) {
+        Call call = { thread, x, interrupt, shared, false };
+        result = dispatch(call);
+        if (!call.interrupted) {
+            threads[thread].waiting = false;
+        }
+        return call.interrupted ? SYSCALL_RESTART : SYSCALL_DONE;
+    }
+    
+    // Thread IDs: the main thread's is the host process ID
+    int tid(int thread) const {
+        return pid + thread;
+    }
+    
+    // Thread for a guest thread ID, -1 if it is not one of ours
+    int threadOf(int64_t tid) {
+        std::lock_guard<std::mutex> lock(threadMtx);
+        int64_t thread = tid - pid;
+        return thread >= 0 && thread < static_cast<int64_t>(threads.size()) && threads[thread].busy ?
+               static_cast<int>(thread) : -1;
+    }
+    
+    int processId() const {
+        return pid;
+    }
+    
+    // Starts a thread for clone() on a free slot, -1 if all are in use.
+    // A slot is free once the vCPU of the thread before has stopped.
+    int claimThread() {
+        std::lock_guard<std::mutex> lock(threadMtx);
+        for (size_t i = 0; i < threads.size(); i++) {
+            if (!threads[i].busy) {
+                threads[i] = ThreadState();
+                threads[i].busy = true;
+                threads[i].alive = true;
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+    
+    bool threadAlive(int thread) {
+        std::lock_guard<std::mutex> lock(threadMtx);
+        return threads[thread].alive;
+    }
+    
+    // The thread's vCPU stopped running, for good if it exited. A thread
+    // that only stopped with the emulator carries on at the next start.
+    void releaseThread(int thread, bool exited) {
+        std::lock_guard<std::mutex> lock(threadMtx);
+        threads[thread].busy = false;
+        threads[thread].alive = threads[thread].alive && !exited;
+    }
+    
+    void setClearChildTid(int thread, uint64_t addr) {
+        threads[thread].clearChildTid = addr;
+    }
+    
+    // Stores thread's ID at guest addr, for CLONE_*_SETTID
+    bool storeTid(uint64_t addr, int thread) {
+        int32_t id = tid(thread);
+        return !(addr & 3) && writeGuest(addr, id);
+    }
+    
+    // A thread left through exit(). Wakes whoever joins it, as the kernel
+    // does through the clear_child_tid address, and returns how many
+    // threads are left.
+    int exitThread(int thread) {
+        uint64_t addr = threads[thread].clearChildTid;
+        uint8_t* word = guest(addr, sizeof(uint32_t));
+        if (word != nullptr && !(addr & 3)) {
+            __atomic_store_n(reinterpret_cast<uint32_t*>(word), 0, __ATOMIC_SEQ_CST);
+            written(addr, sizeof(uint32_t));
+            syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+        std::lock_guard<std::mutex> lock(threadMtx);
+        threads[thread].alive = false;
+        return static_cast<int>(std::count_if(threads.begin(), threads.end(), [](const ThreadState& state) {
+            return state.alive;
+        }));
+    }
+    
+    // Whether signal leaves the process running: the guest handles or
+    // ignores it, or its default action is to ignore it or to stop the
+    // process, which the emulator cannot do
+    bool signalDropped(int signal) {
+        std::lock_guard<std::mutex> lock(signalMtx);
+        if (actions[signal].handler != reinterpret_cast<uint64_t>(SIG_DFL)) {
+            return true;
+        }
+        switch (signal) {
+            case SIGCHLD:
+            case SIGCONT:
+            case SIGURG:
+            case SIGWINCH:
+            case SIGSTOP:
+            case SIGTSTP:
+            case SIGTTIN:
+            case SIGTTOU:
+                return true;
+            default:
+                return false;
+        }
+    }
+    
+private:
+    struct GuestFd {
+        int host;
+        bool mayBlock;      // pipe, socket or terminal
+    };
+    
+    struct ThreadState {
+        bool busy = false;      // its vCPU may run
+        bool alive = false;     // started and not yet exited
+        uint64_t clearChildTid = 0;
+        uint64_t sigmask = 0;
+        
+        // Deadline of a blocking call, kept while it is restarted
+        bool waiting = false;
+        timespec deadline = {};
+    };
+    
+    struct Call {
+        int thread;
+        const uint64_t* x;
+        const std::atomic<uint32_t>& interrupt;
+        bool shared;
+        bool interrupted;
+        
+        long step() const {
+            return shared ? SHARED_WAIT_STEP_NS : WAIT_STEP_NS;
+        }
+        
+        // Between two wait steps: whether a blocked call has to give way
+        bool giveUp() {
+            interrupted = shared || interrupt.load(std::memory_order_acquire) != 0;
+            return interrupted;
+        }
+    };
+    
+    // k_sigaction as arm64 lays it out
+    struct LinuxSigaction {
+        uint64_t handler;
+        uint64_t flags;
+        uint64_t restorer;
+        uint64_t mask;
+    };
+    
+    GuestMemory& memory;
+    MemoryWritten written;
+    std::string exePath;
+    
+    std::mutex threadMtx;
+    std::vector<ThreadState> threads;
+    
+    std::mutex fdMtx;
+    std::vector<GuestFd> fds;
+    int cwd;
+    int pid;
+    
+    // A host descriptor of a mapped file, kept after the guest closes its
+    // own so the mapping can be read again. Closed with the last mapping.
+    struct MappedFile {
+        int host;
+        
+        explicit MappedFile(int host) : host(host) {}
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() {
+            ::close(host);
+        }
+    };
+    
+    struct Mapping {
+        uint64_t end;
+        std::shared_ptr<MappedFile> file;   // nullptr for anonymous memory
+        uint64_t offset;                    // file offset of the start
+    };
+    
+    // Address space: the heap grows up from heapStart, mappings are
+    // placed below mapLimit, where the stack starts
+    std::mutex memMtx;
+    uint64_t heapStart;
+    uint64_t brkEnd;
+    uint64_t mapLimit;
+    std::map<uint64_t, Mapping> mappings;   // by start
+    
+    std::mutex signalMtx;
+    LinuxSigaction actions[_NSIG] = {};
+    
+    static uint64_t pageAlign(uint64_t addr) {
+        return (addr + GuestMemory::PAGE_SIZE - 1) & ~(GuestMemory::PAGE_SIZE - 1);
+    }
+    
+    int64_t dispatch(Call& call) {
+        const uint64_t* x = call.x;
+        switch (x[8]) {
+            case LINUX_READ:
+            case LINUX_WRITE:
+            case LINUX_READV:
+            case LINUX_WRITEV:
+            case LINUX_PREAD64:
+            case LINUX_PWRITE64:
+                return sysTransfer(call);
+            case LINUX_OPENAT:
+                return sysOpenAt(x);
+            case LINUX_CLOSE:
+                return sysClose(static_cast<int>(x[0]));
+            case LINUX_LSEEK:
+                return withFd(x[0], [&](int fd) { return lseek(fd, static_cast<off_t>(x[1]), static_cast<int>(x[2])); });
+            case LINUX_FSTAT:
+                return sysStat(static_cast<int>(x[0]), "", AT_EMPTY_PATH, x[1]);
+            case LINUX_NEWFSTATAT:
+                return sysStat(static_cast<int>(x[0]), guestString(x[1]), static_cast<int>(x[3]), x[2]);
+            case LINUX_STATX:
+                return sysStatx(x);
+            case LINUX_READLINKAT:
+                return sysReadLink(x);
+            case LINUX_GETDENTS64:
+                return sysGetdents(x);
+            case LINUX_IOCTL:
+                return sysIoctl(x);
+            case LINUX_FCNTL:
+                return sysFcntl(x);
+            case LINUX_DUP:
+                return sysDup(static_cast<int>(x[0]), -1, 0);
+            case LINUX_DUP3:
+                if (static_cast<int>(x[1]) < 0) {
+                    return -EBADF;
+                }
+                return static_cast<int>(x[0]) == static_cast<int>(x[1]) ? -EINVAL :
+                       sysDup(static_cast<int>(x[0]), static_cast<int>(x[1]), 0);
+            case LINUX_PIPE2:
+                return sysPipe(x);
+            case LINUX_PPOLL:
+                return sysPpoll(call);
+            case LINUX_FACCESSAT:
+            case LINUX_FACCESSAT2:
+                return atPath(x[0], x[1], [&](int dir, const char* path) {
+                    return faccessat(dir, path, static_cast<int>(x[2]), x[8] == LINUX_FACCESSAT ? 0 : static_cast<int>(x[3]));
+                });
+            case LINUX_MKDIRAT:
+                return atPath(x[0], x[1], [&](int dir, const char* path) {
+                    return mkdirat(dir, path, static_cast<mode_t>(x[2]));
+                });
+            case LINUX_UNLINKAT:
+                return atPath(x[0], x[1], [&](int dir, const char* path) {
+                    return unlinkat(dir, path, static_cast<int>(x[2]));
+                });
+            case LINUX_RENAMEAT:
+            case LINUX_RENAMEAT2:
+                return sysRename(x);
+            case LINUX_GETCWD:
+                return sysGetcwd(x[0], x[1]);
+            case LINUX_CHDIR:
+                return atPath(AT_FDCWD, x[0], [&](int dir, const char* path) {
+                    return sysChangeDirectory(openat(dir, path, O_PATH | O_DIRECTORY | O_CLOEXEC), true);
+                });
+            case LINUX_FCHDIR:
+                return withFd(x[0], [&](int fd) { return sysChangeDirectory(fd, false); });
+            case LINUX_FTRUNCATE:
+                return withFd(x[0], [&](int fd) { return ftruncate(fd, static_cast<off_t>(x[1])); });
+            case LINUX_FSYNC:
+                return withFd(x[0], [&](int fd) { return fsync(fd); });
+            case LINUX_FDATASYNC:
+                return withFd(x[0], [&](int fd) { return fdatasync(fd); });
+            case LINUX_UMASK:
+                return umask(static_cast<mode_t>(x[0]));
+                
+            case LINUX_BRK:
+                return sysBrk(x[0]);
+            case LINUX_MMAP:
+                return sysMmap(x);
+            case LINUX_MUNMAP:
+                return sysMunmap(x[0], x[1]);
+            case LINUX_MREMAP:
+                return sysMremap(x);
+            case LINUX_MPROTECT:
+            case LINUX_MSYNC:
+                // Guest RAM is always readable, writable and executable
+                return (x[0] & (GuestMemory::PAGE_SIZE - 1)) ? -EINVAL : 0;
+            case LINUX_MADVISE:
+                return sysMadvise(x);
+                
+            case LINUX_FUTEX:
+                return sysFutex(call);
+            case LINUX_NANOSLEEP:
+                return sysSleep(call, CLOCK_MONOTONIC, 0, x[0]);
+            case LINUX_CLOCK_NANOSLEEP:
+                return sysSleep(call, static_cast<clockid_t>(x[0]), static_cast<int>(x[1]), x[2]);
+            case LINUX_CLOCK_GETTIME:
+            case LINUX_CLOCK_GETRES:
+                return sysClock(x);
+            case LINUX_GETTIMEOFDAY:
+                return output(x[0], sizeof(timeval), [](void* tv) { return gettimeofday(static_cast<timeval*>(tv), nullptr); });
+            case LINUX_SCHED_YIELD:
+                return sched_yield();
+            case LINUX_SCHED_GETAFFINITY:
+                return sysAffinity(x[1], x[2]);
+                
+            case LINUX_GETPID:
+                return pid;
+            case LINUX_GETPPID:
+                return getppid();
+            case LINUX_GETTID:
+                return tid(call.thread);
+            case LINUX_GETUID:
+                return getuid();
+            case LINUX_GETEUID:
+                return geteuid();
+            case LINUX_GETGID:
+                return getgid();
+            case LINUX_GETEGID:
+                return getegid();
+            case LINUX_SET_TID_ADDRESS:
+                threads[call.thread].clearChildTid = x[0];
+                return tid(call.thread);
+            case LINUX_SET_ROBUST_LIST:
+                return 0;
+            case LINUX_UNAME:
+                return sysUname(x[0]);
+            case LINUX_GETRANDOM:
+                return output(x[0], x[1], [&](void* buf) {
+                    return syscall(SYS_getrandom, buf, x[1], static_cast<unsigned>(x[2]));
+                });
+            case LINUX_PRLIMIT64:
+                return sysPrlimit(x);
+            case LINUX_GETRUSAGE:
+                return output(x[1], sizeof(rusage), [&](void* usage) {
+                    return getrusage(static_cast<int>(x[0]) == 1 ? RUSAGE_THREAD : RUSAGE_SELF, static_cast<rusage*>(usage));
+                });
+            case LINUX_PRCTL:
+                return sysPrctl(x);
+                
+            case LINUX_RT_SIGACTION:
+                return sysSigaction(x);
+            case LINUX_RT_SIGPROCMASK:
+                return sysSigprocmask(call);
+            case LINUX_SIGALTSTACK:
+                return sysSigaltstack(x[1]);
+                
+            default:
+                return -ENOSYS;
+        }
+    }
+    
+    // Guest memory
+    
+    // Host address of [addr, addr + size) of guest RAM; nullptr when it
+    // does not fit or is the null page
+    uint8_t* guest(uint64_t addr, uint64_t size) const {
+        if (addr < GuestMemory::PAGE_SIZE || addr > memory.size() || size > memory.size() - addr) {
+            return nullptr;
+        }
+        return memory.data() + addr;
+    }
+    
+    // NUL-terminated path in guest RAM, nullptr if there is none
+    const char* guestString(uint64_t addr) const {
+        const uint8_t* start = guest(addr, 1);
+        if (start == nullptr) {
+            return nullptr;
+        }
+        size_t limit = std::min<uint64_t>(PATH_MAX, memory.size() - addr);
+        return memchr(start, 0, limit) != nullptr ? reinterpret_cast<const char*>(start) : nullptr;
+    }
+    
+    // Runs fn on a host buffer for guest [addr, addr + size) that fn fills
+    // in, and reports the guest RAM written. fn returns -1 and sets errno
+    // on failure.
+    template <typename F>
+    int64_t output(uint64_t addr, uint64_t size, F fn) {
+        uint8_t* buf = guest(addr, size);
+        if (buf == nullptr) {
+            return -EFAULT;
+        }
+        int64_t result = fn(buf);
+        if (result < 0) {
+            return -errno;
+        }
+        written(addr, size);
+        return result;
+    }
+    
+    template <typename T>
+    bool readGuest(uint64_t addr, T& value) const {
+        const uint8_t* src = guest(addr, sizeof(T));
+        if (src == nullptr) {
+            return false;
+        }
+        memcpy(&value, src, sizeof(T));
+        return true;
+    }
+    
+    template <typename T>
+    bool writeGuest(uint64_t addr, const T& value) {
+        uint8_t* dst = guest(addr, sizeof(T));
+        if (dst == nullptr) {
+            return false;
+        }
+        memcpy(dst, &value, sizeof(T));
+        written(addr, sizeof(T));
+        return true;
+    }
+    
+    // File descriptors
+    
+    static bool mayBlock(int host) {
+        struct stat st;
+        return fstat(host, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) && !S_ISBLK(st.st_mode);
+    }
+    
+    bool lookupFd(uint64_t guestFd, GuestFd& fd) {
+        int index = static_cast<int>(guestFd);
+        std::lock_guard<std::mutex> lock(fdMtx);
+        if (index < 0 || index >= MAX_FDS || fds[index].host < 0) {
+            return false;
+        }
+        fd = fds[index];
+        return true;
+    }
+    
+    // Runs a host call on the host descriptor for guestFd
+    template <typename F>
+    int64_t withFd(uint64_t guestFd, F fn) {
+        GuestFd fd;
+        if (!lookupFd(guestFd, fd)) {
+            return -EBADF;
+        }
+        int64_t result = fn(fd.host);
+        return result < 0 ? -errno : result;
+    }
+    
+    // Takes over host descriptor host as the lowest free guest descriptor
+    // from minFd, or as exactly fixedFd
+    int64_t addFd(int host, int minFd, int fixedFd = -1) {
+        if (host < 0) {
+            return -errno;
+        }
+        bool blocking = mayBlock(host);
+        int old = -1;
+        int index = -1;
+        {
+            std::lock_guard<std::mutex> lock(fdMtx);
+            if (fixedFd >= 0) {
+                index = fixedFd;
+                old = fds[index].host;
+            } else {
+                for (int i = std::max(minFd, 0); i < MAX_FDS; i++) {
+                    if (fds[i].host < 0) {
+                        index = i;
+                        break;
+                    }
+                }
+            }
+            if (index >= 0) {
+                fds[index] = { host, blocking };
+            }
+        }
+        if (old >= 0) {
+            close(old);
+        }
+        if (index < 0) {
+            close(host);
+            return -EMFILE;
+        }
+        return index;
+    }
+    
+    int64_t sysClose(int guestFd) {
+        int host;
+        {
+            std::lock_guard<std::mutex> lock(fdMtx);
+            if (guestFd < 0 || guestFd >= MAX_FDS || fds[guestFd].host < 0) {
+                return -EBADF;
+            }
+            host = fds[guestFd].host;
+            fds[guestFd].host = -1;
+        }
+        close(host);
+        return 0;
+    }
+    
+    // Duplicates to fixedFd, or to the lowest free descriptor from minFd
+    // when fixedFd is -1. Callers reject other negative numbers.
+    int64_t sysDup(int guestFd, int fixedFd, int minFd) {
+        if (fixedFd >= MAX_FDS || minFd >= MAX_FDS) {
+            return -EBADF;
+        }
+        GuestFd fd;
+        if (!lookupFd(static_cast<uint64_t>(guestFd), fd)) {
+            return -EBADF;
+        }
+        return addFd(::fcntl(fd.host, F_DUPFD_CLOEXEC, 3), minFd, fixedFd);
+    }
+    
+    // Directory descriptor for an *at() call
+    int hostDirFd(uint64_t guestFd) {
+        if (static_cast<int>(guestFd) == AT_FDCWD) {
+            return cwd;
+        }
+        GuestFd fd;
+        return lookupFd(guestFd, fd) ? fd.host : -1;
+    }
+    
+    // Runs fn(hostDir, path) for a dirfd and guest path pair
+    template <typename F>
+    int64_t atPath(uint64_t dirFd, uint64_t pathAddr, F fn) {
+        const char* path = guestString(pathAddr);
+        if (path == nullptr) {
+            return -EFAULT;
+        }
+        int dir = hostDirFd(dirFd);
+        if (dir < 0) {
+            return -EBADF;
+        }
+        int64_t result = fn(dir, hostPath(path));
+        return result < 0 ? -errno : result;
+    }
+    
+    // The guest's executable is not the host process's
+    const char* hostPath(const char* path) const {
+        return strcmp(path, "/proc/self/exe") == 0 ? exePath.c_str() : path;
+    }
+    
+    // O_DIRECTORY, O_NOFOLLOW, O_DIRECT and O_LARGEFILE have other values
+    // on x86-64; everything else in the open flags agrees.
+    static int hostOpenFlags(uint64_t flags) {
+        int host = static_cast<int>(flags);
+#if defined(__x86_64__)
+        static const int map[][2] = { { 040000, 0200000 }, { 0100000, 0400000 }, { 0200000, 040000 }, { 0400000, 0 } };
+        host &= ~(040000 | 0100000 | 0200000 | 0400000);
+        for (const auto& pair : map) {
+            if (flags & pair[0]) {
+                host |= pair[1];
+            }
+        }
+#endif
+        return host;
+    }
+    
+    static int64_t guestOpenFlags(int host) {
+        int64_t flags = host;
+#if defined(__x86_64__)
+        static const int map[][2] = { { 040000, 0200000 }, { 0100000, 0400000 }, { 0200000, 040000 }, { 0400000, 0100000 } };
+        flags &= ~(040000 | 0100000 | 0200000 | 0400000);
+        for (const auto& pair : map) {
+            if (host & pair[1]) {
+                flags |= pair[0];
+            }
+        }
+#endif
+        return flags;
+    }
+    
+    int64_t sysOpenAt(const uint64_t* x) {
+        const char* path = guestString(x[1]);
+        if (path == nullptr) {
+            return -EFAULT;
+        }
+        int dir = hostDirFd(x[0]);
+        if (dir < 0) {
+            return -EBADF;
+        }
+        // The guest never execs, so host descriptors are never inherited
+        int host = openat(dir, hostPath(path), hostOpenFlags(x[2]) | O_CLOEXEC, static_cast<mode_t>(x[3]));
+        return addFd(host, 0);
+    }
+    
+    int64_t sysPipe(const uint64_t* x) {
+        int hostFds[2];
+        if (guest(x[0], sizeof(int) * 2) == nullptr) {
+            return -EFAULT;
+        }
+        if (pipe2(hostFds, hostOpenFlags(x[1]) | O_CLOEXEC) != 0) {
+            return -errno;
+        }
+        int64_t readFd = addFd(hostFds[0], 0);
+        if (readFd < 0) {
+            close(hostFds[1]);
+            return readFd;
+        }
+        int64_t writeFd = addFd(hostFds[1], 0);
+        if (writeFd < 0) {
+            sysClose(static_cast<int>(readFd));
+            return writeFd;
+        }
+        int guestFds[2] = { static_cast<int>(readFd), static_cast<int>(writeFd) };
+        writeGuest(x[0], guestFds);
+        return 0;
+    }
+    
+    int64_t sysChangeDirectory(int dir, bool owned) {
+        if (dir < 0) {
+            return -1;
+        }
+        struct stat st;
+        int64_t result = 0;
+        if (fstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            result = -1;
+        } else if (dup3(dir, cwd, O_CLOEXEC) < 0) {
+            // Swapped in place, so *at() calls running meanwhile see
+            // either directory
+            result = -1;
+        }
+        if (owned) {
+            int error = errno;
+            close(dir);
+            errno = error;
+        }
+        return result;
+    }
+    
+    int64_t sysGetcwd(uint64_t buf, uint64_t size) {
+        char link[32];
+        char path[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", cwd);
+        ssize_t length = readlink(link, path, sizeof(path) - 1);
+        if (length < 0) {
+            return -errno;
+        }
+        if (static_cast<uint64_t>(length) + 1 > size) {
+            return -ERANGE;
+        }
+        path[length] = '\0';
+        uint8_t* dst = guest(buf, length + 1);
+        if (dst == nullptr) {
+            return -EFAULT;
+        }
+        memcpy(dst, path, length + 1);
+        written(buf, length + 1);
+        return length + 1;
+    }
+    
+    int64_t sysRename(const uint64_t* x) {
+        const char* from = guestString(x[1]);
+        const char* to = guestString(x[3]);
+        if (from == nullptr || to == nullptr) {
+            return -EFAULT;
+        }
+        int fromDir = hostDirFd(x[0]);
+        int toDir = hostDirFd(x[2]);
+        if (fromDir < 0 || toDir < 0) {
+            return -EBADF;
+        }
+        unsigned flags = x[8] == LINUX_RENAMEAT2 ? static_cast<unsigned>(x[4]) : 0;
+        long result = flags == 0 ? renameat(fromDir, from, toDir, to) :
+                      syscall(SYS_renameat2, fromDir, from, toDir, to, flags);
+        return result < 0 ? -errno : 0;
+    }
+    
+    // read, write and their vectored and positioned forms
+    int64_t sysTransfer(Call& call) {
+        const uint64_t* x = call.x;
+        GuestFd fd;
+        if (!lookupFd(x[0], fd)) {
+            return -EBADF;
+        }
+        
+        uint64_t number = x[8];
+        bool reading = number == LINUX_READ || number == LINUX_READV || number == LINUX_PREAD64;
+        std::vector<iovec> iov;
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        if (number == LINUX_READV || number == LINUX_WRITEV) {
+            if (x[2] > IOV_MAX) {
+                return -EINVAL;
+            }
+            for (uint64_t i = 0; i < x[2]; i++) {
+                uint64_t entry[2];
+                if (!readGuest(x[1] + i * 16, entry)) {
+                    return -EFAULT;
+                }
+                uint8_t* buf = entry[1] != 0 ? guest(entry[0], entry[1]) : memory.data();
+                if (buf == nullptr) {
+                    return -EFAULT;
+                }
+                iov.push_back({ buf, entry[1] });
+                ranges.push_back({ entry[0], entry[1] });
+            }
+        } else {
+            uint8_t* buf = x[2] != 0 ? guest(x[1], x[2]) : memory.data();
+            if (buf == nullptr) {
+                return -EFAULT;
+            }
+            iov.push_back({ buf, x[2] });
+            ranges.push_back({ x[1], x[2] });
+        }
+        
+        bool positioned = number == LINUX_PREAD64 || number == LINUX_PWRITE64;
+        if (!positioned && !waitFor(call, fd, reading ? POLLIN : POLLOUT)) {
+            return 0;
+        }
+        ssize_t result;
+        if (positioned) {
+            result = reading ? preadv(fd.host, iov.data(), 1, static_cast<off_t>(x[3])) :
+                               pwritev(fd.host, iov.data(), 1, static_cast<off_t>(x[3]));
+        } else {
+            result = reading ? readv(fd.host, iov.data(), static_cast<int>(iov.size())) :
+                               writev(fd.host, iov.data(), static_cast<int>(iov.size()));
+        }
+        if (result < 0) {
+            return -errno;
+        }
+        
+        if (reading) {
+            uint64_t left = static_cast<uint64_t>(result);
+            for (const auto& range : ranges) {
+                uint64_t size = std::min(left, range.second);
+                if (size != 0) {
+                    written(range.first, size);
+                }
+                left -= size;
+            }
+        }
+        return result;
+    }
+    
+    // Waits for a pipe, socket or terminal to be ready in steps, so the
+    // vCPU still answers stops and pauses. False if it had to give up.
+    bool waitFor(Call& call, const GuestFd& fd, short events) {
+        if (!fd.mayBlock || (::fcntl(fd.host, F_GETFL) & O_NONBLOCK)) {
+            return true;
+        }
+        pollfd ready = { fd.host, events, 0 };
+        while (poll(&ready, 1, static_cast<int>(call.step() / 1000000)) <= 0) {
+            if (call.giveUp()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    int64_t sysStat(int dirFd, const char* path, int flags, uint64_t buf) {
+        if (path == nullptr) {
+            return -EFAULT;
+        }
+        int dir = hostDirFd(static_cast<uint64_t>(dirFd));
+        if (dir < 0) {
+            return -EBADF;
+        }
+        struct stat st;
+        if (fstatat(dir, hostPath(path), &st, flags) != 0) {
+            return -errno;
+        }
+        
+        LinuxStat out = {};
+        out.dev = st.st_dev;
+        out.ino = st.st_ino;
+        out.mode = st.st_mode;
+        out.nlink = static_cast<uint32_t>(st.st_nlink);
+        out.uid = st.st_uid;
+        out.gid = st.st_gid;
+        out.rdev = st.st_rdev;
+        out.size = st.st_size;
+        out.blksize = static_cast<int32_t>(st.st_blksize);
+        out.blocks = st.st_blocks;
+        out.atime = st.st_atim.tv_sec;
+        out.atimeNsec = st.st_atim.tv_nsec;
+        out.mtime = st.st_mtim.tv_sec;
+        out.mtimeNsec = st.st_mtim.tv_nsec;
+        out.ctime = st.st_ctim.tv_sec;
+        out.ctimeNsec = st.st_ctim.tv_nsec;
+        return writeGuest(buf, out) ? 0 : -EFAULT;
+    }
+    
+    // struct statx is the same everywhere
+    int64_t sysStatx(const uint64_t* x) {
+#ifdef SYS_statx
+        return atPath(x[0], x[1], [&](int dir, const char* path) {
+            return output(x[4], 256, [&](void* buf) {
+                return syscall(SYS_statx, dir, path, static_cast<int>(x[2]), static_cast<unsigned>(x[3]), buf);
+            });
+        });
+#else
+        return -ENOSYS;
+#endif
+    }
+    
+    int64_t sysReadLink(const uint64_t* x) {
+        return atPath(x[0], x[1], [&](int dir, const char* path) -> int64_t {
+            uint8_t* buf = guest(x[2], x[3]);
+            if (buf == nullptr) {
+                errno = EFAULT;
+                return -1;
+            }
+            ssize_t length;
+            if (path == exePath.c_str()) {
+                length = std::min<ssize_t>(exePath.size(), x[3]);
+                memcpy(buf, exePath.data(), length);
+            } else {
+                length = readlinkat(dir, path, reinterpret_cast<char*>(buf), x[3]);
+            }
+            if (length > 0) {
+                written(x[2], length);
+            }
+            return length;
+        });
+    }
+    
+    // struct linux_dirent64 is the same everywhere
+    int64_t sysGetdents(const uint64_t* x) {
+        GuestFd fd;
+        if (!lookupFd(x[0], fd)) {
+            return -EBADF;
+        }
+        return output(x[1], x[2], [&](void* buf) {
+            return syscall(SYS_getdents64, fd.host, buf, static_cast<unsigned>(x[2]));
+        });
+    }
+    
+    // Terminal queries, which have the same numbers and structures on
+    // every host
+    int64_t sysIoctl(const uint64_t* x) {
+        size_t size;
+        switch (x[1]) {
+            case TCGETS:
+                size = 36;
+                break;
+            case TIOCGWINSZ:
+                size = sizeof(winsize);
+                break;
+            case FIONREAD:
+                size = sizeof(int);
+                break;
+            default:
+                return -ENOTTY;
+        }
+        GuestFd fd;
+        if (!lookupFd(x[0], fd)) {
+            return -EBADF;
+        }
+        return output(x[2], size, [&](void* buf) {
+            return ::ioctl(fd.host, x[1], buf);
+        });
+    }
+    
+    int64_t sysFcntl(const uint64_t* x) {
+        int cmd = static_cast<int>(x[1]);
+        switch (cmd) {
+            case F_DUPFD:
+            case F_DUPFD_CLOEXEC:
+                if (static_cast<int>(x[2]) < 0) {
+                    return -EINVAL;
+                }
+                return sysDup(static_cast<int>(x[0]), -1, static_cast<int>(x[2]));
+            case F_GETFD:
+            case F_SETFD:
+                return withFd(x[0], [&](int fd) { return ::fcntl(fd, cmd, static_cast<int>(x[2])); });
+            case F_GETFL:
+                return withFd(x[0], [&](int fd) -> int64_t {
+                    int flags = ::fcntl(fd, F_GETFL);
+                    return flags < 0 ? -1 : guestOpenFlags(flags);
+                });
+            case F_SETFL:
+                return withFd(x[0], [&](int fd) { return ::fcntl(fd, F_SETFL, hostOpenFlags(x[2])); });
+            case F_GETLK:
+            case F_SETLK:
+            case F_SETLKW: {
+                uint8_t* lock = guest(x[2], sizeof(struct flock));
+                if (lock == nullptr) {
+                    return -EFAULT;
+                }
+                int64_t result = withFd(x[0], [&](int fd) { return ::fcntl(fd, cmd, lock); });
+                if (result >= 0) {
+                    written(x[2], sizeof(struct flock));
+                }
+                return result;
+            }
+            default:
+                return -EINVAL;
+        }
+    }
+    
+    int64_t sysPpoll(Call& call) {
+        const uint64_t* x = call.x;
+        uint64_t count = x[1];
+        if (count > MAX_FDS) {
+            return -EINVAL;
+        }
+        std::vector<pollfd> polled(count);
+        if (count != 0 && guest(x[0], count * sizeof(pollfd)) == nullptr) {
+            return -EFAULT;
+        }
+        memcpy(polled.data(), memory.data() + x[0], count * sizeof(pollfd));
+        // Descriptors the guest does not have report POLLNVAL
+        std::vector<int> guestFds(count);
+        for (size_t i = 0; i < count; i++) {
+            GuestFd fd;
+            guestFds[i] = polled[i].fd;
+            if (polled[i].fd >= 0) {
+                polled[i].fd = lookupFd(static_cast<uint64_t>(polled[i].fd), fd) ? fd.host : INT_MAX;
+            }
+        }
+        
+        timespec deadline;
+        bool timed = x[2] != 0;
+        if (timed && !startWait(call, CLOCK_MONOTONIC, 0, x[2], deadline)) {
+            return -EINVAL;
+        }
+        int ready;
+        while (true) {
+            long step = call.step() / 1000000;
+            if (timed) {
+                timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                int64_t left = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+                step = std::max<int64_t>(std::min<int64_t>(left, step), 0);
+            }
+            ready = poll(polled.data(), count, static_cast<int>(step));
+            if (ready < 0 && errno != EINTR) {
+                return -errno;
+            }
+            if (ready > 0 || (timed && step == 0)) {
+                break;
+            }
+            if (call.giveUp()) {
+                return 0;
+            }
+        }
+        
+        for (size_t i = 0; i < count; i++) {
+            polled[i].fd = guestFds[i];
+        }
+        memcpy(memory.data() + x[0], polled.data(), count * sizeof(pollfd));
+        if (count != 0) {
+            written(x[0], count * sizeof(pollfd));
+        }
+        return std::max(ready, 0);
+    }
+    
+    // Time
+    
+    // Deadline of a wait on clock for timeout at addr, relative unless
+    // flags has TIMER_ABSTIME. A restarted call keeps the one it had.
+    bool startWait(Call& call, clockid_t clock, int flags, uint64_t addr, timespec& deadline) {
+        ThreadState& thread = threads[call.thread];
+        if (thread.waiting) {
+            deadline = thread.deadline;
+            return true;
+        }
+        timespec timeout;
+        if (!readGuest(addr, timeout) || timeout.tv_nsec < 0 || timeout.tv_nsec >= 1000000000 || timeout.tv_sec < 0) {
+            return false;
+        }
+        deadline = timeout;
+        if (!(flags & TIMER_ABSTIME)) {
+            clock_gettime(clock, &deadline);
+            deadline.tv_sec += timeout.tv_sec;
+            deadline.tv_nsec += timeout.tv_nsec;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        }
+        thread.waiting = true;
+        thread.deadline = deadline;
+        return true;
+    }
+    
+    // The earlier of deadline and one step from now
+    static timespec nextStep(const Call& call, clockid_t clock, const timespec& deadline, bool& last) {
+        timespec step;
+        clock_gettime(clock, &step);
+        step.tv_nsec += call.step();
+        if (step.tv_nsec >= 1000000000) {
+            step.tv_sec++;
+            step.tv_nsec -= 1000000000;
+        }
+        last = step.tv_sec > deadline.tv_sec || (step.tv_sec == deadline.tv_sec && step.tv_nsec >= deadline.tv_nsec);
+        return last ? deadline : step;
+    }
+    
+    int64_t sysSleep(Call& call, clockid_t clock, int flags, uint64_t addr) {
+        timespec deadline;
+        if (!startWait(call, clock, flags, addr, deadline)) {
+            return -EINVAL;
+        }
+        while (true) {
+            bool last;
+            timespec step = nextStep(call, clock, deadline, last);
+            int error = clock_nanosleep(clock, TIMER_ABSTIME, &step, nullptr);
+            if (error != 0 && error != EINTR) {
+                return -error;
+            }
+            if ((last && error == 0) || call.giveUp()) {
+                return 0;
+            }
+        }
+    }
+    
+    int64_t sysClock(const uint64_t* x) {
+        return output(x[1], sizeof(timespec), [&](void* ts) {
+            clockid_t clock = static_cast<clockid_t>(x[0]);
+            return x[8] == LINUX_CLOCK_GETTIME ? clock_gettime(clock, static_cast<timespec*>(ts)) :
+                                                 clock_getres(clock, static_cast<timespec*>(ts));
+        });
+    }
+    
+    // Futex words are in guest RAM, so host futexes on them work between
+    // the guest's threads as they are
+    int64_t sysFutex(Call& call) {
+        const uint64_t* x = call.x;
+        uint8_t* word = guest(x[0], sizeof(uint32_t));
+        if (word == nullptr) {
+            return -EFAULT;
+        }
+        if (x[0] & 3) {
+            return -EINVAL;
+        }
+        int op = static_cast<int>(x[1]);
+        int cmd = op & FUTEX_CMD_MASK;
+        uint32_t value = static_cast<uint32_t>(x[2]);
+        uint32_t bitset = static_cast<uint32_t>(x[5]);
+        
+        switch (cmd) {
+            case FUTEX_WAIT:
+            case FUTEX_WAIT_BITSET: {
+                if (cmd == FUTEX_WAIT) {
+                    bitset = FUTEX_BITSET_MATCH_ANY;
+                }
+                if (bitset == 0) {
+                    return -EINVAL;
+                }
+                clockid_t clock = (op & FUTEX_CLOCK_REALTIME) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+                timespec deadline;
+                bool timed = x[3] != 0;
+                if (timed && !startWait(call, clock, cmd == FUTEX_WAIT ? 0 : TIMER_ABSTIME, x[3], deadline)) {
+                    return -EINVAL;
+                }
+                int waitOp = FUTEX_WAIT_BITSET | (op & (FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME));
+                while (true) {
+                    bool last = false;
+                    timespec step = nextStep(call, clock, timed ? deadline : timespec{ INT64_MAX, 0 }, last);
+                    if (syscall(SYS_futex, word, waitOp, value, &step, nullptr, bitset) == 0) {
+                        return 0;
+                    }
+                    if (errno != ETIMEDOUT && errno != EINTR) {
+                        return -errno;
+                    }
+                    if (last && errno == ETIMEDOUT) {
+                        return -ETIMEDOUT;
+                    }
+                    if (call.giveUp()) {
+                        return 0;
+                    }
+                }
+            }
+            case FUTEX_WAKE:
+            case FUTEX_WAKE_BITSET: {
+                long woken = syscall(SYS_futex, word, op, value, nullptr, nullptr, bitset);
+                return woken < 0 ? -errno : woken;
+            }
+            case FUTEX_REQUEUE:
+            case FUTEX_CMP_REQUEUE:
+            case FUTEX_WAKE_OP: {
+                uint8_t* word2 = guest(x[4], sizeof(uint32_t));
+                if (word2 == nullptr) {
+                    return -EFAULT;
+                }
+                long result = syscall(SYS_futex, word, op, value, x[3], word2, bitset);
+                return result < 0 ? -errno : result;
+            }
+            default:
+                // Priority inheritance needs the kernel to know our thread IDs
+                return -ENOSYS;
+        }
+    }
+    
+    int64_t sysAffinity(uint64_t size, uint64_t addr) {
+        size_t bytes = (threads.size() + 63) / 64 * 8;
+        if (size < bytes || (size & 7)) {
+            return -EINVAL;
+        }
+        uint8_t* mask = guest(addr, bytes);
+        if (mask == nullptr) {
+            return -EFAULT;
+        }
+        memset(mask, 0, bytes);
+        for (size_t i = 0; i < threads.size(); i++) {
+            mask[i / 8] |= 1 << (i % 8);
+        }
+        written(addr, bytes);
+        return static_cast<int64_t>(bytes);
+    }
+    
+    // Process information
+    
+    int64_t sysUname(uint64_t addr) {
+        return output(addr, sizeof(utsname), [](void* buf) {
+            utsname* name = static_cast<utsname*>(buf);
+            if (::uname(name) != 0) {
+                return -1;
+            }
+            strncpy(name->machine, "aarch64", sizeof(name->machine));
+            return 0;
+        });
+    }
+    
+    int64_t sysPrlimit(const uint64_t* x) {
+        if (x[0] != 0 && static_cast<int>(x[0]) != pid) {
+            return -ESRCH;
+        }
+        // Setting limits would set them for the whole emulator
+        if (x[3] == 0) {
+            return 0;
+        }
+        return output(x[3], sizeof(rlimit), [&](void* buf) {
+            rlimit* limit = static_cast<rlimit*>(buf);
+            switch (x[1]) {
+                case RLIMIT_STACK:
+                    limit->rlim_cur = limit->rlim_max = ElfLoader::STACK_SIZE;
+                    return 0;
+                case RLIMIT_NOFILE:
+                    limit->rlim_cur = limit->rlim_max = MAX_FDS;
+                    return 0;
+                default:
+                    return getrlimit(static_cast<int>(x[1]), limit);
+            }
+        });
+    }
+    
+    int64_t sysPrctl(const uint64_t* x) {
+        switch (x[0]) {
+            case PR_SET_NAME:
+            case PR_SET_VMA:
+            case PR_SET_DUMPABLE:
+                return 0;
+            case PR_GET_DUMPABLE:
+                return 1;
+            case PR_GET_NAME: {
+                char name[16] = "emulated";
+                return writeGuest(x[1], name) ? 0 : -EFAULT;
+            }
+            default:
+                return -EINVAL;
+        }
+    }
+    
+    // Signals: handlers are recorded so the guest reads back what it
+    // set, but never run
+    
+    int64_t sysSigaction(const uint64_t* x) {
+        int signal = static_cast<int>(x[0]);
+        if (signal <= 0 || signal >= _NSIG || x[3] != 8) {
+            return -EINVAL;
+        }
+        if (x[1] != 0 && (signal == SIGKILL || signal == SIGSTOP)) {
+            return -EINVAL;
+        }
+        LinuxSigaction action;
+        if (x[1] != 0 && !readGuest(x[1], action)) {
+            return -EFAULT;
+        }
+        std::lock_guard<std::mutex> lock(signalMtx);
+        if (x[2] != 0 && !writeGuest(x[2], actions[signal])) {
+            return -EFAULT;
+        }
+        if (x[1] != 0) {
+            actions[signal] = action;
+        }
+        return 0;
+    }
+    
+    int64_t sysSigprocmask(Call& call) {
+        const uint64_t* x = call.x;
+        if (x[3] != 8) {
+            return -EINVAL;
+        }
+        uint64_t& mask = threads[call.thread].sigmask;
+        uint64_t set = 0;
+        if (x[1] != 0 && !readGuest(x[1], set)) {
+            return -EFAULT;
+        }
+        if (x[2] != 0 && !writeGuest(x[2], mask)) {
+            return -EFAULT;
+        }
+        if (x[1] == 0) {
+            return 0;
+        }
+        switch (x[0]) {
+            case SIG_BLOCK:
+                mask |= set;
+                return 0;
+            case SIG_UNBLOCK:
+                mask &= ~set;
+                return 0;
+            case SIG_SETMASK:
+                mask = set;
+                return 0;
+            default:
+                return -EINVAL;
+        }
+    }
+    
+    int64_t sysSigaltstack(uint64_t oldAddr) {
+        if (oldAddr == 0) {
+            return 0;
+        }
+        uint64_t old[3] = { 0, SS_DISABLE, 0 };
+        return writeGuest(oldAddr, old) ? 0 : -EFAULT;
+    }
+    
+    // Address space
+    
+    bool overlapsMapping(uint64_t start, uint64_t end) const {
+        auto it = mappings.lower_bound(end);
+        return it != mappings.begin() && std::prev(it)->second.end > start;
+    }
+    
+    // Whether every page of [start, end) is mapped
+    bool coveredByMappings(uint64_t start, uint64_t end) const {
+        auto it = mappings.upper_bound(start);
+        if (it == mappings.begin()) {
+            return false;
+        }
+        --it;
+        while (it != mappings.end() && it->first <= start) {
+            if (it->second.end >= end) {
+                return true;
+            }
+            start = std::max(start, it->second.end);
+            ++it;
+        }
+        return false;
+    }
+    
+    void addMapping(uint64_t start, uint64_t end, std::shared_ptr<MappedFile> file = nullptr, uint64_t offset = 0) {
+        removeMapping(start, end);
+        mappings[start] = { end, std::move(file), offset };
+    }
+    
+    void removeMapping(uint64_t start, uint64_t end) {
+        auto it = mappings.upper_bound(start);
+        if (it != mappings.begin()) {
+            --it;
+        }
+        while (it != mappings.end() && it->first < end) {
+            uint64_t from = it->first;
+            Mapping mapping = it->second;
+            if (mapping.end <= start) {
+                ++it;
+                continue;
+            }
+            it = mappings.erase(it);
+            if (from < start) {
+                mappings[from] = { start, mapping.file, mapping.offset };
+            }
+            if (mapping.end > end) {
+                mappings[end] = { mapping.end, mapping.file, mapping.offset + (end - from) };
+            }
+        }
+    }
+    
+    // Highest free range of size bytes below mapLimit and above the heap,
+    // 0 if there is none
+    uint64_t findFree(uint64_t size) const {
+        uint64_t floor = pageAlign(brkEnd);
+        uint64_t end = mapLimit;
+        for (auto it = mappings.rbegin(); it != mappings.rend(); ++it) {
+            if (it->second.end < end && end - std::max(it->second.end, floor) >= size && end >= floor + size) {
+                return end - size;
+            }
+            end = std::min(end, it->first);
+        }
+        return end >= floor + size ? end - size : 0;
+    }
+    
+    int64_t sysBrk(uint64_t addr) {
+        std::lock_guard<std::mutex> lock(memMtx);
+        if (addr < heapStart || addr > mapLimit) {
+            return static_cast<int64_t>(brkEnd);
+        }
+        uint64_t oldEnd = pageAlign(brkEnd);
+        uint64_t newEnd = pageAlign(addr);
+        if (newEnd > oldEnd && overlapsMapping(oldEnd, newEnd)) {
+            return static_cast<int64_t>(brkEnd);
+        }
+        // Memory given back reads as zeroes when the heap grows again
+        uint64_t low = std::min(oldEnd, newEnd);
+        uint64_t high = std::max(oldEnd, newEnd);
+        memory.zeroRange(low, high - low);
+        written(low, high - low);
+        brkEnd = addr;
+        return static_cast<int64_t>(brkEnd);
+    }
+    
+    int64_t sysMmap(const uint64_t* x) {
+        uint64_t hint = x[0];
+        uint64_t size = pageAlign(x[1]);
+        int flags = static_cast<int>(x[3]);
+        uint64_t offset = x[5];
+        bool fixed = (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)) != 0;
+        if (x[1] == 0 || size < x[1] || (offset & (GuestMemory::PAGE_SIZE - 1)) ||
+            (fixed && (hint & (GuestMemory::PAGE_SIZE - 1)))) {
+            return -EINVAL;
+        }
+        GuestFd fd = { -1, false };
+        if (!(flags & MAP_ANONYMOUS) && !lookupFd(x[4], fd)) {
+            return -EBADF;
+        }
+        std::shared_ptr<MappedFile> file;
+        if (fd.host >= 0) {
+            int held = ::fcntl(fd.host, F_DUPFD_CLOEXEC, 3);
+            if (held < 0) {
+                return -errno;
+            }
+            file = std::make_shared<MappedFile>(held);
+        }
+        
+        std::lock_guard<std::mutex> lock(memMtx);
+        uint64_t addr;
+        if (fixed) {
+            if (guest(hint, size) == nullptr) {
+                return -ENOMEM;
+            }
+            if ((flags & MAP_FIXED_NOREPLACE) && overlapsMapping(hint, hint + size)) {
+                return -EEXIST;
+            }
+            addr = hint;
+        } else if (hint != 0 && !(hint & (GuestMemory::PAGE_SIZE - 1)) && hint >= pageAlign(brkEnd) &&
+                   hint <= mapLimit && size <= mapLimit - hint && !overlapsMapping(hint, hint + size)) {
+            addr = hint;
+        } else {
+            addr = findFree(size);
+            if (addr == 0) {
+                return -ENOMEM;
+            }
+        }
+        
+        if (file) {
+            if (!mapFile(addr, size, file->host, offset)) {
+                return -errno;
+            }
+        } else {
+            memory.zeroRange(addr, size);
+        }
+        addMapping(addr, addr + size, file, offset);
+        written(addr, size);
+        return static_cast<int64_t>(addr);
+    }
+    
+    // Private file mappings are copy-on-write views of the file where the
+    // host page size allows, and copies otherwise. Shared mappings are
+    // copies too, so the guest's writes to them never reach the file.
+    bool mapFile(uint64_t addr, uint64_t size, int host, uint64_t offset) {
+        struct stat st;
+        if (fstat(host, &st) != 0) {
+            return false;
+        }
+        uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+        uint64_t available = offset < fileSize ? std::min(size, fileSize - offset) : 0;
+        uint64_t hostPage = GuestMemory::hostPageSize();
+        uint64_t mapped = std::min(size, (available + hostPage - 1) & ~(hostPage - 1));
+        
+        // Whole pages past the end of the file would fault on the host
+        if (S_ISREG(st.st_mode) && mapped != 0 && !(addr & (hostPage - 1)) && !(offset & (hostPage - 1)) &&
+            memory.mapFileRange(addr, mapped, host, static_cast<off_t>(offset))) {
+            memory.zeroRange(addr + mapped, size - mapped);
+            return true;
+        }
+        
+        memory.zeroRange(addr, size);
+        uint64_t done = 0;
+        while (done < available) {
+            ssize_t got = pread(host, memory.data() + addr + done, available - done, static_cast<off_t>(offset + done));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got < 0) {
+                return false;
+            }
+            if (got == 0) {
+                break;
+            }
+            done += got;
+        }
+        return true;
+    }
+    
+    int64_t sysMunmap(uint64_t addr, uint64_t length) {
+        uint64_t size = pageAlign(length);
+        if ((addr & (GuestMemory::PAGE_SIZE - 1)) || size == 0 || guest(addr, size) == nullptr) {
+            return -EINVAL;
+        }
+        std::lock_guard<std::mutex> lock(memMtx);
+        removeMapping(addr, addr + size);
+        memory.zeroRange(addr, size);
+        written(addr, size);
+        return 0;
+    }
+    
+    int64_t sysMremap(const uint64_t* x) {
+        uint64_t addr = x[0];
+        uint64_t oldSize = pageAlign(x[1]);
+        uint64_t newSize = pageAlign(x[2]);
+        if ((addr & (GuestMemory::PAGE_SIZE - 1)) || newSize == 0 || guest(addr, oldSize) == nullptr ||
+            (x[3] & ~static_cast<uint64_t>(MREMAP_MAYMOVE))) {
+            return -EINVAL;
+        }
+        
+        std::lock_guard<std::mutex> lock(memMtx);
+        if (newSize <= oldSize) {
+            removeMapping(addr + newSize, addr + oldSize);
+            memory.zeroRange(addr + newSize, oldSize - newSize);
+            written(addr + newSize, oldSize - newSize);
+            return static_cast<int64_t>(addr);
+        }
+        // Growing needs the whole old range mapped
+        if (!coveredByMappings(addr, addr + oldSize)) {
+            return -EFAULT;
+        }
+        uint64_t grow = newSize - oldSize;
+        if (addr + newSize <= mapLimit && !overlapsMapping(addr + oldSize, addr + newSize)) {
+            memory.zeroRange(addr + oldSize, grow);
+            addMapping(addr + oldSize, addr + newSize);
+            written(addr + oldSize, grow);
+            return static_cast<int64_t>(addr);
+        }
+        if (!(x[3] & MREMAP_MAYMOVE)) {
+            return -ENOMEM;
+        }
+        
+        uint64_t moved = findFree(newSize);
+        if (moved == 0) {
+            return -ENOMEM;
+        }
+        memory.zeroRange(moved, newSize);
+        memcpy(memory.data() + moved, memory.data() + addr, oldSize);
+        // The pages keep the files they map; the grown part is anonymous
+        addMapping(moved + oldSize, moved + newSize);
+        for (auto it = std::prev(mappings.upper_bound(addr)); it != mappings.end() && it->first < addr + oldSize; ++it) {
+            uint64_t from = std::max(addr, it->first);
+            uint64_t to = std::min(addr + oldSize, it->second.end);
+            mappings[moved + (from - addr)] = { moved + (to - addr), it->second.file, it->second.offset + (from - it->first) };
+        }
+        removeMapping(addr, addr + oldSize);
+        memory.zeroRange(addr, oldSize);
+        written(moved, newSize);
+        written(addr, oldSize);
+        return static_cast<int64_t>(moved);
+    }
+    
+    int64_t sysMadvise(const uint64_t* x) {
+        uint64_t start = x[0];
+        uint64_t size = pageAlign(x[1]);
+        if (start & (GuestMemory::PAGE_SIZE - 1)) {
+            return -EINVAL;
+        }
+        if (x[2] != MADV_DONTNEED || guest(start, size) == nullptr) {
+            return 0;
+        }
+        
+        // Anonymous memory reads as zeroes afterwards, file mappings as
+        // the file does
+        std::lock_guard<std::mutex> lock(memMtx);
+        memory.zeroRange(start, size);
+        auto it = mappings.upper_bound(start);
+        if (it != mappings.begin()) {
+            --it;
+        }
+        for (; it != mappings.end() && it->first < start + size; ++it) {
+            uint64_t from = std::max(start, it->first);
+            uint64_t to = std::min(start + size, it->second.end);
+            if (it->second.file && from < to) {
+                mapFile(from, to - from, it->second.file->host, it->second.offset + (from - it->first));
+            }
+        }
+        written(start, size);
+        return 0;
+    }
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <sys/mman.h>
+
+#include "guest_memory.h"
+#include "shared_page_store.h"
+
+// Deduplicates guest RAM against a SharedPageStore, in the background.
+//
+// A thread walks guest RAM a few pages at a time and hashes every
+// resident host page. A page whose hash is unchanged since the previous
+// pass is stable enough to merge: it is looked up in the store, added if
+// it is not there yet, and guest RAM at that address is replaced with a
+// private mapping of the store's copy. Instances running the same
+// software then share one page cache page per distinct page instead of
+// holding an anonymous copy each. All-zero pages are simply released.
+//
+// A merged page is copy-on-write. The first write to it from anywhere,
+// translated code, the soft MMU or device DMA, faults in the kernel, which
+// gives the instance a private copy again; nothing on the emulator's
+// access paths changes. Host addresses of guest RAM stay the same, so
+// TLBs need no flush.
+//
+// Remapping a page has to happen while nothing writes it, so the owner
+// supplies a function that runs the merge step with the guest stopped.
+// When guest RAM is replaced as a whole (reset, program load, snapshot
+// restore) the merger notices by GuestMemory::generation() and starts
+// over.
+class PageMerger {
+public:
+    // Runs work with no vCPU running and no DMA in flight; false if that
+    // cannot be arranged right now
+    using Exclusive = std::function<bool(const std::function<void()>& work)>;
+    
+    // Host pages hashed per step, and how often a step runs
+    static constexpr size_t SCAN_PAGES = 2048;
+    static constexpr auto SCAN_INTERVAL = std::chrono::milliseconds(100);
+    
+    // Every run of merged pages is a mapping of its own and splits the one
+    // around it, and the kernel limits mappings per process
+    // (vm.max_map_count, 65530 by default). Merging stops adding mappings
+    // past this many per instance.
+    static constexpr int64_t MAX_MAPPINGS = 16384;
+    
+    PageMerger(GuestMemory& memory, std::unique_ptr<SharedPageStore> store, Exclusive exclusive) :
+        memory(memory),
+        store(std::move(store)),
+        exclusive(std::move(exclusive)),
+        pageSize(static_cast<size_t>(GuestMemory::hostPageSize())),
+        numPages(memory.size() / pageSize),
+        generation(memory.generation()),
+        lastHash(numPages, 0),
+        mappedPage(numPages, 0),
+        merged(numPages, 0) {}
+    
+    ~PageMerger() {
+        stop();
+    }
+    
+    PageMerger(const PageMerger&) = delete;
+    PageMerger& operator=(const PageMerger&) = delete;
+    
+    void start() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running) {
+            return;
+        }
+        running = true;
+        thread = std::thread([this]() {
+            run();
+        });
+    }
+    
+    // Pages merged so far stay shared
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+    
+    // Guest RAM currently mapped from the store, as far as the last pass
+    // could tell
+    size_t sharedBytes() const {
+        return sharedPages.load(std::memory_order_relaxed) * pageSize;
+    }
+    
+    size_t releasedZeroBytes() const {
+        return zeroPages.load(std::memory_order_relaxed) * pageSize;
+    }
+    
+    uint64_t storePages() const {
+        return store->usedPages();
+    }
+    
+private:
+    struct Candidate {
+        size_t page;
+        uint64_t hash;
+    };
+    
+    GuestMemory& memory;
+    std::unique_ptr<SharedPageStore> store;
+    Exclusive exclusive;
+    size_t pageSize;
+    size_t numPages;
+    uint64_t generation;    // of guest RAM the per-page state describes
+    
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running = false;
+    std::thread thread;
+    
+    // Per host page, only touched by the scanning thread: the hash seen
+    // last pass, the store page mapped there plus one (0 for none) and
+    // whether it still shares that page. A page the guest wrote to stays
+    // inside its mapping, so mappedPage keeps it until the page is zeroed
+    // or remapped.
+    std::vector<uint64_t> lastHash;
+    std::vector<uint64_t> mappedPage;
+    std::vector<uint8_t> merged;
+    size_t cursor = 0;
+    std::atomic<size_t> sharedPages{0};
+    std::atomic<size_t> zeroPages{0};
+    
+    void run() {
+        std::vector<Candidate> candidates;
+        std::unique_lock<std::mutex> lock(mtx);
+        while (running) {
+            cv.wait_for(lock, SCAN_INTERVAL, [this]() { return !running; });
+            if (!running) {
+                break;
+            }
+            lock.unlock();
+            
+            candidates.clear();
+            scan(candidates);
+            if (!candidates.empty()) {
+                // Candidates passed over now come up again next pass
+                exclusive([&]() { merge(candidates); });
+            }
+            lock.lock();
+        }
+    }
+    
+    // Forgets every page once guest RAM was replaced under the merger: the
+    // mappings it made are gone with it. False if that happened.
+    bool sameGeneration() {
+        uint64_t current = memory.generation();
+        if (current == generation) {
+            return true;
+        }
+        std::fill(lastHash.begin(), lastHash.end(), 0);
+        std::fill(mappedPage.begin(), mappedPage.end(), 0);
+        std::fill(merged.begin(), merged.end(), 0);
+        cursor = 0;
+        sharedPages.store(0, std::memory_order_relaxed);
+        generation = current;
+        return false;
+    }
+    
+    // Mappings the pages merged so far take: two per run of consecutive
+    // store pages, see MAX_MAPPINGS
+    int64_t countMappings() const {
+        int64_t count = 0;
+        for (size_t page = 0; page < numPages; page++) {
+            uint64_t tag = mappedPage[page];
+            if (tag != 0 && (page == 0 || mappedPage[page - 1] == 0 || mappedPage[page - 1] + 1 != tag)) {
+                count += 2;
+            }
+        }
+        return count;
+    }
+    
+    // Hashes the next SCAN_PAGES pages while the guest runs. Pages that
+    // are not resident are skipped so scanning never faults them in.
+    void scan(std::vector<Candidate>& candidates) {
+        sameGeneration();
+        if (numPages == 0) {
+            return;
+        }
+        size_t count = std::min(SCAN_PAGES, numPages - cursor);
+        std::vector<unsigned char> resident(count);
+        uint8_t* start = memory.data() + cursor * pageSize;
+        if (mincore(start, count * pageSize, resident.data()) != 0) {
+            std::fill(resident.begin(), resident.end(), 0);
+        }
+        
+        for (size_t i = 0; i < count; i++) {
+            size_t page = cursor + i;
+            if (!(resident[i] & 1)) {
+                continue;
+            }
+            uint64_t hash = SharedPageStore::hashPage(start + i * pageSize, pageSize);
+            if (merged[page] && hash == lastHash[page]) {
+                continue;
+            }
+            if (merged[page]) {
+                // Written since, so the kernel gave it a private copy
+                merged[page] = 0;
+                sharedPages.fetch_sub(1, std::memory_order_relaxed);
+            } else if (hash == lastHash[page]) {
+                candidates.push_back({ page, hash });
+            }
+            lastHash[page] = hash;
+        }
+        cursor = cursor + count == numPages ? 0 : cursor + count;
+    }
+    
+    // Called with the guest stopped. Each candidate is checked once more,
+    // as the guest ran since it was hashed. Mappings are counted afresh,
+    // so pages zeroed since give theirs back.
+    void merge(const std::vector<Candidate>& candidates) {
+        if (!sameGeneration()) {
+            return;
+        }
+        int64_t mappings = countMappings();
+        for (const Candidate& candidate : candidates) {
+            size_t page = candidate.page;
+            uint64_t addr = static_cast<uint64_t>(page) * pageSize;
+            const uint8_t* data = memory.data() + addr;
+            if (SharedPageStore::hashPage(data, pageSize) != candidate.hash) {
+                continue;
+            }
+            
+            if (isZero(data)) {
+                // Back to untouched memory, which costs nothing
+                memory.zeroRange(addr, pageSize);
+                lastHash[page] = 0;
+                mappedPage[page] = 0;
+                zeroPages.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            
+            int64_t index = store->find(candidate.hash, data);
+            if (index < 0) {
+                index = store->publish(candidate.hash, data);
+            }
+            if (index < 0) {
+                continue;
+            }
+            
+            // A page that continues the store pages mapped next to it
+            // extends their mapping; any other page splits what it lands in
+            uint64_t tag = static_cast<uint64_t>(index) + 1;
+            int64_t cost = 2;
+            if (page > 0 && mappedPage[page - 1] == tag - 1 && tag > 1) {
+                cost -= 2;
+            }
+            if (page + 1 < numPages && mappedPage[page + 1] == tag + 1) {
+                cost -= 2;
+            }
+            if (mappings + cost > MAX_MAPPINGS ||
+                !memory.mapFileRange(addr, pageSize, store->fileDescriptor(), store->fileOffset(index))) {
+                continue;
+            }
+            mappings += cost;
+            mappedPage[page] = tag;
+            merged[page] = 1;
+            sharedPages.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    bool isZero(const uint8_t* data) const {
+        for (size_t i = 0; i < pageSize; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            if (word != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include "a64_decoder.h"
+#include "timer.h"
+
+// A guest function, for symbolizing profiles
+struct GuestSymbol {
+    uint64_t address;
+    uint64_t size;      // 0 if unknown; the symbol then extends to the next one
+    std::string name;
+};
+
+// One sample: the guest PC followed by the call sites found by walking
+// the guest's frame records
+struct ProfileSample {
+    static constexpr unsigned MAX_FRAMES = 16;
+    
+    uint32_t depth;
+    uint64_t frames[MAX_FRAMES];
+};
+
+// Single-producer, single-consumer sample queue. The vCPU thread pushes
+// without locking or waiting; when the ring is full the sample is
+// dropped.
+class SampleRing {
+public:
+    static constexpr size_t CAPACITY = 1024;
+    
+    SampleRing() :
+        samples(new ProfileSample[CAPACITY]) {}
+    
+    bool push(const ProfileSample& sample) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        if (pos - tail.load(std::memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        samples[pos % CAPACITY] = sample;
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    
+    template <typename F>
+    void drain(F fn) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        size_t end = head.load(std::memory_order_acquire);
+        for (; pos != end; pos++) {
+            fn(samples[pos % CAPACITY]);
+        }
+        tail.store(pos, std::memory_order_release);
+    }
+    
+private:
+    std::unique_ptr<ProfileSample[]> samples;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+// Sampling profiler for guest code. A timer asks each vCPU for a sample
+// at the configured rate; the vCPU takes it at its next block boundary
+// and pushes it to its own ring, which the timer thread drains into the
+// aggregate. Ops run by the interpreter are also counted by kind, which
+// shows where emulation time goes; ops the JIT translates natively are
+// not counted.
+class Profiler {
+public:
+    static constexpr size_t OP_KIND_COUNT = static_cast<size_t>(MicroOpKind::Simd) + 1;
+    
+    // Called from the timer thread to ask a vCPU for a sample
+    using SampleRequest = std::function<void(int)>;
+    
+    Profiler(size_t vcpuCount, SampleRequest request) :
+        vcpus(vcpuCount),
+        request(std::move(request)),
+        timers(vcpuCount, [this](int id) {
+            tick(id);
+        }) {}
+    
+    ~Profiler() {
+        stop();
+    }
+    
+    bool isEnabled() const {
+        return enabled.load(std::memory_order_relaxed);
+    }
+    
+    // Discards the previous profile and samples every vCPU hz times per
+    // second
+    bool start(unsigned hz) {
+        if (hz == 0 || hz > 10000) {
+            return false;
+        }
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stacks.clear();
+            samples = 0;
+            for (PerVcpu& vcpu : vcpus) {
+                vcpu.ring.drain([](const ProfileSample&) {});
+                for (size_t i = 0; i < OP_KIND_COUNT; i++) {
+                    vcpu.opBase[i] = vcpu.ops[i].load(std::memory_order_relaxed);
+                }
+                vcpu.droppedBase = vcpu.dropped.load(std::memory_order_relaxed);
+            }
+        }
+        interval = std::max<uint64_t>(1, GuestCounter::FREQUENCY / hz);
+        enabled.store(true, std::memory_order_relaxed);
+        uint64_t now = GuestCounter::now();
+        for (size_t i = 0; i < vcpus.size(); i++) {
+            timers.arm(static_cast<int>(i), now + interval);
+        }
+        timers.start();
+        return true;
+    }
+    
+    // Stops sampling; the profile collected so far stays available
+    void stop() {
+        enabled.store(false, std::memory_order_relaxed);
+        timers.stop();
+        timers.disarmAll();
+        std::lock_guard<std::mutex> lock(mtx);
+        for (size_t i = 0; i < vcpus.size(); i++) {
+            collect(i);
+        }
+    }
+    
+    // vCPU thread only. Counters have a single writer, so a plain load
+    // and store is enough.
+    void countOp(int vcpu, MicroOpKind kind) {
+        std::atomic<uint64_t>& counter = vcpus[vcpu].ops[static_cast<size_t>(kind)];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    
+    // vCPU thread only
+    void record(int vcpu, const ProfileSample& sample) {
+        if (!vcpus[vcpu].ring.push(sample)) {
+            std::atomic<uint64_t>& dropped = vcpus[vcpu].dropped;
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+    
+    void setSymbols(std::vector<GuestSymbol> table) {
+        std::sort(table.begin(), table.end(), [](const GuestSymbol& a, const GuestSymbol& b) {
+            return a.address < b.address;
+        });
+        std::lock_guard<std::mutex> lock(mtx);
+        symbols = std::move(table);
+    }
+    
+    // Writes prefix.flat.txt, with self samples per function, the hottest
+    // PCs and the op counts, and prefix.collapsed.txt, one line per
+    // distinct call chain in the folded format flame graph tools read
+    bool dump(const std::string& prefix, std::string& error) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (size_t i = 0; i < vcpus.size(); i++) {
+            collect(i);
+        }
+        
+        std::map<uint64_t, uint64_t> pcs;
+        std::map<std::string, uint64_t> functions;
+        std::map<std::string, uint64_t> folded;
+        for (const auto& entry : stacks) {
+            const std::vector<uint64_t>& frames = entry.first;
+            pcs[frames[0]] += entry.second;
+            functions[symbolize(frames[0], false)] += entry.second;
+            
+            std::string line;
+            for (size_t i = frames.size(); i-- > 0;) {
+                line += symbolize(frames[i], false);
+                line += i > 0 ? ";" : "";
+            }
+            folded[line] += entry.second;
+        }
+        
+        std::string flatPath = prefix + ".flat.txt";
+        FILE* flat = fopen(flatPath.c_str(), "w");
+        if (flat == nullptr) {
+            error = flatPath + ": " + strerror(errno);
+            return false;
+        }
+        
+        uint64_t dropped = 0;
+        for (const PerVcpu& vcpu : vcpus) {
+            dropped += vcpu.dropped.load(std::memory_order_relaxed) - vcpu.droppedBase;
+        }
+        fprintf(flat, "# %llu samples, %llu dropped\n", static_cast<unsigned long long>(samples),
+                static_cast<unsigned long long>(dropped));
+        
+        fprintf(flat, "\n# self samples by function\n");
+        for (const auto& entry : sortedByCount(functions)) {
+            fprintf(flat, "%6.2f%% %10llu  %s\n", percent(entry.second, samples),
+                    static_cast<unsigned long long>(entry.second), entry.first.c_str());
+        }
+        
+        fprintf(flat, "\n# hottest PCs\n");
+        std::vector<std::pair<uint64_t, uint64_t>> hot(pcs.begin(), pcs.end());
+        std::sort(hot.begin(), hot.end(), [](const std::pair<uint64_t, uint64_t>& a,
+                                             const std::pair<uint64_t, uint64_t>& b) {
+            return a.second > b.second;
+        });
+        hot.resize(std::min<size_t>(hot.size(), HOT_PC_COUNT));
+        for (const auto& entry : hot) {
+            fprintf(flat, "%6.2f%% %10llu  0x%llx %s\n", percent(entry.second, samples),
+                    static_cast<unsigned long long>(entry.second), static_cast<unsigned long long>(entry.first),
+                    symbolize(entry.first, true).c_str());
+        }
+        
+        std::map<std::string, uint64_t> ops;
+        uint64_t totalOps = 0;
+        for (size_t i = 0; i < OP_KIND_COUNT; i++) {
+            uint64_t count = 0;
+            for (const PerVcpu& vcpu : vcpus) {
+                count += vcpu.ops[i].load(std::memory_order_relaxed) - vcpu.opBase[i];
+            }
+            if (count != 0) {
+                ops[OP_KIND_NAMES[i]] = count;
+                totalOps += count;
+            }
+        }
+        fprintf(flat, "\n# interpreted ops by kind\n");
+        for (const auto& entry : sortedByCount(ops)) {
+            fprintf(flat, "%6.2f%% %14llu  %s\n", percent(entry.second, totalOps),
+                    static_cast<unsigned long long>(entry.second), entry.first.c_str());
+        }
+        bool ok = fclose(flat) == 0;
+        
+        std::string foldedPath = prefix + ".collapsed.txt";
+        FILE* collapsed = fopen(foldedPath.c_str(), "w");
+        if (collapsed == nullptr) {
+            error = foldedPath + ": " + strerror(errno);
+            return false;
+        }
+        for (const auto& entry : folded) {
+            fprintf(collapsed, "%s %llu\n", entry.first.c_str(), static_cast<unsigned long long>(entry.second));
+        }
+        ok = fclose(collapsed) == 0 && ok;
+        if (!ok) {
+            error = "write failed: " + std::string(strerror(errno));
+        }
+        return ok;
+    }
+    
+private:
+    static constexpr size_t HOT_PC_COUNT = 32;
+    
+    static constexpr const char* OP_KIND_NAMES[] = {
+        "Nop", "Undefined", "Adr", "Adrp", "AddImm", "SubImm", "AndImm", "OrrImm", "EorImm", "MovImm",
+        "MovK", "Sbfm", "Bfm", "Ubfm", "Extr", "AddReg", "SubReg", "AddExt", "SubExt", "Adc", "Sbc", "And",
+        "Orr", "Eor", "Csel", "Ccmp", "Ccmn", "Udiv", "Sdiv", "ShiftVar", "Rbit", "Rev", "Clz", "Cls",
+        "Madd", "Msub", "MaddLong", "MsubLong", "MulHigh", "Load", "Store", "LoadPair", "StorePair",
+        "LoadLiteral", "LoadAcquire", "StoreRelease", "LoadExclusive", "StoreExclusive",
+        "LoadExclusivePair", "StoreExclusivePair", "CompareSwap", "AtomicRmw", "VecLoad", "VecStore",
+        "VecLoadPair", "VecStorePair", "VecLoadLiteral", "VecLoadMulti", "VecStoreMulti", "Branch",
+        "BranchCond", "CompareBranch", "TestBranch", "BranchReg", "Svc", "Brk", "Eret", "Barrier", "Clrex",
+        "Mrs", "Msr", "MsrImm", "Sys", "Wfi", "Wfe", "Sev", "Simd"
+    };
+    static_assert(std::size(OP_KIND_NAMES) == OP_KIND_COUNT, "OP_KIND_NAMES out of sync with MicroOpKind");
+    
+    // Everything but the aggregate is written by one thread and read by
+    // others, so vCPUs do not share cache lines
+    struct alignas(64) PerVcpu {
+        SampleRing ring;
+        std::atomic<uint64_t> ops[OP_KIND_COUNT] = {};
+        std::atomic<uint64_t> dropped{0};
+        
+        // Counter values when profiling started; guarded by mtx
+        uint64_t opBase[OP_KIND_COUNT] = {};
+        uint64_t droppedBase = 0;
+    };
+    
+    std::vector<PerVcpu> vcpus;
+    SampleRequest request;
+    std::atomic<bool> enabled{false};
+    uint64_t interval = 0;
+    
+    // Aggregate and symbols, guarded by mtx
+    std::mutex mtx;
+    std::map<std::vector<uint64_t>, uint64_t> stacks;
+    uint64_t samples = 0;
+    std::vector<GuestSymbol> symbols;
+    
+    // Declared last so its thread stops before the rest goes away
+    TimerService timers;
+    
+    void tick(int id) {
+        request(id);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            collect(id);
+        }
+        if (enabled.load(std::memory_order_relaxed)) {
+            timers.arm(id, GuestCounter::now() + interval);
+        }
+    }
+    
+    // mtx held
+    void collect(size_t id) {
+        vcpus[id].ring.drain([this](const ProfileSample& sample) {
+            stacks[std::vector<uint64_t>(sample.frames, sample.frames + sample.depth)]++;
+            samples++;
+        });
+    }
+    
+    // mtx held. Function name, with the offset into it if asked for; raw
+    // addresses outside every symbol.
+    std::string symbolize(uint64_t address, bool withOffset) const {
+        auto next = std::upper_bound(symbols.begin(), symbols.end(), address,
+                                     [](uint64_t value, const GuestSymbol& symbol) {
+            return value < symbol.address;
+        });
+        char text[32];
+        if (next != symbols.begin()) {
+            const GuestSymbol& symbol = *(next - 1);
+            uint64_t offset = address - symbol.address;
+            if (symbol.size == 0 || offset < symbol.size) {
+                if (!withOffset) {
+                    return symbol.name;
+                }
+                snprintf(text, sizeof(text), "+0x%llx", static_cast<unsigned long long>(offset));
+                return symbol.name + text;
+            }
+        }
+        if (withOffset) {
+            return "";
+        }
+        snprintf(text, sizeof(text), "0x%llx", static_cast<unsigned long long>(address));
+        return text;
+    }
+    
+    static std::vector<std::pair<std::string, uint64_t>> sortedByCount(const std::map<std::string, uint64_t>& counts) {
+        std::vector<std::pair<std::string, uint64_t>> sorted(counts.begin(), counts.end());
+        std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, uint64_t>& a,
+                                                          const std::pair<std::string, uint64_t>& b) {
+            return a.second > b.second;
+        });
+        return sorted;
+    }
+    
+    static double percent(uint64_t part, uint64_t total) {
+        return total == 0 ? 0.0 : 100.0 * static_cast<double>(part) / static_cast<double>(total);
+    }
+};
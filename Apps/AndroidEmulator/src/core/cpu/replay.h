@@ -0,0 +1,310 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Whether a CPUEmulator logs or consumes a trace of its inputs
+enum class ReplayMode : int {
+    Off = 0,
+    Record = 1,
+    Replay = 2
+};
+
+// Trace file layout:
+//
+//   TraceHeader
+//   TraceVcpuState[numVcpus]
+//   events until end of file
+//
+// Each event is a type byte followed by LEB128 fields. Boundary events
+// (interrupt, switch, end) happen at a dispatcher boundary of the vCPU
+// holding the run token and carry its boundary count, as a delta from
+// that vCPU's previous boundary event. Values are zigzag deltas from the
+// previous value, so counter reads take two or three bytes.
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numVcpus;
+    uint64_t memorySize;
+    uint32_t executionMode;
+    uint32_t memoryBackend;
+};
+
+// Scheduler state a snapshot does not hold
+struct TraceVcpuState {
+    uint32_t pendingInterrupts;
+    uint8_t halted;
+    uint8_t waitState;
+    uint8_t eventRegister;
+    uint8_t reserved;
+};
+
+enum TraceEventType : uint8_t {
+    TRACE_VALUE = 0,        // an input the guest read, e.g. CNTVCT_EL0
+    TRACE_INTERRUPT = 1,    // interrupt lines raised from outside; arg = mask
+    TRACE_SWITCH = 2,       // run token passed on; arg = next vCPU + 1, 0 for none
+    TRACE_END = 3           // recording stopped; arg = hash of the final state
+};
+
+struct TraceEvent {
+    uint8_t type;
+    uint64_t step;      // boundary events only
+    uint64_t arg;
+};
+
+// Sequential reader or writer of one trace. Only the vCPU holding the run
+// token uses it while the emulator runs, so it needs no locking.
+class ReplayLog {
+public:
+    static constexpr char MAGIC[8] = { 'A', 'E', 'M', 'U', 'T', 'R', 'C', 'E' };
+    static constexpr uint32_t VERSION = 1;
+    
+    ~ReplayLog() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    static std::unique_ptr<ReplayLog> create(const std::string& path, const TraceHeader& header,
+                                             const std::vector<TraceVcpuState>& vcpus, std::string& error) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return nullptr;
+        }
+        
+        std::unique_ptr<ReplayLog> log(new ReplayLog(fd, vcpus.size()));
+        log->append(&header, sizeof(header));
+        log->append(vcpus.data(), vcpus.size() * sizeof(TraceVcpuState));
+        return log;
+    }
+    
+    // Opens a trace for replay. The header is returned for the caller to
+    // check against its configuration.
+    static std::unique_ptr<ReplayLog> load(const std::string& path, TraceHeader& header,
+                                           std::vector<TraceVcpuState>& vcpus, std::string& error) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return nullptr;
+        }
+        
+        std::unique_ptr<ReplayLog> log(new ReplayLog(fd, 0));
+        if (!log->take(&header, sizeof(header)) || memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != VERSION) {
+            error = "not a trace of this version";
+            return nullptr;
+        }
+        vcpus.resize(header.numVcpus);
+        log->lastStep.assign(header.numVcpus, 0);
+        if (!log->take(vcpus.data(), vcpus.size() * sizeof(TraceVcpuState))) {
+            error = "truncated trace header";
+            return nullptr;
+        }
+        return log;
+    }
+    
+    // Recording
+    
+    void value(uint64_t value) {
+        putByte(TRACE_VALUE);
+        putVarint(zigzag(value - lastValue));
+        lastValue = value;
+    }
+    
+    void event(TraceEventType type, int vcpu, uint64_t step, uint64_t arg) {
+        putByte(type);
+        putVarint(step - lastStep[vcpu]);
+        putVarint(arg);
+        lastStep[vcpu] = step;
+    }
+    
+    // Writes out everything logged so far and closes the file
+    bool finish(std::string& error) {
+        bool ok = flush();
+        if (close(fd) != 0) {
+            ok = false;
+        }
+        fd = -1;
+        if (!ok) {
+            error = "write failed: " + std::string(strerror(errno));
+        }
+        return ok;
+    }
+    
+    // Replay
+    
+    // The next event, with its step resolved for the vCPU that holds the
+    // token. False at the end of the trace.
+    bool peek(int vcpu, TraceEvent& event) {
+        if (!nextValid && !decode()) {
+            return false;
+        }
+        event.type = next.type;
+        event.step = next.type == TRACE_VALUE ? 0 : lastStep[vcpu] + next.step;
+        event.arg = next.arg;
+        return true;
+    }
+    
+    void consume(int vcpu) {
+        if (next.type == TRACE_VALUE) {
+            lastValue = next.arg;
+        } else {
+            lastStep[vcpu] += next.step;
+        }
+        nextValid = false;
+    }
+    
+    // Next recorded input, false if the trace has something else here
+    bool takeValue(uint64_t& value) {
+        TraceEvent event;
+        if (!peek(0, event) || event.type != TRACE_VALUE) {
+            return false;
+        }
+        value = event.arg;
+        consume(0);
+        return true;
+    }
+    
+private:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+    
+    ReplayLog(int fd, size_t numVcpus) :
+        fd(fd),
+        lastStep(numVcpus, 0) {
+        buffer.reserve(BUFFER_SIZE);
+    }
+    
+    static uint64_t zigzag(uint64_t delta) {
+        return (delta << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+    }
+    
+    static uint64_t unzigzag(uint64_t encoded) {
+        return (encoded >> 1) ^ (0 - (encoded & 1));
+    }
+    
+    void append(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), p, p + size);
+        if (buffer.size() >= BUFFER_SIZE) {
+            flush();
+        }
+    }
+    
+    void putByte(uint8_t byte) {
+        buffer.push_back(byte);
+        if (buffer.size() >= BUFFER_SIZE) {
+            flush();
+        }
+    }
+    
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            putByte(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        putByte(static_cast<uint8_t>(value));
+    }
+    
+    // A failed write is reported by finish
+    bool flush() {
+        const uint8_t* p = buffer.data();
+        size_t size = buffer.size();
+        while (size > 0 && !failed) {
+            ssize_t written = write(fd, p, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                break;
+            }
+            p += written;
+            size -= written;
+        }
+        buffer.clear();
+        return !failed;
+    }
+    
+    bool getByte(uint8_t& byte) {
+        if (readPos == buffer.size()) {
+            buffer.resize(BUFFER_SIZE);
+            ssize_t got;
+            do {
+                got = read(fd, buffer.data(), BUFFER_SIZE);
+            } while (got < 0 && errno == EINTR);
+            buffer.resize(got > 0 ? got : 0);
+            readPos = 0;
+            if (buffer.empty()) {
+                return false;
+            }
+        }
+        byte = buffer[readPos++];
+        return true;
+    }
+    
+    bool getVarint(uint64_t& value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            if (!getByte(byte)) {
+                return false;
+            }
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool take(void* data, size_t size) {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        for (size_t i = 0; i < size; i++) {
+            if (!getByte(p[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Reads the next event into next; a truncated one ends the trace
+    bool decode() {
+        uint8_t type;
+        uint64_t field;
+        if (!getByte(type) || type > TRACE_END || !getVarint(field)) {
+            return false;
+        }
+        next.type = type;
+        if (type == TRACE_VALUE) {
+            next.arg = lastValue + unzigzag(field);
+        } else {
+            next.step = field;
+            if (!getVarint(next.arg)) {
+                return false;
+            }
+        }
+        nextValid = true;
+        return true;
+    }
+    
+    int fd;
+    bool failed = false;
+    std::vector<uint8_t> buffer;
+    size_t readPos = 0;
+    
+    // Previous value and per-vCPU boundary step the deltas refer to
+    uint64_t lastValue = 0;
+    std::vector<uint64_t> lastStep;
+    
+    // Replay look-ahead; step is still a delta
+    TraceEvent next = {};
+    bool nextValid = false;
+};
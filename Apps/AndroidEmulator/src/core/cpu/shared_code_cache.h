@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// What a shared entry holds. Translations are only valid for the kind of
+// memory access they were made for.
+enum SharedCodeKind : uint32_t {
+    SHARED_DECODED = 1,         // MicroOp[], one per guest instruction
+    SHARED_JIT = 2,             // JitTranslator image
+    SHARED_JIT_FLAT = 3         // JitTranslator image using host-mapped memory
+};
+
+// File layout:
+//
+//   SharedCacheHeader
+//   SharedCacheSlot[numSlots]
+//   entry data, allocated front to back
+//
+// Each entry is the guest code it was made from followed by its payload.
+// Entries are keyed by guest PC and a hash of the code bytes, and are
+// never removed: code that changes simply hashes to another key, and a
+// full cache stops taking new entries.
+struct SharedCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hostArch;
+    uint64_t buildId;       // from the attaching build, see SharedCodeCache::attach
+    uint64_t size;
+    uint64_t numSlots;
+    uint64_t dataOffset;
+    std::atomic<uint64_t> used;     // data bytes allocated
+};
+
+enum SharedSlotState : uint32_t {
+    SLOT_EMPTY = 0,
+    SLOT_CLAIMED = 1,       // being filled in; readers skip it
+    SLOT_READY = 2
+};
+
+struct SharedCacheSlot {
+    std::atomic<uint32_t> state;
+    uint32_t kind;
+    uint64_t pc;
+    uint64_t hash;
+    uint64_t offset;        // from the start of the file
+    uint32_t guestSize;
+    uint32_t payloadSize;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "shared cache atomics must work across processes");
+
+// Content-addressed store of decoded blocks and translations that any
+// number of emulator instances, in this process or others, map from the
+// same file. Lookups and inserts are lock-free; creating the file is
+// serialized with flock.
+class SharedCodeCache {
+public:
+    static constexpr char MAGIC[8] = { 'A', 'E', 'M', 'U', 'C', 'O', 'D', 'E' };
+    // Changes with the format of decoded blocks or translations
+    static constexpr uint32_t VERSION = 3;
+    static constexpr uint64_t DEFAULT_SIZE = 64ull * 1024 * 1024;
+    static constexpr uint64_t MIN_SIZE = 1024 * 1024;
+    static constexpr size_t MAX_PROBES = 16;
+    
+    // Average entry size the slot table is sized for
+    static constexpr uint64_t BYTES_PER_SLOT = 1024;
+    
+    ~SharedCodeCache() {
+        if (base != nullptr) {
+            munmap(base, mappedSize);
+        }
+    }
+    
+    SharedCodeCache(const SharedCodeCache&) = delete;
+    SharedCodeCache& operator=(const SharedCodeCache&) = delete;
+    
+    // Maps the cache at path, creating it with size bytes if it does not
+    // exist yet. An existing file keeps the size it was created with. The
+    // file holds host code that gets run, so it has to belong to this user
+    // and be closed to everyone else. buildId
+    // identifies everything entries depend on beyond VERSION, such as the
+    // compiler and the layout of the state translations access; a file
+    // made under another one is refused.
+    static std::unique_ptr<SharedCodeCache> attach(const std::string& path, uint64_t size, uint64_t buildId,
+                                                   std::string& error) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return nullptr;
+        }
+        
+        std::unique_ptr<SharedCodeCache> cache(new SharedCodeCache());
+        bool ok = flock(fd, LOCK_EX) == 0 && cache->map(fd, size, buildId, error);
+        close(fd);
+        return ok ? std::move(cache) : nullptr;
+    }
+    
+    // Hash of the guest code an entry is keyed by
+    static uint64_t hashCode(const uint8_t* code, size_t size) {
+        uint64_t h = 0xCBF29CE484222325ull ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, code + i, 8);
+            h = (h ^ word) * 0x100000001B3ull;
+            h ^= h >> 29;
+        }
+        for (; i < size; i++) {
+            h = (h ^ code[i]) * 0x100000001B3ull;
+        }
+        h ^= h >> 32;
+        return h * 0x9E3779B97F4A7C15ull;
+    }
+    
+    // Payload of the entry for kind, pc and hash whose guest code is a
+    // prefix of code, nullptr if there is none. The pointer stays valid
+    // for the lifetime of this object.
+    const uint8_t* find(SharedCodeKind kind, uint64_t pc, uint64_t hash,
+                        const uint8_t* code, size_t codeSize, uint32_t& payloadSize) const {
+        size_t index = slotIndex(kind, pc, hash);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            const SharedCacheSlot& slot = slots[(index + probe) % header->numSlots];
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if (state == SLOT_EMPTY) {
+                return nullptr;
+            }
+            if (state != SLOT_READY || slot.kind != kind || slot.pc != pc || slot.hash != hash) {
+                continue;
+            }
+            // The hash only picks the slot; the code itself decides
+            const uint8_t* entry = base + slot.offset;
+            if (slot.offset + slot.guestSize + slot.payloadSize <= header->size &&
+                slot.guestSize <= codeSize && memcmp(entry, code, slot.guestSize) == 0) {
+                payloadSize = slot.payloadSize;
+                return entry + slot.guestSize;
+            }
+        }
+        return nullptr;
+    }
+    
+    // Adds an entry made from the first guestSize bytes of code. False when
+    // the cache is full or another instance got there first.
+    bool publish(SharedCodeKind kind, uint64_t pc, uint64_t hash, const uint8_t* code, uint32_t guestSize,
+                 const void* payload, uint32_t payloadSize) {
+        uint64_t bytes = (static_cast<uint64_t>(guestSize) + payloadSize + 15) & ~15ull;
+        uint64_t offset = header->dataOffset + header->used.fetch_add(bytes, std::memory_order_relaxed);
+        if (offset + bytes > header->size) {
+            return false;
+        }
+        memcpy(base + offset, code, guestSize);
+        memcpy(base + offset + guestSize, payload, payloadSize);
+        
+        size_t index = slotIndex(kind, pc, hash);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            SharedCacheSlot& slot = slots[(index + probe) % header->numSlots];
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if (state == SLOT_READY && slot.kind == kind && slot.pc == pc && slot.hash == hash &&
+                slot.guestSize == guestSize && memcmp(base + slot.offset, code, guestSize) == 0) {
+                return false;
+            }
+            if (state != SLOT_EMPTY ||
+                !slot.state.compare_exchange_strong(state, SLOT_CLAIMED, std::memory_order_acquire)) {
+                continue;
+            }
+            slot.kind = kind;
+            slot.pc = pc;
+            slot.hash = hash;
+            slot.offset = offset;
+            slot.guestSize = guestSize;
+            slot.payloadSize = payloadSize;
+            slot.state.store(SLOT_READY, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+    
+    uint64_t usedBytes() const {
+        return header->used.load(std::memory_order_relaxed);
+    }
+    
+private:
+    uint8_t* base = nullptr;
+    size_t mappedSize = 0;
+    SharedCacheHeader* header = nullptr;
+    SharedCacheSlot* slots = nullptr;
+    
+    SharedCodeCache() = default;
+    
+    static uint32_t hostArch() {
+#if defined(__x86_64__)
+        return 1;
+#elif defined(__aarch64__)
+        return 2;
+#else
+        return 0;
+#endif
+    }
+    
+    static size_t slotIndex(SharedCodeKind kind, uint64_t pc, uint64_t hash) {
+        uint64_t h = (hash ^ (pc * 0x9E3779B97F4A7C15ull)) + kind;
+        h ^= h >> 31;
+        return static_cast<size_t>(h * 0xBF58476D1CE4E5B9ull >> 17);
+    }
+    
+    // Called with the file locked. A new file is laid out here; an
+    // existing one must have been made by this build on this host.
+    bool map(int fd, uint64_t size, uint64_t buildId, std::string& error) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            error = "stat failed: " + std::string(strerror(errno));
+            return false;
+        }
+        if (st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+            error = "file is not private to this user";
+            return false;
+        }
+        
+        bool created = st.st_size == 0;
+        if (created) {
+            if (size < MIN_SIZE) {
+                error = "cache size too small";
+                return false;
+            }
+            if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                error = "resize failed: " + std::string(strerror(errno));
+                return false;
+            }
+        } else {
+            size = static_cast<uint64_t>(st.st_size);
+        }
+        
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            error = "mmap failed: " + std::string(strerror(errno));
+            return false;
+        }
+        base = static_cast<uint8_t*>(mem);
+        mappedSize = size;
+        header = reinterpret_cast<SharedCacheHeader*>(base);
+        slots = reinterpret_cast<SharedCacheSlot*>(base + sizeof(SharedCacheHeader));
+        
+        if (created) {
+            // The file is all zeroes, so every slot starts out empty
+            memcpy(header->magic, MAGIC, sizeof(header->magic));
+            header->version = VERSION;
+            header->hostArch = hostArch();
+            header->buildId = buildId;
+            header->size = size;
+            header->numSlots = size / BYTES_PER_SLOT;
+            uint64_t table = sizeof(SharedCacheHeader) + header->numSlots * sizeof(SharedCacheSlot);
+            header->dataOffset = (table + 15) & ~15ull;
+            header->used.store(0, std::memory_order_relaxed);
+            return true;
+        }
+        
+        if (size < sizeof(SharedCacheHeader) || memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != VERSION || header->hostArch != hostArch() || header->buildId != buildId ||
+            header->size != size || header->numSlots == 0 ||
+            header->dataOffset < sizeof(SharedCacheHeader) + header->numSlots * sizeof(SharedCacheSlot) ||
+            header->dataOffset > size) {
+            error = "not a code cache of this build and host";
+            return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// File layout:
+//
+//   SharedPageHeader
+//   SharedPageSlot[numSlots]
+//   pages, from dataOffset on, allocated front to back
+//
+// Pages are keyed by a hash of their contents and never change once
+// published, since every instance maps them privately: a page that
+// changed under such a mapping would change guest RAM.
+struct SharedPageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageSize;
+    uint64_t size;
+    uint64_t numSlots;
+    uint64_t numPages;
+    uint64_t dataOffset;
+    std::atomic<uint64_t> usedPages;
+};
+
+enum SharedPageSlotState : uint32_t {
+    PAGE_SLOT_EMPTY = 0,
+    PAGE_SLOT_CLAIMED = 1,      // being filled in; readers skip it
+    PAGE_SLOT_READY = 2
+};
+
+struct SharedPageSlot {
+    std::atomic<uint32_t> state;
+    uint32_t reserved;
+    uint64_t hash;
+    uint64_t page;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "shared page store atomics must work across processes");
+
+// Content-addressed store of host pages that emulator instances, in this
+// process or others, map from the same file in place of identical pages
+// of guest RAM. Lookups and inserts are lock-free; creating the file is
+// serialized with flock. The file must never be truncated while any
+// instance maps pages from it.
+class SharedPageStore {
+public:
+    static constexpr char MAGIC[8] = { 'A', 'E', 'M', 'U', 'P', 'A', 'G', 'E' };
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint64_t DEFAULT_SIZE = 1024ull * 1024 * 1024;
+    static constexpr uint64_t MIN_SIZE = 1024 * 1024;
+    static constexpr size_t MAX_PROBES = 16;
+    
+    ~SharedPageStore() {
+        if (base != nullptr) {
+            munmap(base, mappedSize);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    SharedPageStore(const SharedPageStore&) = delete;
+    SharedPageStore& operator=(const SharedPageStore&) = delete;
+    
+    // Maps the store at path, creating it with size bytes if it does not
+    // exist yet. The file is sparse, so only published pages take space.
+    static std::unique_ptr<SharedPageStore> attach(const std::string& path, uint64_t size, std::string& error) {
+        std::unique_ptr<SharedPageStore> store(new SharedPageStore());
+        store->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (store->fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return nullptr;
+        }
+        
+        bool ok = flock(store->fd, LOCK_EX) == 0 && store->map(size, error);
+        flock(store->fd, LOCK_UN);
+        return ok ? std::move(store) : nullptr;
+    }
+    
+    static uint64_t hashPage(const uint8_t* page, size_t size) {
+        uint64_t a = 0xCBF29CE484222325ull;
+        uint64_t b = 0x84222325CBF29CE4ull;
+        for (size_t i = 0; i < size; i += 16) {
+            uint64_t x, y;
+            memcpy(&x, page + i, 8);
+            memcpy(&y, page + i + 8, 8);
+            a = (a ^ x) * 0x100000001B3ull;
+            b = (b ^ y) * 0x100000001B3ull;
+        }
+        uint64_t h = a ^ (b >> 29) ^ (b << 35);
+        h ^= h >> 32;
+        return h * 0x9E3779B97F4A7C15ull;
+    }
+    
+    // Index of the page with these contents, -1 if there is none
+    int64_t find(uint64_t hash, const uint8_t* page) const {
+        size_t index = slotIndex(hash);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            const SharedPageSlot& slot = slots[(index + probe) % header->numSlots];
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if (state == PAGE_SLOT_EMPTY) {
+                return -1;
+            }
+            if (state == PAGE_SLOT_READY && slot.hash == hash && slot.page < header->numPages &&
+                memcmp(pageData(slot.page), page, header->pageSize) == 0) {
+                return static_cast<int64_t>(slot.page);
+            }
+        }
+        return -1;
+    }
+    
+    // Adds a copy of page and returns its index, or that of an equal page
+    // another instance added first. -1 when the store is full or the probe
+    // chain is. A page is only taken once a slot is claimed for it, so a
+    // failed publish costs no capacity.
+    int64_t publish(uint64_t hash, const uint8_t* page) {
+        size_t start = slotIndex(hash);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            SharedPageSlot& slot = slots[(start + probe) % header->numSlots];
+            uint32_t state = slot.state.load(std::memory_order_acquire);
+            if (state == PAGE_SLOT_READY && slot.hash == hash && slot.page < header->numPages &&
+                memcmp(pageData(slot.page), page, header->pageSize) == 0) {
+                return static_cast<int64_t>(slot.page);
+            }
+            if (state != PAGE_SLOT_EMPTY ||
+                !slot.state.compare_exchange_strong(state, PAGE_SLOT_CLAIMED, std::memory_order_acquire)) {
+                continue;
+            }
+            
+            uint64_t index = header->usedPages.fetch_add(1, std::memory_order_relaxed);
+            if (index >= header->numPages) {
+                slot.state.store(PAGE_SLOT_EMPTY, std::memory_order_release);
+                return -1;
+            }
+            memcpy(pageData(index), page, header->pageSize);
+            slot.hash = hash;
+            slot.page = index;
+            slot.state.store(PAGE_SLOT_READY, std::memory_order_release);
+            return static_cast<int64_t>(index);
+        }
+        return -1;
+    }
+    
+    // For mapping page index from the file
+    int fileDescriptor() const {
+        return fd;
+    }
+    
+    off_t fileOffset(int64_t index) const {
+        return static_cast<off_t>(header->dataOffset + static_cast<uint64_t>(index) * header->pageSize);
+    }
+    
+    uint64_t usedPages() const {
+        return std::min(header->usedPages.load(std::memory_order_relaxed), header->numPages);
+    }
+    
+private:
+    int fd = -1;
+    uint8_t* base = nullptr;
+    size_t mappedSize = 0;
+    SharedPageHeader* header = nullptr;
+    SharedPageSlot* slots = nullptr;
+    
+    SharedPageStore() = default;
+    
+    uint8_t* pageData(uint64_t index) const {
+        return base + header->dataOffset + index * header->pageSize;
+    }
+    
+    size_t slotIndex(uint64_t hash) const {
+        uint64_t h = hash ^ (hash >> 31);
+        return static_cast<size_t>((h * 0xBF58476D1CE4E5B9ull >> 17) % header->numSlots);
+    }
+    
+    // Called with the file locked. A new file is laid out here; an
+    // existing one must use this host's page size.
+    bool map(uint64_t size, std::string& error) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            error = "stat failed: " + std::string(strerror(errno));
+            return false;
+        }
+        
+        uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        bool created = st.st_size == 0;
+        if (created) {
+            if (size < MIN_SIZE) {
+                error = "store size too small";
+                return false;
+            }
+            if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                error = "resize failed: " + std::string(strerror(errno));
+                return false;
+            }
+        } else {
+            size = static_cast<uint64_t>(st.st_size);
+        }
+        
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            error = "mmap failed: " + std::string(strerror(errno));
+            return false;
+        }
+        base = static_cast<uint8_t*>(mem);
+        mappedSize = size;
+        header = reinterpret_cast<SharedPageHeader*>(base);
+        slots = reinterpret_cast<SharedPageSlot*>(base + sizeof(SharedPageHeader));
+        
+        if (created) {
+            // Two slots per page keeps probe chains short. The file is all
+            // zeroes, so every slot starts out empty.
+            uint64_t perPage = pageSize + 2 * sizeof(SharedPageSlot);
+            memcpy(header->magic, MAGIC, sizeof(header->magic));
+            header->version = VERSION;
+            header->pageSize = static_cast<uint32_t>(pageSize);
+            header->size = size;
+            header->numPages = (size - sizeof(SharedPageHeader) - pageSize) / perPage;
+            header->numSlots = header->numPages * 2;
+            uint64_t table = sizeof(SharedPageHeader) + header->numSlots * sizeof(SharedPageSlot);
+            header->dataOffset = (table + pageSize - 1) & ~(pageSize - 1);
+            header->usedPages.store(0, std::memory_order_relaxed);
+            return true;
+        }
+        
+        if (size < sizeof(SharedPageHeader) || memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != VERSION || header->pageSize != pageSize || header->size != size ||
+            header->numSlots == 0 || header->dataOffset < sizeof(SharedPageHeader) + header->numSlots * sizeof(SharedPageSlot) ||
+            header->dataOffset % pageSize != 0 || header->dataOffset + header->numPages * pageSize > size) {
+            error = "not a page store of this version and page size";
+            return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,1106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#if defined(__FMA__)
+#include <immintrin.h>
+#endif
+#else
+#error "Advanced SIMD emulation needs NEON or SSE4.2 on the host"
+#endif
+
+#include "a64_decoder.h"
+
+// One V register. Lanes are laid out little-endian as on the guest, so
+// lane i of an n-byte element type starts at byte i * n.
+struct alignas(16) Vec128 {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+// Executes decoded Advanced SIMD data-processing ops (MicroOpKind::Simd)
+// with the host's own vector instructions: NEON on arm64, SSE4.2 on
+// x86-64. The few operations the host has no instruction for (64-bit
+// saturating arithmetic and some conversions on SSE) fall back to lane
+// loops.
+//
+// Every op computes a full 128-bit result; 64-bit (Q = 0) forms then
+// clear the upper half of the destination, as the architecture requires.
+class SimdUnit {
+public:
+    // v is the V register file, x the general registers. False for an op
+    // this unit does not implement.
+    static bool execute(const MicroOp& op, Vec128* v, uint64_t* x) {
+        const Vec128& a = v[op.rn];
+        const Vec128& b = v[op.rm];
+        Vec128& d = v[op.rd];
+        unsigned size = op.shift;
+        bool q = op.flags & OP_SF;
+        unsigned n = static_cast<unsigned>(op.imm);
+        Vec128 r;
+        
+        switch (op.opt) {
+            // Integer arithmetic
+            case a64::SIMD_ADD: r = add(a, b, size); break;
+            case a64::SIMD_SUB: r = sub(a, b, size); break;
+            case a64::SIMD_MUL: r = mul(a, b, size); break;
+            case a64::SIMD_MLA: r = add(d, mul(a, b, size), size); break;
+            case a64::SIMD_MLS: r = sub(d, mul(a, b, size), size); break;
+            case a64::SIMD_ADDP: r = addPairwise(lowHalves(a, b, q), b, size, q); break;
+            case a64::SIMD_SQADD: r = saturatingAdd(a, b, size, true); break;
+            case a64::SIMD_UQADD: r = saturatingAdd(a, b, size, false); break;
+            case a64::SIMD_SQSUB: r = saturatingSub(a, b, size, true); break;
+            case a64::SIMD_UQSUB: r = saturatingSub(a, b, size, false); break;
+            case a64::SIMD_SMAX: r = smax(a, b, size); break;
+            case a64::SIMD_SMIN: r = smin(a, b, size); break;
+            case a64::SIMD_UMAX: r = umax(a, b, size); break;
+            case a64::SIMD_UMIN: r = umin(a, b, size); break;
+            case a64::SIMD_NEG: r = sub(Vec128{0, 0}, a, size); break;
+            case a64::SIMD_ABS: r = abs(a, size); break;
+            case a64::SIMD_CNT: r = popcount(a); break;
+            case a64::SIMD_REV: r = reverse(a, size, n); break;
+            
+            // Integer compares
+            case a64::SIMD_CMEQ: r = cmeq(a, b, size); break;
+            case a64::SIMD_CMGT: r = cmgt(a, b, size); break;
+            case a64::SIMD_CMHI: r = cmhi(a, b, size); break;
+            case a64::SIMD_CMGE: r = bitNot(cmgt(b, a, size)); break;
+            case a64::SIMD_CMHS: r = bitNot(cmhi(b, a, size)); break;
+            case a64::SIMD_CMTST: r = bitNot(cmeq(bitAnd(a, b), Vec128{0, 0}, size)); break;
+            case a64::SIMD_CMEQ0: r = cmeq(a, Vec128{0, 0}, size); break;
+            case a64::SIMD_CMGT0: r = cmgt(a, Vec128{0, 0}, size); break;
+            case a64::SIMD_CMGE0: r = bitNot(cmgt(Vec128{0, 0}, a, size)); break;
+            case a64::SIMD_CMLE0: r = bitNot(cmgt(a, Vec128{0, 0}, size)); break;
+            case a64::SIMD_CMLT0: r = cmgt(Vec128{0, 0}, a, size); break;
+            
+            // Bitwise
+            case a64::SIMD_AND: r = bitAnd(a, b); break;
+            case a64::SIMD_BIC: r = bitAndNot(a, b); break;
+            case a64::SIMD_ORR: r = bitOr(a, b); break;
+            case a64::SIMD_ORN: r = bitOr(a, bitNot(b)); break;
+            case a64::SIMD_EOR: r = bitXor(a, b); break;
+            case a64::SIMD_NOT: r = bitNot(a); break;
+            case a64::SIMD_BSL: r = select(d, a, b); break;
+            case a64::SIMD_BIT: r = select(b, a, d); break;
+            case a64::SIMD_BIF: r = select(b, d, a); break;
+            
+            // Floating point
+            case a64::SIMD_FADD: r = fadd(a, b, size); break;
+            case a64::SIMD_FSUB: r = fsub(a, b, size); break;
+            case a64::SIMD_FMUL: r = fmul(a, b, size); break;
+            case a64::SIMD_FDIV: r = fdiv(a, b, size); break;
+            case a64::SIMD_FMAX: r = fmax(a, b, size); break;
+            case a64::SIMD_FMIN: r = fmin(a, b, size); break;
+            case a64::SIMD_FMLA: r = fmla(d, a, b, size, false); break;
+            case a64::SIMD_FMLS: r = fmla(d, a, b, size, true); break;
+            case a64::SIMD_FADDP: r = faddPairwise(lowHalves(a, b, q), b, size, q); break;
+            case a64::SIMD_FABD: r = fabs(fsub(a, b, size), size); break;
+            case a64::SIMD_FCMEQ: r = fcmeq(a, b, size); break;
+            case a64::SIMD_FCMGE: r = fcmge(a, b, size); break;
+            case a64::SIMD_FCMGT: r = fcmgt(a, b, size); break;
+            case a64::SIMD_FABS: r = fabs(a, size); break;
+            case a64::SIMD_FNEG: r = fneg(a, size); break;
+            case a64::SIMD_FSQRT: r = fsqrt(a, size); break;
+            case a64::SIMD_SCVTF: r = intToFloat(a, size, true); break;
+            case a64::SIMD_UCVTF: r = intToFloat(a, size, false); break;
+            case a64::SIMD_FCVTZS: r = floatToInt(a, size, true); break;
+            case a64::SIMD_FCVTZU: r = floatToInt(a, size, false); break;
+            
+            // Shifts by immediate
+            case a64::SIMD_SHL: r = shl(a, size, n); break;
+            case a64::SIMD_SSHR: r = sshr(a, size, n); break;
+            case a64::SIMD_USHR: r = ushr(a, size, n); break;
+            case a64::SIMD_SSRA: r = add(d, sshr(a, size, n), size); break;
+            case a64::SIMD_USRA: r = add(d, ushr(a, size, n), size); break;
+            case a64::SIMD_SSHLL: r = shl(widen(a, size, q, true), size + 1, n); q = true; break;
+            case a64::SIMD_USHLL: r = shl(widen(a, size, q, false), size + 1, n); q = true; break;
+            case a64::SIMD_SHRN:
+                r = narrow(ushr(a, size + 1, n), size);
+                if (q) {
+                    // SHRN2 and XTN2 fill the upper half and keep the lower
+                    r = Vec128{d.lo, r.lo};
+                }
+                break;
+            
+            // Reductions; the result is a scalar in lane 0
+            case a64::SIMD_ADDV: r = reduce(a, size, q, add); q = false; break;
+            case a64::SIMD_SMAXV: r = reduce(a, size, q, smax); q = false; break;
+            case a64::SIMD_SMINV: r = reduce(a, size, q, smin); q = false; break;
+            case a64::SIMD_UMAXV: r = reduce(a, size, q, umax); q = false; break;
+            case a64::SIMD_UMINV: r = reduce(a, size, q, umin); q = false; break;
+            
+            // Permutes
+            case a64::SIMD_ZIP1:
+            case a64::SIMD_ZIP2:
+            case a64::SIMD_UZP1:
+            case a64::SIMD_UZP2:
+            case a64::SIMD_TRN1:
+            case a64::SIMD_TRN2:
+                r = permute(a, b, op.opt, size, q);
+                break;
+            case a64::SIMD_EXT: r = extract(a, b, n, q); break;
+            
+            // Element copies; imm is the destination or source lane
+            case a64::SIMD_DUP_ELEMENT: r = duplicate(a, size, n); break;
+            case a64::SIMD_DUP_GENERAL: r = duplicate(Vec128{x[op.rn], 0}, size, 0); break;
+            case a64::SIMD_INS_GENERAL:
+                r = d;
+                setLaneBits(r, size, n, x[op.rn]);
+                break;
+            case a64::SIMD_INS_ELEMENT:
+                r = d;
+                setLaneBits(r, size, n, laneBits(a, size, op.ra));
+                break;
+            case a64::SIMD_UMOV:
+            case a64::SIMD_SMOV:
+                if (op.rd != REG_ZR) {
+                    uint64_t value = laneBits(a, size, n);
+                    if (op.opt == a64::SIMD_SMOV) {
+                        unsigned bits = 8u << size;
+                        value = static_cast<uint64_t>(static_cast<int64_t>(value << (64 - bits)) >> (64 - bits));
+                        value = q ? value : static_cast<uint32_t>(value);
+                    }
+                    x[op.rd] = value;
+                }
+                return true;
+            
+            // Modified immediates, already expanded to 64 bits by the decoder
+            case a64::SIMD_MOVI: r = Vec128{static_cast<uint64_t>(op.imm), static_cast<uint64_t>(op.imm)}; break;
+            case a64::SIMD_ORR_IMM: r = bitOr(d, Vec128{static_cast<uint64_t>(op.imm), static_cast<uint64_t>(op.imm)}); break;
+            case a64::SIMD_BIC_IMM: r = bitAndNot(d, Vec128{static_cast<uint64_t>(op.imm), static_cast<uint64_t>(op.imm)}); break;
+            
+            default:
+                return false;
+        }
+        
+        if (!q) {
+            r.hi = 0;
+        }
+        d = r;
+        return true;
+    }
+    
+    static uint64_t laneBits(const Vec128& v, unsigned size, unsigned i) {
+        switch (size) {
+            case 0: return lane<uint8_t>(v, i);
+            case 1: return lane<uint16_t>(v, i);
+            case 2: return lane<uint32_t>(v, i);
+            default: return lane<uint64_t>(v, i);
+        }
+    }
+    
+    static void setLaneBits(Vec128& v, unsigned size, unsigned i, uint64_t value) {
+        switch (size) {
+            case 0: setLane<uint8_t>(v, i, static_cast<uint8_t>(value)); break;
+            case 1: setLane<uint16_t>(v, i, static_cast<uint16_t>(value)); break;
+            case 2: setLane<uint32_t>(v, i, static_cast<uint32_t>(value)); break;
+            default: setLane<uint64_t>(v, i, value); break;
+        }
+    }
+    
+private:
+    using BinaryFn = Vec128 (*)(const Vec128&, const Vec128&, unsigned);
+    
+    // Byte index that makes shuffle() produce zero
+    static constexpr uint8_t ZERO_BYTE = 0xFF;
+    
+    template <typename T>
+    static T lane(const Vec128& v, unsigned i) {
+        T value;
+        memcpy(&value, reinterpret_cast<const uint8_t*>(&v) + i * sizeof(T), sizeof(T));
+        return value;
+    }
+    
+    template <typename T>
+    static void setLane(Vec128& v, unsigned i, T value) {
+        memcpy(reinterpret_cast<uint8_t*>(&v) + i * sizeof(T), &value, sizeof(T));
+    }
+    
+    // Lane loop for operations the host has no instruction for
+    template <typename T, typename F>
+    static Vec128 mapLanes(const Vec128& a, const Vec128& b, F fn) {
+        Vec128 r;
+        for (unsigned i = 0; i < 16 / sizeof(T); i++) {
+            setLane<T>(r, i, fn(lane<T>(a, i), lane<T>(b, i)));
+        }
+        return r;
+    }
+    
+    // Pairwise ops of 64-bit vectors work on a:b packed into one register
+    static Vec128 lowHalves(const Vec128& a, const Vec128& b, bool q) {
+        return q ? a : Vec128{a.lo, b.lo};
+    }
+
+#if defined(__aarch64__)
+    static uint8x16_t u8(const Vec128& v) { return vld1q_u8(reinterpret_cast<const uint8_t*>(&v)); }
+    static uint16x8_t u16(const Vec128& v) { return vld1q_u16(reinterpret_cast<const uint16_t*>(&v)); }
+    static uint32x4_t u32(const Vec128& v) { return vld1q_u32(reinterpret_cast<const uint32_t*>(&v)); }
+    static uint64x2_t u64(const Vec128& v) { return vld1q_u64(reinterpret_cast<const uint64_t*>(&v)); }
+    static int8x16_t s8(const Vec128& v) { return vld1q_s8(reinterpret_cast<const int8_t*>(&v)); }
+    static int16x8_t s16(const Vec128& v) { return vld1q_s16(reinterpret_cast<const int16_t*>(&v)); }
+    static int32x4_t s32(const Vec128& v) { return vld1q_s32(reinterpret_cast<const int32_t*>(&v)); }
+    static int64x2_t s64(const Vec128& v) { return vld1q_s64(reinterpret_cast<const int64_t*>(&v)); }
+    static float32x4_t f32(const Vec128& v) { return vld1q_f32(reinterpret_cast<const float*>(&v)); }
+    static float64x2_t f64(const Vec128& v) { return vld1q_f64(reinterpret_cast<const double*>(&v)); }
+    
+    static Vec128 out(uint8x16_t x) { Vec128 r; vst1q_u8(reinterpret_cast<uint8_t*>(&r), x); return r; }
+    static Vec128 out(uint16x8_t x) { Vec128 r; vst1q_u16(reinterpret_cast<uint16_t*>(&r), x); return r; }
+    static Vec128 out(uint32x4_t x) { Vec128 r; vst1q_u32(reinterpret_cast<uint32_t*>(&r), x); return r; }
+    static Vec128 out(uint64x2_t x) { Vec128 r; vst1q_u64(reinterpret_cast<uint64_t*>(&r), x); return r; }
+    static Vec128 out(int8x16_t x) { Vec128 r; vst1q_s8(reinterpret_cast<int8_t*>(&r), x); return r; }
+    static Vec128 out(int16x8_t x) { Vec128 r; vst1q_s16(reinterpret_cast<int16_t*>(&r), x); return r; }
+    static Vec128 out(int32x4_t x) { Vec128 r; vst1q_s32(reinterpret_cast<int32_t*>(&r), x); return r; }
+    static Vec128 out(int64x2_t x) { Vec128 r; vst1q_s64(reinterpret_cast<int64_t*>(&r), x); return r; }
+    static Vec128 out(float32x4_t x) { Vec128 r; vst1q_f32(reinterpret_cast<float*>(&r), x); return r; }
+    static Vec128 out(float64x2_t x) { Vec128 r; vst1q_f64(reinterpret_cast<double*>(&r), x); return r; }
+#else
+    static __m128i in(const Vec128& v) { return _mm_load_si128(reinterpret_cast<const __m128i*>(&v)); }
+    static __m128 f32(const Vec128& v) { return _mm_load_ps(reinterpret_cast<const float*>(&v)); }
+    static __m128d f64(const Vec128& v) { return _mm_load_pd(reinterpret_cast<const double*>(&v)); }
+    
+    static Vec128 out(__m128i x) { Vec128 r; _mm_store_si128(reinterpret_cast<__m128i*>(&r), x); return r; }
+    static Vec128 out(__m128 x) { Vec128 r; _mm_store_ps(reinterpret_cast<float*>(&r), x); return r; }
+    static Vec128 out(__m128d x) { Vec128 r; _mm_store_pd(reinterpret_cast<double*>(&r), x); return r; }
+    
+    // A byte repeated across the register, for 8-bit shifts
+    static __m128i bytes(unsigned value) {
+        return _mm_set1_epi8(static_cast<char>(value));
+    }
+    
+    // Sign bit of each lane
+    static __m128i signBits(unsigned size) {
+        switch (size) {
+            case 0: return _mm_set1_epi8(INT8_MIN);
+            case 1: return _mm_set1_epi16(INT16_MIN);
+            case 2: return _mm_set1_epi32(INT32_MIN);
+            default: return _mm_set1_epi64x(INT64_MIN);
+        }
+    }
+#endif
+    
+    // Bitwise
+    
+    static Vec128 bitAnd(const Vec128& a, const Vec128& b) {
+#if defined(__aarch64__)
+        return out(vandq_u8(u8(a), u8(b)));
+#else
+        return out(_mm_and_si128(in(a), in(b)));
+#endif
+    }
+    
+    // a & ~b
+    static Vec128 bitAndNot(const Vec128& a, const Vec128& b) {
+#if defined(__aarch64__)
+        return out(vbicq_u8(u8(a), u8(b)));
+#else
+        return out(_mm_andnot_si128(in(b), in(a)));
+#endif
+    }
+    
+    static Vec128 bitOr(const Vec128& a, const Vec128& b) {
+#if defined(__aarch64__)
+        return out(vorrq_u8(u8(a), u8(b)));
+#else
+        return out(_mm_or_si128(in(a), in(b)));
+#endif
+    }
+    
+    static Vec128 bitXor(const Vec128& a, const Vec128& b) {
+#if defined(__aarch64__)
+        return out(veorq_u8(u8(a), u8(b)));
+#else
+        return out(_mm_xor_si128(in(a), in(b)));
+#endif
+    }
+    
+    static Vec128 bitNot(const Vec128& a) {
+#if defined(__aarch64__)
+        return out(vmvnq_u8(u8(a)));
+#else
+        return out(_mm_xor_si128(in(a), _mm_set1_epi32(-1)));
+#endif
+    }
+    
+    // Bits of a where mask is set, of b elsewhere
+    static Vec128 select(const Vec128& mask, const Vec128& a, const Vec128& b) {
+#if defined(__aarch64__)
+        return out(vbslq_u8(u8(mask), u8(a), u8(b)));
+#else
+        __m128i m = in(mask);
+        return out(_mm_or_si128(_mm_and_si128(m, in(a)), _mm_andnot_si128(m, in(b))));
+#endif
+    }
+    
+    // Byte i of the result is byte idx[i] of a, or zero for ZERO_BYTE
+    static Vec128 shuffle(const Vec128& a, const uint8_t* idx) {
+#if defined(__aarch64__)
+        return out(vqtbl1q_u8(u8(a), vld1q_u8(idx)));
+#else
+        // PSHUFB zeroes on the top bit of the index, so ZERO_BYTE works as is
+        return out(_mm_shuffle_epi8(in(a), _mm_loadu_si128(reinterpret_cast<const __m128i*>(idx))));
+#endif
+    }
+    
+    // The same over the 32 bytes of a followed by b
+    static Vec128 shuffle2(const Vec128& a, const Vec128& b, const uint8_t* idx) {
+#if defined(__aarch64__)
+        uint8x16x2_t table = { { u8(a), u8(b) } };
+        return out(vqtbl2q_u8(table, vld1q_u8(idx)));
+#else
+        alignas(16) uint8_t fromA[16];
+        alignas(16) uint8_t fromB[16];
+        for (unsigned i = 0; i < 16; i++) {
+            fromA[i] = idx[i] < 16 ? idx[i] : 0x80;
+            fromB[i] = idx[i] >= 16 && idx[i] < 32 ? idx[i] - 16 : 0x80;
+        }
+        return out(_mm_or_si128(_mm_shuffle_epi8(in(a), _mm_load_si128(reinterpret_cast<const __m128i*>(fromA))),
+                                _mm_shuffle_epi8(in(b), _mm_load_si128(reinterpret_cast<const __m128i*>(fromB)))));
+#endif
+    }
+    
+    // Integer arithmetic. size is log2 of the element size in bytes.
+    
+    static Vec128 add(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vaddq_u8(u8(a), u8(b)));
+            case 1: return out(vaddq_u16(u16(a), u16(b)));
+            case 2: return out(vaddq_u32(u32(a), u32(b)));
+            default: return out(vaddq_u64(u64(a), u64(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_add_epi8(in(a), in(b)));
+            case 1: return out(_mm_add_epi16(in(a), in(b)));
+            case 2: return out(_mm_add_epi32(in(a), in(b)));
+            default: return out(_mm_add_epi64(in(a), in(b)));
+        }
+#endif
+    }
+    
+    static Vec128 sub(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vsubq_u8(u8(a), u8(b)));
+            case 1: return out(vsubq_u16(u16(a), u16(b)));
+            case 2: return out(vsubq_u32(u32(a), u32(b)));
+            default: return out(vsubq_u64(u64(a), u64(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_sub_epi8(in(a), in(b)));
+            case 1: return out(_mm_sub_epi16(in(a), in(b)));
+            case 2: return out(_mm_sub_epi32(in(a), in(b)));
+            default: return out(_mm_sub_epi64(in(a), in(b)));
+        }
+#endif
+    }
+    
+    // 8, 16 and 32-bit lanes only; there is no 64-bit vector MUL
+    static Vec128 mul(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vmulq_u8(u8(a), u8(b)));
+            case 1: return out(vmulq_u16(u16(a), u16(b)));
+            default: return out(vmulq_u32(u32(a), u32(b)));
+        }
+#else
+        __m128i x = in(a);
+        __m128i y = in(b);
+        switch (size) {
+            case 0: {
+                // Even and odd bytes as 16-bit products, then merged
+                __m128i even = _mm_mullo_epi16(x, y);
+                __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(x, 8), _mm_srli_epi16(y, 8));
+                return out(_mm_or_si128(_mm_and_si128(even, _mm_set1_epi16(0xFF)), _mm_slli_epi16(odd, 8)));
+            }
+            case 1: return out(_mm_mullo_epi16(x, y));
+            default: return out(_mm_mullo_epi32(x, y));
+        }
+#endif
+    }
+    
+    // Sums of adjacent lanes of a, then of b
+    static Vec128 addPairwise(const Vec128& a, const Vec128& b, unsigned size, bool q) {
+        if (!q) {
+            // a holds both halves already; the upper result half is dropped
+            return addPairwise(a, Vec128{0, 0}, size, true);
+        }
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vpaddq_u8(u8(a), u8(b)));
+            case 1: return out(vpaddq_u16(u16(a), u16(b)));
+            case 2: return out(vpaddq_u32(u32(a), u32(b)));
+            default: return out(vpaddq_u64(u64(a), u64(b)));
+        }
+#else
+        switch (size) {
+            case 0: {
+                // Byte pairs summed into 16-bit lanes, then truncated back
+                __m128i ones = bytes(1);
+                __m128i low = _mm_set1_epi16(0xFF);
+                return out(_mm_packus_epi16(_mm_and_si128(_mm_maddubs_epi16(in(a), ones), low),
+                                            _mm_and_si128(_mm_maddubs_epi16(in(b), ones), low)));
+            }
+            case 1: return out(_mm_hadd_epi16(in(a), in(b)));
+            case 2: return out(_mm_hadd_epi32(in(a), in(b)));
+            default: return Vec128{a.lo + a.hi, b.lo + b.hi};
+        }
+#endif
+    }
+    
+    template <typename T>
+    static T saturate(T x, T y, bool subtract) {
+        T r;
+        bool overflow = subtract ? __builtin_sub_overflow(x, y, &r) : __builtin_add_overflow(x, y, &r);
+        if (!overflow) {
+            return r;
+        }
+        if (std::is_signed<T>::value) {
+            return x < 0 ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+        }
+        return subtract ? 0 : std::numeric_limits<T>::max();
+    }
+    
+    template <typename T>
+    static Vec128 saturateLanes(const Vec128& a, const Vec128& b, bool subtract) {
+        return mapLanes<T>(a, b, [subtract](T x, T y) { return saturate<T>(x, y, subtract); });
+    }
+    
+    static Vec128 saturatingAdd(const Vec128& a, const Vec128& b, unsigned size, bool isSigned) {
+#if defined(__aarch64__)
+        if (isSigned) {
+            switch (size) {
+                case 0: return out(vqaddq_s8(s8(a), s8(b)));
+                case 1: return out(vqaddq_s16(s16(a), s16(b)));
+                case 2: return out(vqaddq_s32(s32(a), s32(b)));
+                default: return out(vqaddq_s64(s64(a), s64(b)));
+            }
+        }
+        switch (size) {
+            case 0: return out(vqaddq_u8(u8(a), u8(b)));
+            case 1: return out(vqaddq_u16(u16(a), u16(b)));
+            case 2: return out(vqaddq_u32(u32(a), u32(b)));
+            default: return out(vqaddq_u64(u64(a), u64(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(isSigned ? _mm_adds_epi8(in(a), in(b)) : _mm_adds_epu8(in(a), in(b)));
+            case 1: return out(isSigned ? _mm_adds_epi16(in(a), in(b)) : _mm_adds_epu16(in(a), in(b)));
+            case 2: return isSigned ? saturateLanes<int32_t>(a, b, false) : saturateLanes<uint32_t>(a, b, false);
+            default: return isSigned ? saturateLanes<int64_t>(a, b, false) : saturateLanes<uint64_t>(a, b, false);
+        }
+#endif
+    }
+    
+    static Vec128 saturatingSub(const Vec128& a, const Vec128& b, unsigned size, bool isSigned) {
+#if defined(__aarch64__)
+        if (isSigned) {
+            switch (size) {
+                case 0: return out(vqsubq_s8(s8(a), s8(b)));
+                case 1: return out(vqsubq_s16(s16(a), s16(b)));
+                case 2: return out(vqsubq_s32(s32(a), s32(b)));
+                default: return out(vqsubq_s64(s64(a), s64(b)));
+            }
+        }
+        switch (size) {
+            case 0: return out(vqsubq_u8(u8(a), u8(b)));
+            case 1: return out(vqsubq_u16(u16(a), u16(b)));
+            case 2: return out(vqsubq_u32(u32(a), u32(b)));
+            default: return out(vqsubq_u64(u64(a), u64(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(isSigned ? _mm_subs_epi8(in(a), in(b)) : _mm_subs_epu8(in(a), in(b)));
+            case 1: return out(isSigned ? _mm_subs_epi16(in(a), in(b)) : _mm_subs_epu16(in(a), in(b)));
+            case 2: return isSigned ? saturateLanes<int32_t>(a, b, true) : saturateLanes<uint32_t>(a, b, true);
+            default: return isSigned ? saturateLanes<int64_t>(a, b, true) : saturateLanes<uint64_t>(a, b, true);
+        }
+#endif
+    }
+    
+    // Maximum and minimum have no 64-bit vector forms
+    static Vec128 smax(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vmaxq_s8(s8(a), s8(b)));
+            case 1: return out(vmaxq_s16(s16(a), s16(b)));
+            default: return out(vmaxq_s32(s32(a), s32(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_max_epi8(in(a), in(b)));
+            case 1: return out(_mm_max_epi16(in(a), in(b)));
+            default: return out(_mm_max_epi32(in(a), in(b)));
+        }
+#endif
+    }
+    
+    static Vec128 smin(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vminq_s8(s8(a), s8(b)));
+            case 1: return out(vminq_s16(s16(a), s16(b)));
+            default: return out(vminq_s32(s32(a), s32(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_min_epi8(in(a), in(b)));
+            case 1: return out(_mm_min_epi16(in(a), in(b)));
+            default: return out(_mm_min_epi32(in(a), in(b)));
+        }
+#endif
+    }
+    
+    static Vec128 umax(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vmaxq_u8(u8(a), u8(b)));
+            case 1: return out(vmaxq_u16(u16(a), u16(b)));
+            default: return out(vmaxq_u32(u32(a), u32(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_max_epu8(in(a), in(b)));
+            case 1: return out(_mm_max_epu16(in(a), in(b)));
+            default: return out(_mm_max_epu32(in(a), in(b)));
+        }
+#endif
+    }
+    
+    static Vec128 umin(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vminq_u8(u8(a), u8(b)));
+            case 1: return out(vminq_u16(u16(a), u16(b)));
+            default: return out(vminq_u32(u32(a), u32(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_min_epu8(in(a), in(b)));
+            case 1: return out(_mm_min_epu16(in(a), in(b)));
+            default: return out(_mm_min_epu32(in(a), in(b)));
+        }
+#endif
+    }
+    
+    static Vec128 abs(const Vec128& a, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vabsq_s8(s8(a)));
+            case 1: return out(vabsq_s16(s16(a)));
+            case 2: return out(vabsq_s32(s32(a)));
+            default: return out(vabsq_s64(s64(a)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_abs_epi8(in(a)));
+            case 1: return out(_mm_abs_epi16(in(a)));
+            case 2: return out(_mm_abs_epi32(in(a)));
+            default: {
+                __m128i sign = _mm_cmpgt_epi64(_mm_setzero_si128(), in(a));
+                return out(_mm_sub_epi64(_mm_xor_si128(in(a), sign), sign));
+            }
+        }
+#endif
+    }
+    
+    // Bits set in each byte
+    static Vec128 popcount(const Vec128& a) {
+#if defined(__aarch64__)
+        return out(vcntq_u8(u8(a)));
+#else
+        __m128i table = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        __m128i nibble = bytes(0x0F);
+        __m128i low = _mm_shuffle_epi8(table, _mm_and_si128(in(a), nibble));
+        __m128i high = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(in(a), 4), nibble));
+        return out(_mm_add_epi8(low, high));
+#endif
+    }
+    
+    // Reverses the order of the elements within each container of
+    // 1 << container bytes (REV16, REV32, REV64)
+    static Vec128 reverse(const Vec128& a, unsigned size, unsigned container) {
+        unsigned width = 1u << container;
+        unsigned element = 1u << size;
+        uint8_t idx[16];
+        for (unsigned i = 0; i < 16; i++) {
+            unsigned within = i & (width - 1);
+            unsigned reversed = width - element - (within & ~(element - 1));
+            idx[i] = static_cast<uint8_t>((i & ~(width - 1)) + reversed + (within & (element - 1)));
+        }
+        return shuffle(a, idx);
+    }
+    
+    // Integer compares; true lanes are all ones
+    
+    static Vec128 cmeq(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vceqq_u8(u8(a), u8(b)));
+            case 1: return out(vceqq_u16(u16(a), u16(b)));
+            case 2: return out(vceqq_u32(u32(a), u32(b)));
+            default: return out(vceqq_u64(u64(a), u64(b)));
+        }
+#else
+        switch (size) {
+            case 0: return out(_mm_cmpeq_epi8(in(a), in(b)));
+            case 1: return out(_mm_cmpeq_epi16(in(a), in(b)));
+            case 2: return out(_mm_cmpeq_epi32(in(a), in(b)));
+            default: return out(_mm_cmpeq_epi64(in(a), in(b)));
+        }
+#endif
+    }
+    
+    // Signed a > b
+    static Vec128 cmgt(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vcgtq_s8(s8(a), s8(b)));
+            case 1: return out(vcgtq_s16(s16(a), s16(b)));
+            case 2: return out(vcgtq_s32(s32(a), s32(b)));
+            default: return out(vcgtq_s64(s64(a), s64(b)));
+        }
+#else
+        return cmgtSigned(in(a), in(b), size);
+#endif
+    }
+    
+    // Unsigned a > b
+    static Vec128 cmhi(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vcgtq_u8(u8(a), u8(b)));
+            case 1: return out(vcgtq_u16(u16(a), u16(b)));
+            case 2: return out(vcgtq_u32(u32(a), u32(b)));
+            default: return out(vcgtq_u64(u64(a), u64(b)));
+        }
+#else
+        // Flipping the sign bits turns an unsigned compare into a signed one
+        __m128i sign = signBits(size);
+        return cmgtSigned(_mm_xor_si128(in(a), sign), _mm_xor_si128(in(b), sign), size);
+#endif
+    }
+
+#if !defined(__aarch64__)
+    static Vec128 cmgtSigned(__m128i a, __m128i b, unsigned size) {
+        switch (size) {
+            case 0: return out(_mm_cmpgt_epi8(a, b));
+            case 1: return out(_mm_cmpgt_epi16(a, b));
+            case 2: return out(_mm_cmpgt_epi32(a, b));
+            default: return out(_mm_cmpgt_epi64(a, b));
+        }
+    }
+#endif
+    
+    // Shifts by immediate. Left shifts are below the element size; right
+    // shifts go from 1 up to the element size inclusive.
+    
+    static Vec128 shl(const Vec128& a, unsigned size, unsigned n) {
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vshlq_u8(u8(a), vdupq_n_s8(static_cast<int8_t>(n))));
+            case 1: return out(vshlq_u16(u16(a), vdupq_n_s16(static_cast<int16_t>(n))));
+            case 2: return out(vshlq_u32(u32(a), vdupq_n_s32(static_cast<int32_t>(n))));
+            default: return out(vshlq_u64(u64(a), vdupq_n_s64(static_cast<int64_t>(n))));
+        }
+#else
+        __m128i count = _mm_cvtsi32_si128(static_cast<int>(n));
+        switch (size) {
+            case 0: return out(_mm_and_si128(_mm_sll_epi16(in(a), count), bytes((0xFFu << n) & 0xFF)));
+            case 1: return out(_mm_sll_epi16(in(a), count));
+            case 2: return out(_mm_sll_epi32(in(a), count));
+            default: return out(_mm_sll_epi64(in(a), count));
+        }
+#endif
+    }
+    
+    static Vec128 ushr(const Vec128& a, unsigned size, unsigned n) {
+#if defined(__aarch64__)
+        // USHL by a negative amount; shifting out every bit gives zero
+        switch (size) {
+            case 0: return out(vshlq_u8(u8(a), vdupq_n_s8(static_cast<int8_t>(-static_cast<int>(n)))));
+            case 1: return out(vshlq_u16(u16(a), vdupq_n_s16(static_cast<int16_t>(-static_cast<int>(n)))));
+            case 2: return out(vshlq_u32(u32(a), vdupq_n_s32(-static_cast<int32_t>(n))));
+            default: return out(vshlq_u64(u64(a), vdupq_n_s64(-static_cast<int64_t>(n))));
+        }
+#else
+        // PSRL* by the full lane width gives zero as well
+        __m128i count = _mm_cvtsi32_si128(static_cast<int>(n));
+        switch (size) {
+            case 0: return out(_mm_and_si128(_mm_srl_epi16(in(a), count), bytes(0xFFu >> n)));
+            case 1: return out(_mm_srl_epi16(in(a), count));
+            case 2: return out(_mm_srl_epi32(in(a), count));
+            default: return out(_mm_srl_epi64(in(a), count));
+        }
+#endif
+    }
+    
+    static Vec128 sshr(const Vec128& a, unsigned size, unsigned n) {
+        // Shifting by the element size leaves copies of the sign bit, the
+        // same as one less
+        unsigned bits = 8u << size;
+        n = n < bits ? n : bits - 1;
+#if defined(__aarch64__)
+        switch (size) {
+            case 0: return out(vshlq_s8(s8(a), vdupq_n_s8(static_cast<int8_t>(-static_cast<int>(n)))));
+            case 1: return out(vshlq_s16(s16(a), vdupq_n_s16(static_cast<int16_t>(-static_cast<int>(n)))));
+            case 2: return out(vshlq_s32(s32(a), vdupq_n_s32(-static_cast<int32_t>(n))));
+            default: return out(vshlq_s64(s64(a), vdupq_n_s64(-static_cast<int64_t>(n))));
+        }
+#else
+        __m128i count = _mm_cvtsi32_si128(static_cast<int>(n));
+        switch (size) {
+            case 1: return out(_mm_sra_epi16(in(a), count));
+            case 2: return out(_mm_sra_epi32(in(a), count));
+            default: {
+                // No arithmetic shift for bytes and quadwords: shift
+                // logically, then sign-extend from the moved sign bit
+                __m128i shifted = in(ushr(a, size, n));
+                __m128i sign = in(ushr(out(signBits(size)), size, n));
+                return sub(out(_mm_xor_si128(shifted, sign)), out(sign), size);
+            }
+        }
+#endif
+    }
+    
+    // Lanes of one half of a, selected by upper, extended to twice their
+    // size
+    static Vec128 widen(const Vec128& a, unsigned size, bool upper, bool isSigned) {
+#if defined(__aarch64__)
+        if (isSigned) {
+            switch (size) {
+                case 0: return out(vmovl_s8(upper ? vget_high_s8(s8(a)) : vget_low_s8(s8(a))));
+                case 1: return out(vmovl_s16(upper ? vget_high_s16(s16(a)) : vget_low_s16(s16(a))));
+                default: return out(vmovl_s32(upper ? vget_high_s32(s32(a)) : vget_low_s32(s32(a))));
+            }
+        }
+        switch (size) {
+            case 0: return out(vmovl_u8(upper ? vget_high_u8(u8(a)) : vget_low_u8(u8(a))));
+            case 1: return out(vmovl_u16(upper ? vget_high_u16(u16(a)) : vget_low_u16(u16(a))));
+            default: return out(vmovl_u32(upper ? vget_high_u32(u32(a)) : vget_low_u32(u32(a))));
+        }
+#else
+        __m128i half = upper ? _mm_srli_si128(in(a), 8) : in(a);
+        switch (size) {
+            case 0: return out(isSigned ? _mm_cvtepi8_epi16(half) : _mm_cvtepu8_epi16(half));
+            case 1: return out(isSigned ? _mm_cvtepi16_epi32(half) : _mm_cvtepu16_epi32(half));
+            default: return out(isSigned ? _mm_cvtepi32_epi64(half) : _mm_cvtepu32_epi64(half));
+        }
+#endif
+    }
+    
+    // Low half of each lane of a, packed into the lower 64 bits. size is
+    // the narrow element size.
+    static Vec128 narrow(const Vec128& a, unsigned size) {
+        unsigned element = 1u << size;
+        uint8_t idx[16];
+        for (unsigned i = 0; i < 16; i++) {
+            idx[i] = i < 8 ? static_cast<uint8_t>((i / element) * 2 * element + i % element) : ZERO_BYTE;
+        }
+        return shuffle(a, idx);
+    }
+    
+    // Folds the lanes of a with fn, halving the width each step. Lane 0 of
+    // the result holds the answer.
+    static Vec128 reduce(Vec128 a, unsigned size, bool q, BinaryFn fn) {
+        for (unsigned width = q ? 8 : 4; width >= (1u << size); width /= 2) {
+            uint8_t idx[16];
+            for (unsigned i = 0; i < 16; i++) {
+                idx[i] = i + width < 16 ? static_cast<uint8_t>(i + width) : ZERO_BYTE;
+            }
+            a = fn(a, shuffle(a, idx), size);
+        }
+        return Vec128{laneBits(a, size, 0), 0};
+    }
+    
+    // ZIP, UZP and TRN
+    static Vec128 permute(const Vec128& a, const Vec128& b, unsigned kind, unsigned size, bool q) {
+        unsigned element = 1u << size;
+        unsigned lanes = (q ? 16 : 8) / element;
+        uint8_t idx[16];
+        for (unsigned i = 0; i < 16; i++) {
+            unsigned index = i / element;
+            unsigned source;    // lane of a:b, b's lanes numbered from 16 / element
+            switch (kind) {
+                case a64::SIMD_ZIP1:
+                case a64::SIMD_ZIP2: {
+                    unsigned from = index / 2 + (kind == a64::SIMD_ZIP2 ? lanes / 2 : 0);
+                    source = (index & 1) ? 16 / element + from : from;
+                    break;
+                }
+                case a64::SIMD_UZP1:
+                case a64::SIMD_UZP2: {
+                    unsigned from = 2 * index + (kind == a64::SIMD_UZP2 ? 1 : 0);
+                    source = from < lanes ? from : 16 / element + from - lanes;
+                    break;
+                }
+                default: {
+                    unsigned from = (index & ~1u) + (kind == a64::SIMD_TRN2 ? 1 : 0);
+                    source = (index & 1) ? 16 / element + from : from;
+                    break;
+                }
+            }
+            idx[i] = static_cast<uint8_t>(source * element + i % element);
+        }
+        return shuffle2(a, b, idx);
+    }
+    
+    // EXT: bytes of a:b from byte n on
+    static Vec128 extract(const Vec128& a, const Vec128& b, unsigned n, bool q) {
+        unsigned length = q ? 16 : 8;
+        uint8_t idx[16];
+        for (unsigned i = 0; i < 16; i++) {
+            unsigned from = n + i;
+            idx[i] = static_cast<uint8_t>(from < length ? from : 16 + from - length);
+        }
+        return shuffle2(a, b, idx);
+    }
+    
+    // Lane index of a copied into every lane
+    static Vec128 duplicate(const Vec128& a, unsigned size, unsigned index) {
+        unsigned element = 1u << size;
+        uint8_t idx[16];
+        for (unsigned i = 0; i < 16; i++) {
+            idx[i] = static_cast<uint8_t>(index * element + i % element);
+        }
+        return shuffle(a, idx);
+    }
+    
+    // Floating point. size is 2 for single and 3 for double precision.
+    // Rounding and flushing follow the host FP environment, which the
+    // caller sets up from FPCR (HostFpEnvironment).
+    
+    static Vec128 fadd(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vaddq_f32(f32(a), f32(b))) : out(vaddq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_add_ps(f32(a), f32(b))) : out(_mm_add_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fsub(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vsubq_f32(f32(a), f32(b))) : out(vsubq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_sub_ps(f32(a), f32(b))) : out(_mm_sub_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fmul(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vmulq_f32(f32(a), f32(b))) : out(vmulq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_mul_ps(f32(a), f32(b))) : out(_mm_mul_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fdiv(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vdivq_f32(f32(a), f32(b))) : out(vdivq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_div_ps(f32(a), f32(b))) : out(_mm_div_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fmax(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vmaxq_f32(f32(a), f32(b))) : out(vmaxq_f64(f64(a), f64(b)));
+#else
+        return fminmax(a, b, size, true);
+#endif
+    }
+    
+    static Vec128 fmin(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vminq_f32(f32(a), f32(b))) : out(vminq_f64(f64(a), f64(b)));
+#else
+        return fminmax(a, b, size, false);
+#endif
+    }
+
+#if !defined(__aarch64__)
+    // MAXPS/MINPS return the second operand for NaNs and for a pair of
+    // zeros. FMAX/FMIN propagate the NaN and order -0 below +0, so those
+    // lanes are patched up: equal operands combine bitwise (only the sign
+    // of zeros can differ), and NaNs come through an add, which picks the
+    // NaN operand and quiets it.
+    static Vec128 fminmax(const Vec128& a, const Vec128& b, unsigned size, bool max) {
+        if (size == 2) {
+            __m128 x = f32(a);
+            __m128 y = f32(b);
+            __m128 r = max ? _mm_max_ps(x, y) : _mm_min_ps(x, y);
+            r = _mm_blendv_ps(r, max ? _mm_and_ps(x, y) : _mm_or_ps(x, y), _mm_cmpeq_ps(x, y));
+            return out(_mm_blendv_ps(r, _mm_add_ps(x, y), _mm_cmpunord_ps(x, y)));
+        }
+        __m128d x = f64(a);
+        __m128d y = f64(b);
+        __m128d r = max ? _mm_max_pd(x, y) : _mm_min_pd(x, y);
+        r = _mm_blendv_pd(r, max ? _mm_and_pd(x, y) : _mm_or_pd(x, y), _mm_cmpeq_pd(x, y));
+        return out(_mm_blendv_pd(r, _mm_add_pd(x, y), _mm_cmpunord_pd(x, y)));
+    }
+#endif
+    
+    // d + a * b, or d - a * b, with a single rounding
+    static Vec128 fmla(const Vec128& d, const Vec128& a, const Vec128& b, unsigned size, bool subtract) {
+#if defined(__aarch64__)
+        if (size == 2) {
+            return out(subtract ? vfmsq_f32(f32(d), f32(a), f32(b)) : vfmaq_f32(f32(d), f32(a), f32(b)));
+        }
+        return out(subtract ? vfmsq_f64(f64(d), f64(a), f64(b)) : vfmaq_f64(f64(d), f64(a), f64(b)));
+#elif defined(__FMA__)
+        if (size == 2) {
+            return out(subtract ? _mm_fnmadd_ps(f32(a), f32(b), f32(d)) : _mm_fmadd_ps(f32(a), f32(b), f32(d)));
+        }
+        return out(subtract ? _mm_fnmadd_pd(f64(a), f64(b), f64(d)) : _mm_fmadd_pd(f64(a), f64(b), f64(d)));
+#else
+        // Separate multiply and add would round twice
+        Vec128 product = subtract ? fneg(a, size) : a;
+        Vec128 r;
+        for (unsigned i = 0; i < (size == 2 ? 4u : 2u); i++) {
+            if (size == 2) {
+                setLane<float>(r, i, std::fma(lane<float>(product, i), lane<float>(b, i), lane<float>(d, i)));
+            } else {
+                setLane<double>(r, i, std::fma(lane<double>(product, i), lane<double>(b, i), lane<double>(d, i)));
+            }
+        }
+        return r;
+#endif
+    }
+    
+    static Vec128 faddPairwise(const Vec128& a, const Vec128& b, unsigned size, bool q) {
+        if (!q) {
+            return faddPairwise(a, Vec128{0, 0}, size, true);
+        }
+#if defined(__aarch64__)
+        return size == 2 ? out(vpaddq_f32(f32(a), f32(b))) : out(vpaddq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_hadd_ps(f32(a), f32(b))) : out(_mm_hadd_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fcmeq(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vceqq_f32(f32(a), f32(b))) : out(vceqq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_cmpeq_ps(f32(a), f32(b))) : out(_mm_cmpeq_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fcmge(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vcgeq_f32(f32(a), f32(b))) : out(vcgeq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_cmpge_ps(f32(a), f32(b))) : out(_mm_cmpge_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    static Vec128 fcmgt(const Vec128& a, const Vec128& b, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vcgtq_f32(f32(a), f32(b))) : out(vcgtq_f64(f64(a), f64(b)));
+#else
+        return size == 2 ? out(_mm_cmpgt_ps(f32(a), f32(b))) : out(_mm_cmpgt_pd(f64(a), f64(b)));
+#endif
+    }
+    
+    // FABS and FNEG only touch the sign bit, NaNs included
+    static Vec128 fabs(const Vec128& a, unsigned size) {
+        Vec128 sign = size == 2 ? Vec128{0x8000000080000000ull, 0x8000000080000000ull}
+                                : Vec128{0x8000000000000000ull, 0x8000000000000000ull};
+        return bitAndNot(a, sign);
+    }
+    
+    static Vec128 fneg(const Vec128& a, unsigned size) {
+        Vec128 sign = size == 2 ? Vec128{0x8000000080000000ull, 0x8000000080000000ull}
+                                : Vec128{0x8000000000000000ull, 0x8000000000000000ull};
+        return bitXor(a, sign);
+    }
+    
+    static Vec128 fsqrt(const Vec128& a, unsigned size) {
+#if defined(__aarch64__)
+        return size == 2 ? out(vsqrtq_f32(f32(a))) : out(vsqrtq_f64(f64(a)));
+#else
+        return size == 2 ? out(_mm_sqrt_ps(f32(a))) : out(_mm_sqrt_pd(f64(a)));
+#endif
+    }
+    
+    // SCVTF and UCVTF, lanes of the same size
+    static Vec128 intToFloat(const Vec128& a, unsigned size, bool isSigned) {
+#if defined(__aarch64__)
+        if (size == 2) {
+            return isSigned ? out(vcvtq_f32_s32(s32(a))) : out(vcvtq_f32_u32(u32(a)));
+        }
+        return isSigned ? out(vcvtq_f64_s64(s64(a))) : out(vcvtq_f64_u64(u64(a)));
+#else
+        if (size == 2 && isSigned) {
+            return out(_mm_cvtepi32_ps(in(a)));
+        }
+        Vec128 r;
+        for (unsigned i = 0; i < (size == 2 ? 4u : 2u); i++) {
+            if (size == 2) {
+                setLane<float>(r, i, static_cast<float>(lane<uint32_t>(a, i)));
+            } else if (isSigned) {
+                setLane<double>(r, i, static_cast<double>(lane<int64_t>(a, i)));
+            } else {
+                setLane<double>(r, i, static_cast<double>(lane<uint64_t>(a, i)));
+            }
+        }
+        return r;
+#endif
+    }
+    
+    // Round toward zero, saturate, NaN to zero: what FCVTZS/FCVTZU do
+    template <typename I, typename F>
+    static I convertToInt(F value) {
+        if (std::isnan(value)) {
+            return 0;
+        }
+        F truncated = std::trunc(value);
+        if (truncated <= static_cast<F>(std::numeric_limits<I>::min())) {
+            return std::numeric_limits<I>::min();
+        }
+        if (truncated >= static_cast<F>(std::numeric_limits<I>::max())) {
+            return std::numeric_limits<I>::max();
+        }
+        return static_cast<I>(truncated);
+    }
+    
+    static Vec128 floatToInt(const Vec128& a, unsigned size, bool isSigned) {
+#if defined(__aarch64__)
+        if (size == 2) {
+            return isSigned ? out(vcvtq_s32_f32(f32(a))) : out(vcvtq_u32_f32(f32(a)));
+        }
+        return isSigned ? out(vcvtq_s64_f64(f64(a))) : out(vcvtq_u64_f64(f64(a)));
+#else
+        if (size == 2 && isSigned) {
+            // CVTTPS2DQ gives INT32_MIN for NaN and anything out of range.
+            // Positive overflow flips that to INT32_MAX; NaN lanes are
+            // cleared.
+            __m128 x = f32(a);
+            __m128i r = _mm_cvttps_epi32(x);
+            r = _mm_xor_si128(r, _mm_castps_si128(_mm_cmpge_ps(x, _mm_set1_ps(2147483648.0f))));
+            return out(_mm_and_si128(r, _mm_castps_si128(_mm_cmpord_ps(x, x))));
+        }
+        Vec128 r;
+        for (unsigned i = 0; i < (size == 2 ? 4u : 2u); i++) {
+            if (size == 2) {
+                setLane<uint32_t>(r, i, convertToInt<uint32_t>(lane<float>(a, i)));
+            } else if (isSigned) {
+                setLane<int64_t>(r, i, convertToInt<int64_t>(lane<double>(a, i)));
+            } else {
+                setLane<uint64_t>(r, i, convertToInt<uint64_t>(lane<double>(a, i)));
+            }
+        }
+        return r;
+#endif
+    }
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "guest_memory.h"
+#include "vcpu.h"
+
+// On-disk layout:
+//
+//   SnapshotHeader
+//   CPUState[numVcpus]
+//   (padding up to dataOffset)
+//   guest RAM image, memorySize bytes
+//
+// The RAM image has one fixed slot per guest page, so it can be mmapped
+// straight back over guest RAM, and an incremental save only rewrites the
+// slots of pages dirtied since the previous save. Pages the guest never
+// wrote are holes in a sparse file.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageSize;
+    uint64_t memorySize;
+    uint32_t numVcpus;
+    uint32_t cpuStateSize;
+    uint64_t dataOffset;
+};
+
+class Snapshot {
+public:
+    static constexpr char MAGIC[8] = { 'A', 'E', 'M', 'U', 'S', 'N', 'A', 'P' };
+    static constexpr uint32_t VERSION = 5;
+    
+    // Large enough for any host page size we run on, so the RAM image
+    // can be mapped directly.
+    static constexpr uint64_t DATA_ALIGNMENT = 64 * 1024;
+    
+    // Writes CPU state and guest RAM to path. With incremental set, path
+    // must hold a snapshot of this instance and only dirty pages are
+    // written; otherwise the file is rebuilt from scratch.
+    static bool save(const std::string& path, const std::vector<CPUState>& states,
+                     GuestMemory& memory, bool incremental, std::string& error) {
+        int flags = O_RDWR | O_CREAT | O_CLOEXEC | (incremental ? 0 : O_TRUNC);
+        int fd = open(path.c_str(), flags, 0644);
+        if (fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return false;
+        }
+        
+        SnapshotHeader header = makeHeader(states.size(), memory.size());
+        bool ok = writeAll(fd, &header, sizeof(header), 0) &&
+                  writeAll(fd, states.data(), states.size() * sizeof(CPUState), sizeof(header));
+        
+        if (ok && !incremental && ftruncate(fd, header.dataOffset + header.memorySize) != 0) {
+            ok = false;
+        }
+        
+        // Write runs of consecutive pages that need saving with one call
+        // each. A full save of RAM restored from another snapshot also has
+        // to carry over the clean pages that came from that file.
+        size_t pages = memory.pageCount();
+        size_t run = 0;
+        for (size_t page = 0; ok && page <= pages; page++) {
+            bool save = page < pages && (memory.isPageDirty(page) ||
+                                         (!incremental && memory.isFileBacked() && !isZeroPage(memory, page)));
+            if (save) {
+                run++;
+                continue;
+            }
+            if (run > 0) {
+                ok = writeRun(fd, memory, header.dataOffset, page - run, run);
+                run = 0;
+            }
+        }
+        
+        if (ok && fdatasync(fd) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            error = "write failed: " + std::string(strerror(errno));
+        }
+        close(fd);
+        return ok;
+    }
+    
+    // Loads CPU state from path and maps its RAM image copy-on-write over
+    // guest RAM. Nothing is copied; pages come in from the file on first
+    // touch.
+    static bool restore(const std::string& path, std::vector<CPUState>& states,
+                        GuestMemory& memory, std::string& error) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = "open failed: " + std::string(strerror(errno));
+            return false;
+        }
+        
+        SnapshotHeader header;
+        bool ok = readAll(fd, &header, sizeof(header), 0);
+        if (ok) {
+            SnapshotHeader expected = makeHeader(states.size(), memory.size());
+            if (memcmp(&header, &expected, sizeof(header)) != 0) {
+                error = "snapshot does not match this emulator configuration";
+                close(fd);
+                return false;
+            }
+            ok = readAll(fd, states.data(), states.size() * sizeof(CPUState), sizeof(header));
+        }
+        
+        if (ok && !memory.mapFile(fd, static_cast<off_t>(header.dataOffset))) {
+            ok = false;
+        }
+        if (!ok) {
+            error = "read failed: " + std::string(strerror(errno));
+        }
+        
+        // The mapping keeps its own reference to the file
+        close(fd);
+        return ok;
+    }
+    
+private:
+    static SnapshotHeader makeHeader(size_t numVcpus, size_t memorySize) {
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.pageSize = static_cast<uint32_t>(GuestMemory::PAGE_SIZE);
+        header.memorySize = memorySize;
+        header.numVcpus = static_cast<uint32_t>(numVcpus);
+        header.cpuStateSize = sizeof(CPUState);
+        
+        uint64_t metadata = sizeof(header) + numVcpus * sizeof(CPUState);
+        header.dataOffset = (metadata + DATA_ALIGNMENT - 1) & ~(DATA_ALIGNMENT - 1);
+        return header;
+    }
+    
+    static bool isZeroPage(const GuestMemory& memory, size_t page) {
+        const uint64_t* words = reinterpret_cast<const uint64_t*>(memory.data() + page * GuestMemory::PAGE_SIZE);
+        for (size_t i = 0; i < GuestMemory::PAGE_SIZE / sizeof(uint64_t); i++) {
+            if (words[i] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    static bool writeRun(int fd, GuestMemory& memory, uint64_t dataOffset, size_t firstPage, size_t count) {
+        uint64_t offset = firstPage * GuestMemory::PAGE_SIZE;
+        uint64_t size = count * GuestMemory::PAGE_SIZE;
+        if (offset + size > memory.size()) {
+            size = memory.size() - offset;
+        }
+        return writeAll(fd, memory.data() + offset, size, dataOffset + offset);
+    }
+    
+    static bool writeAll(int fd, const void* data, size_t size, uint64_t offset) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(fd, p, size, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+    
+    static bool readAll(int fd, void* data, size_t size, uint64_t offset) {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        while (size > 0) {
+            ssize_t got = pread(fd, p, size, static_cast<off_t>(offset));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += got;
+            size -= got;
+            offset += got;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "guest_memory.h"
+
+// EL1 translation controls the walker looks at
+struct SystemRegisters {
+    uint64_t sctlr;
+    uint64_t ttbr0;
+    uint64_t ttbr1;
+    uint64_t tcr;
+};
+
+enum MMUAccess {
+    MMU_READ = 0,
+    MMU_WRITE = 1,
+    MMU_EXEC = 2
+};
+
+enum MMUFaultType {
+    MMU_FAULT_NONE = 0,
+    MMU_FAULT_ADDRESS_SIZE,
+    MMU_FAULT_TRANSLATION,
+    MMU_FAULT_ACCESS_FLAG,
+    MMU_FAULT_PERMISSION
+};
+
+struct MMUFault {
+    uint64_t address;
+    int access;
+    int type;
+    int level;
+};
+
+// One direct-mapped TLB entry. A tag holds the virtual page address when
+// that kind of access is allowed and INVALID_TAG otherwise, so a hit is a
+// single compare. host = va + addend.
+struct TLBEntry {
+    uint64_t tag[3];
+    uintptr_t addend;
+};
+
+struct SoftTLB {
+    static constexpr size_t SIZE = 256;
+    static constexpr uint64_t INVALID_TAG = ~0ull;
+    
+    TLBEntry entries[SIZE];
+    
+    SoftTLB() {
+        flush();
+    }
+    
+    void flush() {
+        for (TLBEntry& entry : entries) {
+            entry.tag[MMU_READ] = INVALID_TAG;
+            entry.tag[MMU_WRITE] = INVALID_TAG;
+            entry.tag[MMU_EXEC] = INVALID_TAG;
+            entry.addend = 0;
+        }
+    }
+};
+
+// Translates guest virtual addresses through the guest's stage-1 page
+// tables (4KB granule, up to 48-bit VAs) and caches the result per vCPU
+// in a SoftTLB. Only the TLB lookup is on the hot path; the walker runs
+// on misses.
+//
+// A write tag is only installed for pages already marked dirty in guest
+// RAM, so the first store to a clean page takes the slow path once and
+// marks it. Dirty tracking therefore costs nothing on the hot path.
+class SoftMMU {
+public:
+    static constexpr unsigned PAGE_SHIFT = 12;
+    static constexpr uint64_t PAGE_SIZE = 1ull << PAGE_SHIFT;
+    static constexpr uint64_t PAGE_MASK = PAGE_SIZE - 1;
+    
+    static constexpr uint64_t SCTLR_M = 1ull << 0;
+    
+    explicit SoftMMU(GuestMemory& ram) :
+        ram(ram),
+        memory(ram.data()),
+        memorySize(ram.size()) {}
+    
+    // Host pointer for an access of size bytes at va, or nullptr with
+    // fault filled in. Accesses that straddle a page return nullptr with
+    // fault.type == MMU_FAULT_NONE; callers split those.
+    inline uint8_t* translate(SoftTLB& tlb, const SystemRegisters& sys, uint64_t va,
+                              size_t size, int access, MMUFault& fault) {
+        if ((va & PAGE_MASK) + size > PAGE_SIZE) {
+            fault.type = MMU_FAULT_NONE;
+            return nullptr;
+        }
+        
+        uint64_t page = va & ~PAGE_MASK;
+        TLBEntry& entry = tlb.entries[(va >> PAGE_SHIFT) & (SoftTLB::SIZE - 1)];
+        if (entry.tag[access] == page) {
+            return reinterpret_cast<uint8_t*>(va + entry.addend);
+        }
+        return fill(tlb, sys, va, access, fault);
+    }
+    
+    template <typename T>
+    inline bool load(SoftTLB& tlb, const SystemRegisters& sys, uint64_t va, T& value, MMUFault& fault) {
+        uint8_t* host = translate(tlb, sys, va, sizeof(T), MMU_READ, fault);
+        if (host != nullptr) {
+            memcpy(&value, host, sizeof(T));
+            return true;
+        }
+        return fault.type == MMU_FAULT_NONE &&
+               copySplit(tlb, sys, va, reinterpret_cast<uint8_t*>(&value), sizeof(T), MMU_READ, fault);
+    }
+    
+    // On success returns the physical address written so the caller can
+    // check it against cached code.
+    template <typename T>
+    inline bool store(SoftTLB& tlb, const SystemRegisters& sys, uint64_t va, const T& value,
+                      uint64_t& pa, MMUFault& fault) {
+        uint8_t* host = translate(tlb, sys, va, sizeof(T), MMU_WRITE, fault);
+        if (host != nullptr) {
+            memcpy(host, &value, sizeof(T));
+            pa = host - memory;
+            return true;
+        }
+        if (fault.type != MMU_FAULT_NONE ||
+            !copySplit(tlb, sys, va, const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(&value)),
+                       sizeof(T), MMU_WRITE, fault)) {
+            return false;
+        }
+        pa = translate(tlb, sys, va, 1, MMU_WRITE, fault) - memory;
+        return true;
+    }
+    
+    // Physical address of an instruction fetch
+    inline bool fetchAddress(SoftTLB& tlb, const SystemRegisters& sys, uint64_t va, uint64_t& pa, MMUFault& fault) {
+        uint8_t* host = translate(tlb, sys, va, 4, MMU_EXEC, fault);
+        if (host == nullptr) {
+            if (fault.type == MMU_FAULT_NONE) {
+                // Misaligned PC straddling a page
+                fault = { va, MMU_EXEC, MMU_FAULT_TRANSLATION, 0 };
+            }
+            return false;
+        }
+        pa = host - memory;
+        return true;
+    }
+    
+    // Full table walk without touching any TLB. perms gets a bitmask of
+    // (1 << MMUAccess) for every access the mapping allows.
+    bool walk(const SystemRegisters& sys, uint64_t va, uint64_t& pa, unsigned& perms, MMUFault& fault) const {
+        int level;
+        return walkTables(sys, va, pa, perms, level, fault) && checkPhysical(va, pa, level, fault);
+    }
+    
+    // Physical address of a data access that maps past the end of RAM,
+    // where device registers live. False if va does not map there or the
+    // mapping does not allow the access.
+    bool ioAddress(const SystemRegisters& sys, uint64_t va, int access, uint64_t& pa) const {
+        unsigned perms;
+        int level;
+        MMUFault fault = {};
+        return walkTables(sys, va, pa, perms, level, fault) && pa >= memorySize && (perms & (1u << access));
+    }
+    
+private:
+    static constexpr uint64_t OUTPUT_ADDRESS_MASK = 0x0000FFFFFFFFF000ull;
+    static constexpr uint64_t DESC_AP_RO = 1ull << 7;
+    static constexpr uint64_t DESC_AF = 1ull << 10;
+    static constexpr uint64_t DESC_PXN = 1ull << 53;
+    
+    GuestMemory& ram;
+    uint8_t* memory;
+    size_t memorySize;
+    
+    // The walk itself, which leaves the output address unchecked
+    bool walkTables(const SystemRegisters& sys, uint64_t va, uint64_t& pa, unsigned& perms, int& leafLevel,
+                    MMUFault& fault) const {
+        const unsigned ALL = (1u << MMU_READ) | (1u << MMU_WRITE) | (1u << MMU_EXEC);
+        
+        if (!(sys.sctlr & SCTLR_M)) {
+            // MMU off: flat physical addressing
+            pa = va;
+            perms = ALL;
+            leafLevel = 0;
+            return true;
+        }
+        
+        bool upper = (va >> 63) & 1;
+        unsigned tsz = upper ? (sys.tcr >> 16) & 0x3F : sys.tcr & 0x3F;
+        tsz = tsz < 16 ? 16 : (tsz > 39 ? 39 : tsz);
+        unsigned vaBits = 64 - tsz;
+        
+        uint64_t top = va >> vaBits;
+        if (upper ? top != (~0ull >> vaBits) : top != 0) {
+            fault = { va, 0, MMU_FAULT_TRANSLATION, 0 };
+            return false;
+        }
+        
+        uint64_t offset = va & ((1ull << vaBits) - 1);
+        uint64_t table = (upper ? sys.ttbr1 : sys.ttbr0) & OUTPUT_ADDRESS_MASK;
+        int level = 4 - static_cast<int>((vaBits - PAGE_SHIFT + 8) / 9);
+        
+        for (; level <= 3; level++) {
+            unsigned shift = PAGE_SHIFT + 9 * (3 - level);
+            uint64_t descAddr = table + ((offset >> shift) & 0x1FF) * 8;
+            if (descAddr + 8 > memorySize) {
+                fault = { va, 0, MMU_FAULT_ADDRESS_SIZE, level };
+                return false;
+            }
+            
+            uint64_t desc;
+            memcpy(&desc, memory + descAddr, sizeof(desc));
+            
+            bool isTableOrPage = desc & 2;
+            if (!(desc & 1) || (level == 3 && !isTableOrPage) || (level == 0 && !isTableOrPage)) {
+                fault = { va, 0, MMU_FAULT_TRANSLATION, level };
+                return false;
+            }
+            
+            if (level < 3 && isTableOrPage) {
+                table = desc & OUTPUT_ADDRESS_MASK;
+                continue;
+            }
+            
+            // Block or page descriptor
+            if (!(desc & DESC_AF)) {
+                fault = { va, 0, MMU_FAULT_ACCESS_FLAG, level };
+                return false;
+            }
+            
+            uint64_t blockMask = (1ull << shift) - 1;
+            pa = ((desc & OUTPUT_ADDRESS_MASK) & ~blockMask) | (va & blockMask);
+            perms = 1u << MMU_READ;
+            if (!(desc & DESC_AP_RO)) {
+                perms |= 1u << MMU_WRITE;
+            }
+            if (!(desc & DESC_PXN)) {
+                perms |= 1u << MMU_EXEC;
+            }
+            leafLevel = level;
+            return true;
+        }
+        
+        fault = { va, 0, MMU_FAULT_TRANSLATION, 3 };
+        return false;
+    }
+    
+    bool checkPhysical(uint64_t va, uint64_t pa, int level, MMUFault& fault) const {
+        if (pa >= memorySize) {
+            fault = { va, 0, MMU_FAULT_ADDRESS_SIZE, level };
+            return false;
+        }
+        return true;
+    }
+    
+    // TLB miss: walk, check permissions and install the page
+    uint8_t* fill(SoftTLB& tlb, const SystemRegisters& sys, uint64_t va, int access, MMUFault& fault) {
+        uint64_t pa;
+        unsigned perms;
+        if (!walk(sys, va, pa, perms, fault)) {
+            fault.access = access;
+            return nullptr;
+        }
+        if (!(perms & (1u << access))) {
+            fault = { va, access, MMU_FAULT_PERMISSION, 3 };
+            return nullptr;
+        }
+        
+        if (access == MMU_WRITE) {
+            ram.markDirty(pa);
+        } else if (!ram.isDirty(pa)) {
+            perms &= ~(1u << MMU_WRITE);
+        }
+        
+        uint64_t page = va & ~PAGE_MASK;
+        TLBEntry& entry = tlb.entries[(va >> PAGE_SHIFT) & (SoftTLB::SIZE - 1)];
+        for (int i = MMU_READ; i <= MMU_EXEC; i++) {
+            entry.tag[i] = (perms & (1u << i)) ? page : SoftTLB::INVALID_TAG;
+        }
+        entry.addend = reinterpret_cast<uintptr_t>(memory + (pa & ~PAGE_MASK)) - page;
+        return reinterpret_cast<uint8_t*>(va + entry.addend);
+    }
+    
+    // Byte-wise copy for accesses that straddle a page boundary
+    bool copySplit(SoftTLB& tlb, const SystemRegisters& sys, uint64_t va, uint8_t* data,
+                   size_t size, int access, MMUFault& fault) {
+        uint8_t* hosts[16];
+        for (size_t i = 0; i < size; i++) {
+            hosts[i] = translate(tlb, sys, va + i, 1, access, fault);
+            if (hosts[i] == nullptr) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (access == MMU_WRITE) {
+                *hosts[i] = data[i];
+            } else {
+                data[i] = *hosts[i];
+            }
+        }
+        return true;
+    }
+};
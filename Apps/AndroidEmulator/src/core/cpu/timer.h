@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+
+// Guest system counter (CNTVCT_EL0), derived from the host monotonic clock
+class GuestCounter {
+public:
+    static constexpr uint64_t NS_PER_TICK = 16;
+    static constexpr uint64_t FREQUENCY = 1000000000 / NS_PER_TICK;    // 62.5MHz
+    
+    static uint64_t now() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch());
+        return static_cast<uint64_t>(ns.count()) / NS_PER_TICK;
+    }
+    
+    static std::chrono::steady_clock::time_point toTimePoint(uint64_t ticks) {
+        return std::chrono::steady_clock::time_point(std::chrono::nanoseconds(ticks * NS_PER_TICK));
+    }
+};
+
+// Sleeps until the earliest armed deadline and reports each expiry to
+// the owner. One thread serves every vCPU of an emulator, so vCPU threads
+// never have to poll the clock.
+class TimerService {
+public:
+    using Callback = std::function<void(int)>;
+    
+    TimerService(size_t count, Callback fire) :
+        deadlines(count, NEVER),
+        fire(std::move(fire)) {}
+    
+    ~TimerService() {
+        stop();
+    }
+    
+    void start() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running) {
+            return;
+        }
+        running = true;
+        thread = std::thread([this]() {
+            run();
+        });
+    }
+    
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+    
+    // deadline is in GuestCounter ticks. Re-arming replaces the previous
+    // deadline; it survives stop() and start().
+    void arm(int id, uint64_t deadline) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            deadlines[id] = deadline;
+        }
+        cv.notify_all();
+    }
+    
+    void disarm(int id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        deadlines[id] = NEVER;
+    }
+    
+    void disarmAll() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::fill(deadlines.begin(), deadlines.end(), NEVER);
+    }
+    
+private:
+    static constexpr uint64_t NEVER = ~0ull;
+    
+    std::vector<uint64_t> deadlines;
+    Callback fire;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread thread;
+    bool running = false;
+    
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (running) {
+            auto next = std::min_element(deadlines.begin(), deadlines.end());
+            if (*next == NEVER) {
+                cv.wait(lock);
+                continue;
+            }
+            uint64_t now = GuestCounter::now();
+            if (*next > now) {
+                // Far-off deadlines are approached in steps of at most a
+                // second, which keeps the time point arithmetic in range
+                cv.wait_until(lock, GuestCounter::toTimePoint(std::min(*next, now + GuestCounter::FREQUENCY)));
+                continue;
+            }
+            
+            // One-shot; the owner re-arms when the guest reprograms the timer
+            int id = static_cast<int>(next - deadlines.begin());
+            *next = NEVER;
+            lock.unlock();
+            fire(id);
+            lock.lock();
+        }
+    }
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "soft_mmu.h"
+#include "a64_decoder.h"
+#include "host_access_guard.h"
+#include "jit.h"
+#include "simd.h"
+
+// EL1 exception registers
+struct ExceptionRegisters {
+    uint64_t vbar;
+    uint64_t elr;
+    uint64_t spsr;
+    uint64_t esr;
+    uint64_t far;
+};
+
+// Exception classes (ESR_EL1.EC) the emulator raises
+enum ExceptionClass : uint32_t {
+    EC_UNKNOWN = 0x00,
+    EC_SVC64 = 0x15,
+    EC_INSTRUCTION_ABORT = 0x21,
+    EC_PC_ALIGNMENT = 0x22,
+    EC_DATA_ABORT = 0x25,
+    EC_BRK64 = 0x3C
+};
+
+constexpr uint64_t ESR_IL = 1ull << 25;
+constexpr uint32_t ISS_WNR = 1u << 6;
+constexpr uint32_t ISS_ALIGNMENT_FAULT = 0x21;
+
+// Offsets of the exception vectors taken from EL1 using SP_EL1
+constexpr uint64_t VECTOR_CURRENT_SPX_SYNC = 0x200;
+constexpr uint64_t VECTOR_CURRENT_SPX_IRQ = 0x280;
+
+// Interrupt IDs as the GIC numbers them. Only the 32 private ones (SGIs
+// and PPIs) exist, one bit each in VCPU::pendingInterrupts.
+constexpr uint32_t IRQ_VIRTIO_BLOCK = 16;    // routed to vCPU 0
+constexpr uint32_t IRQ_VIRTUAL_TIMER = 27;
+constexpr uint32_t INTID_SPURIOUS = 1023;
+
+// CNTV_CTL_EL0 bits
+constexpr uint64_t TIMER_ENABLE = 1ull << 0;
+constexpr uint64_t TIMER_IMASK = 1ull << 1;
+constexpr uint64_t TIMER_ISTATUS = 1ull << 2;
+
+// Virtual timer and GIC CPU interface state
+struct TimerRegisters {
+    uint64_t ctl;
+    uint64_t cval;
+    uint64_t kctl;
+};
+
+struct InterruptRegisters {
+    uint64_t pmr;
+    uint64_t igrpen1;
+    uint64_t active;    // acknowledged, waiting for EOI
+};
+
+// System registers the guest can read and write but that do not affect
+// the emulator, such as the thread pointers and memory attributes
+constexpr uint16_t STORED_SYSREGS[] = {
+    a64::CPACR_EL1, a64::SP_EL0, a64::PAR_EL1, a64::MAIR_EL1, a64::AMAIR_EL1,
+    a64::CONTEXTIDR_EL1, a64::TPIDR_EL1, a64::TPIDR_EL0, a64::TPIDRRO_EL0
+};
+constexpr size_t STORED_SYSREG_COUNT = sizeof(STORED_SYSREGS) / sizeof(STORED_SYSREGS[0]);
+
+// PSTATE bits, in their SPSR positions
+constexpr uint64_t PSTATE_N = 1ull << 31;
+constexpr uint64_t PSTATE_Z = 1ull << 30;
+constexpr uint64_t PSTATE_C = 1ull << 29;
+constexpr uint64_t PSTATE_V = 1ull << 28;
+constexpr uint64_t PSTATE_NZCV = PSTATE_N | PSTATE_Z | PSTATE_C | PSTATE_V;
+constexpr uint64_t PSTATE_DAIF = 0xFull << 6;
+constexpr uint64_t PSTATE_I = 1ull << 7;
+constexpr uint64_t PSTATE_EL1H = 0x5;
+
+// What produced the current NZCV. Flag-setting ops only record their
+// operands and result, and the flags are worked out when something reads
+// them; most are overwritten before that happens.
+enum FlagOp : uint32_t {
+    FLAGS_VALUE = 0,    // CPUState::nzcv holds the flags
+    FLAGS_ADD32,        // result = a + b + carry, 32-bit
+    FLAGS_ADD64,
+    FLAGS_LOGIC32,      // logical op, C and V clear
+    FLAGS_LOGIC64
+};
+
+struct LazyFlags {
+    uint32_t op;
+    uint64_t a;
+    uint64_t b;
+    uint64_t result;
+};
+
+// Architectural state of one guest CPU. The guest always runs at EL1
+// with a single stack pointer.
+struct CPUState {
+    // Indexed by REG_* / decoded register numbers; registers[REG_ZR] is
+    // kept at zero
+    uint64_t registers[REG_COUNT];
+    uint64_t pc;
+    uint64_t nzcv;      // only valid while flags.op == FLAGS_VALUE
+    uint64_t daif;
+    LazyFlags flags;
+    
+    // Advanced SIMD and floating point
+    Vec128 vregs[32];
+    uint64_t fpcr;
+    uint64_t fpsr;
+    
+    // EL1 system registers
+    SystemRegisters sys;
+    ExceptionRegisters el1;
+    TimerRegisters timer;
+    InterruptRegisters gic;
+    uint64_t storedSysregs[STORED_SYSREG_COUNT];
+};
+
+// NZCV of a recorded flag-setting op. Operands and result are stored
+// truncated to the operation size. The carry out of the top bit follows
+// from the operand and result bits alone, so the carry in is not needed.
+inline uint64_t computeFlags(const LazyFlags& flags) {
+    unsigned top = (flags.op == FLAGS_ADD64 || flags.op == FLAGS_LOGIC64) ? 63 : 31;
+    uint64_t nzcv = (((flags.result >> top) & 1) ? PSTATE_N : 0) | (flags.result == 0 ? PSTATE_Z : 0);
+    if (flags.op == FLAGS_ADD32 || flags.op == FLAGS_ADD64) {
+        uint64_t carries = (flags.a & flags.b) | ((flags.a ^ flags.b) & ~flags.result);
+        uint64_t overflow = ~(flags.a ^ flags.b) & (flags.a ^ flags.result);
+        nzcv |= (((carries >> top) & 1) ? PSTATE_C : 0) | (((overflow >> top) & 1) ? PSTATE_V : 0);
+    }
+    return nzcv;
+}
+
+inline uint64_t currentNzcv(const CPUState& state) {
+    return state.flags.op == FLAGS_VALUE ? state.nzcv : computeFlags(state.flags);
+}
+
+// Evaluates pending flags into state.nzcv so later reads are plain loads
+inline uint64_t materializeFlags(CPUState& state) {
+    if (state.flags.op != FLAGS_VALUE) {
+        state.nzcv = computeFlags(state.flags);
+        state.flags.op = FLAGS_VALUE;
+    }
+    return state.nzcv;
+}
+
+inline void setNzcv(CPUState& state, uint64_t nzcv) {
+    state.nzcv = nzcv & PSTATE_NZCV;
+    state.flags.op = FLAGS_VALUE;
+}
+
+// Reasons a vCPU leaves its dispatch loop at the next block boundary
+enum VCPUExitReason : uint32_t {
+    VCPU_EXIT_STOP = 1u << 0,
+    VCPU_EXIT_PAUSE = 1u << 1,
+    VCPU_EXIT_INTERRUPT = 1u << 2,
+    VCPU_EXIT_TLB_FLUSH = 1u << 3,
+    VCPU_EXIT_SAMPLE = 1u << 4,     // profiler sample
+    VCPU_EXIT_HALT = 1u << 5        // the user mode process exited
+};
+
+// Why a vCPU thread is parked instead of running guest code
+enum VCPUWaitState {
+    VCPU_RUNNING = 0,
+    VCPU_WAIT_INTERRUPT,    // WFI
+    VCPU_WAIT_EVENT         // WFE
+};
+
+// Local exclusive monitor, opened by a load-exclusive. The matching
+// store-exclusive is a host compare-and-swap against the values loaded,
+// so it fails if any other store changed them in between.
+struct ExclusiveMonitor {
+    bool open;
+    unsigned bytes;
+    uint64_t address;
+    uint64_t value[2];
+};
+
+// Exclusives reservation granule, as CTR_EL0.ERG reports it
+constexpr unsigned MONITOR_GRANULE_SHIFT = 6;
+constexpr uint64_t NO_GRANULE = ~0ull;
+
+// One virtual CPU, running on its own host thread or in turns on a shared
+// pool of them. The state is only ever touched by the thread running it;
+// other threads talk to it through the atomic fields, which it polls once
+// per block.
+struct VCPU {
+    int id = 0;
+    CPUState state = {};
+    std::thread thread;
+    bool halted = false;
+    
+    // Software TLB, private to this vCPU's thread
+    SoftTLB tlb;
+    
+    // Host-mapped memory accesses of this vCPU's thread
+    HostAccessGuard guard;
+    
+    // Translated code runs with this context. Other threads may only zero
+    // its budget, which sends translated code back to the dispatcher at
+    // the next block entry.
+    JitContext jit = {};
+    
+    std::atomic<uint32_t> exitRequest{0};
+    std::atomic<uint32_t> pendingInterrupts{0};
+    
+    // WFI/WFE. The thread sleeps on waitCv; whoever makes it runnable
+    // again updates the atomics above or eventRegister first and then
+    // notifies under waitMtx.
+    VCPUWaitState waitState = VCPU_RUNNING;
+    std::atomic<bool> eventRegister{false};
+    std::mutex waitMtx;
+    std::condition_variable waitCv;
+    
+    // A user mode system call would have blocked the worker thread of a
+    // pooled vCPU, so it lets others run before trying again
+    bool syscallBlocked = false;
+    
+    ExclusiveMonitor monitor = {};
+    
+    // Physical granule of the open monitor, NO_GRANULE without one. Other
+    // vCPUs storing to it clear it and send this vCPU a WFE event, which
+    // is what guest spin-wait loops rely on.
+    std::atomic<uint64_t> monitorGranule{NO_GRANULE};
+    
+    // Guest instructions retired since reset. Only the vCPU's own thread
+    // writes it.
+    std::atomic<uint64_t> retired{0};
+    
+    // Record/replay: interrupt lines raised from outside that the guest
+    // has not seen yet, and dispatcher iterations since the trace started
+    std::atomic<uint32_t> externalInterrupts{0};
+    uint64_t replaySteps = 0;
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// Runs many vCPUs on a few host threads. Each vCPU is a task that runs in
+// time slices: a worker takes it from a run queue, calls the owner's slice
+// function, and queues it again if it used up its slice. A vCPU that has
+// nothing to do (WFI/WFE) leaves the queues until something wakes it, so
+// idle vCPUs cost neither a host thread nor any CPU time.
+//
+// Every worker has its own queue. Tasks a worker wakes or requeues go to
+// its own queue, which keeps a vCPU on the host core whose caches hold its
+// state; a worker that runs dry steals from the back of the others'.
+//
+// The slice function always returns at a block boundary, so a task needs
+// no stack of its own between slices.
+class VcpuScheduler {
+public:
+    enum SliceResult {
+        SLICE_YIELD,    // used its slice; still runnable
+        SLICE_BLOCK,    // waiting to be woken
+        SLICE_EXIT      // done for good
+    };
+    
+    using RunSlice = std::function<SliceResult(int)>;
+    
+    VcpuScheduler(size_t count, RunSlice run) :
+        states(new std::atomic<uint8_t>[count]),
+        count(count),
+        run(std::move(run)) {
+        for (size_t i = 0; i < count; i++) {
+            states[i].store(TASK_EXITED, std::memory_order_relaxed);
+        }
+    }
+    
+    ~VcpuScheduler() {
+        join();
+    }
+    
+    VcpuScheduler(const VcpuScheduler&) = delete;
+    VcpuScheduler& operator=(const VcpuScheduler&) = delete;
+    
+    // Queues tasks and starts numWorkers threads to run them; the other
+    // tasks stay exited until spawned. The workers return once every task
+    // has exited.
+    void start(size_t numWorkers, const std::vector<int>& tasks) {
+        join();
+        workers.clear();
+        for (size_t i = 0; i < numWorkers; i++) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        liveTasks.store(tasks.size(), std::memory_order_relaxed);
+        queuedTasks.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++) {
+            states[i].store(TASK_EXITED, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < tasks.size(); i++) {
+            states[tasks[i]].store(TASK_QUEUED, std::memory_order_relaxed);
+            push(i % numWorkers, tasks[i]);
+        }
+        for (size_t i = 0; i < numWorkers; i++) {
+            workers[i]->thread = std::thread([this, i]() {
+                work(i);
+            });
+        }
+    }
+    
+    void join() {
+        for (auto& worker : workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+    }
+    
+    // Starts an exited task again while the workers run, such as a vCPU
+    // that takes over a new guest thread. Its last slice may still be
+    // winding down.
+    void spawn(int task) {
+        std::atomic<uint8_t>& state = states[task];
+        while (state.load(std::memory_order_acquire) != TASK_EXITED) {
+            std::this_thread::yield();
+        }
+        liveTasks.fetch_add(1, std::memory_order_acq_rel);
+        state.store(TASK_QUEUED, std::memory_order_release);
+        push(localQueue(), task);
+    }
+    
+    // Makes a blocked task runnable again. A wake that arrives while the
+    // task is running makes its next SLICE_BLOCK requeue it instead, so
+    // none is lost. Safe to call from any thread at any time; tasks that
+    // are not blocked or running are left alone.
+    void wake(int task) {
+        if (task < 0 || static_cast<size_t>(task) >= count) {
+            return;
+        }
+        std::atomic<uint8_t>& state = states[task];
+        uint8_t current = state.load(std::memory_order_acquire);
+        while (true) {
+            if (current == TASK_BLOCKED) {
+                if (state.compare_exchange_weak(current, TASK_QUEUED, std::memory_order_acq_rel)) {
+                    push(localQueue(), task);
+                    return;
+                }
+            } else if (current == TASK_RUNNING) {
+                if (state.compare_exchange_weak(current, TASK_WOKEN, std::memory_order_acq_rel)) {
+                    return;
+                }
+            } else {
+                return;
+            }
+        }
+    }
+    
+private:
+    enum TaskState : uint8_t {
+        TASK_QUEUED,
+        TASK_RUNNING,
+        TASK_WOKEN,     // running, and woken since it started
+        TASK_BLOCKED,
+        TASK_EXITED
+    };
+    
+    struct Worker {
+        std::mutex mtx;
+        std::deque<int> queue;
+        std::thread thread;
+    };
+    
+    std::unique_ptr<std::atomic<uint8_t>[]> states;
+    size_t count;
+    RunSlice run;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> liveTasks{0};
+    std::atomic<size_t> queuedTasks{0};
+    std::atomic<size_t> nextQueue{0};
+    
+    // Workers with empty queues sleep here
+    std::mutex idleMtx;
+    std::condition_variable idleCv;
+    
+    // The worker the calling thread is, if any. Several emulators may
+    // each have a scheduler in one process.
+    struct WorkerThread {
+        const VcpuScheduler* scheduler;
+        size_t index;
+    };
+    
+    static WorkerThread& currentWorker() {
+        static thread_local WorkerThread worker = { nullptr, 0 };
+        return worker;
+    }
+    
+    size_t localQueue() {
+        const WorkerThread& self = currentWorker();
+        if (self.scheduler == this) {
+            return self.index;
+        }
+        return nextQueue.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    }
+    
+    void push(size_t queue, int task) {
+        {
+            std::lock_guard<std::mutex> lock(workers[queue]->mtx);
+            workers[queue]->queue.push_back(task);
+        }
+        queuedTasks.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> idleLock(idleMtx);
+        }
+        idleCv.notify_one();
+    }
+    
+    // Oldest task of our own queue, so runnable tasks take turns, else
+    // the newest of someone else's
+    bool pop(size_t self, int& task) {
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker& worker = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mtx);
+            if (worker.queue.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = worker.queue.front();
+                worker.queue.pop_front();
+            } else {
+                task = worker.queue.back();
+                worker.queue.pop_back();
+            }
+            queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+    
+    void work(size_t self) {
+        currentWorker() = { this, self };
+        while (true) {
+            int task;
+            if (!pop(self, task)) {
+                std::unique_lock<std::mutex> idleLock(idleMtx);
+                idleCv.wait(idleLock, [this]() {
+                    return queuedTasks.load(std::memory_order_acquire) != 0 ||
+                           liveTasks.load(std::memory_order_acquire) == 0;
+                });
+                if (liveTasks.load(std::memory_order_acquire) == 0) {
+                    break;
+                }
+                continue;
+            }
+            
+            std::atomic<uint8_t>& state = states[task];
+            state.store(TASK_RUNNING, std::memory_order_release);
+            SliceResult result = run(task);
+            
+            if (result == SLICE_EXIT) {
+                state.store(TASK_EXITED, std::memory_order_release);
+                if (liveTasks.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    {
+                        std::lock_guard<std::mutex> idleLock(idleMtx);
+                    }
+                    idleCv.notify_all();
+                }
+                continue;
+            }
+            
+            uint8_t expected = TASK_RUNNING;
+            if (result == SLICE_BLOCK &&
+                state.compare_exchange_strong(expected, TASK_BLOCKED, std::memory_order_acq_rel)) {
+                continue;
+            }
+            state.store(TASK_QUEUED, std::memory_order_release);
+            push(self, task);
+        }
+        currentWorker() = { nullptr, 0 };
+    }
+};
@@ -0,0 +1,632 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/uio.h>
+
+#include "guest_memory.h"
+#include "async_io.h"
+#include "disk_image.h"
+
+// virtio-mmio register offsets (virtio 1.x, device version 2)
+enum VirtioMmioRegister : uint32_t {
+    VIRTIO_MMIO_MAGIC = 0x000,
+    VIRTIO_MMIO_VERSION = 0x004,
+    VIRTIO_MMIO_DEVICE_ID = 0x008,
+    VIRTIO_MMIO_VENDOR_ID = 0x00C,
+    VIRTIO_MMIO_DEVICE_FEATURES = 0x010,
+    VIRTIO_MMIO_DEVICE_FEATURES_SEL = 0x014,
+    VIRTIO_MMIO_DRIVER_FEATURES = 0x020,
+    VIRTIO_MMIO_DRIVER_FEATURES_SEL = 0x024,
+    VIRTIO_MMIO_QUEUE_SEL = 0x030,
+    VIRTIO_MMIO_QUEUE_NUM_MAX = 0x034,
+    VIRTIO_MMIO_QUEUE_NUM = 0x038,
+    VIRTIO_MMIO_QUEUE_READY = 0x044,
+    VIRTIO_MMIO_QUEUE_NOTIFY = 0x050,
+    VIRTIO_MMIO_INTERRUPT_STATUS = 0x060,
+    VIRTIO_MMIO_INTERRUPT_ACK = 0x064,
+    VIRTIO_MMIO_STATUS = 0x070,
+    VIRTIO_MMIO_QUEUE_DESC_LOW = 0x080,
+    VIRTIO_MMIO_QUEUE_DESC_HIGH = 0x084,
+    VIRTIO_MMIO_QUEUE_DRIVER_LOW = 0x090,
+    VIRTIO_MMIO_QUEUE_DRIVER_HIGH = 0x094,
+    VIRTIO_MMIO_QUEUE_DEVICE_LOW = 0x0A0,
+    VIRTIO_MMIO_QUEUE_DEVICE_HIGH = 0x0A4,
+    VIRTIO_MMIO_CONFIG_GENERATION = 0x0FC,
+    VIRTIO_MMIO_CONFIG = 0x100
+};
+
+constexpr uint32_t VIRTIO_STATUS_FEATURES_OK = 8;
+constexpr uint32_t VIRTIO_INTERRUPT_USED_BUFFER = 1;
+
+constexpr uint64_t VIRTIO_F_VERSION_1 = 1ull << 32;
+constexpr uint64_t VIRTIO_BLK_F_RO = 1ull << 5;
+constexpr uint64_t VIRTIO_BLK_F_FLUSH = 1ull << 9;
+
+constexpr uint16_t VIRTQ_DESC_F_NEXT = 1;
+constexpr uint16_t VIRTQ_DESC_F_WRITE = 2;
+
+enum VirtioBlockRequestType : uint32_t {
+    VIRTIO_BLK_T_IN = 0,
+    VIRTIO_BLK_T_OUT = 1,
+    VIRTIO_BLK_T_FLUSH = 4,
+    VIRTIO_BLK_T_GET_ID = 8
+};
+
+enum VirtioBlockStatus : uint8_t {
+    VIRTIO_BLK_S_OK = 0,
+    VIRTIO_BLK_S_IOERR = 1,
+    VIRTIO_BLK_S_UNSUPP = 2
+};
+
+// Split virtqueue layout in guest memory
+struct VirtqDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct VirtqUsedElem {
+    uint32_t id;
+    uint32_t len;
+};
+
+// Paravirtual disk with one request queue, backed by a DiskImage. The
+// guest sees a virtio-mmio block device at MMIO_BASE; reads and writes go
+// straight between the image files and guest RAM through AsyncIo, one
+// operation per extent the image maps a request to, and every batch of
+// completions raises the device interrupt.
+//
+// Register accesses come from vCPU threads and completions from the I/O
+// thread. Guest RAM the device writes is reported through dmaWritten so
+// the emulator can track it like a guest store.
+class VirtioBlockDevice {
+public:
+    // Guest physical placement, far above any RAM size we support so
+    // that flat host-mapped accesses never reach it
+    static constexpr uint64_t MMIO_BASE = 1ull << 36;
+    static constexpr uint64_t MMIO_SIZE = 0x200;
+    
+    static constexpr uint32_t QUEUE_SIZE = 128;
+    static constexpr uint64_t SECTOR_SIZE = 512;
+    static constexpr uint32_t DEVICE_ID_BLOCK = 2;
+    static constexpr uint32_t VENDOR_ID = 0x554D4541;      // "AEMU"
+    static constexpr size_t ID_BYTES = 20;
+    
+    using Interrupt = std::function<void()>;
+    using DmaWritten = std::function<void(uint64_t pa, size_t size)>;
+    
+    VirtioBlockDevice(GuestMemory& memory, Interrupt interrupt, DmaWritten dmaWritten) :
+        memory(memory),
+        interrupt(std::move(interrupt)),
+        dmaWritten(std::move(dmaWritten)) {}
+    
+    // In-flight requests finish before the image is closed
+    ~VirtioBlockDevice() {
+        io.reset();
+    }
+    
+    VirtioBlockDevice(const VirtioBlockDevice&) = delete;
+    VirtioBlockDevice& operator=(const VirtioBlockDevice&) = delete;
+    
+    // Opens a raw image or an overlay. The capacity is the disk size
+    // rounded down to whole sectors.
+    bool open(const std::string& path, bool readOnly, std::string& error) {
+        disk = DiskImage::open(path, readOnly, error);
+        if (!disk) {
+            return false;
+        }
+        capacity = disk->size() / SECTOR_SIZE;
+        features = VIRTIO_F_VERSION_1 | VIRTIO_BLK_F_FLUSH | (readOnly ? VIRTIO_BLK_F_RO : 0);
+        this->readOnly = readOnly;
+        
+        io = std::make_unique<AsyncIo>([this](const AsyncIoResult* results, size_t count) {
+            completeBatch(results, count);
+        });
+        return true;
+    }
+    
+    uint64_t sectors() const {
+        return capacity;
+    }
+    
+    const char* backendName() const {
+        return io->backendName();
+    }
+    
+    const char* formatName() const {
+        return disk->formatName();
+    }
+    
+    // Nothing will write guest RAM until the driver queues more requests
+    bool idle() {
+        std::lock_guard<std::mutex> usedLock(usedMtx);
+        return inFlightCount == 0;
+    }
+    
+    static bool contains(uint64_t pa) {
+        return pa - MMIO_BASE < MMIO_SIZE;
+    }
+    
+    // Register read of 1 to 8 bytes at an offset into the device window
+    uint64_t read(uint64_t offset, unsigned size) {
+        std::lock_guard<std::mutex> lock(regMtx);
+        if (offset >= VIRTIO_MMIO_CONFIG) {
+            return readConfig(offset - VIRTIO_MMIO_CONFIG, size);
+        }
+        switch (offset) {
+            case VIRTIO_MMIO_MAGIC: return 0x74726976;        // "virt"
+            case VIRTIO_MMIO_VERSION: return 2;
+            case VIRTIO_MMIO_DEVICE_ID: return DEVICE_ID_BLOCK;
+            case VIRTIO_MMIO_VENDOR_ID: return VENDOR_ID;
+            case VIRTIO_MMIO_DEVICE_FEATURES:
+                return deviceFeaturesSel < 2 ? static_cast<uint32_t>(features >> (32 * deviceFeaturesSel)) : 0;
+            case VIRTIO_MMIO_QUEUE_NUM_MAX: return queueSel == 0 ? QUEUE_SIZE : 0;
+            case VIRTIO_MMIO_QUEUE_READY: return queueSel == 0 ? queue.ready : 0;
+            case VIRTIO_MMIO_INTERRUPT_STATUS: return interruptStatus.load(std::memory_order_acquire);
+            case VIRTIO_MMIO_STATUS: return status;
+            case VIRTIO_MMIO_CONFIG_GENERATION: return 0;
+            default: return 0;
+        }
+    }
+    
+    // Register write. The control registers only take 32-bit accesses and
+    // the configuration space is read-only.
+    void write(uint64_t offset, unsigned size, uint64_t value) {
+        if (size != 4) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(regMtx);
+        uint32_t v = static_cast<uint32_t>(value);
+        if (queueSel != 0 && isQueueRegister(offset)) {
+            // Only queue 0 exists
+            return;
+        }
+        switch (offset) {
+            case VIRTIO_MMIO_DEVICE_FEATURES_SEL: deviceFeaturesSel = v; break;
+            case VIRTIO_MMIO_DRIVER_FEATURES:
+                if (driverFeaturesSel < 2) {
+                    uint64_t mask = 0xFFFFFFFFull << (32 * driverFeaturesSel);
+                    driverFeatures = (driverFeatures & ~mask) | (static_cast<uint64_t>(v) << (32 * driverFeaturesSel));
+                }
+                break;
+            case VIRTIO_MMIO_DRIVER_FEATURES_SEL: driverFeaturesSel = v; break;
+            case VIRTIO_MMIO_QUEUE_SEL: queueSel = v; break;
+            case VIRTIO_MMIO_QUEUE_NUM: queue.num = v; break;
+            case VIRTIO_MMIO_QUEUE_READY: queue.ready = v & 1; break;
+            case VIRTIO_MMIO_QUEUE_DESC_LOW: setLow(queue.desc, v); break;
+            case VIRTIO_MMIO_QUEUE_DESC_HIGH: setHigh(queue.desc, v); break;
+            case VIRTIO_MMIO_QUEUE_DRIVER_LOW: setLow(queue.avail, v); break;
+            case VIRTIO_MMIO_QUEUE_DRIVER_HIGH: setHigh(queue.avail, v); break;
+            case VIRTIO_MMIO_QUEUE_DEVICE_LOW: setLow(queue.used, v); break;
+            case VIRTIO_MMIO_QUEUE_DEVICE_HIGH: setHigh(queue.used, v); break;
+            case VIRTIO_MMIO_INTERRUPT_ACK: interruptStatus.fetch_and(~v, std::memory_order_acq_rel); break;
+            case VIRTIO_MMIO_QUEUE_NOTIFY:
+                if (v == 0) {
+                    processQueue();
+                }
+                break;
+            case VIRTIO_MMIO_STATUS:
+                if (v == 0) {
+                    reset();
+                } else {
+                    // Features we do not offer, or a legacy driver, fail
+                    // negotiation
+                    if ((v & VIRTIO_STATUS_FEATURES_OK) &&
+                        ((driverFeatures & ~features) || !(driverFeatures & VIRTIO_F_VERSION_1))) {
+                        v &= ~VIRTIO_STATUS_FEATURES_OK;
+                    }
+                    status = v;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    
+private:
+    struct Queue {
+        uint32_t num = 0;
+        uint32_t ready = 0;
+        uint64_t desc = 0;
+        uint64_t avail = 0;
+        uint64_t used = 0;
+        uint16_t lastAvail = 0;     // next available entry to take
+    };
+    
+    // A request between submission and completion
+    struct Request {
+        uint16_t head;
+        uint32_t type;
+        uint64_t sector;
+        uint8_t* status;
+        std::vector<iovec> data;
+        uint64_t dataBytes;
+        size_t pendingOps;      // file operations not completed yet
+        bool failed;
+    };
+    
+    GuestMemory& memory;
+    Interrupt interrupt;
+    DmaWritten dmaWritten;
+    
+    std::unique_ptr<DiskImage> disk;
+    uint64_t capacity = 0;
+    uint64_t features = 0;
+    bool readOnly = false;
+    std::unique_ptr<AsyncIo> io;
+    
+    // Registers and the available side of the queue
+    std::mutex regMtx;
+    uint32_t deviceFeaturesSel = 0;
+    uint32_t driverFeaturesSel = 0;
+    uint64_t driverFeatures = 0;
+    uint32_t queueSel = 0;
+    uint32_t status = 0;
+    Queue queue;
+    std::atomic<uint32_t> interruptStatus{0};
+    
+    // Used side of the queue, as of the last notify, and requests in
+    // flight by head descriptor
+    std::mutex usedMtx;
+    uint64_t usedRing = 0;
+    uint32_t usedNum = 0;
+    uint16_t usedIdx = 0;
+    std::condition_variable idleCv;
+    std::vector<std::unique_ptr<Request>> inFlight = std::vector<std::unique_ptr<Request>>(QUEUE_SIZE);
+    size_t inFlightCount = 0;
+    
+    static bool isQueueRegister(uint64_t offset) {
+        return offset == VIRTIO_MMIO_QUEUE_NUM || offset == VIRTIO_MMIO_QUEUE_READY ||
+               (offset >= VIRTIO_MMIO_QUEUE_DESC_LOW && offset <= VIRTIO_MMIO_QUEUE_DEVICE_HIGH);
+    }
+    
+    static void setLow(uint64_t& reg, uint32_t v) {
+        reg = (reg & ~0xFFFFFFFFull) | v;
+    }
+    
+    static void setHigh(uint64_t& reg, uint32_t v) {
+        reg = (reg & 0xFFFFFFFFull) | (static_cast<uint64_t>(v) << 32);
+    }
+    
+    uint64_t readConfig(uint64_t offset, unsigned size) const {
+        // struct virtio_blk_config starts with the capacity in sectors
+        uint8_t config[8];
+        memcpy(config, &capacity, sizeof(capacity));
+        uint64_t value = 0;
+        for (unsigned i = 0; i < size && offset + i < sizeof(config); i++) {
+            value |= static_cast<uint64_t>(config[offset + i]) << (8 * i);
+        }
+        return value;
+    }
+    
+    // Host pointer to size bytes of guest RAM, nullptr if they are not all
+    // inside it
+    uint8_t* guest(uint64_t pa, uint64_t size) const {
+        if (pa > memory.size() || size > memory.size() - pa) {
+            return nullptr;
+        }
+        return memory.data() + pa;
+    }
+    
+    // Waits out requests in flight, then forgets all driver state.
+    // Called with regMtx held.
+    void reset() {
+        {
+            std::unique_lock<std::mutex> usedLock(usedMtx);
+            idleCv.wait(usedLock, [this]() { return inFlightCount == 0; });
+            usedRing = 0;
+            usedNum = 0;
+            usedIdx = 0;
+        }
+        deviceFeaturesSel = 0;
+        driverFeaturesSel = 0;
+        driverFeatures = 0;
+        queueSel = 0;
+        status = 0;
+        queue = Queue();
+        interruptStatus.store(0, std::memory_order_release);
+    }
+    
+    // Takes every request the driver has made available and submits them
+    // as one batch. Called with regMtx held.
+    void processQueue() {
+        Queue& q = queue;
+        if (!q.ready || q.num == 0 || q.num > QUEUE_SIZE || (q.num & (q.num - 1)) != 0) {
+            return;
+        }
+        VirtqDesc* table = reinterpret_cast<VirtqDesc*>(guest(q.desc, q.num * sizeof(VirtqDesc)));
+        uint8_t* avail = guest(q.avail, 4 + q.num * sizeof(uint16_t));
+        if (table == nullptr || avail == nullptr || guest(q.used, 4 + q.num * sizeof(VirtqUsedElem)) == nullptr) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> usedLock(usedMtx);
+            usedRing = q.used;
+            usedNum = q.num;
+        }
+        
+        std::vector<AsyncIoRequest> batch;
+        uint16_t availIdx = __atomic_load_n(reinterpret_cast<uint16_t*>(avail + 2), __ATOMIC_ACQUIRE);
+        while (q.lastAvail != availIdx) {
+            uint16_t head;
+            memcpy(&head, avail + 4 + (q.lastAvail % q.num) * sizeof(uint16_t), sizeof(head));
+            q.lastAvail++;
+            if (head >= q.num) {
+                continue;
+            }
+            
+            std::unique_ptr<Request> request(new Request());
+            request->head = head;
+            uint8_t result = parseRequest(table, q.num, *request);
+            if (result != VIRTIO_BLK_S_OK || request->type == VIRTIO_BLK_T_GET_ID) {
+                finishNow(std::move(request), result);
+                continue;
+            }
+            
+            bool reused;
+            {
+                std::lock_guard<std::mutex> usedLock(usedMtx);
+                reused = inFlight[head] != nullptr;
+            }
+            if (reused) {
+                // The driver reused a chain still in flight. Failing it
+                // keeps the driver from waiting on it forever.
+                finishNow(std::move(request), VIRTIO_BLK_S_IOERR);
+                continue;
+            }
+            std::vector<AsyncIoRequest> ops;
+            if (!planOps(*request, ops)) {
+                finishNow(std::move(request), VIRTIO_BLK_S_IOERR);
+                continue;
+            }
+            if (ops.empty()) {
+                // Nothing but zeroes to read
+                finishNow(std::move(request), VIRTIO_BLK_S_OK);
+                continue;
+            }
+            request->pendingOps = ops.size();
+            request->failed = false;
+            {
+                std::lock_guard<std::mutex> usedLock(usedMtx);
+                inFlight[head] = std::move(request);
+                inFlightCount++;
+            }
+            for (AsyncIoRequest& op : ops) {
+                batch.push_back(std::move(op));
+            }
+        }
+        io->submit(std::move(batch));
+    }
+    
+    // Turns a request into file operations tagged with its head, one per
+    // extent of the image it covers. Parts that read as zeroes are filled
+    // in here. False if the image could not map the request.
+    bool planOps(Request& request, std::vector<AsyncIoRequest>& ops) {
+        if (request.type == VIRTIO_BLK_T_FLUSH) {
+            ops.push_back({ AsyncIoOp::Flush, disk->syncFd(), 0, {}, request.head });
+            return true;
+        }
+        
+        bool write = request.type == VIRTIO_BLK_T_OUT;
+        std::vector<DiskExtent> extents;
+        if (!disk->map(request.sector * SECTOR_SIZE, request.dataBytes, write, extents)) {
+            return false;
+        }
+        uint64_t done = 0;
+        for (const DiskExtent& extent : extents) {
+            std::vector<iovec> iov = sliceData(request.data, done, extent.length);
+            done += extent.length;
+            if (extent.fd < 0) {
+                for (const iovec& segment : iov) {
+                    memset(segment.iov_base, 0, segment.iov_len);
+                }
+                continue;
+            }
+            ops.push_back({ write ? AsyncIoOp::Write : AsyncIoOp::Read, extent.fd, extent.offset, std::move(iov),
+                            request.head });
+        }
+        return true;
+    }
+    
+    // The iovecs covering length bytes of data from offset on
+    static std::vector<iovec> sliceData(const std::vector<iovec>& data, uint64_t offset, uint64_t length) {
+        std::vector<iovec> slice;
+        for (const iovec& segment : data) {
+            if (length == 0) {
+                break;
+            }
+            if (offset >= segment.iov_len) {
+                offset -= segment.iov_len;
+                continue;
+            }
+            size_t n = static_cast<size_t>(std::min<uint64_t>(segment.iov_len - offset, length));
+            slice.push_back({ static_cast<uint8_t*>(segment.iov_base) + offset, n });
+            offset = 0;
+            length -= n;
+        }
+        return slice;
+    }
+    
+    // Walks a descriptor chain: a 16-byte header the driver wrote, the data
+    // buffers and a status byte for us. Anything but a well-formed request
+    // for sectors inside the disk is an error.
+    uint8_t parseRequest(const VirtqDesc* table, uint32_t num, Request& request) {
+        struct Segment {
+            uint8_t* host;
+            uint32_t len;
+            bool writable;
+        };
+        std::vector<Segment> segments;
+        uint16_t index = request.head;
+        for (uint32_t n = 0; ; n++) {
+            if (n >= num || index >= num) {
+                request.status = nullptr;
+                return VIRTIO_BLK_S_IOERR;
+            }
+            VirtqDesc desc;
+            memcpy(&desc, &table[index], sizeof(desc));
+            uint8_t* host = guest(desc.addr, desc.len);
+            if (host == nullptr) {
+                request.status = nullptr;
+                return VIRTIO_BLK_S_IOERR;
+            }
+            if (desc.len > 0) {
+                segments.push_back({ host, desc.len, (desc.flags & VIRTQ_DESC_F_WRITE) != 0 });
+            }
+            if (!(desc.flags & VIRTQ_DESC_F_NEXT)) {
+                break;
+            }
+            index = desc.next;
+        }
+        
+        // The status byte is the last one of the chain
+        request.status = nullptr;
+        if (segments.empty() || !segments.back().writable) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        Segment& last = segments.back();
+        request.status = last.host + last.len - 1;
+        if (--last.len == 0) {
+            segments.pop_back();
+        }
+        
+        // The header is the first 16 bytes, which in practice are a
+        // descriptor of their own
+        if (segments.empty() || segments.front().writable || segments.front().len < 16) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        Segment& first = segments.front();
+        memcpy(&request.type, first.host, sizeof(request.type));
+        memcpy(&request.sector, first.host + 8, sizeof(request.sector));
+        first.host += 16;
+        first.len -= 16;
+        
+        request.dataBytes = 0;
+        bool toGuest = request.type == VIRTIO_BLK_T_IN || request.type == VIRTIO_BLK_T_GET_ID;
+        for (const Segment& segment : segments) {
+            if (segment.len == 0) {
+                continue;
+            }
+            if (segment.writable != toGuest) {
+                return VIRTIO_BLK_S_IOERR;
+            }
+            request.data.push_back({ segment.host, segment.len });
+            request.dataBytes += segment.len;
+        }
+        
+        switch (request.type) {
+            case VIRTIO_BLK_T_IN:
+            case VIRTIO_BLK_T_OUT:
+                if (request.type == VIRTIO_BLK_T_OUT && readOnly) {
+                    return VIRTIO_BLK_S_IOERR;
+                }
+                if (request.dataBytes % SECTOR_SIZE != 0 || request.sector > capacity ||
+                    request.dataBytes / SECTOR_SIZE > capacity - request.sector) {
+                    return VIRTIO_BLK_S_IOERR;
+                }
+                return VIRTIO_BLK_S_OK;
+            case VIRTIO_BLK_T_FLUSH:
+            case VIRTIO_BLK_T_GET_ID:
+                return VIRTIO_BLK_S_OK;
+            default:
+                return VIRTIO_BLK_S_UNSUPP;
+        }
+    }
+    
+    // Completes a request without waiting for file I/O
+    void finishNow(std::unique_ptr<Request> request, uint8_t result) {
+        uint32_t written = 0;
+        if (result == VIRTIO_BLK_S_OK && request->type == VIRTIO_BLK_T_GET_ID) {
+            static const char id[ID_BYTES] = "aemu-virtio-blk";
+            size_t left = ID_BYTES;
+            for (const iovec& segment : request->data) {
+                size_t n = std::min(left, segment.iov_len);
+                memcpy(segment.iov_base, id + (ID_BYTES - left), n);
+                reportDma(segment.iov_base, n);
+                left -= n;
+                written += static_cast<uint32_t>(n);
+            }
+        } else if (result == VIRTIO_BLK_S_OK) {
+            written = reportRead(*request);
+        }
+        
+        std::lock_guard<std::mutex> usedLock(usedMtx);
+        pushUsed(*request, result, written);
+        raiseUsed();
+    }
+    
+    // A request is done once the last of its operations is
+    void completeBatch(const AsyncIoResult* results, size_t count) {
+        std::lock_guard<std::mutex> usedLock(usedMtx);
+        bool anyDone = false;
+        for (size_t i = 0; i < count; i++) {
+            Request& request = *inFlight[results[i].tag];
+            request.failed |= results[i].result < 0;
+            if (--request.pendingOps > 0) {
+                continue;
+            }
+            std::unique_ptr<Request> done = std::move(inFlight[results[i].tag]);
+            inFlightCount--;
+            anyDone = true;
+            
+            uint32_t written = done->failed ? 0 : reportRead(*done);
+            pushUsed(*done, done->failed ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK, written);
+        }
+        if (anyDone) {
+            raiseUsed();
+        }
+        if (inFlightCount == 0) {
+            idleCv.notify_all();
+        }
+    }
+    
+    // Data a successful read put in guest RAM
+    uint32_t reportRead(const Request& request) {
+        if (request.type != VIRTIO_BLK_T_IN) {
+            return 0;
+        }
+        for (const iovec& segment : request.data) {
+            reportDma(segment.iov_base, segment.iov_len);
+        }
+        return static_cast<uint32_t>(request.dataBytes);
+    }
+    
+    void reportDma(const void* host, size_t size) {
+        dmaWritten(static_cast<const uint8_t*>(host) - memory.data(), size);
+    }
+    
+    // Writes the status byte and returns the chain to the driver. Called
+    // with usedMtx held; written is the data the device put in the chain.
+    void pushUsed(const Request& request, uint8_t result, uint32_t written) {
+        if (request.status != nullptr) {
+            *request.status = result;
+            reportDma(request.status, 1);
+            written++;
+        }
+        uint8_t* used = guest(usedRing, 4 + usedNum * sizeof(VirtqUsedElem));
+        if (used == nullptr || usedNum == 0) {
+            return;
+        }
+        VirtqUsedElem elem = { request.head, written };
+        memcpy(used + 4 + (usedIdx % usedNum) * sizeof(VirtqUsedElem), &elem, sizeof(elem));
+        usedIdx++;
+        __atomic_store_n(reinterpret_cast<uint16_t*>(used + 2), usedIdx, __ATOMIC_RELEASE);
+        reportDma(used, 4 + usedNum * sizeof(VirtqUsedElem));
+    }
+    
+    void raiseUsed() {
+        interruptStatus.fetch_or(VIRTIO_INTERRUPT_USED_BUFFER, std::memory_order_acq_rel);
+        interrupt();
+    }
+};
@@ -7,6 +7,7 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <cstring>
 
 #define LOG_TAG "GPUEmulator"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
@@ -26,6 +27,21 @@ private:
     GLuint frameBuffer = 0;
     GLuint renderBuffer = 0;
     GLuint shaderProgram = 0;
+    GLint positionAttrib = -1;
+    
+    // Vertex data streams through one ring buffer, read through a vertex
+    // array object set up once. Each draw maps the next free range of the
+    // ring unsynchronized, so uploading neither allocates nor waits for
+    // the GPU. When the ring is full its storage is orphaned: the driver
+    // hands out fresh memory while draws still in flight read the old.
+    // The ring grows to fit a larger draw, up to MAX_STREAM_BUFFER_SIZE.
+    static constexpr GLsizeiptr STREAM_BUFFER_SIZE = 4 * 1024 * 1024;
+    static constexpr GLsizeiptr MAX_STREAM_BUFFER_SIZE = 64 * 1024 * 1024;
+    static constexpr GLsizeiptr VERTEX_SIZE = sizeof(float) * 3;
+    GLuint streamBuffer = 0;
+    GLuint vertexArray = 0;
+    GLsizeiptr streamSize = 0;
+    GLintptr streamOffset = 0;
     
     // Emulator State
     struct GPUState {
@@ -135,6 +151,18 @@ public:
             return false;
         }
         
+        // Initialize Vertex Streaming
+        glGenVertexArrays(1, &vertexArray);
+        glGenBuffers(1, &streamBuffer);
+        glBindVertexArray(vertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+        if (!allocateStream(STREAM_BUFFER_SIZE)) {
+            return false;
+        }
+        glEnableVertexAttribArray(positionAttrib);
+        glVertexAttribPointer(positionAttrib, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glUseProgram(shaderProgram);
+        
         // Initialize State
         state.width = width;
         state.height = height;
@@ -152,6 +180,16 @@ public:
             return;
         }
         
+        if (vertexArray) {
+            glDeleteVertexArrays(1, &vertexArray);
+            vertexArray = 0;
+        }
+        
+        if (streamBuffer) {
+            glDeleteBuffers(1, &streamBuffer);
+            streamBuffer = 0;
+        }
+        
         if (shaderProgram) {
             glDeleteProgram(shaderProgram);
             shaderProgram = 0;
@@ -188,6 +226,7 @@ public:
         LOGI("GPU cleanup complete");
     }
     
+    // A frame of a single draw
     bool render(const void* vertices, size_t vertexCount) {
         if (!initialized) {
             LOGE("GPU not initialized");
@@ -197,29 +236,45 @@ public:
         std::lock_guard<std::mutex> lock(mtx);
         
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        bool drawn = drawVertices(vertices, vertexCount);
+        readFrame();
+        return drawn;
+    }
+    
+    // A frame of many draws: beginFrame, any number of draw calls, then
+    // endFrame to read the result back
+    bool beginFrame() {
+        if (!initialized) {
+            LOGE("GPU not initialized");
+            return false;
+        }
         
-        glUseProgram(shaderProgram);
-        
-        // Set up vertex data
-        GLuint vbo;
-        glGenBuffers(1, &vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(float) * 3, vertices, GL_STATIC_DRAW);
+        std::lock_guard<std::mutex> lock(mtx);
         
-        // Set up vertex attributes
-        GLint posAttrib = glGetAttribLocation(shaderProgram, "position");
-        glEnableVertexAttribArray(posAttrib);
-        glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        return true;
+    }
+    
+    bool draw(const void* vertices, size_t vertexCount) {
+        if (!initialized) {
+            LOGE("GPU not initialized");
+            return false;
+        }
         
-        // Draw
-        glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+        std::lock_guard<std::mutex> lock(mtx);
         
-        // Cleanup
-        glDeleteBuffers(1, &vbo);
+        return drawVertices(vertices, vertexCount);
+    }
+    
+    bool endFrame() {
+        if (!initialized) {
+            LOGE("GPU not initialized");
+            return false;
+        }
         
-        // Read pixels
-        glReadPixels(0, 0, state.width, state.height, GL_RGBA, GL_UNSIGNED_BYTE, state.frameBuffer.data());
+        std::lock_guard<std::mutex> lock(mtx);
         
+        readFrame();
         return true;
     }
     
@@ -228,6 +283,79 @@ public:
     }
     
 private:
+    // Gives the ring new storage of size bytes. On failure it keeps the
+    // size it had, and draws fail until an allocation succeeds.
+    bool allocateStream(GLsizeiptr size) {
+        while (glGetError() != GL_NO_ERROR) {
+        }
+        glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        if (glGetError() != GL_NO_ERROR) {
+            LOGE("Failed to allocate %ld bytes of vertex storage", static_cast<long>(size));
+            return false;
+        }
+        streamSize = size;
+        streamOffset = 0;
+        return true;
+    }
+    
+    // Copies vertices into the ring and draws them. Ranges start on a
+    // vertex boundary, so the attribute pointer stays at offset 0 and the
+    // draw picks its range with the first vertex instead.
+    bool drawVertices(const void* vertices, size_t vertexCount) {
+        if (vertexCount == 0) {
+            return true;
+        }
+        if (vertexCount > static_cast<size_t>(MAX_STREAM_BUFFER_SIZE / VERTEX_SIZE)) {
+            LOGE("Draw of %zu vertices is too large", vertexCount);
+            return false;
+        }
+        
+        GLsizeiptr bytes = static_cast<GLsizeiptr>(vertexCount) * VERTEX_SIZE;
+        GLintptr offset = (streamOffset + VERTEX_SIZE - 1) / VERTEX_SIZE * VERTEX_SIZE;
+        if (bytes > streamSize) {
+            // Grow to fit; later draws share the larger ring
+            GLsizeiptr size = streamSize;
+            while (size < bytes) {
+                size *= 2;
+            }
+            if (!allocateStream(size)) {
+                return false;
+            }
+            offset = 0;
+        } else if (offset + bytes > streamSize) {
+            if (!allocateStream(streamSize)) {
+                return false;
+            }
+            offset = 0;
+        }
+        
+        void* mapped = glMapBufferRange(GL_ARRAY_BUFFER, offset, bytes,
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        bool uploaded = false;
+        if (mapped != nullptr) {
+            memcpy(mapped, vertices, bytes);
+            uploaded = glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE;
+        }
+        if (!uploaded) {
+            // Mapping failed or the mapped memory was lost
+            while (glGetError() != GL_NO_ERROR) {
+            }
+            glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, vertices);
+            if (glGetError() != GL_NO_ERROR) {
+                LOGE("Failed to upload vertices");
+                return false;
+            }
+        }
+        streamOffset = offset + bytes;
+        
+        glDrawArrays(GL_TRIANGLES, static_cast<GLint>(offset / VERTEX_SIZE), static_cast<GLsizei>(vertexCount));
+        return true;
+    }
+    
+    void readFrame() {
+        glReadPixels(0, 0, state.width, state.height, GL_RGBA, GL_UNSIGNED_BYTE, state.frameBuffer.data());
+    }
+    
     bool initShaders() {
         const char* vertexShaderSource = R"(
             #version 300 es
@@ -290,6 +418,12 @@ private:
         glDeleteShader(vertexShader);
         glDeleteShader(fragmentShader);
         
+        positionAttrib = glGetAttribLocation(shaderProgram, "position");
+        if (positionAttrib < 0) {
+            LOGE("Shader program has no position attribute");
+            return false;
+        }
+        
         return true;
     }
 };
@@ -327,13 +461,56 @@ extern "C" {
             return JNI_FALSE;
         }
         
+        if (vertices == nullptr || vertexCount < 0 || vertexCount > env->GetArrayLength(vertices) / 3) {
+            return JNI_FALSE;
+        }
         jfloat* buffer = env->GetFloatArrayElements(vertices, nullptr);
+        if (buffer == nullptr) {
+            return JNI_FALSE;
+        }
         bool result = emulator->render(buffer, vertexCount);
         env->ReleaseFloatArrayElements(vertices, buffer, JNI_ABORT);
         
         return result ? JNI_TRUE : JNI_FALSE;
     }
     
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_GPUEmulator_beginFrame(JNIEnv* env, jobject obj) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        return emulator->beginFrame() ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_GPUEmulator_draw(JNIEnv* env, jobject obj, jfloatArray vertices, jint vertexCount) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        if (vertices == nullptr || vertexCount < 0 || vertexCount > env->GetArrayLength(vertices) / 3) {
+            return JNI_FALSE;
+        }
+        jfloat* buffer = env->GetFloatArrayElements(vertices, nullptr);
+        if (buffer == nullptr) {
+            return JNI_FALSE;
+        }
+        bool result = emulator->draw(buffer, vertexCount);
+        env->ReleaseFloatArrayElements(vertices, buffer, JNI_ABORT);
+        
+        return result ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_android_emulator_GPUEmulator_endFrame(JNIEnv* env, jobject obj) {
+        if (emulator == nullptr) {
+            return JNI_FALSE;
+        }
+        
+        return emulator->endFrame() ? JNI_TRUE : JNI_FALSE;
+    }
+    
     JNIEXPORT jbyteArray JNICALL
     Java_com_android_emulator_GPUEmulator_getFrameBuffer(JNIEnv* env, jobject obj) {
         if (emulator == nullptr) {